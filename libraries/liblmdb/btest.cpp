@@ -5,6 +5,11 @@
 #include <cassert>
 #include <getopt.h>
 #include <thread>
+#include <atomic>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
 
 #include <midl.h>
 #define B 10240
@@ -79,6 +84,328 @@ void handle_error(int rc, const char* msg) {
     }
 }
 
+uint64_t get_cur_ns() {
+    auto now = std::chrono::steady_clock::now();
+    auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch());
+    return now_ns.count();
+}
+
+/* Options of the bench command, see bench() */
+struct BenchOpts {
+    uint64_t n = 100000;        // -N: ops per workload
+    unsigned ksize = 16;        // -k: key size, at least 8
+    unsigned vsize = 100;       // -v: value size, at least 8
+    unsigned bigsize = 65536;   // -V: value size of fillbig
+    unsigned batch = 1000;      // -b: ops per txn
+    unsigned threads = 4;       // -t: reader threads
+    unsigned scanlen = 100;     // -L: records per range scan
+    unsigned dups = 16;         // -D: values per key of filldup
+    unsigned seed = 1;          // -s: random seed
+    bool json = false;          // -j: one JSON object per workload
+};
+static BenchOpts bopt;
+
+struct Bench {
+    MDB_env* env;
+    MDB_dbi dbi, dup, big;
+};
+
+struct BenchResult {
+    uint64_t ops = 0, bytes = 0, miss = 0;
+    std::vector<uint32_t> lat;  // ns per op
+
+    void add(uint64_t ns) {
+        lat.push_back(ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns);
+        ops++;
+    }
+    void merge(const BenchResult& r) {
+        ops += r.ops;
+        bytes += r.bytes;
+        miss += r.miss;
+        lat.insert(lat.end(), r.lat.begin(), r.lat.end());
+    }
+};
+
+/* What bench_report() diffs against */
+struct BenchSnap {
+    uint64_t t0, file;
+    MDB_metrics m;
+};
+
+/* Keys start with the big endian id, so sequential ids sort in order */
+static void bench_id(char* p, uint64_t id) {
+    for (int i = 7; i >= 0; --i, id >>= 8)
+        p[i] = (char)id;
+}
+
+static void bench_snap(Bench& b, BenchSnap& s) {
+    mdb_filehandle_t fd;
+    struct stat st;
+
+    mdb_env_get_fd(b.env, &fd);
+    s.file = fstat(fd, &st) ? 0 : st.st_size;
+    mdb_env_metrics(b.env, &s.m);
+    s.t0 = get_cur_ns();
+}
+
+static uint64_t bench_free_pages(MDB_env* env) {
+    MDB_txn* txn;
+    MDB_cursor* cursor;
+    MDB_val key, data;
+    uint64_t pages = 0;
+
+    handle_error(mdb_txn_begin(env, nullptr, MDB_RDONLY, &txn), "Failed to begin read transaction");
+    handle_error(mdb_cursor_open(txn, 0, &cursor), "Failed to open cursor");
+    while (mdb_cursor_get(cursor, &key, &data, MDB_NEXT) == MDB_SUCCESS) {
+        MDB_ID* idl = (MDB_ID*)data.mv_data;
+        if (MDB_IDL_IS_RANGES(idl)) {
+            for (MDB_ID i = 0; i < MDB_RIDL_LEN(idl); ++i)
+                pages += idl[2 + 2*i];
+        } else {
+            pages += idl[0];
+        }
+    }
+    mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+    return pages;
+}
+
+static double bench_pct(const std::vector<uint32_t>& lat, double p) {
+    if (lat.empty())
+        return 0;
+    size_t i = (size_t)(p * lat.size());
+    return lat[i < lat.size() ? i : lat.size() - 1] / 1000.0;
+}
+
+static void bench_report(Bench& b, const char* name, BenchResult& r, const BenchSnap& s0) {
+    BenchSnap s1;
+    bench_snap(b, s1);
+    const double sec = (s1.t0 - s0.t0) / 1e9;
+    const uint64_t free_pages = bench_free_pages(b.env);
+    std::sort(r.lat.begin(), r.lat.end());
+    const double p50 = bench_pct(r.lat, 0.5), p99 = bench_pct(r.lat, 0.99), p999 = bench_pct(r.lat, 0.999);
+    const double ops_sec = sec > 0 ? r.ops / sec : 0;
+
+    if (bopt.json) {
+        printf("{\"workload\":\"%s\",\"ops\":%lu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+            "\"mb_per_sec\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"misses\":%lu,"
+            "\"file_bytes\":%lu,\"file_growth\":%ld,\"free_pages\":%lu,"
+            "\"splits\":%lu,\"spills\":%lu,\"syncs\":%lu,\"sync_usec\":%lu}\n",
+            name, r.ops, sec, ops_sec, sec > 0 ? r.bytes / sec / 1e6 : 0, p50, p99, p999, r.miss,
+            s1.file, (long)(s1.file - s0.file), free_pages,
+            s1.m.me_splits - s0.m.me_splits, s1.m.me_spills - s0.m.me_spills,
+            s1.m.me_syncs - s0.m.me_syncs, s1.m.me_sync_usec - s0.m.me_sync_usec);
+    } else {
+        printf("%-12s: %10.3f us/op %10.0f ops/sec %8.1f MB/sec  p50 %.3f p99 %.3f p99.9 %.3f us\n",
+            name, r.ops ? sec * 1e6 / r.ops : 0, ops_sec, sec > 0 ? r.bytes / sec / 1e6 : 0, p50, p99, p999);
+        printf("%-12s  file %.1f MB (%+.1f), %lu free pages, %lu splits, %lu spills, %lu syncs in %.3f ms",
+            "", s1.file / 1e6, ((double)s1.file - s0.file) / 1e6, free_pages,
+            s1.m.me_splits - s0.m.me_splits, s1.m.me_spills - s0.m.me_spills,
+            s1.m.me_syncs - s0.m.me_syncs, (s1.m.me_sync_usec - s0.m.me_sync_usec) / 1e3);
+        if (r.miss)
+            printf(", %lu misses", r.miss);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/* Empty a DB before a fill */
+static void bench_drop(Bench& b, MDB_dbi dbi) {
+    MDB_txn* txn;
+    handle_error(mdb_txn_begin(b.env, nullptr, 0, &txn), "Failed to begin transaction");
+    handle_error(mdb_drop(txn, dbi, 0), "Failed to empty database");
+    handle_error(mdb_txn_commit(txn), "Failed to commit transaction");
+}
+
+/* Put the ids in \b order, or 0..n-1. Each value goes to key id/dups.
+ * A commit is timed as part of the op that ends its txn.
+ */
+static void bench_write(Bench& b, MDB_dbi dbi, BenchResult& r, const std::vector<uint64_t>* order,
+    uint64_t n, unsigned vsize, unsigned dups) {
+    std::vector<char> kbuf(bopt.ksize, 'k'), vbuf(vsize, 'v');
+    MDB_txn* txn = nullptr;
+    MDB_val key, data;
+
+    for (uint64_t i = 0; i < n; ++i) {
+        const uint64_t id = order ? (*order)[i] : i;
+        const uint64_t st = get_cur_ns();
+        if (!txn)
+            handle_error(mdb_txn_begin(b.env, nullptr, 0, &txn), "Failed to begin transaction");
+        bench_id(kbuf.data(), id / dups);
+        bench_id(vbuf.data(), id);
+        key.mv_size = kbuf.size();
+        key.mv_data = kbuf.data();
+        data.mv_size = vbuf.size();
+        data.mv_data = vbuf.data();
+        handle_error(mdb_put(txn, dbi, &key, &data, 0), "Failed to put data");
+        if ((i + 1) % bopt.batch == 0 || i + 1 == n) {
+            handle_error(mdb_txn_commit(txn), "Failed to commit transaction");
+            txn = nullptr;
+        }
+        r.add(get_cur_ns() - st);
+        r.bytes += key.mv_size + data.mv_size;
+    }
+}
+
+/* Point gets, or range scans of bopt.scanlen records, of random ids
+ * below \b range. Runs \b n ops, or until \b stop is set. The snapshot
+ * is renewed every bopt.batch ops, so readers don't pin old pages.
+ */
+static void bench_read(Bench* b, MDB_dbi dbi, BenchResult* r, uint64_t n, uint64_t range,
+    unsigned seed, bool scan, const std::atomic<bool>* stop) {
+    std::mt19937_64 rng(seed);
+    std::vector<char> kbuf(bopt.ksize, 'k');
+    MDB_txn* txn;
+    MDB_cursor* cursor = nullptr;
+    MDB_val key, data;
+    int rc;
+
+    handle_error(mdb_txn_begin(b->env, nullptr, MDB_RDONLY, &txn), "Failed to begin read transaction");
+    if (scan)
+        handle_error(mdb_cursor_open(txn, dbi, &cursor), "Failed to open cursor");
+    for (uint64_t i = 0; stop ? !stop->load() : i < n; ++i) {
+        if (i && i % bopt.batch == 0) {
+            mdb_txn_reset(txn);
+            handle_error(mdb_txn_renew(txn), "Failed to renew read transaction");
+            if (cursor)
+                handle_error(mdb_cursor_renew(txn, cursor), "Failed to renew cursor");
+        }
+        const uint64_t st = get_cur_ns();
+        bench_id(kbuf.data(), range ? rng() % range : 0);
+        key.mv_size = kbuf.size();
+        key.mv_data = kbuf.data();
+        if (!scan) {
+            rc = mdb_get(txn, dbi, &key, &data);
+            if (rc == MDB_SUCCESS)
+                r->bytes += key.mv_size + data.mv_size;
+        } else {
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+            for (unsigned j = 0; rc == MDB_SUCCESS; ) {
+                r->bytes += key.mv_size + data.mv_size;
+                if (++j == bopt.scanlen)
+                    break;
+                rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+            }
+        }
+        if (rc == MDB_NOTFOUND)
+            r->miss++;
+        else
+            handle_error(rc, scan ? "Failed to scan" : "Failed to get data");
+        r->add(get_cur_ns() - st);
+    }
+    if (cursor)
+        mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+}
+
+/* Run bopt.threads readers of bench_read() and merge their results */
+static void bench_readers(Bench& b, BenchResult& r, uint64_t n, bool scan, const std::atomic<bool>* stop) {
+    std::vector<BenchResult> res(bopt.threads);
+    std::vector<std::thread> th;
+
+    for (unsigned t = 0; t < bopt.threads; ++t)
+        th.emplace_back(bench_read, &b, b.dbi, &res[t], n / bopt.threads, bopt.n,
+            bopt.seed + t + 1, scan, stop);
+    for (unsigned t = 0; t < bopt.threads; ++t) {
+        th[t].join();
+        r.merge(res[t]);
+    }
+}
+
+/* btest [-n] [-f path] [options] bench workload[,workload...]
+ *
+ * Runs the workloads in order on an environment of its own, and
+ * prints one line per workload, or one JSON object with -j:
+ *   fillseq     put ids 0..N-1 in order, bopt.batch per txn
+ *   fillrandom  the same ids in random order
+ *   readrandom  N point gets of random ids, on bopt.threads threads
+ *   scan        N/L range scans of L records from random ids
+ *   mixed       random overwrites of N ids while the readers get
+ *   filldup     N values of -v size on N/D keys of a DUPSORT DB,
+ *               not in "make bench" until plain DUPSORT DBs work again
+ *   fillbig     overflow values of -V size, as many bytes as fillrandom
+ * The fills empty their DB first. The reads expect a fill of the same N before.
+ */
+static int bench(const char* path, unsigned int flags, char* workloads) {
+    Bench b;
+    MDB_txn* txn;
+    int rc;
+
+    if (bopt.ksize < 8) bopt.ksize = 8;
+    if (bopt.vsize < 8) bopt.vsize = 8;
+    if (bopt.bigsize < 8) bopt.bigsize = 8;
+    if (!bopt.batch) bopt.batch = 1;
+    if (!bopt.threads) bopt.threads = 1;
+    if (!bopt.scanlen) bopt.scanlen = 1;
+    if (!bopt.dups) bopt.dups = 1;
+
+    handle_error(mdb_env_create(&b.env), "Failed to create environment");
+    handle_error(mdb_env_set_mapsize(b.env, 10485760lu*1000), "Failed to set map size");
+    handle_error(mdb_env_set_maxdbs(b.env, 4), "Failed to set max DBs");
+    handle_error(mdb_env_set_maxreaders(b.env, bopt.threads + 8), "Failed to set max readers");
+    handle_error(mdb_env_open(b.env, path, flags | MDB_NOTLS, 0664), "Failed to open environment");
+    rc = mdb_txn_begin(b.env, nullptr, 0, &txn);
+    handle_error(rc, "Failed to begin transaction");
+    handle_error(mdb_dbi_open(txn, "bench", MDB_CREATE, &b.dbi), "Failed to open database");
+    handle_error(mdb_dbi_open(txn, "bench_dup", MDB_CREATE|MDB_DUPSORT, &b.dup), "Failed to open database");
+    handle_error(mdb_dbi_open(txn, "bench_big", MDB_CREATE, &b.big), "Failed to open database");
+    handle_error(mdb_txn_commit(txn), "Failed to commit transaction");
+
+    if (!bopt.json)
+        printf("bench: %lu ops, keys %u bytes, values %u bytes, %u per txn, %u readers\n",
+            bopt.n, bopt.ksize, bopt.vsize, bopt.batch, bopt.threads);
+
+    std::vector<uint64_t> order(bopt.n);
+    for (uint64_t i = 0; i < bopt.n; ++i)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(bopt.seed));
+
+    for (char* w = strtok(workloads, ","); w; w = strtok(nullptr, ",")) {
+        BenchResult r;
+        BenchSnap s0;
+
+        if (!strcmp(w, "fillseq") || !strcmp(w, "fillrandom")) {
+            bench_drop(b, b.dbi);
+            bench_snap(b, s0);
+            bench_write(b, b.dbi, r, w[4] == 'r' ? &order : nullptr, bopt.n, bopt.vsize, 1);
+        } else if (!strcmp(w, "readrandom") || !strcmp(w, "scan")) {
+            const bool scan = w[0] == 's';
+            bench_snap(b, s0);
+            bench_readers(b, r, scan ? bopt.n / bopt.scanlen : bopt.n, scan, nullptr);
+        } else if (!strcmp(w, "mixed")) {
+            std::atomic<bool> stop(false);
+            BenchResult rr;
+            std::vector<uint64_t> ids(bopt.n);
+            std::mt19937_64 rng(bopt.seed);
+            for (auto& id : ids)
+                id = rng() % bopt.n;
+            bench_snap(b, s0);
+            std::thread readers(bench_readers, std::ref(b), std::ref(rr), 0, false, &stop);
+            bench_write(b, b.dbi, r, &ids, bopt.n, bopt.vsize, 1);
+            stop = true;
+            readers.join();
+            bench_report(b, "mixed.read", rr, s0);
+            w = (char*)"mixed.write";
+        } else if (!strcmp(w, "filldup")) {
+            bench_drop(b, b.dup);
+            bench_snap(b, s0);
+            bench_write(b, b.dup, r, &order, bopt.n, bopt.vsize, bopt.dups);
+        } else if (!strcmp(w, "fillbig")) {
+            const uint64_t n = std::max<uint64_t>(1, bopt.n * bopt.vsize / bopt.bigsize);
+            bench_drop(b, b.big);
+            bench_snap(b, s0);
+            bench_write(b, b.big, r, nullptr, n, bopt.bigsize, 1);
+        } else {
+            std::cerr << w << ": unknown workload" << std::endl;
+            mdb_env_close(b.env);
+            return 1;
+        }
+        bench_report(b, w, r, s0);
+    }
+    mdb_env_close(b.env);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     int c;
     unsigned int flags = 0;
@@ -88,7 +415,7 @@ int main(int argc, char** argv) {
     MDB_val key, data;
     MDB_txn* txn;
 
-    while ((c = getopt(argc, argv, "nrf:")) != -1) {
+    while ((c = getopt(argc, argv, "nrf:N:k:v:V:b:t:L:D:s:j")) != -1) {
         switch (c) {
         case 'n':
             flags |= MDB_NOSYNC;
@@ -96,6 +423,36 @@ int main(int argc, char** argv) {
         case 'f':
             filename = optarg;
             break;
+        case 'N':
+            bopt.n = strtoull(optarg, nullptr, 0);
+            break;
+        case 'k':
+            bopt.ksize = atoi(optarg);
+            break;
+        case 'v':
+            bopt.vsize = atoi(optarg);
+            break;
+        case 'V':
+            bopt.bigsize = atoi(optarg);
+            break;
+        case 'b':
+            bopt.batch = atoi(optarg);
+            break;
+        case 't':
+            bopt.threads = atoi(optarg);
+            break;
+        case 'L':
+            bopt.scanlen = atoi(optarg);
+            break;
+        case 'D':
+            bopt.dups = atoi(optarg);
+            break;
+        case 's':
+            bopt.seed = atoi(optarg);
+            break;
+        case 'j':
+            bopt.json = true;
+            break;
         default:
             break;
         }
@@ -109,6 +466,13 @@ int main(int argc, char** argv) {
         return 1;
     }
     assert(sizeof(mdb_size_t)==8);
+    if (strcmp(argv[0], "bench") == 0) {
+        if (argc < 2) {
+            std::cerr << "Missing workloads" << std::endl;
+            return 1;
+        }
+        return bench(filename, flags, argv[1]);
+    }
     int rc = mdb_env_create(&env);
     handle_error(rc, "Failed to create environment");
     
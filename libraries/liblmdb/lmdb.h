@@ -265,6 +265,12 @@ typedef unsigned int	MDB_dbi;
 /** @brief Opaque structure for navigating through a database */
 typedef struct MDB_cursor MDB_cursor;
 
+/** @brief Opaque structure for a bottom-up bulk load, see #mdb_bulk_begin() */
+typedef struct MDB_bulk MDB_bulk;
+
+/** @brief Opaque structure keeping a read snapshot alive, see #mdb_lease_acquire() */
+typedef struct MDB_lease MDB_lease;
+
 /** @brief Generic structure used for passing keys and data in and out
  * of the database.
  *
@@ -300,6 +306,28 @@ typedef int  (MDB_cmp_func)(const MDB_val *a, const MDB_val *b);
  */
 typedef void (MDB_rel_func)(MDB_val *item, void *oldptr, void *newptr, void *relctx);
 
+/** @brief A callback function used to compress a large data item.
+ *
+ * It is called for data items that will be stored on overflow pages.
+ * @param[in] src The data item to compress.
+ * @param[out] dst The buffer to compress into.
+ * @param[in] dstsize The size of \b dst. Results that don't fit would not
+ * save any space, so there is no need to produce them.
+ * @param[in] ctx An application-provided context, set by #mdb_set_codec().
+ * @return The compressed size, or 0 to store the item uncompressed.
+ */
+typedef size_t (MDB_pack_func)(const MDB_val *src, void *dst, size_t dstsize, void *ctx);
+
+/** @brief A callback function used to decompress a data item.
+ *
+ * @param[in] src The compressed data.
+ * @param[in,out] dst The buffer to decompress into. Its \b mv_size is the
+ * original size of the item, which must be produced exactly.
+ * @param[in] ctx An application-provided context, set by #mdb_set_codec().
+ * @return 0 on success, non-zero if \b src is not valid.
+ */
+typedef int (MDB_unpack_func)(const MDB_val *src, MDB_val *dst, void *ctx);
+
 /** @defgroup	mdb_env	Environment Flags
  *	@{
  */
@@ -307,6 +335,8 @@ typedef void (MDB_rel_func)(MDB_val *item, void *oldptr, void *newptr, void *rel
 #define MDB_FIXEDMAP	0x01
 	/** no environment directory */
 #define MDB_NOSUBDIR	0x4000
+	/** log the pages each txn writes, for #mdb_env_copyfd_delta() */
+#define MDB_CHANGELOG	0x8000
 	/** don't fsync after commit */
 #define MDB_NOSYNC		0x10000
 	/** read only */
@@ -383,6 +413,18 @@ typedef void (MDB_rel_func)(MDB_val *item, void *oldptr, void *newptr, void *rel
 #define MDB_CP_COMPACT	0x01
 /*	@} */
 
+/**	@defgroup mdb_mapopts	Memory Placement Options
+ *	See #mdb_env_set_mapopts().
+ *	@{
+ */
+/** Ask for transparent huge pages on the data file map */
+#define MDB_MAP_HUGEPAGE	0x01
+/** Interleave the page cache pages written by commits over all NUMA nodes */
+#define MDB_MAP_INTERLEAVE	0x02
+/** Keep one branch page cache per NUMA node */
+#define MDB_MAP_NODECACHE	0x04
+/*	@} */
+
 /** @brief Cursor Get operations.
  *
  *	This is the set of all operations for retrieving data
@@ -476,8 +518,10 @@ typedef enum MDB_cursor_op {
 #define MDB_BAD_DBI		(-30780)
 	/** Unexpected problem - txn should abort */
 #define MDB_PROBLEM		(-30779)
+	/** A DBI of a #mdb_txn_begin_dbis() transaction was changed by another writer */
+#define MDB_CONFLICT		(-30778)
 	/** The last defined error code */
-#define MDB_LAST_ERRCODE	MDB_PROBLEM
+#define MDB_LAST_ERRCODE	MDB_CONFLICT
 /** @} */
 
 /** @brief Statistics for a database in the environment */
@@ -501,6 +545,38 @@ typedef struct MDB_envinfo {
 	unsigned int me_numreaders;		/**< max reader slots used in the environment */
 } MDB_envinfo;
 
+	/** Number of latency buckets in #MDB_metrics. Bucket \b i counts
+	 *	events that took less than 2^i microseconds, the last one
+	 *	also counts everything slower.
+	 */
+#define MDB_METRICS_HIST	24
+
+/** @brief Hot path counters of the environment, see #mdb_env_metrics().
+ *
+ * All counters only ever grow, from the time the first process opened
+ * the environment. Callers wanting rates take two snapshots and subtract.
+ */
+typedef struct MDB_metrics {
+	mdb_size_t	me_page_gets;		/**< Pages looked up by #MDB_cursor or #mdb_get() */
+	mdb_size_t	me_page_dirty;		/**< Of those, found in the txn's dirty list */
+	mdb_size_t	me_page_spilled;	/**< Of those, found in the txn's spill list */
+	mdb_size_t	me_splits;			/**< Page splits */
+	mdb_size_t	me_rebalances;		/**< Pages rebalanced after a delete */
+	mdb_size_t	me_merges;			/**< Of those, merged into a neighbour */
+	mdb_size_t	me_spills;			/**< Dirty pages spilled to the map */
+	mdb_size_t	me_unspills;		/**< Spilled pages made dirty again */
+	mdb_size_t	me_freedb_reads;	/**< freeDB records read to find free pages */
+	mdb_size_t	me_commits;			/**< Write txns committed with changes */
+	mdb_size_t	me_commit_usec;		/**< Total time spent in those commits */
+	mdb_size_t	me_flush_pages;		/**< Dirty pages written by commits and spills */
+	mdb_size_t	me_flush_bytes;		/**< Bytes written for those pages */
+	mdb_size_t	me_flush_usec;		/**< Total time spent writing them */
+	mdb_size_t	me_syncs;			/**< Data file syncs */
+	mdb_size_t	me_sync_usec;		/**< Total time spent in those syncs */
+	mdb_size_t	me_commit_hist[MDB_METRICS_HIST];	/**< Commit latencies */
+	mdb_size_t	me_sync_hist[MDB_METRICS_HIST];		/**< Sync latencies */
+} MDB_metrics;
+
 	/** @brief Return the LMDB library version information.
 	 *
 	 * @param[out] major if non-NULL, the library major version number is copied here
@@ -648,6 +724,14 @@ int  mdb_env_create(MDB_env **env);
 	 *		types of corruption. If opened with write access, this must be the
 	 *		only process using the environment. This flag is automatically reset
 	 *		after a write transaction is successfully committed.
+	 *	<li>#MDB_CHANGELOG
+	 *		Append the numbers of the pages each write transaction writes
+	 *		to a change log, "changes.mdb" in the environment directory or
+	 *		the path with "-changes" appended with #MDB_NOSUBDIR. This is what
+	 *		#mdb_env_copyfd_delta() sends incremental backups from. Every
+	 *		process writing to the environment must use this flag, or
+	 *		deltas spanning its transactions fail. The log only grows; to
+	 *		restart it, remove it while no process has the environment open.
 	 * </ul>
 	 * @param[in] mode The UNIX permissions to set on created files and semaphores.
 	 * This parameter is ignored on Windows.
@@ -714,6 +798,8 @@ int  mdb_env_copyfd(MDB_env *env, mdb_filehandle_t fd);
 	 *	<li>#MDB_CP_COMPACT - Perform compaction while copying: omit free
 	 *		pages and sequentially renumber all pages in output. This option
 	 *		consumes more CPU and runs more slowly than the default.
+	 *		Large environments copied to a regular file are walked by
+	 *		one thread per CPU, each writing its own range of pages.
 	 *		Currently it fails if the environment has suffered a page leak.
 	 * </ul>
 	 * @return A non-zero error value on failure and 0 on success.
@@ -739,6 +825,68 @@ int  mdb_env_copy2(MDB_env *env, const char *path, unsigned int flags);
 	 */
 int  mdb_env_copyfd2(MDB_env *env, mdb_filehandle_t fd, unsigned int flags);
 
+	/** @brief Write the changes since a past transaction as a delta.
+	 *
+	 * The delta holds every page written by the transactions after
+	 * \b since, up to the latest one, and the meta page of the latest one.
+	 * #mdb_env_apply_delta() rolls a copy forward with it. The pages are
+	 * taken from the #MDB_CHANGELOG file, which must cover all of those
+	 * transactions.
+	 * @note Like #mdb_env_copyfd2(), this call employs a read-only
+	 * transaction for the duration of the copy.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully.
+	 * @param[in] fd The filedescriptor to write the delta to. It must
+	 * have already been opened for Write access.
+	 * @param[in] since The ID of the transaction the copy to be rolled
+	 * forward was made at, as #MDB_envinfo.%me_last_txnid reported it.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>ENOENT - the environment has no change log.
+	 *	<li>#MDB_NOTFOUND - the change log does not cover every transaction
+	 *	after \b since.
+	 *	<li>EINVAL - \b since is newer than the latest transaction.
+	 * </ul>
+	 */
+int  mdb_env_copyfd_delta(MDB_env *env, mdb_filehandle_t fd, mdb_size_t since);
+
+	/** @brief Write the changes since a past transaction to a file.
+	 *
+	 * See #mdb_env_copyfd_delta() for details.
+	 * @param[in] env An environment handle returned by #mdb_env_create(). It
+	 * must have already been opened successfully.
+	 * @param[in] path The file to write the delta to. It must not exist yet.
+	 * @param[in] since The ID of the transaction the copy to be rolled
+	 * forward was made at.
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_env_copy_delta(MDB_env *env, const char *path, mdb_size_t since);
+
+	/** @brief Roll a copy of an environment forward with a delta.
+	 *
+	 * The copy must have been made by #mdb_env_copy() without
+	 * #MDB_CP_COMPACT, at or after the transaction the delta was made
+	 * since, and no later than the delta's own. No process may have it open.
+	 * Afterwards it is at the delta's transaction. If this fails after the
+	 * first page was written, the copy is no longer usable: keep the
+	 * previous one until the delta was applied.
+	 * @param[in] path The directory of the copy, or its data file with
+	 * #MDB_NOSUBDIR.
+	 * @param[in] flags 0 or #MDB_NOSUBDIR.
+	 * @param[in] fd The filedescriptor to read the delta from.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EBUSY - the copy is open in some process.
+	 *	<li>#MDB_NOTFOUND - the copy is older than the delta's base, or
+	 *	newer than the delta.
+	 *	<li>#MDB_INVALID - the input is not a delta, or it is truncated.
+	 *	<li>#MDB_INCOMPATIBLE - the copy has a different page size.
+	 * </ul>
+	 */
+int  mdb_env_apply_delta(const char *path, unsigned int flags, mdb_filehandle_t fd);
+
 	/** @brief Return statistics about the LMDB environment.
 	 *
 	 * @param[in] env An environment handle returned by #mdb_env_create()
@@ -755,6 +903,20 @@ int  mdb_env_stat(MDB_env *env, MDB_stat *stat);
 	 */
 int  mdb_env_info(MDB_env *env, MDB_envinfo *stat);
 
+	/** @brief Return the hot path counters of the LMDB environment.
+	 *
+	 * The counters live in the lock file, so they cover every process
+	 * using the environment, and a monitoring tool like mdb_stat(1) can
+	 * read them without interfering. With #MDB_NOLOCK they only cover
+	 * this environment handle. Read txns add their page lookups when
+	 * they end, so long running ones show up late.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[out] metrics The address of an #MDB_metrics structure
+	 * 	where the counters will be copied
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int  mdb_env_metrics(MDB_env *env, MDB_metrics *metrics);
+
 	/** @brief Flush the data buffers to disk.
 	 *
 	 * Data is always written to disk when #mdb_txn_commit() is called,
@@ -909,6 +1071,89 @@ int  mdb_env_set_maxreaders(MDB_env *env, unsigned int readers);
 	 */
 int  mdb_env_get_maxreaders(MDB_env *env, unsigned int *readers);
 
+	/** @brief Set the size of the branch page cache for the environment.
+	 *
+	 * Read-only transactions that search a database in the default key
+	 * order may keep the upper branch pages of its tree, the ones above
+	 * the parents of the leaf pages, decoded in a per-process cache. The
+	 * cache holds each page's key prefixes and child page numbers in a
+	 * compact layout, so that most steps of a search down to a leaf
+	 * parent do not touch the mapped pages. Cached pages only serve
+	 * transactions on the snapshot they were decoded from, so the cache
+	 * is worth most to many short readers between infrequent commits.
+	 * Each slot takes about 4KB. The default is 0, no cache.
+	 * This function may only be called after #mdb_env_create() and before #mdb_env_open().
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] slots The number of cached pages, rounded up to a power of 2
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the environment is already open.
+	 * </ul>
+	 */
+int  mdb_env_set_branch_cache(MDB_env *env, unsigned int slots);
+
+	/** @brief Set memory placement options for the environment.
+	 *
+	 * These are hints for large hosts; each is silently skipped where the
+	 * OS does not support it, and the NUMA options on single node hosts.
+	 * This function may only be called after #mdb_env_create() and before #mdb_env_open().
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] opts Options for the environment. This parameter must be
+	 * set to 0 or by bitwise OR'ing together one or more of the values
+	 * described here.
+	 * <ul>
+	 *	<li>#MDB_MAP_HUGEPAGE
+	 *		Advise the kernel to back the data file map with huge pages, to
+	 *		save TLB misses on large databases. Whether file pages can be
+	 *		huge depends on the filesystem. The memory dirty pages are
+	 *		carved from already asks for huge pages.
+	 *	<li>#MDB_MAP_INTERLEAVE
+	 *		The kernel places page cache pages by the memory policy of the
+	 *		thread that allocates them, and ignores mbind() on shared file
+	 *		maps. With this option the writer interleaves the pages it
+	 *		writes at commit over all nodes, so readers on every node see
+	 *		the same average latency. Pages that readers fault in from disk
+	 *		still follow the reading thread's policy; run the process under
+	 *		an interleave policy, e.g. numactl --interleave=all, for those.
+	 *	<li>#MDB_MAP_NODECACHE
+	 *		Keep a replica of the branch page cache, see
+	 *		#mdb_env_set_branch_cache(), in the memory of every node.
+	 *		Read-only transactions use the replica of the node they begin
+	 *		on, so the hot upper levels of each tree are decoded once per
+	 *		node and searched without cross-node memory traffic.
+	 * </ul>
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the environment is already open.
+	 * </ul>
+	 */
+int  mdb_env_set_mapopts(MDB_env *env, unsigned int opts);
+
+	/** @brief Set how many dirty pages a write transaction holds in memory.
+	 *
+	 * When a write transaction has dirtied this many pages, some of them
+	 * are written to the data file ahead of the commit to bound its memory
+	 * use. Spilled pages that are touched again are read back in. The
+	 * default is 131071 pages, about 512MB with 4KB pages. Bulk loads that
+	 * can afford the memory may raise the limit, or remove it with 0 to
+	 * never spill; the dirty page table grows as needed either way.
+	 * Nested transactions do not spill. The pages they dirty count
+	 * against the limit of their parent once they commit.
+	 * The limit can be changed at any time and applies from the next
+	 * write transaction on.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] pages The most dirty pages, or 0 for no limit.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, e.g. a limit
+	 *	below 1024 pages.
+	 * </ul>
+	 */
+int  mdb_env_set_dirty_limit(MDB_env *env, unsigned int pages);
+
 	/** @brief Set the maximum number of named databases for the environment.
 	 *
 	 * This function is only needed if multiple databases will be used in the
@@ -970,6 +1215,42 @@ typedef void MDB_assert_func(MDB_env *env, const char *msg);
 	 */
 int  mdb_env_set_assert(MDB_env *env, MDB_assert_func *func);
 
+	/** @brief A page allocator for the dirty pages of write transactions.
+	 *
+	 * @param[in] ctx The context passed to #mdb_env_set_page_allocator().
+	 * @param[in] size The number of bytes needed, a multiple of the page size.
+	 * @return The memory, or NULL on failure.
+	 */
+typedef void *MDB_page_alloc_func(void *ctx, size_t size);
+
+	/** @brief Release memory returned by an #MDB_page_alloc_func.
+	 *
+	 * @param[in] ctx The context passed to #mdb_env_set_page_allocator().
+	 * @param[in] ptr The memory to release.
+	 * @param[in] size The size it was allocated with.
+	 */
+typedef void MDB_page_free_func(void *ctx, void *ptr, size_t size);
+
+	/** @brief Set the allocator for the dirty pages of the environment.
+	 *
+	 * By default dirty pages are carved from large anonymous mappings,
+	 * which use transparent huge pages where available and are released
+	 * in bulk when each write transaction ends. This replaces that arena
+	 * with the caller's own allocator.
+	 * This function may only be called after #mdb_env_create() and before #mdb_env_open().
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] alloc An #MDB_page_alloc_func function, or NULL to use the default.
+	 * @param[in] dealloc An #MDB_page_free_func function, required if \b alloc is set.
+	 * @param[in] ctx An arbitrary pointer passed to both functions.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified, or the environment is already open.
+	 * </ul>
+	 */
+int  mdb_env_set_page_allocator(MDB_env *env, MDB_page_alloc_func *alloc,
+	MDB_page_free_func *dealloc, void *ctx);
+
 	/** @brief Create a transaction for use with the environment.
 	 *
 	 * The transaction handle may be discarded using #mdb_txn_abort() or #mdb_txn_commit().
@@ -983,6 +1264,9 @@ int  mdb_env_set_assert(MDB_env *env, MDB_assert_func *func);
 	 * as its parent. Transactions may be nested to any level. A parent
 	 * transaction and its cursors may not issue any other operations than
 	 * mdb_txn_commit and mdb_txn_abort while it has active child transactions.
+	 * Committing or aborting a child takes time in proportion to what the
+	 * child changed, not to the size of its parent, so children can serve
+	 * as savepoints within a large write transaction.
 	 * @param[in] flags Special options for this transaction. This parameter
 	 * must be set to 0 or by bitwise OR'ing together one or more of the
 	 * values described here.
@@ -1010,6 +1294,52 @@ int  mdb_env_set_assert(MDB_env *env, MDB_assert_func *func);
 	 */
 int  mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **txn);
 
+	/** @brief Create a write transaction limited to the given databases.
+	 *
+	 * Unlike #mdb_txn_begin(), this does not take the environment's writer
+	 * lock. It claims the listed databases instead, waiting while another
+	 * such transaction in this process has claimed any of them, and then
+	 * starts on the newest snapshot. Transactions on disjoint sets of
+	 * databases thus run concurrently with each other and with a regular
+	 * write transaction. Puts and deletes are collected in memory; only
+	 * #mdb_txn_commit() takes the writer lock, to replay them in one
+	 * regular write transaction.
+	 *
+	 * On the listed databases, #mdb_get(), #mdb_put(), #mdb_put_batch()
+	 * and #mdb_del() see the transaction's own changes, and their results
+	 * are final: for example #MDB_NOOVERWRITE reports #MDB_KEYEXIST at
+	 * once. Only the #MDB_NOOVERWRITE and #MDB_RESERVE put flags are
+	 * supported, and cursors cannot be opened on these databases. Other
+	 * databases are read-only and show the snapshot. The claim only
+	 * excludes other transactions from this function in this process. If
+	 * any other writer changes a listed database in the meantime, commit
+	 * fails with #MDB_CONFLICT. #mdb_txn_abort() and #mdb_txn_reset()
+	 * discard the changes and release the claim. The transaction holds a
+	 * reader slot like a read-only one, so unless the environment uses
+	 * #MDB_NOTLS, a thread may not have both open at once.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] dbis The named databases the transaction will write.
+	 * They must have been opened, and must not be #MDB_DUPSORT.
+	 * @param[in] ndbis The number of handles in \b dbis
+	 * @param[in] flags Special options for this transaction. This parameter
+	 * must be set to 0 or by bitwise OR'ing together one or more of
+	 * #MDB_NOSYNC and #MDB_NOMETASYNC, which apply to the commit.
+	 * @param[out] txn Address where the new #MDB_txn handle will be stored
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_INCOMPATIBLE - a database is #MDB_DUPSORT.
+	 *	<li>#MDB_READERS_FULL - the reader lock table is full.
+	 *		See #mdb_env_set_maxreaders().
+	 *	<li>#MDB_BAD_RSLOT - this thread already has a read-only transaction,
+	 *		and the environment does not use #MDB_NOTLS.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_txn_begin_dbis(MDB_env *env, const MDB_dbi *dbis, unsigned int ndbis,
+	unsigned int flags, MDB_txn **txn);
+
 	/** @brief Returns the transaction's #MDB_env
 	 *
 	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
@@ -1037,6 +1367,8 @@ mdb_size_t mdb_txn_id(MDB_txn *txn);
 	 * @return A non-zero error value on failure and 0 on success. Some possible
 	 * errors are:
 	 * <ul>
+	 *	<li>#MDB_CONFLICT - for a #mdb_txn_begin_dbis() transaction, another
+	 *		writer changed one of its databases.
 	 *	<li>EINVAL - an invalid parameter was specified.
 	 *	<li>ENOSPC - no more disk space.
 	 *	<li>EIO - a low-level I/O error occurred while writing.
@@ -1045,6 +1377,47 @@ mdb_size_t mdb_txn_id(MDB_txn *txn);
 	 */
 int  mdb_txn_commit(MDB_txn *txn);
 
+	/** @brief Commit a transaction without waiting for it to reach the disk.
+	 *
+	 * The data pages are written as for #mdb_txn_commit(), but the sync and
+	 * the meta page update are deferred, and a ticket is returned instead.
+	 * The next write transaction, in any process, starts from the result of
+	 * this one. Readers don't see it until it has been made durable by
+	 * #mdb_env_sync_group(), or by a later #mdb_txn_commit().
+	 * A single sync then covers any number of group commits.
+	 *
+	 * If the system crashes before that, the transaction is lost, but all
+	 * durable transactions remain intact: pages referenced by the last
+	 * durable meta page are not reused until a newer one is written.
+	 * Unsynced group commits are also flushed by #mdb_env_close().
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[out] ticket Address where the ticket for #mdb_env_sync_group()
+	 * is stored. It is the ID of the committed transaction.
+	 * @return A non-zero error value on failure and 0 on success. The same
+	 * errors as #mdb_txn_commit() are possible.
+	 */
+int  mdb_txn_commit_group(MDB_txn *txn, mdb_size_t *ticket);
+
+	/** @brief Wait until a group commit is durable and visible to readers.
+	 *
+	 * Makes the group commit with the given ticket, and all before it,
+	 * durable with one data sync and one meta page write, unless another
+	 * thread or process already did so. Concurrent callers queue on the
+	 * writer lock, and the first one syncs on behalf of all of them.
+	 * This function must not be called while the calling thread has a
+	 * write transaction open.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] ticket A ticket returned by #mdb_txn_commit_group()
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EACCES - the environment is read-only.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>EIO - an error occurred during synchronization.
+	 * </ul>
+	 */
+int  mdb_env_sync_group(MDB_env *env, mdb_size_t ticket);
+
 	/** @brief Abandon all the operations of the transaction instead of saving them.
 	 *
 	 * The transaction handle is freed. It and its cursors must not be used
@@ -1090,6 +1463,83 @@ void mdb_txn_reset(MDB_txn *txn);
 	 */
 int  mdb_txn_renew(MDB_txn *txn);
 
+	/** @brief Begin a read-only transaction on the snapshot of another.
+	 *
+	 * The new transaction sees the same data as \b txn, including the
+	 * database handles opened in \b txn, however much the environment
+	 * has changed since \b txn began. It is otherwise independent: it
+	 * may be used from another thread, and must be ended on its own. This
+	 * lets several threads read one consistent snapshot, each with its
+	 * own transaction. A renewed clone reads the latest snapshot.
+	 *
+	 * The same rules as for #mdb_txn_begin() apply to the reader slot:
+	 * unless the environment was opened with #MDB_NOTLS, the transaction
+	 * must be cloned in the thread that will use it, and that thread may
+	 * not have another read-only transaction. \b txn may not be used by
+	 * another thread during the call.
+	 * @param[in] txn A read-only transaction handle returned by #mdb_txn_begin()
+	 * @param[out] ret Address where the new #MDB_txn handle will be stored
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_READERS_FULL - the reader lock table is full.
+	 *		See #mdb_env_set_maxreaders().
+	 *	<li>#MDB_BAD_RSLOT - this thread already has a read-only transaction.
+	 *	<li>EINVAL - an invalid parameter was specified, or \b txn is not
+	 *		read-only.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_txn_clone(MDB_txn *txn, MDB_txn **ret);
+
+	/** @brief Keep the values of a read-only transaction valid after it ends.
+	 *
+	 * Data returned by a read-only transaction normally points into the
+	 * memory map, or into memory owned by the transaction, and is only valid
+	 * until the transaction ends or is reset. A lease takes over that role:
+	 * it holds a reader lock table slot of its own on the transaction's
+	 * snapshot, and at the end of the transaction it takes over the
+	 * memory the transaction returned decompressed values in. Every value
+	 * the transaction returns, before or after this call, then stays valid
+	 * until the last reference to the lease is released. The transaction
+	 * itself may be reset, renewed or aborted as usual in the meantime.
+	 *
+	 * Calling this again in the same transaction returns the same lease
+	 * with one more reference. Like an open read-only transaction, a lease
+	 * keeps old database pages from being reused, so it should be released
+	 * as soon as the values are no longer needed. All leases must be
+	 * released before the environment is closed.
+	 * @param[in] txn A read-only transaction handle returned by #mdb_txn_begin()
+	 * @param[out] lease Address where the new #MDB_lease handle will be stored
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_READERS_FULL - a read-only transaction was requested and
+	 *		the reader lock table is full. See #mdb_env_set_maxreaders().
+	 *	<li>EINVAL - an invalid parameter was specified, or \b txn is not
+	 *		read-only.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_lease_acquire(MDB_txn *txn, MDB_lease **lease);
+
+	/** @brief Add a reference to a lease.
+	 *
+	 * Each reference must be dropped with #mdb_lease_release(). This may be
+	 * called from any thread.
+	 * @param[in] lease A lease handle returned by #mdb_lease_acquire()
+	 */
+void mdb_lease_retain(MDB_lease *lease);
+
+	/** @brief Drop a reference to a lease.
+	 *
+	 * When the last reference is gone the lease's snapshot is released and
+	 * all values it covered become invalid. This may be called from any
+	 * thread, and does not need the transaction the lease came from.
+	 * @param[in] lease A lease handle returned by #mdb_lease_acquire()
+	 */
+void mdb_lease_release(MDB_lease *lease);
+
 /** Compat with version <= 0.9.4, avoid clash with libmdb from MDB Tools project */
 #define mdb_open(txn,name,flags,dbi)	mdb_dbi_open(txn,name,flags,dbi)
 /** Compat with version <= 0.9.4, avoid clash with libmdb from MDB Tools project */
@@ -1189,6 +1639,30 @@ int  mdb_stat(MDB_txn *txn, MDB_dbi dbi, MDB_stat *stat);
 	 */
 int mdb_dbi_flags(MDB_txn *txn, MDB_dbi dbi, unsigned int *flags);
 
+	/** @brief Find keys that cut a database into ranges of similar size.
+	 *
+	 * The keys are taken from the branch pages of the upper levels of the
+	 * tree, so this reads only a few pages. They are returned in database
+	 * order. Each may be passed to #mdb_cursor_get() with #MDB_SET_RANGE
+	 * to start a range, which then ends before the next key. The ranges
+	 * differ in size as the pages below them do, and fewer keys than
+	 * asked for are returned for small databases, none if the database
+	 * fits on one page. The keys point into the database and are valid
+	 * as long as a value returned by #mdb_get() would be.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[out] keys An array for up to \b *nkeys keys
+	 * @param[in,out] nkeys The size of \b keys on input, the number of
+	 * keys returned on output
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_dbi_ranges(MDB_txn *txn, MDB_dbi dbi, MDB_val *keys, unsigned int *nkeys);
+
 	/** @brief Close a database handle. Normally unnecessary. Use with care:
 	 *
 	 * This call is not mutex protected. Handles should only be closed by
@@ -1298,6 +1772,32 @@ int  mdb_set_relfunc(MDB_txn *txn, MDB_dbi dbi, MDB_rel_func *rel);
 	 */
 int  mdb_set_relctx(MDB_txn *txn, MDB_dbi dbi, void *ctx);
 
+	/** @brief Set a compression codec for the large data items of a database.
+	 *
+	 * Data items too big to fit in a page are compressed with \b pack
+	 * before they go to overflow pages, if that saves at least one page.
+	 * Reads decompress them transparently into memory owned by the
+	 * transaction, which stays valid until the transaction ends or is
+	 * reset. Like #mdb_set_compare(), this must be called before any
+	 * data access and the same codec must be set every time the
+	 * database is used, or compressed items can't be read back
+	 * (#MDB_INCOMPATIBLE). Has no effect on #MDB_DUPSORT data or on
+	 * items written with #MDB_RESERVE.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] pack A #MDB_pack_func function, or NULL to stop compressing
+	 * new items.
+	 * @param[in] unpack A #MDB_unpack_func function. Required if \b pack is set.
+	 * @param[in] ctx An arbitrary pointer passed to both functions.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_set_codec(MDB_txn *txn, MDB_dbi dbi, MDB_pack_func *pack,
+	MDB_unpack_func *unpack, void *ctx);
+
 	/** @brief Get items from a database.
 	 *
 	 * This function retrieves key/data pairs from the database. The address
@@ -1326,6 +1826,33 @@ int  mdb_set_relctx(MDB_txn *txn, MDB_dbi dbi, void *ctx);
 	 */
 int  mdb_get(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 
+	/** @brief Get many items from a database in one call.
+	 *
+	 * This is equivalent to calling #mdb_get() for each of the \b n keys,
+	 * but the keys are probed in sorted order and the search path of one
+	 * key is reused for the next, so keys that share a leaf page cost a
+	 * single in-page search instead of a full descent from the root.
+	 * The \b keys array itself is not reordered.
+	 *
+	 * The same restrictions as #mdb_get() apply to the returned values.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] keys An array of \b n keys to search for
+	 * @param[in] n The number of keys
+	 * @param[out] vals An array of \b n items, receiving the data for
+	 * each found key
+	 * @param[out] rcs An array of \b n result codes, one per key, as
+	 * #mdb_get() would have returned them
+	 * @return A non-zero error value on failure and 0 on success. A missing
+	 * key is not a failure, it is reported in \b rcs. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_get_batch(MDB_txn *txn, MDB_dbi dbi, MDB_val *keys, size_t n, MDB_val *vals, int *rcs);
+
 	/** @brief Store items into a database.
 	 *
 	 * This function stores key/data pairs in the database. The default behavior
@@ -1375,6 +1902,102 @@ int  mdb_get(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 	 */
 int  mdb_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, unsigned int flags);
 
+	/** @brief Store many items into a database in one call.
+	 *
+	 * This is equivalent to calling #mdb_put() for each of the \b count
+	 * key/data pairs, but the pairs are stored in key order and runs of
+	 * new keys that land on the same leaf page are merged into it in a
+	 * single pass, shifting the page's node pointers once per run instead
+	 * of once per key. Keys that need a page split, an overflow page or
+	 * that already exist go through the regular #mdb_put() path.
+	 * The leaf pages that upcoming keys land on are prefetched while
+	 * earlier keys are stored, so a batch on a cold cache does not wait
+	 * for one page fault per leaf.
+	 * The caller's arrays are not reordered. If the same key appears more
+	 * than once, the last one in \b keys wins, as with repeated #mdb_put()
+	 * calls.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open(). It
+	 * must not have been opened with #MDB_DUPSORT.
+	 * @param[in] keys An array of \b count keys to store
+	 * @param[in] data An array of \b count data items to store
+	 * @param[in] count The number of key/data pairs
+	 * @param[in] flags Special options for this operation.
+	 * This parameter must be set to 0 or to:
+	 * <ul>
+	 *	<li>#MDB_NOOVERWRITE - leave keys that already appear in the database
+	 *		unchanged. This is not an error; the existing data is returned
+	 *		in the matching \b data item, as #mdb_put() does.
+	 * </ul>
+	 * @return A non-zero error value on failure and 0 on success. On failure
+	 * some of the pairs may have been stored; the transaction should be
+	 * aborted. Some possible errors are:
+	 * <ul>
+	 *	<li>#MDB_MAP_FULL - the database is full, see #mdb_env_set_mapsize().
+	 *	<li>#MDB_TXN_FULL - the transaction has too many dirty pages.
+	 *	<li>#MDB_INCOMPATIBLE - the database uses #MDB_DUPSORT.
+	 *	<li>EACCES - an attempt was made to write in a read-only transaction.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_put_batch(MDB_txn *txn, MDB_dbi dbi, MDB_val *keys, MDB_val *data, size_t count, unsigned int flags);
+
+	/** @brief Store many duplicate data items under one key.
+	 *
+	 * This is the same as calling #mdb_put() with #MDB_NODUPDATA once for
+	 * each item, but the items are sorted first. On an #MDB_DUPFIXED
+	 * database, new items that land on the same page of duplicates are
+	 * merged into it in a single pass, moving the page's items once per
+	 * run instead of once per item. Items that need a new page or a
+	 * conversion of the key's duplicates go through the regular
+	 * #mdb_put() path. Items already present are left alone.
+	 * The caller's array is not reordered.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open(). It
+	 * must have been opened with #MDB_DUPSORT.
+	 * @param[in] key The key to store the items under
+	 * @param[in] data An array of \b count data items to store
+	 * @param[in] count The number of data items
+	 * @return A non-zero error value on failure and 0 on success. On failure
+	 * some of the items may have been stored; the transaction should be
+	 * aborted. Some possible errors are:
+	 * <ul>
+	 *	<li>#MDB_MAP_FULL - the database is full, see #mdb_env_set_mapsize().
+	 *	<li>#MDB_TXN_FULL - the transaction has too many dirty pages.
+	 *	<li>#MDB_INCOMPATIBLE - the database does not use #MDB_DUPSORT.
+	 *	<li>EACCES - an attempt was made to write in a read-only transaction.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_put_dups(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, size_t count);
+
+	/** @brief Delete many duplicate data items of one key.
+	 *
+	 * The items are sorted first and removed in order. A delete leaves
+	 * the cursor on the next item, so a run of adjacent items is removed
+	 * without searching the tree again. Items that are not present are
+	 * skipped. The caller's array is not reordered.
+	 * @param[in] txn A transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open(). It
+	 * must have been opened with #MDB_DUPSORT.
+	 * @param[in] key The key whose items to delete
+	 * @param[in] data An array of \b count data items to delete
+	 * @param[in] count The number of data items
+	 * @param[out] deleted If non-NULL, the number of items actually deleted
+	 * @return A non-zero error value on failure and 0 on success. On failure
+	 * some of the items may have been deleted; the transaction should be
+	 * aborted. Some possible errors are:
+	 * <ul>
+	 *	<li>#MDB_INCOMPATIBLE - the database does not use #MDB_DUPSORT.
+	 *	<li>EACCES - an attempt was made to write in a read-only transaction.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_del_dups(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, size_t count, size_t *deleted);
+
 	/** @brief Delete items from a database.
 	 *
 	 * This function removes key/data pairs from the database.
@@ -1449,6 +2072,25 @@ void mdb_cursor_close(MDB_cursor *cursor);
 	 */
 int  mdb_cursor_renew(MDB_txn *txn, MDB_cursor *cursor);
 
+	/** @brief Prefetch pages ahead of a range scan with a cursor.
+	 *
+	 * When the cursor moves on to a new leaf page with #MDB_NEXT,
+	 * #MDB_PREV or similar operations, the kernel is told with
+	 * madvise(MADV_WILLNEED) that the next \b leaves leaf pages in the
+	 * direction of the scan, and the overflow pages of large items on
+	 * the new leaf, will be needed soon. This helps cold scans that are
+	 * bound by I/O latency, in particular with #MDB_NORDAHEAD.
+	 * The setting is kept by #mdb_cursor_renew().
+	 * @param[in] cursor A cursor handle returned by #mdb_cursor_open()
+	 * @param[in] leaves The number of leaf pages to prefetch, or 0 to stop.
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_cursor_set_readahead(MDB_cursor *cursor, unsigned int leaves);
+
 	/** @brief Return the cursor's transaction handle.
 	 *
 	 * @param[in] cursor A cursor handle returned by #mdb_cursor_open()
@@ -1580,6 +2222,33 @@ int  mdb_cursor_del(MDB_cursor *cursor, unsigned int flags);
 	 */
 int  mdb_cursor_count(MDB_cursor *cursor, mdb_size_t *countp);
 
+	/** @brief Retrieve a page of duplicates and the key's duplicate count.
+	 *
+	 * This combines #mdb_cursor_get(), #MDB_GET_MULTIPLE and
+	 * #mdb_cursor_count() in one call for #MDB_DUPFIXED databases.
+	 * The cursor is moved with \b op, then \b data is set to the
+	 * contiguous array of fixed-size items on the page of duplicates
+	 * holding the cursor's item: the first page after a forward move,
+	 * the last page after #MDB_LAST or #MDB_PREV_NODUP. A key with a
+	 * single data item returns just that item. Further pages are read
+	 * with #MDB_NEXT_MULTIPLE or #MDB_PREV_MULTIPLE as \b op.
+	 * @param[in] cursor A cursor handle returned by #mdb_cursor_open()
+	 * @param[in,out] key The key for a specified data item, or the key
+	 * the cursor was moved to
+	 * @param[out] data The page of data items
+	 * @param[out] countp Address where the key's total number of data
+	 * items will be stored
+	 * @param[in] op A cursor operation #MDB_cursor_op
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_NOTFOUND - no matching key found.
+	 *	<li>#MDB_INCOMPATIBLE - the database does not use #MDB_DUPFIXED.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_cursor_get_dups(MDB_cursor *cursor, MDB_val *key, MDB_val *data, mdb_size_t *countp, MDB_cursor_op op);
+
 	/** @brief Compare two data items according to a particular database.
 	 *
 	 * This returns a comparison as if the two data items were keys in the
@@ -1604,6 +2273,57 @@ int  mdb_cmp(MDB_txn *txn, MDB_dbi dbi, const MDB_val *a, const MDB_val *b);
 	 */
 int  mdb_dcmp(MDB_txn *txn, MDB_dbi dbi, const MDB_val *a, const MDB_val *b);
 
+	/** @brief Start building an empty database from sorted input.
+	 *
+	 * Instead of inserting through the normal put path, which splits
+	 * pages and leaves them about half full, the builder fills each leaf
+	 * page up to \b fill percent of its space, then starts the next one, and
+	 * builds the branch levels above it as it goes. The database is
+	 * valid after every #mdb_bulk_put(), and the pages are written out
+	 * by the normal commit of \b txn.
+	 *
+	 * The database must be empty and must not use #MDB_DUPSORT or
+	 * #MDB_DUPFIXED. No other writes may be made to the database until
+	 * #mdb_bulk_close() is called, which must happen before the
+	 * transaction ends. Other databases may be written meanwhile.
+	 * @param[in] txn A write transaction handle returned by #mdb_txn_begin()
+	 * @param[in] dbi A database handle returned by #mdb_dbi_open()
+	 * @param[in] fill Percentage of each page to fill, 1 to 100. Zero means 100.
+	 * @param[out] ret Address where the new #MDB_bulk handle will be stored
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_INCOMPATIBLE - the database uses duplicate data items.
+	 *	<li>EACCES - \b txn is read-only.
+	 *	<li>EINVAL - the database is not empty, or an invalid parameter was specified.
+	 *	<li>ENOMEM - out of memory.
+	 * </ul>
+	 */
+int  mdb_bulk_begin(MDB_txn *txn, MDB_dbi dbi, unsigned int fill, MDB_bulk **ret);
+
+	/** @brief Append a key/data pair to a bulk build.
+	 *
+	 * Keys must be given in strictly ascending order of the database's
+	 * comparison function.
+	 * @param[in] bulk A handle returned by #mdb_bulk_begin()
+	 * @param[in] key The key to store
+	 * @param[in] data The data to store
+	 * @return A non-zero error value on failure and 0 on success. Some possible
+	 * errors are:
+	 * <ul>
+	 *	<li>#MDB_KEYEXIST - the key does not sort after the previous one.
+	 *	<li>#MDB_MAP_FULL - the database is full, see #mdb_env_set_mapsize().
+	 *	<li>#MDB_TXN_FULL - the transaction has too many dirty pages.
+	 *	<li>EINVAL - an invalid parameter was specified.
+	 * </ul>
+	 */
+int  mdb_bulk_put(MDB_bulk *bulk, MDB_val *key, MDB_val *data);
+
+	/** @brief Finish a bulk build and free its handle.
+	 * @param[in] bulk A handle returned by #mdb_bulk_begin()
+	 */
+void mdb_bulk_close(MDB_bulk *bulk);
+
 	/** @brief A callback function used to print a message from the library.
 	 *
 	 * @param[in] msg The string to be printed.
@@ -1628,6 +2348,70 @@ int	mdb_reader_list(MDB_env *env, MDB_msg_func *func, void *ctx);
 	 * @return 0 on success, non-zero on failure.
 	 */
 int	mdb_reader_check(MDB_env *env, int *dead);
+
+	/** @brief Information about a reader holding a snapshot open.
+	 *	Filled in by #mdb_reader_info().
+	 */
+typedef struct MDB_rdrinfo {
+	unsigned int	mri_slot;	/**< index of the slot in the reader table */
+	int		mri_pid;		/**< process ID of the reader */
+	size_t	mri_tid;		/**< thread ID of the reader */
+	mdb_size_t	mri_txnid;	/**< ID of the snapshot it reads */
+	mdb_size_t	mri_lag;	/**< txns committed since that snapshot */
+	mdb_size_t	mri_msec;	/**< milliseconds the snapshot has been held */
+	/** Free pages that cannot be reused while this reader lives: those
+	 *	freed by txns from #mri_txnid up to the last committed one.
+	 */
+	mdb_size_t	mri_pinned;
+} MDB_rdrinfo;
+
+	/** @brief A callback function used to report a reader.
+	 *
+	 * @param[in] info The reader. Only valid during the call.
+	 * @param[in] ctx An arbitrary context pointer for the callback.
+	 * @return < 0 to stop, >= 0 to go on.
+	 */
+typedef int (MDB_rdr_func)(const MDB_rdrinfo *info, void *ctx);
+
+	/** @brief Report the readers holding a snapshot, oldest first.
+	 *
+	 * Slots which are claimed but have no read transaction open are
+	 * skipped. This function opens a read-only transaction of its own, so it
+	 * must not be called from a thread that has one open unless the
+	 * environment was opened with #MDB_NOTLS.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] func A #MDB_rdr_func function
+	 * @param[in] ctx Anything the function needs
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int	mdb_reader_info(MDB_env *env, MDB_rdr_func *func, void *ctx);
+
+	/** @brief A callback function for too many pinned pages.
+	 *
+	 * @param[in] env The environment.
+	 * @param[in] pinned Free pages that readers keep from being reused,
+	 *	counted up to the limit given to #mdb_env_set_pin_callback().
+	 * @param[in] txnid ID of the snapshot of the oldest reader.
+	 * @param[in] ctx An arbitrary context pointer for the callback.
+	 */
+typedef void (MDB_pin_func)(MDB_env *env, mdb_size_t pinned, mdb_size_t txnid, void *ctx);
+
+	/** @brief Set a callback for readers pinning too many pages.
+	 *
+	 * After each write transaction this environment handle commits, the
+	 * free pages which cannot be reused because of old readers are
+	 * counted, and \b func is called when the count rises to \b limit.
+	 * It is called again only after the count has gone back below it.
+	 * The callback runs in the committing thread after the write lock is
+	 * released. Counting reads free DB records from the newest down, and
+	 * stops once \b limit is reached.
+	 * @param[in] env An environment handle returned by #mdb_env_create()
+	 * @param[in] func A #MDB_pin_func function, or NULL to remove it
+	 * @param[in] limit Pinned page count that fires the callback, nonzero
+	 * @param[in] ctx Anything the function needs
+	 * @return A non-zero error value on failure and 0 on success.
+	 */
+int	mdb_env_set_pin_callback(MDB_env *env, MDB_pin_func *func, mdb_size_t limit, void *ctx);
 /**	@} */
 
 int mdb_dump_page(MDB_env *env, unsigned pgno);
@@ -50,6 +50,9 @@
 #include <sys/param.h>
 #include <sys/uio.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #ifdef HAVE_SYS_FILE_H
 #include <sys/file.h>
 #endif
@@ -108,6 +111,10 @@ typedef SSIZE_T	ssize_t;
 
 #define MDB_USE_POSIX_MUTEX	1
 
+#ifdef MDB_USE_IOURING
+#include <liburing.h>
+#endif
+
 #ifdef USE_VALGRIND
 #include <valgrind/memcheck.h>
 #define VGMEMP_CREATE(h,r,z)    VALGRIND_CREATE_MEMPOOL(h,r,z)
@@ -172,6 +179,13 @@ typedef SSIZE_T	ssize_t;
 # endif
 #endif
 
+#ifdef __GNUC__
+/** Hint the CPU to start loading a cache line we will read shortly */
+#define MDB_PREFETCH(addr)	__builtin_prefetch((addr), 0, 3)
+#else
+#define MDB_PREFETCH(addr)	((void)0)
+#endif
+
 #ifdef _WIN32
 #define CALL_CONV WINAPI
 #else
@@ -244,6 +258,18 @@ typedef SSIZE_T	ssize_t;
 #define THREAD_CREATE(thr,start,arg)	pthread_create(&thr,NULL,start,arg)
 #define THREAD_FINISH(thr)	pthread_join(thr,NULL)
 
+	/** Atomically set \b *ptr to \b nval if it equals \b old.
+	 *	Full barrier. Used to claim reader slots without the reader mutex.
+	 * @return nonzero if the swap was done.
+	 */
+#define MDB_CAS(ptr, old, nval)	__sync_bool_compare_and_swap(ptr, old, nval)
+	/** Atomically add \b v to \b *ptr. Full barrier.
+	 * @return the new value.
+	 */
+#define MDB_XADD(ptr, v)	__sync_add_and_fetch(ptr, v)
+	/** Full memory barrier */
+#define MDB_MB()	__sync_synchronize()
+
 	/** For MDB_LOCK_FORMAT: True if readers take a pid lock in the lockfile */
 #define MDB_PIDLOCK			1
 	/* MDB_USE_POSIX_MUTEX: */
@@ -354,6 +380,18 @@ static inline int lock_mutex(MDB_env *env, pthread_mutex_t *mutex){
 # define MDB_MSYNC(addr,len,flags)	msync(addr,len,flags)
 #endif
 
+#ifdef MDB_USE_IOURING
+/**	Submission queue depth of the commit ring. Define MDB_USE_IOURING
+ *	(and link with -luring) to have commits submit their page writes,
+ *	the datasync and the meta page write through io_uring instead of
+ *	one blocking pwritev() per run of pages. If the ring can't be set
+ *	up at #mdb_env_open() time, commits fall back to the normal path.
+ */
+#ifndef MDB_URING_DEPTH
+#define MDB_URING_DEPTH	256
+#endif
+#endif
+
 #ifndef MS_SYNC
 #define	MS_SYNC	1
 #endif
@@ -456,10 +494,14 @@ static txnid_t mdb_debug_start;
 	 */
 #define MDB_MAGIC	 0xBEEFC0DE
 
-	/**	The version number for a database's datafile format. */
-#define MDB_DATA_VERSION	 ((MDB_DEVEL) ? 999 : 1)
+	/**	The version number for a database's datafile format.
+	 *	2: freeDB records may be split into chunks, keyed by txnid and a
+	 *	chunk number, see #MDB_FREE_CHUNK, and may be range-encoded
+	 *	(#MDB_RIDL_FLAG). Version 1 libraries can't read either.
+	 */
+#define MDB_DATA_VERSION	 ((MDB_DEVEL) ? 999 : 2)
 	/**	The version number for a database's lockfile format. */
-#define MDB_LOCK_VERSION	 ((MDB_DEVEL) ? 999 : 2)
+#define MDB_LOCK_VERSION	 ((MDB_DEVEL) ? 999 : 8)
 	/** Number of bits representing #MDB_LOCK_VERSION in #MDB_LOCK_FORMAT.
 	 *	The remaining bits must leave room for #MDB_lock_desc.
 	 */
@@ -632,6 +674,8 @@ typedef struct MDB_rxbody {
 	volatile MDB_PID_T	mrb_pid;
 	/** The thread ID of the thread owning this txn. */
 	volatile MDB_THR_T	mrb_tid;
+	/** Monotonic clock in msec when #mrb_txnid was taken, for #mdb_reader_info() */
+	volatile mdb_size_t	mrb_since;
 } MDB_rxbody;
 
 	/** The actual reader record, with cacheline padding. */
@@ -639,6 +683,7 @@ typedef struct MDB_rxbody {
 #define	mr_txnid	mru.mrx.mrb_txnid
 #define	mr_pid	mru.mrx.mrb_pid
 #define	mr_tid	mru.mrx.mrb_tid
+#define	mr_since	mru.mrx.mrb_since
 typedef struct MDB_reader_entry {
 	union {
 		MDB_rxbody mrx;
@@ -684,29 +729,6 @@ typedef struct MDB_txbody {
 
 } MDB_txbody;
 
-	/** The actual reader table definition. */
-#define mti_magic	mt1.mtb.mtb_magic
-#define mti_format	mt1.mtb.mtb_format
-#define mti_rmutex	mt1.mtb.mtb_rmutex
-#define mti_txnid	mt1.mtb.mtb_txnid
-#define mti_numreaders	mt1.mtb.mtb_numreaders
-#define mti_mutexid	mt1.mtb.mtb_mutexid
-#define mti_wmutex	mt2.mt2_wmutex
-
-typedef struct MDB_reader_LockTableHeader {
-	union {
-		MDB_txbody mtb;
-		char pad[(sizeof(MDB_txbody)+CACHELINE-1) & ~(CACHELINE-1)];
-	} mt1;
-
-	union {
-
-		mdb_mutex_t	mt2_wmutex;
-		char pad[(MNAME_LEN+CACHELINE-1) & ~(CACHELINE-1)];
-	} mt2;
-
-	MDB_reader_entry	mti_readers[1];
-} MDB_reader_LockTableHeader;
 
 	/** Lockfile format signature: version, features and field layout */
 #define MDB_LOCK_FORMAT \
@@ -905,6 +927,7 @@ static inline unsigned int get_page_keys_count(MDB_PageHeader* page){
 #define F_BIGDATA	 				0x01			/**< data put on overflow page */
 #define F_SUB_DATABASE	 			0x02			/**< data is a sub-database */
 #define F_DUPDATA	 				0x04			/**< data has duplicates */
+#define F_COMPRESSED				0x08			/**< overflow data was packed by #MDB_dbx.%md_pack */
 
 /** valid flags for #mdb_insert_node() */
 #define	NODE_ADD_FLAGS	(F_DUPDATA|F_SUB_DATABASE|MDB_RESERVE)
@@ -1062,6 +1085,85 @@ typedef struct MDB_meta {
 	volatile txnid_t	mm_txnid;	/**< txnid that committed this page */
 } MDB_meta;
 
+	/** The actual reader table definition. */
+#define mti_magic	mt1.mtb.mtb_magic
+#define mti_format	mt1.mtb.mtb_format
+#define mti_rmutex	mt1.mtb.mtb_rmutex
+#define mti_txnid	mt1.mtb.mtb_txnid
+#define mti_numreaders	mt1.mtb.mtb_numreaders
+#define mti_mutexid	mt1.mtb.mtb_mutexid
+#define mti_wmutex	mt2.mt2_wmutex
+#define mti_pending	mt3.mt3_pending
+#define mti_oldest	mt4.mt4_oldest.mo_txnid
+#define mti_oldest_gen	mt4.mt4_oldest.mo_gen
+#define mti_readers_gen	mt5.mt5_readers_gen
+#define mti_metrics	mt6.mt6_metrics
+#define mti_chglen	mt7.mt7_chglen
+
+typedef struct MDB_reader_LockTableHeader {
+	union {
+		MDB_txbody mtb;
+		char pad[(sizeof(MDB_txbody)+CACHELINE-1) & ~(CACHELINE-1)];
+	} mt1;
+
+	union {
+
+		mdb_mutex_t	mt2_wmutex;
+		char pad[(MNAME_LEN+CACHELINE-1) & ~(CACHELINE-1)];
+	} mt2;
+
+	union {
+		/** Metas of #mdb_txn_commit_group() txns not yet written to
+		 *	the data file, by txnid parity. Zero txnid if none.
+		 *	Protected by the wmutex.
+		 */
+		MDB_meta	mt3_pending[NUM_METAS];
+		char pad[(NUM_METAS*sizeof(MDB_meta)+CACHELINE-1) & ~(CACHELINE-1)];
+	} mt3;
+
+	/** Cache of the oldest reader, see #mdb_find_alive_snapshot_id().
+	 *	Only written by writers, holding the wmutex.
+	 */
+	union {
+		struct {
+			/** Oldest reader txnid found by the last scan of the table,
+			 *	(txnid_t)-1 if none. It stays a safe lower bound until
+			 *	the oldest reader goes away or a reader starts below it,
+			 *	both of which bump #mti_readers_gen.
+			 */
+			volatile txnid_t	mo_txnid;
+			/** #mti_readers_gen when that scan started */
+			volatile unsigned	mo_gen;
+		} mt4_oldest;
+		char pad[(2*sizeof(txnid_t)+CACHELINE-1) & ~(CACHELINE-1)];
+	} mt4;
+
+	union {
+		/** Bumped with #MDB_XADD by readers that end at or below
+		 *	#mti_oldest, or start below it. Kept on a cacheline of its
+		 *	own, readers of every process write it unlocked.
+		 */
+		volatile unsigned	mt5_readers_gen;
+		char pad[(sizeof(unsigned)+CACHELINE-1) & ~(CACHELINE-1)];
+	} mt5;
+
+	union {
+		/** Counters of #mdb_env_metrics(), updated with #MDB_XADD */
+		MDB_metrics	mt6_metrics;
+		char pad[(sizeof(MDB_metrics)+CACHELINE-1) & ~(CACHELINE-1)];
+	} mt6;
+
+	union {
+		/** Length of the committed part of the #MDB_CHANGELOG file,
+		 *	0 until a writer has checked it. Protected by the wmutex.
+		 */
+		mdb_size_t	mt7_chglen;
+		char pad[(sizeof(mdb_size_t)+CACHELINE-1) & ~(CACHELINE-1)];
+	} mt7;
+
+	MDB_reader_entry	mti_readers[1];
+} MDB_reader_LockTableHeader;
+
 	/** Buffer for a stack-allocated meta page.
 	 *	The members define size and alignment, and silence type
 	 *	aliasing warnings.  They are not used directly; that could
@@ -1085,8 +1187,32 @@ typedef struct MDB_dbx {
 	MDB_cmp_func	*md_dcmp;	/**< function for comparing data items */
 	MDB_rel_func	*md_rel;	/**< user relocate function */
 	void		*md_relctx;		/**< user-provided context for md_rel */
+	MDB_pack_func	*md_pack;	/**< user function compressing overflow data */
+	MDB_unpack_func	*md_unpack;	/**< user function decompressing it again */
+	void		*md_packctx;	/**< user-provided context for md_pack/md_unpack */
 } MDB_dbx;
 
+	/** Size of the blocks #mdb_txn_scratch() hands out memory from */
+#define MDB_SCRATCH_SIZE	(64U << 10)
+
+	/** A block of per-txn memory for decompressed values */
+typedef struct MDB_scratch {
+	struct MDB_scratch *ms_next;	/**< older block */
+	size_t		ms_size;	/**< usable bytes after this header */
+	size_t		ms_used;	/**< bytes handed out */
+} MDB_scratch;
+
+	/** A reader slot of its own on a read txn's snapshot, which outlives
+	 *	the txn. See #mdb_lease_acquire().
+	 */
+struct MDB_lease {
+	MDB_env		*ml_env;		/**< the environment */
+	MDB_reader_entry	*ml_reader;	/**< our reader slot, or NULL with #MDB_NOLOCK */
+	txnid_t		ml_txnid;		/**< the snapshot kept alive */
+	MDB_scratch	*ml_scratch;	/**< decompressed values taken over from the txn */
+	volatile unsigned int	ml_refs;	/**< references, one of them the txn's */
+};
+
 	/** A database transaction.
 	 *	Every operation requires a transaction handle.
 	 */
@@ -1118,9 +1244,77 @@ typedef struct MDB_dbx {
 #define MDB_TXN_DIRTY		0x04		/**< must write, even if dirty list is empty */
 #define MDB_TXN_SPILLS		0x08		/**< txn or a parent has spilled pages */
 #define MDB_TXN_HAS_CHILD	0x10		/**< txn has an #MDB_txn.%mt_child */
+#define MDB_TXN_DBI_NEW		0x20		/**< a DBI handle was opened, see #mdb_dbis_update() */
 	/** most operations on the txn are currently illegal */
 #define MDB_TXN_BLOCKED		(MDB_TXN_FINISHED|MDB_TXN_ERROR|MDB_TXN_HAS_CHILD)
 /** @} */
+/** An open addressing hash of pages by page number */
+typedef struct MDB_dhash {
+	MDB_ID2		*dh_slots;	/**< entries, a 0 pgno marks an empty slot */
+	unsigned int	dh_mask;	/**< number of slots - 1 */
+	unsigned int	dh_count;	/**< entries in use */
+} MDB_dhash;
+
+/** Where the last new key of a DB went in this write txn, so that
+ *	#mdb_page_split_insert() can tell sequential inserts from random ones.
+ */
+typedef struct MDB_ins_hint {
+	pgno_t		mh_pgno;	/**< leaf page of the last insert */
+	indx_t		mh_ki;		/**< its index in that page */
+	/** Length of the current run of inserts: positive counts keys that
+	 *	went right after the previous one, negative counts keys that
+	 *	went right before it.
+	 */
+	short		mh_run;
+} MDB_ins_hint;
+
+	/** Most ops a staged DBI collects before sorting them into a run */
+#ifndef MDB_STAGE_BUF
+#define MDB_STAGE_BUF	64
+#endif
+
+	/** One put or delete of a txn from #mdb_txn_begin_dbis() */
+typedef struct MDB_sop {
+	MDB_val		so_key;
+	MDB_val		so_data;	/**< the value, unused by a delete */
+	int			so_del;		/**< the op deletes the key */
+} MDB_sop;
+
+	/** Sorted staged ops with distinct keys */
+typedef struct MDB_srun {
+	MDB_sop		*sr_ops;
+	size_t		sr_n;
+} MDB_srun;
+
+	/** Staged ops of one DBI. The newest op on a key hides older ones.
+	 *	New ops go into the sorted buffer; a full buffer becomes a run.
+	 *	Each run is kept more than twice as long as the next newer one,
+	 *	so a lookup searches O(log n) runs.
+	 */
+typedef struct MDB_sdbi {
+	MDB_dbi		sd_dbi;
+	MDB_db		sd_db;		/**< DB record in the snapshot, checked at commit */
+	unsigned int	sd_nbuf;	/**< number of ops in sd_buf */
+	unsigned int	sd_nruns;	/**< number of runs in sd_runs */
+	MDB_sop		sd_buf[MDB_STAGE_BUF];
+	MDB_srun	sd_runs[64];	/**< oldest first */
+} MDB_sdbi;
+
+	/** Memory for the keys and values of staged ops */
+typedef struct MDB_sblk {
+	struct MDB_sblk	*sb_next;
+	size_t		sb_used;	/**< bytes handed out after the header */
+	size_t		sb_size;	/**< bytes available after the header */
+} MDB_sblk;
+
+	/** State of a txn from #mdb_txn_begin_dbis() */
+typedef struct MDB_stage {
+	MDB_sblk	*st_blk;	/**< newest block first */
+	unsigned int	st_flags;	/**< #mdb_txn_begin() flags for the commit */
+	unsigned int	st_ndbs;	/**< number of DBIs in st_dbs */
+	MDB_sdbi	st_dbs[1];	/**< the declared DBIs */
+} MDB_stage;
+
 struct MDB_txn {
 	MDB_txn		*mt_parent;		/**< parent of a nested txn */
 	/** Nested txn under this txn, set together with flag #MDB_TXN_HAS_CHILD */
@@ -1148,7 +1342,9 @@ struct MDB_txn {
 	 */
 	MDB_ID*		mt_spill_pgs;
 	union {
-		/** For write txns: Modified pages. Sorted when not MDB_WRITEMAP. */
+		/** For write txns: Modified pages. The first #mt_dirty_nsorted
+		 *	are sorted, see #mdb_dlist_sort(). Looked up by #mdb_dhash_find().
+		 */
 		MDB_ID2 *	dirty_list;
 		/** For read txns: This thread/txn's reader table slot, or NULL. */
 		MDB_reader_entry	*reader;
@@ -1162,6 +1358,8 @@ struct MDB_txn {
 
 	/** In write txns, array of cursors for each DB */
 	MDB_cursor	**mt_cursors;
+	/** In write txns, the last insert position for each DB */
+	MDB_ins_hint	*mt_ins_hints;
 	/** Array of flags for each DB */
 	unsigned char	*mt_dbflags;
 
@@ -1172,12 +1370,41 @@ struct MDB_txn {
 	MDB_dbi		mt_numdbs;
 
 	unsigned int	txn_flags;		/**< @ref mdb_txn */
-	/** #dirty_list room: Array size - \#dirty pages visible to this txn.
-	 *	Includes ancestor txns' dirty pages not hidden by other txns'
-	 *	dirty/spilled pages. Thus commit(nested txn) has room to merge
-	 *	dirty_list into mt_parent after freeing hidden mt_parent pages.
+	/** Pages this txn may dirty before #mdb_page_spill() must make room,
+	 *	see #mdb_env_set_dirty_limit(). Unlimited in nested txns, which
+	 *	charge their pages to the parent when they commit.
 	 */
 	unsigned int	mt_dirty_room;
+	/** Number of leading #dirty_list entries known to be in pgno order */
+	unsigned int	mt_dirty_nsorted;
+	/** Nested txns: the length of #dirty_list when this txn began.
+	 *	The parent's entries before it stay in place until this txn
+	 *	ends, the pages this txn dirties first are appended after it.
+	 */
+	unsigned int	mt_dirty_base;
+	/** Nested txns: every page this txn dirtied. For pages that were
+	 *	already dirty in the parent, the copy of their contents before
+	 *	this txn changed them; NULL for pages this txn dirtied first.
+	 */
+	MDB_dhash	mt_undo;
+	/** Decompressed values returned in this txn, newest block first */
+	MDB_scratch	*mt_scratch;
+	/** Read txns: lease on this snapshot from #mdb_lease_acquire(), or NULL */
+	MDB_lease	*mt_lease;
+	/** Read txns: next txn on #MDB_env.%me_pooled */
+	MDB_txn		*mt_pool_next;
+	int			mt_pooled;		/**< on #MDB_env.%me_pooled */
+	/** Read txns: ops staged for commit, see #mdb_txn_begin_dbis() */
+	MDB_stage	*mt_stage;
+	/** Read txns: the branch cache replica for this txn's node, or NULL */
+	struct MDB_bcslot *mt_bcache;
+	/** @name Page lookups not yet added to #MDB_env.%me_metrics
+	 *	@{
+	 */
+	mdb_size_t	mt_page_gets;
+	mdb_size_t	mt_page_dirty;
+	mdb_size_t	mt_page_spilled;
+	/** @} */
 };
 
 /** Enough space for 2^32 nodes with minimum of 2 keys per node. I.e., plenty.
@@ -1236,6 +1463,10 @@ struct MDB_cursor {
 	unsigned int	mc_flags;	/**< @ref mdb_cursor */
 	MDB_PageHeader	*mc_pg[CURSOR_STACK];	/**< stack of pushed pages */
 	indx_t		mc_ki[CURSOR_STACK];	/**< stack of page indices */
+	/** Leaves to prefetch ahead of a scan, see #mdb_cursor_set_readahead() */
+	unsigned int	mc_readahead;
+	MDB_PageHeader	*mc_ra_pg;	/**< branch page whose children were last prefetched */
+	indx_t		mc_ra_ki;	/**< furthest child of mc_ra_pg prefetched so far */
 
 #	define MC_OVPG(mc)			((MDB_PageHeader *)0)
 #	define MC_SET_OVPG(mc, pg)	((void)0)
@@ -1279,12 +1510,161 @@ static inline void __refresh_xcursor(MDB_cursor*mc, unsigned int top, MDB_PageHe
 		mc->mc_xcursor->mx_cursor.mc_pg[0] = sub_page;
 	}
 } 
+	/** Number of page counts that get their own list of freed dirty pages.
+	 *	Freed overflow pages of up to this many pages are re-used within
+	 *	the same write txn.
+	 */
+#ifndef MDB_PAGE_CLASSES
+#define MDB_PAGE_CLASSES	16
+#endif
+
+	/** Size of the chunks dirty pages are carved from: one huge page */
+#ifndef MDB_ARENA_CHUNK
+#define MDB_ARENA_CHUNK	(2U << 20)
+#endif
+
+	/** Transparent huge page size that arena chunks are aligned to */
+#define MDB_HUGE_PAGE	(2U << 20)
+
+	/** True if \b sz bytes of pages don't fit in an arena chunk, and get
+	 *	a mapping of their own instead
+	 */
+#define MDB_ARENA_BIG(env, sz)	((sz) > MDB_ARENA_CHUNK - (env)->me_psize)
+
+	/** Number of empty chunks kept from one write txn to the next */
+#ifndef MDB_ARENA_KEEP
+#define MDB_ARENA_KEEP	4
+#endif
+
+	/** Slots in the dirty page index of a small write txn, a power of 2.
+	 *	The index doubles whenever it gets half full, and drops back to
+	 *	this size when the txn ends.
+	 */
+#ifndef MDB_DHASH_MIN
+#define MDB_DHASH_MIN	4096
+#endif
+
+	/** Smallest non-zero limit #mdb_env_set_dirty_limit() accepts */
+#ifndef MDB_DIRTY_LIMIT_MIN
+#define MDB_DIRTY_LIMIT_MIN	1024
+#endif
+
+	/** Fibonacci hash of a page number into the dirty page index */
+#define MDB_DHASH(pgno)	((unsigned)(((uint64_t)(pgno) * 0x9E3779B97F4A7C15ULL) >> 32))
+
+	/** A chunk of anonymous memory that dirty pages are carved from.
+	 *	Chunks are only returned all at once, when the write txn ends.
+	 */
+typedef struct MDB_chunk {
+	struct MDB_chunk *ck_next;	/**< next chunk in the arena */
+	size_t		ck_size;	/**< size of the mapping, including this header */
+	size_t		ck_used;	/**< bytes handed out after the header page */
+} MDB_chunk;
+
+	/** Most page numbers in one freeDB record. A txn which frees more
+	 *	saves them as several records, keyed by its txnid and a chunk
+	 *	number, so later txns load and rewrite one bounded chunk at a
+	 *	time instead of the whole list left by a big delete.
+	 *	0 keeps a single record per txn.
+	 */
+#ifndef MDB_FREE_CHUNK
+#define MDB_FREE_CHUNK	8192
+#endif
+
+	/** How many freeDB leaves to prefetch when reading freeDB records
+	 *	moves onto a new leaf, see #MDB_cursor.%mc_readahead. The
+	 *	overflow pages of the new leaf's records are prefetched along
+	 *	with them. 0 disables it.
+	 */
+#ifndef MDB_FREE_READAHEAD
+#define MDB_FREE_READAHEAD	4
+#endif
+
+	/** Bytes of data file to reserve ahead of the last page in use.
+	 *	When a flush writes past the reserved space, the file is
+	 *	extended with fallocate(FALLOC_FL_KEEP_SIZE) to the next
+	 *	multiple of this, plus one step more. Commits that grow the
+	 *	file then write into allocated extents instead of allocating
+	 *	them one write at a time. The file size is not changed.
+	 *	0 disables it.
+	 */
+#ifndef MDB_FALLOC_CHUNK
+#define MDB_FALLOC_CHUNK	0
+#endif
+
+	/** The chunk number of a freeDB key. A plain txnid is chunk 0. */
+#define FREE_KEY_SEQ(key)	((key)->mv_size > sizeof(txnid_t) ? \
+	((txnid_t *)(key)->mv_data)[1] : 0)
+
+	/** The number of pages in a freeDB record. Records are plain
+	 *	#MDB_IDLs, or #MDB_RIDLs when range-encoding makes them smaller.
+	 */
+#define FREE_REC_PAGES(idl)	(MDB_IDL_IS_RANGES(idl) ? mdb_ridl_count(idl) : (idl)[0])
+
 	/** State of FreeDB old pages, stored in the MDB_env */
 typedef struct MDB_pgstate {
 	pgno_t		*mf_pghead;	/**< Reclaimed freeDB pages, or NULL before use */
 	txnid_t		last_snapshot_id;	/**< ID of last used record, or 0 if !mf_pghead */
+	txnid_t		last_snapshot_seq;	/**< Chunk number of last used record */
+	int			last_snapshot_more;	/**< A later chunk of last_snapshot_id may follow */
+	/** Runs of 2 or more consecutive pages in mf_pghead, as #MDB_run
+	 *	pairs after the IDL length word, sorted by size then page number.
+	 *	Only meaningful while mf_runs_ok is set.
+	 */
+	pgno_t		*mf_runs;
+	int			mf_runs_ok;
 } MDB_pgstate;
 
+	/** A run of consecutive free pages in #MDB_pgstate.%mf_runs */
+typedef struct MDB_run {
+	pgno_t		ru_count;	/**< number of pages */
+	pgno_t		ru_pgno;	/**< lowest page number */
+} MDB_run;
+
+	/** The runs and the number of runs in an #MDB_pgstate.%mf_runs list */
+#define RUNS(r)		((MDB_run *)((r) + 1))
+#define NUMRUNS(r)	((unsigned)((r)[0] >> 1))
+
+	/** Most keys a branch page may have to fit in an #MDB_bcslot */
+#ifndef MDB_BCACHE_KEYS
+#define MDB_BCACHE_KEYS	256
+#endif
+
+	/** A branch page decoded for #mdb_bcache_search(), one slot of the
+	 *	per-env branch cache set up by #mdb_env_set_branch_cache().
+	 *	Slots are shared by all read txns without locking: \b bs_seq is
+	 *	odd while a reader refills the slot, and readers retry on the page
+	 *	itself if it changed while they were looking. A slot only holds for
+	 *	the snapshot it was filled from, since a later writer may reuse
+	 *	the page.
+	 */
+typedef struct MDB_bcslot {
+	volatile unsigned int	bs_seq;	/**< bumped before and after each refill */
+	unsigned int	bs_nkeys;	/**< number of keys on the page */
+	pgno_t		bs_pgno;	/**< the page this slot holds */
+	txnid_t		bs_txnid;	/**< snapshot the slot was filled from */
+	/** Big-endian 8 byte key prefixes, see #mdb_key_prefix() */
+	uint64_t	bs_pfx[MDB_BCACHE_KEYS];
+	pgno_t		bs_child[MDB_BCACHE_KEYS];	/**< child page of each key */
+} MDB_bcslot;
+
+#if defined(SYS_get_mempolicy) && defined(SYS_set_mempolicy) && \
+	defined(SYS_mbind) && defined(SYS_getcpu)
+	/** NUMA memory policies can be set, see #mdb_env_set_mapopts() */
+#define MDB_NUMA	1
+#define MDB_MPOL_DEFAULT	0	/**< memory policy modes of the syscalls */
+#define MDB_MPOL_PREFERRED	1
+#define MDB_MPOL_INTERLEAVE	3
+	/** Bits in the node masks we pass, nodes above are ignored */
+#define MDB_NUMA_BITS	(sizeof(unsigned long) * CHAR_BIT)
+#endif
+
+	/** A thread's memory policy, saved by #mdb_numa_enter() */
+typedef struct MDB_numapol {
+	int			np_mode;	/**< saved mode, or -1 if nothing was changed */
+	unsigned long	np_mask;	/**< saved node mask */
+} MDB_numapol;
+
 	/** Failed to update the meta page. Probably an I/O error. */
 #define	MDB_FATAL_ERROR	0x80000000U
 	/** Some fields are initialized. */
@@ -1293,12 +1673,17 @@ typedef struct MDB_pgstate {
 #define	MDB_EVN_TLS_TX_KEY	0x10000000U
 	/** fdatasync is unreliable */
 #define	MDB_FSYNCONLY	0x08000000U
+	/** me_txpool is set */
+#define	MDB_ENV_TXPOOL	0x04000000U
+	/** me_stage_mutex and me_stage_cond are set */
+#define	MDB_ENV_STAGE	0x40000000U
 
 	/** The database environment. */
 struct MDB_env {
 	HANDLE		me_fd;		/**< The main data file */
 	HANDLE		me_lfd;		/**< The lock file */
 	HANDLE		me_mfd;		/**< For writing and syncing the meta pages */
+	HANDLE		me_chgfd;	/**< The #MDB_CHANGELOG file */
 
 
 	uint32_t 	me_flags;		/**< @ref mdb_env */
@@ -1315,6 +1700,8 @@ struct MDB_env {
 	MDB_reader_LockTableHeader	*m_reader_table;		/**< the memory map of the lock file or NULL */
 	MDB_meta	*me_metas[NUM_METAS];	/**< pointers to the two meta pages */
 	void		*	one_page_buf;		/**< scratch area for DUPSORT put() */
+	void		*me_pbuf;		/**< scratch area for compressing overflow data */
+	size_t		me_pbuf_size;	/**< size of me_pbuf */
 	MDB_txn		*me_txn;		/**< current write transaction */
 	MDB_txn		*me_txn0;		/**< prealloc'd write transaction */
 	mdb_size_t	m_map_size;		/**< size of the data memory map */
@@ -1324,15 +1711,49 @@ struct MDB_env {
 	uint16_t	*me_dbflags;	/**< array of flags from MDB_db.md_flags */
 	unsigned int	*m_dbiseqs;	/**< array of dbi sequence numbers */
 	pthread_key_t	me_txkey;	/**< thread-key for readers */
+	/** thread-key for each thread's spare read txn, see #mdb_txn_pool_put() */
+	pthread_key_t	me_txpool;
+	pthread_mutex_t	me_pool_mutex;	/**< protects #me_pooled */
+	MDB_txn		*me_pooled;		/**< read txns that belong to the pool */
+	pthread_mutex_t	me_stage_mutex;	/**< protects #me_dbi_busy */
+	pthread_cond_t	me_stage_cond;	/**< signalled when DBIs are released */
+	/** DBIs claimed by a txn from #mdb_txn_begin_dbis() */
+	unsigned char	*me_dbi_busy;
 	txnid_t		alive_snapshot_id;	/**< ID of oldest reader last time we looked */
 	MDB_pgstate	old_pg_state;		/**< state of old pages from freeDB */
 
 
-	MDB_PageHeader	*m_free_mem_pages;		/**< list of malloc'd blocks for re-use */
+	/** lists of freed dirty pages for re-use, by number of pages */
+	MDB_PageHeader	*m_free_mem_pages[MDB_PAGE_CLASSES];
+	MDB_chunk	*me_arena;		/**< chunks dirty pages are carved from */
+	MDB_chunk	*me_arena_spare;	/**< empty chunks kept for re-use */
+	MDB_page_alloc_func *me_page_alloc;	/**< user's page allocator, or NULL */
+	MDB_page_free_func *me_page_free;	/**< frees pages from #me_page_alloc */
+	void		*me_page_ctx;	/**< context for the page allocator */
+	MDB_pin_func	*me_pinfunc;	/**< called when readers pin too many pages */
+	void		*me_pinctx;		/**< context for #me_pinfunc */
+	mdb_size_t	me_pinlimit;	/**< pinned page count that fires #me_pinfunc */
+	int			me_pinned;		/**< the last commit was at or above #me_pinlimit */
+	MDB_bcslot	*me_bcache;		/**< branch page cache, or NULL */
+	unsigned int	me_bcache_slots;	/**< number of #me_bcache slots, a power of 2 */
+	unsigned int	me_bcache_nodes;	/**< number of replicas of the branch cache */
+	size_t		me_bcache_stride;	/**< bytes from one replica to the next */
+	unsigned int	me_mapopts;		/**< @ref mdb_mapopts */
+	unsigned int	me_numa_nodes;	/**< NUMA nodes the mapopts spread over */
+	MDB_metrics	*me_metrics;	/**< counters in the lock file, or #me_metrics0 */
+	MDB_metrics	me_metrics0;	/**< counters of an env without a lock file */
+	mdb_size_t	*me_chglen;		/**< committed change log length, in the lock file or #me_chglen0 */
+	mdb_size_t	me_chglen0;		/**< change log length of an env without a lock file */
+	mdb_size_t	me_chgpend;		/**< bytes logged by the commit in progress */
+	MDB_IDL		me_chgrec;		/**< change log record being built */
+	size_t		me_falloc_end;	/**< end of the data file space reserved so far, see #MDB_FALLOC_CHUNK */
 	/** IDL of pages that became unused in a write txn */
 	MDB_ID*		m_free_pgs;
-	/** ID2L of pages written during a write txn. Length MDB_IDL_UM_SIZE. */
+	/** ID2L of pages written during a write txn, room for #me_dirty_cap */
 	MDB_ID2 *	me_dirty_list;
+	unsigned int	me_dirty_cap;	/**< #me_dirty_list entries allocated */
+	unsigned int	me_dirty_limit;	/**< dirty pages before spilling, 0 for none */
+	MDB_dhash	me_dirty_hash;	/**< index of #me_dirty_list by pgno */
 	/** Max number of freelist items that can fit in a single overflow page */
 	int			me_maxfree_1pg;
 	/** Max size of a node on a page */
@@ -1341,6 +1762,10 @@ struct MDB_env {
 	unsigned int	me_maxkey;	/**< max size of a key */
 #endif
 	int		me_live_reader;		/**< have liveness lock in reader table */
+#ifdef MDB_USE_IOURING
+	struct io_uring	me_ring;	/**< commit ring, valid if me_ring_ok */
+	int		me_ring_ok;		/**< me_ring was set up */
+#endif
 
 /* Posix mutexes reside in shared mem */
 #	define		me_rmutex	m_reader_table->mti_rmutex /**< Shared reader lock */
@@ -1355,6 +1780,8 @@ struct MDB_env {
 typedef struct MDB_ntxn {
 	MDB_txn		mnt_txn;		/**< the transaction */
 	MDB_pgstate	mnt_pgstate;	/**< parent transaction's saved freestate */
+	/** The txn has its own copy of the freestate, see #mdb_pgstate_own() */
+	int			mnt_pgcopy;
 } MDB_ntxn;
 
 	/** max number of pages to commit in one writev() call */
@@ -1367,6 +1794,18 @@ typedef struct MDB_ntxn {
 	/** max bytes to write in one call */
 #define MAX_WRITE		(0x40000000U >> (sizeof(ssize_t) == 4))
 
+#ifdef MDB_USE_IOURING
+	/** max number of pages to commit in one ring writev request */
+#define MDB_URING_IOV	1024
+#if defined(IOV_MAX) && IOV_MAX < MDB_URING_IOV
+#undef MDB_URING_IOV
+#define MDB_URING_IOV	IOV_MAX
+#endif
+#endif
+
+	/** Add \b n to counter \b field of #mdb_env_metrics() */
+#define MDB_METRIC(env, field, n)	((void) MDB_XADD(&(env)->me_metrics->field, n))
+
 	/** Check \b txn and \b dbi arguments to a function */
 #define TXN_DBI_EXIST(txn, dbi, validity) \
 	((txn) && (dbi)<(txn)->mt_numdbs && ((txn)->mt_dbflags[dbi] & (validity)))
@@ -1391,6 +1830,8 @@ enum {
 #define MDB_END_FREE	0x20	/**< free txn unless it is #MDB_env.%me_txn0 */
 #define MDB_END_SLOT MDB_NOTLS	/**< release any reader slot if #MDB_NOTLS */
 static void mdb_txn_end(MDB_txn *txn, unsigned mode);
+static int  mdb_txn_begin0(MDB_env *env, const MDB_txn *snap, unsigned int flags, MDB_txn **ret);
+static void mdb_txn_scratch_free(MDB_txn *txn, int all);
 
 static int  mdb_page_get(MDB_txn*txn, pgno_t pgno, MDB_PageHeader **mp, int *lvl);
 static int  __mdb_locate_cursor(MDB_cursor *mc,const MDB_val *key, int modify);
@@ -1402,11 +1843,24 @@ static int  mdb_relocate_cursor(MDB_cursor *mc,const MDB_val *key, int flags);
 static int	mdb_page_merge(MDB_cursor *csrc, MDB_cursor *cdst);
 
 #define MDB_SPLIT_REPLACE	MDB_APPENDDUP	/**< newkey is not new */
+	/**	Number of new keys that must go in next to each other before
+	 *	#mdb_page_split_insert() splits at the insertion point instead
+	 *	of the middle of the page.
+	 */
+#ifndef MDB_SPLIT_SEQ
+#define MDB_SPLIT_SEQ	4
+#endif
 static int	mdb_page_split_insert(MDB_cursor *mc, MDB_val *newkey, MDB_val *newdata,
 				pgno_t newpgno, unsigned int nflags);
 
 static int  mdb_env_read_header(MDB_env *env, int prev, MDB_meta *meta);
 static MDB_meta *mdb_env_pick_meta(const MDB_env *env);
+static MDB_bcslot *mdb_bcache_replica(MDB_env *env);
+static void mdb_numa_enter(MDB_env *env, MDB_numapol *np);
+static void mdb_numa_leave(MDB_numapol *np);
+static MDB_meta *mdb_env_pending_meta(const MDB_env *env);
+static int  mdb_env_write_pending(MDB_env *env);
+static int  mdb_env_write_prev(MDB_env *env, txnid_t txnid, unsigned flags);
 static int  mdb_env_write_meta(MDB_txn *txn);
 #if defined(MDB_USE_POSIX_MUTEX) && !defined(MDB_ROBUST_SUPPORTED) /* Drop unused excl arg */
 # define mdb_env_close0(env, excl) mdb_env_close1(env)
@@ -1433,6 +1887,12 @@ static int	_mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data, unsigned
 
 static int	mdb_cursor_del0(MDB_cursor *mc);
 static int	mdb_del0(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, unsigned flags);
+static MDB_sdbi	*mdb_stage_dbi(MDB_txn *txn, MDB_dbi dbi);
+static MDB_sop	*mdb_stage_find(MDB_txn *txn, MDB_dbi dbi, const MDB_val *key);
+static int	mdb_stage_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, unsigned int flags);
+static int	mdb_stage_del(MDB_txn *txn, MDB_dbi dbi, MDB_val *key);
+static int	mdb_stage_commit(MDB_txn *txn, mdb_size_t *ticket);
+static void	mdb_stage_free(MDB_env *env, MDB_stage *st);
 static int	mdb_cursor_sibling(MDB_cursor *mc, int move_right);
 static int	mdb_cursor_next(MDB_cursor *mc, MDB_val *key, MDB_val *data, MDB_cursor_op op);
 static int	mdb_cursor_prev(MDB_cursor *mc, MDB_val *key, MDB_val *data, MDB_cursor_op op);
@@ -1451,7 +1911,7 @@ static void mdb_init_default_cmp(MDB_txn *txn, MDB_dbi dbi);
 static int MDB_reader_entry_check0(MDB_env *env, int rlocked, int *dead);
 
 /** @cond */
-static MDB_cmp_func	mdb_cmp_memn, mdb_cmp_memnr, mdb_cmp_int, mdb_cmp_cint, mdb_cmp_long;
+static MDB_cmp_func	mdb_cmp_memn, mdb_cmp_memnr, mdb_cmp_int, mdb_cmp_cint, mdb_cmp_long, mdb_cmp_free;
 /** @endcond */
 
 /** Compare two items pointing at '#mdb_size_t's of unknown alignment. */
@@ -1497,6 +1957,7 @@ static char *const mdb_errstr[] = {
 	"MDB_BAD_VALSIZE: Unsupported size of key/DB name/data, or wrong DUPFIXED size",
 	"MDB_BAD_DBI: The specified DBI handle was closed/changed unexpectedly",
 	"MDB_PROBLEM: Unexpected problem - txn should abort",
+	"MDB_CONFLICT: A staged DBI was changed by another writer",
 };
 
 
@@ -1565,7 +2026,7 @@ static pgno_t mdb_dbg_pgno(MDB_PageHeader *mp)
 	return ret;
 }
 static void print_data(bool idl, MDB_val *data){
-	#if defined(MDB_DEBUG)
+	#if MDB_DEBUG
 	if(idl){
 		assert(data->mv_size%8==0);
 		for(int k=0;k<data->mv_size;k+=8){
@@ -1743,7 +2204,7 @@ static void mdb_audit(MDB_txn *txn)
 	freecount = 0;
 	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
 	while ((rc = mdb_cursor_get(&mc, &key, &data, MDB_NEXT)) == 0)
-		freecount += *(MDB_ID *)data.mv_data;
+		freecount += FREE_REC_PAGES((MDB_ID *)data.mv_data);
 	mdb_tassert(txn, rc == MDB_NOTFOUND);
 
 	count = 0;
@@ -1827,8 +2288,112 @@ int mdb_dcmp(MDB_txn *txn, MDB_dbi dbi, const MDB_val *a, const MDB_val *b)
 	return dcmp(a, b);
 }
 
+/** Get a chunk of at least \b size bytes from the OS.
+ *	When the chunk is big enough, ask for transparent huge pages. It
+ *	is then mapped one huge page larger and trimmed to start on a huge
+ *	page boundary, or the kernel could not back it with any.
+ */
+static MDB_chunk * mdb_chunk_new(size_t size)
+{
+	MDB_chunk *ck;
+	size_t extra = 0, head = 0;
+	char *p;
+
+#ifdef MADV_HUGEPAGE
+	if (size >= MDB_HUGE_PAGE)
+		extra = MDB_HUGE_PAGE;
+#endif
+	p = mmap(NULL, size + extra, PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (extra) {
+		head = -(uintptr_t)p & (MDB_HUGE_PAGE - 1);
+		if (head)
+			munmap(p, head);
+		if (extra > head)
+			munmap(p + head + size, extra - head);
+		(void) madvise(p + head, size, MADV_HUGEPAGE);
+	}
+#endif
+	ck = (MDB_chunk *)(p + head);
+	ck->ck_next = NULL;
+	ck->ck_size = size;
+	ck->ck_used = 0;
+	return ck;
+}
+
+/** Carve \b sz bytes of pages out of the env's arena.
+ *	Pages start one DB page into each chunk, so they keep the
+ *	alignment of the chunk. Requests too big for a chunk get a
+ *	private mapping, with its #MDB_chunk header just before the
+ *	pages, and are unmapped again as soon as they are freed.
+ */
+static void * mdb_arena_alloc(MDB_env *env, size_t sz)
+{
+	const size_t psize = env->me_psize;
+	MDB_chunk *ck = env->me_arena;
+
+	if (MDB_ARENA_BIG(env, sz)) {
+		if (!(ck = mdb_chunk_new(sz + psize)))
+			return NULL;
+		return (char *)ck + psize;
+	}
+	if (!ck || ck->ck_used + sz > ck->ck_size - psize) {
+		if ((ck = env->me_arena_spare) != NULL)
+			env->me_arena_spare = ck->ck_next;
+		else if (!(ck = mdb_chunk_new(MDB_ARENA_CHUNK)))
+			return NULL;
+		ck->ck_next = env->me_arena;
+		env->me_arena = ck;
+	}
+	ck->ck_used += sz;
+	return (char *)ck + psize + ck->ck_used - sz;
+}
+
+/** Release the pages of a finished write txn in bulk.
+ *	Up to #MDB_ARENA_KEEP chunks are kept for the next txn,
+ *	the rest go back to the OS.
+ */
+static void mdb_arena_reset(MDB_env *env)
+{
+	MDB_chunk *ck, *next;
+	int i, kept = 0;
+
+	for (i = 0; i < MDB_PAGE_CLASSES; i++)
+		env->m_free_mem_pages[i] = NULL;
+	for (ck = env->me_arena_spare; ck; ck = ck->ck_next)
+		kept++;
+	for (ck = env->me_arena; ck; ck = next) {
+		next = ck->ck_next;
+		if (kept < MDB_ARENA_KEEP) {
+			ck->ck_used = 0;
+			ck->ck_next = env->me_arena_spare;
+			env->me_arena_spare = ck;
+			kept++;
+		} else {
+			munmap(ck, ck->ck_size);
+		}
+	}
+	env->me_arena = NULL;
+}
+
+/** Return all arena chunks to the OS */
+static void mdb_arena_free(MDB_env *env)
+{
+	MDB_chunk *ck;
+
+	mdb_arena_reset(env);
+	while ((ck = env->me_arena_spare) != NULL) {
+		env->me_arena_spare = ck->ck_next;
+		munmap(ck, ck->ck_size);
+	}
+}
+
 /** Allocate memory for a page.
- * Re-use old malloc'd pages first for singletons, otherwise just malloc.
+ * Re-use pages freed earlier in this txn of the same size first,
+ * otherwise take them from the arena or the user's allocator.
  * Set #MDB_TXN_ERROR on failure.
  */
 static MDB_PageHeader * mdb_page_malloc(MDB_txn *txn, unsigned num)
@@ -1839,24 +2404,29 @@ static MDB_PageHeader * mdb_page_malloc(MDB_txn *txn, unsigned num)
 	MDB_env *env = txn->mt_env;
 
 	size_t psize = env->me_psize, sz = psize, off;
+	MDB_PageHeader *ret = NULL;
 	/* For ! #MDB_NOMEMINIT, psize counts how much to init.
 	 * For a single page alloc, we init everything after the page header.
 	 * For multi-page, we init the final page; if the caller needed that
 	 * many pages they will be filling in at least up to the last page.
 	 */
 	if (num == 1) {
-		if (env->m_free_mem_pages) {
-			MDB_PageHeader * const p = env->m_free_mem_pages;
-			env->m_free_mem_pages = env->m_free_mem_pages->mp_next;
+		if (env->m_free_mem_pages[0]) {
+			MDB_PageHeader * const p = env->m_free_mem_pages[0];
+			env->m_free_mem_pages[0] = p->mp_next;
 			return p;
 		}
 		psize -= off = PAGEHDRSZ;
 	} else {
 		sz *= num;
 		off = sz - psize;
+		if (num <= MDB_PAGE_CLASSES && (ret = env->m_free_mem_pages[num-1]) != NULL)
+			env->m_free_mem_pages[num-1] = ret->mp_next;
 	}
-		MDB_PageHeader *ret = NULL;
-	if ((ret = malloc(sz)) != NULL) {
+	if (!ret)
+		ret = env->me_page_alloc ? env->me_page_alloc(env->me_page_ctx, sz)
+			: mdb_arena_alloc(env, sz);
+	if (ret != NULL) {
 	
 		if (!(env->me_flags & MDB_NOMEMINIT)) {
 			memset((char *)ret + off, 0, psize);
@@ -1873,19 +2443,174 @@ static MDB_PageHeader * mdb_page_malloc(MDB_txn *txn, unsigned num)
  */
 static void mdb_page_free(MDB_env *env, MDB_PageHeader *mp)
 {
-	mp->mp_next = env->m_free_mem_pages;
-	env->m_free_mem_pages = mp;
+	if (env->me_page_alloc) {
+		env->me_page_free(env->me_page_ctx, mp, env->me_psize);
+		return;
+	}
+	mp->mp_next = env->m_free_mem_pages[0];
+	env->m_free_mem_pages[0] = mp;
 }
 
 /** Free a dirty page */
 static void mdb_dpage_free(MDB_env *env, MDB_PageHeader *dp)
 {
-	if (!IS_OVERFLOW(dp) || dp->m_ovf_page_count == 1) {
+	const unsigned num = IS_OVERFLOW(dp) ? dp->m_ovf_page_count : 1;
+
+	if (num == 1) {
 		mdb_page_free(env, dp);
-	} else {
-		/* large pages just get freed directly */
-		free(dp);
+	} else if (env->me_page_alloc) {
+		env->me_page_free(env->me_page_ctx, dp, (size_t)num * env->me_psize);
+	} else if (MDB_ARENA_BIG(env, (size_t)num * env->me_psize)) {
+		/* large pages have their own mapping, see #mdb_arena_alloc().
+		 * Checked first, the size class lists are dropped unmapped.
+		 */
+		MDB_chunk *ck = (MDB_chunk *)((char *)dp - env->me_psize);
+		munmap(ck, ck->ck_size);
+	} else if (num <= MDB_PAGE_CLASSES) {
+		dp->mp_next = env->m_free_mem_pages[num-1];
+		env->m_free_mem_pages[num-1] = dp;
+	}	/* else the arena takes it back when the txn ends */
+}
+
+/** Return the slot of \b dh holding \b pgno, or the empty slot
+ *	where it would go.
+ */
+static unsigned mdb_dhash_slot(const MDB_dhash *dh, pgno_t pgno)
+{
+	const MDB_ID2 *h = dh->dh_slots;
+	unsigned mask = dh->dh_mask, i = MDB_DHASH(pgno) & mask;
+
+	while (h[i].mid && h[i].mid != pgno)
+		i = (i + 1) & mask;
+	return i;
+}
+
+/** Return the entry of \b dh for \b pgno, or NULL */
+static MDB_ID2 *mdb_dhash_find(const MDB_dhash *dh, pgno_t pgno)
+{
+	MDB_ID2 *h = &dh->dh_slots[mdb_dhash_slot(dh, pgno)];
+	return h->mid ? h : NULL;
+}
+
+/** Set the entry of \b dh for \b pgno. #mdb_dhash_reserve() must
+ *	have made room for it.
+ */
+static void mdb_dhash_add(MDB_dhash *dh, pgno_t pgno, MDB_PageHeader *mp)
+{
+	MDB_ID2 *h = &dh->dh_slots[mdb_dhash_slot(dh, pgno)];
+	dh->dh_count += !h->mid;
+	h->mid = pgno;
+	h->mptr = mp;
+}
+
+/** Remove \b pgno from \b dh. The entries after it in its probe
+ *	sequence are shifted back, so no tombstones are needed.
+ */
+static void mdb_dhash_del(MDB_dhash *dh, pgno_t pgno)
+{
+	MDB_ID2 *h = dh->dh_slots;
+	unsigned mask = dh->dh_mask, i = mdb_dhash_slot(dh, pgno), j, k;
+
+	if (!h[i].mid)
+		return;
+	dh->dh_count--;
+	for (j = i;;) {
+		h[i].mid = 0;
+		do {
+			j = (j + 1) & mask;
+			if (!h[j].mid)
+				return;
+			k = MDB_DHASH(h[j].mid) & mask;
+			/* skip entries whose home slot is cyclically in (i, j] */
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		h[i] = h[j];
+		i = j;
+	}
+}
+
+/** Rebuild \b dh with \b size slots, a power of 2 */
+static int mdb_dhash_resize(MDB_dhash *dh, unsigned size)
+{
+	MDB_ID2 *old = dh->dh_slots, *h;
+	unsigned i, n = dh->dh_mask + 1;
+
+	if (!(h = calloc(size, sizeof(MDB_ID2))))
+		return ENOMEM;
+	dh->dh_slots = h;
+	dh->dh_mask = size - 1;
+	dh->dh_count = 0;
+	for (i = 0; old && i < n; i++)
+		if (old[i].mid)
+			mdb_dhash_add(dh, old[i].mid, old[i].mptr);
+	free(old);
+	return MDB_SUCCESS;
+}
+
+/** Make sure \b dh stays at most half full with \b more entries */
+static int mdb_dhash_reserve(MDB_dhash *dh, unsigned more)
+{
+	unsigned size = dh->dh_mask + 1;
+
+	while ((dh->dh_count + more) * 2 > size)
+		size *= 2;
+	return size > dh->dh_mask + 1 ? mdb_dhash_resize(dh, size) : MDB_SUCCESS;
+}
+
+/** Make room in the dirty list and its index for one more page.
+ *	Neither has a fixed size; #MDB_env.%me_dirty_limit is what keeps
+ *	a txn's memory use in check, by spilling.
+ */
+static int mdb_dlist_grow(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	unsigned n = txn->mt_u.dirty_list[0].mid + 1;
+	int rc;
+
+	if (n > env->me_dirty_cap) {
+		unsigned cap = env->me_dirty_cap * 2;
+		MDB_ID2 *dl = realloc(env->me_dirty_list, (cap + 1) * sizeof(MDB_ID2));
+		if (!dl)
+			return ENOMEM;
+		env->me_dirty_list = txn->mt_u.dirty_list = dl;
+		env->me_dirty_cap = cap;
+	}
+	if (txn->mt_parent && (rc = mdb_dhash_reserve(&txn->mt_undo, 1)))
+		return rc;
+	return mdb_dhash_reserve(&env->me_dirty_hash, 1);
+}
+
+static int mdb_id2_cmp(const void *a, const void *b)
+{
+	pgno_t x = ((const MDB_ID2 *)a)->mid, y = ((const MDB_ID2 *)b)->mid;
+	return (x > y) - (x < y);
+}
+
+/** Sort the dirty list by pgno, as page flushes and spills need.
+ *	Pages are mostly dirtied in ascending order, so only the tail
+ *	appended since the last sort is sorted and then merged in.
+ */
+static int mdb_dlist_sort(MDB_txn *txn)
+{
+	MDB_ID2 *dl = txn->mt_u.dirty_list, *tmp;
+	unsigned n = dl[0].mid, i = txn->mt_dirty_nsorted, m = n - i, k = n;
+
+	if (!m)
+		return MDB_SUCCESS;
+	qsort(dl + i + 1, m, sizeof(MDB_ID2), mdb_id2_cmp);
+	if (i && dl[i].mid > dl[i+1].mid) {
+		if (!(tmp = malloc(m * sizeof(MDB_ID2))))
+			return ENOMEM;
+		memcpy(tmp, dl + i + 1, m * sizeof(MDB_ID2));
+		while (m) {
+			if (i && dl[i].mid > tmp[m-1].mid)
+				dl[k--] = dl[i--];
+			else
+				dl[k--] = tmp[--m];
+		}
+		free(tmp);
 	}
+	txn->mt_dirty_nsorted = n;
+	return MDB_SUCCESS;
 }
 
 /**	Return all dirty pages to dpage list */
@@ -1894,11 +2619,36 @@ static void mdb_dlist_free(MDB_txn *txn)
 	MDB_env *env = txn->mt_env;
 	MDB_ID2 * dl = txn->mt_u.dirty_list;
 	unsigned i, n = dl[0].mid;
+	int big = env->me_dirty_hash.dh_mask + 1 > MDB_DHASH_MIN;
 
 	for (i = 1; i <= n; i++) {
+		if (!big)
+			mdb_dhash_del(&env->me_dirty_hash, dl[i].mid);
 		mdb_dpage_free(env, dl[i].mptr);
 	}
 	dl[0].mid = 0;
+	txn->mt_dirty_nsorted = 0;
+
+	/* Give back what a huge txn needed */
+	if (big) {
+		MDB_dhash *dh = &env->me_dirty_hash;
+		MDB_ID2 *h = calloc(MDB_DHASH_MIN, sizeof(MDB_ID2));
+		if (h) {
+			free(dh->dh_slots);
+			dh->dh_slots = h;
+			dh->dh_mask = MDB_DHASH_MIN - 1;
+		} else {
+			memset(dh->dh_slots, 0, (dh->dh_mask + 1) * sizeof(MDB_ID2));
+		}
+		dh->dh_count = 0;
+	}
+	if (env->me_dirty_cap > MDB_IDL_UM_MAX) {
+		MDB_ID2 *ndl = realloc(dl, MDB_IDL_UM_SIZE * sizeof(MDB_ID2));
+		if (ndl) {
+			env->me_dirty_list = txn->mt_u.dirty_list = ndl;
+			env->me_dirty_cap = MDB_IDL_UM_MAX;
+		}
+	}
 }
 
 #define MDB_PAGE_UNREF(txn, mp)
@@ -1922,8 +2672,12 @@ static int mdb_page_loose(MDB_cursor *mc, MDB_PageHeader *mp)
 	MDB_txn *txn = mc->mc_txn;
 
 	if ((mp->mp_flags & P_DIRTY) && mc->mc_dbi != FREE_DBI) {
-			/* no parent txn, so it's just ours */
-			loose = 1;
+		/* A nested txn can only reuse pages it dirtied first,
+		 * the parent's must be there if the txn aborts.
+		 */
+		MDB_ID2 *u;
+		loose = !txn->mt_parent ||
+			((u = mdb_dhash_find(&txn->mt_undo, pgno)) && !u->mptr);
 	}
 	if (loose) {
 		DPRINTF(("loosen db %d page %"Yu, DDBI(mc), mp->mp_pgno));
@@ -2007,6 +2761,10 @@ mark_done:
 }
 
 static int mdb_page_flush(MDB_txn *txn, int keep);
+static int mdb_page_spill0(MDB_cursor *m0, unsigned int need);
+#ifdef MDB_USE_IOURING
+static int mdb_txn_flush_uring(MDB_txn *txn);
+#endif
 
 /**	Spill pages from the dirty list back to disk.
  * This is intended to prevent running into #MDB_TXN_FULL situations,
@@ -2043,10 +2801,7 @@ static int mdb_page_flush(MDB_txn *txn, int keep);
 static int mdb_page_spill(MDB_cursor *m0, MDB_val *key, MDB_val *data)
 {
 	MDB_txn *txn = m0->mc_txn;
-	MDB_PageHeader *dp;
-	MDB_ID2L dl = txn->mt_u.dirty_list;
-	unsigned int i, j, need;
-	int rc;
+	unsigned int i, need;
 
 	if (m0->mc_flags & C_SUB)
 		return MDB_SUCCESS;
@@ -2064,6 +2819,17 @@ static int mdb_page_spill(MDB_cursor *m0, MDB_val *key, MDB_val *data)
 
 	if (txn->mt_dirty_room > i)
 		return MDB_SUCCESS;
+	return mdb_page_spill0(m0, need);
+}
+
+/** Spill at least \b need pages of \b m0's txn, see #mdb_page_spill(). */
+static int mdb_page_spill0(MDB_cursor *m0, unsigned int need)
+{
+	MDB_txn *txn = m0->mc_txn;
+	MDB_PageHeader *dp;
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	unsigned int i, j, nspilled;
+	int rc;
 
 	if (!txn->mt_spill_pgs) {
 		txn->mt_spill_pgs = mdb_midl_alloc(MDB_IDL_UM_MAX);
@@ -2092,11 +2858,14 @@ static int mdb_page_spill(MDB_cursor *m0, MDB_val *key, MDB_val *data)
 	 * of the dirty pages. Testing revealed this to be a good tradeoff,
 	 * better than 1/2, 1/4, or 1/10.
 	 */
-	if (need < MDB_IDL_UM_MAX / 8)
-		need = MDB_IDL_UM_MAX / 8;
+	if (need < txn->mt_env->me_dirty_limit / 8)
+		need = txn->mt_env->me_dirty_limit / 8;
+	if ((rc = mdb_dlist_sort(txn)))
+		goto done;
 
 	/* Save the page IDs of all the pages we're flushing */
 	/* flush from the tail forward, this saves a lot of shifting later on. */
+	nspilled = txn->mt_spill_pgs[0];
 	for (i=dl[0].mid; i && need; i--) {
 		MDB_ID pn = dl[i].mid << 1;
 		dp = dl[i].mptr;
@@ -2128,6 +2897,7 @@ static int mdb_page_spill(MDB_cursor *m0, MDB_val *key, MDB_val *data)
 	/* Flush the spilled part of dirty list */
 	if ((rc = mdb_page_flush(txn, i)) != MDB_SUCCESS)
 		goto done;
+	MDB_METRIC(txn->mt_env, me_spills, txn->mt_spill_pgs[0] - nspilled);
 
 	/* Reset any dirty pages we kept that page_flush didn't see */
 	rc = mdb_pages_xkeep(m0, P_DIRTY|P_KEEP, i);
@@ -2137,80 +2907,354 @@ done:
 	return rc;
 }
 
-/** Find oldest txnid still referenced. Expects txn->m_snapshot_id > 0. */
+/** Find oldest txnid still referenced. Expects txn->m_snapshot_id > 0.
+ *
+ * The reader table is only scanned when a reader that may have been
+ * the oldest one went away since the last scan, as counted by
+ * #mti_readers_gen. Otherwise the cached #mti_oldest still bounds
+ * all readers from below.
+ */
 static txnid_t mdb_find_alive_snapshot_id(MDB_txn *txn)
 {
-	DKBUF;
-	
-	txnid_t  oldest = txn->m_snapshot_id - 1;
-		MDB_reader_entry *r = txn->mt_env->m_reader_table->mti_readers;
-		for (int i = txn->mt_env->m_reader_table->mti_numreaders; --i >= 0; ) {
+	MDB_reader_LockTableHeader * const ti = txn->mt_env->m_reader_table;
+	txnid_t  oldest = txn->m_snapshot_id - 1, mr;
+	MDB_reader_entry *r = ti->mti_readers;
+	unsigned gen;
+
+	/* Pages still in the last meta on disk stay put until a group
+	 * commit on top of it is synced, new readers may still pick it.
+	 */
+	if (ti->mti_txnid < oldest)
+		oldest = ti->mti_txnid;
+	gen = ti->mti_readers_gen;
+	if (gen == ti->mti_oldest_gen) {
+		mr = ti->mti_oldest;
+	} else {
+		/* Make every reader that ends during the scan bump the
+		 * generation, it may end after being counted.
+		 */
+		ti->mti_oldest = (txnid_t)-1;
+		MDB_MB();
+		gen = ti->mti_readers_gen;
+		mr = (txnid_t)-1;
+		for (int i = ti->mti_numreaders; --i >= 0; ) {
 			if (r[i].mr_pid) {
-				txnid_t mr = r[i].mr_txnid;
-				if (mr < oldest)
-					oldest = mr;
+				txnid_t t = r[i].mr_txnid;
+				if (t < mr)
+					mr = t;
 			}
 		}
-		DPRINTF(("cur txn:%lu, alive snapshot_id:%lu, readers_count:%u",txn->m_snapshot_id,oldest,txn->mt_env->m_reader_table->mti_numreaders));
+		ti->mti_oldest = mr;
+		ti->mti_oldest_gen = gen;
+	}
+	if (mr < oldest)
+		oldest = mr;
+	DPRINTF(("cur txn:%lu, alive snapshot_id:%lu, readers_count:%u",txn->m_snapshot_id,oldest,ti->mti_numreaders));
 	return oldest;
 }
 
-/** Add a page to the txn's dirty list */
-static void mdb_page_dirty(MDB_txn *txn, MDB_PageHeader *mp)
+	/** Note that a reader of snapshot \b txnid appeared.
+	 *	Call after publishing its slot, and before checking that
+	 *	#mti_txnid did not move: a cached #mti_oldest above \b txnid no
+	 *	longer bounds the readers, so the next writer must scan again.
+	 */
+static void mdb_reader_new(MDB_env *env, txnid_t txnid)
 {
-	MDB_ID2 mid;
-	int rc;
+	MDB_reader_LockTableHeader * const ti = env->m_reader_table;
 
-	mid.mid = mp->mp_pgno;
-	mid.mptr = mp;
-	rc = mdb_mid2l_insert(txn->mt_u.dirty_list, &mid);
-	mdb_tassert(txn, rc == 0);
-	txn->mt_dirty_room--;
+	MDB_MB();
+	if (txnid < ti->mti_oldest)
+		(void) MDB_XADD(&ti->mti_readers_gen, 1);
 }
 
-int __try_alloc_from_free_page_db(MDB_txn *txn, const int num, 	MDB_PageHeader **np){
-	int  retry = num * 60;
-	MDB_env *const env = txn->mt_env;
+	/** Note that a reader of snapshot \b txnid went away.
+	 *	Call after clearing its slot.
+	 */
+static void mdb_reader_gone(MDB_env *env, txnid_t txnid)
+{
+	MDB_reader_LockTableHeader * const ti = env->m_reader_table;
+
+	MDB_MB();
+	if (txnid <= ti->mti_oldest)
+		(void) MDB_XADD(&ti->mti_readers_gen, 1);
+}
+
+/** Add a page to the txn's dirty list. The room for it was made by
+ *	#mdb_dlist_grow(). Appending keeps the list sorted as long as
+ *	pages come in ascending order, as new pages from the map do.
+ */
+static void mdb_page_dirty(MDB_txn *txn, MDB_PageHeader *mp)
+{
+	MDB_ID2 *dl = txn->mt_u.dirty_list;
+	unsigned n = ++dl[0].mid;
+
+	dl[n].mid = mp->mp_pgno;
+	dl[n].mptr = mp;
+	if (txn->mt_dirty_nsorted == n - 1 && (n == 1 || dl[n-1].mid < mp->mp_pgno))
+		txn->mt_dirty_nsorted = n;
+	mdb_dhash_add(&txn->mt_env->me_dirty_hash, mp->mp_pgno, mp);
+	if (txn->mt_parent)
+		mdb_dhash_add(&txn->mt_undo, mp->mp_pgno, NULL);
+	txn->mt_dirty_room--;
+}
+
+/** Return the lowest index of the run of consecutive pages in the
+ *	descending list \b mop that ends at index \b x.
+ *	Pages i < j are in the same run iff mop[i] - mop[j] == j - i,
+ *	which can be binary searched.
+ */
+static unsigned mdb_run_top(const pgno_t *mop, unsigned x)
+{
+	unsigned lo = 1, hi = x, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (mop[mid] - mop[x] == x - mid)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/** Return the highest index of the run of consecutive pages in \b mop
+ *	that starts at index \b x, not going down to page \b floor.
+ */
+static unsigned mdb_run_bottom(const pgno_t *mop, unsigned x, pgno_t floor)
+{
+	unsigned lo = x, hi = mop[0], mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) >> 1;
+		if (mop[x] - mop[mid] == mid - x && mop[mid] > floor)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/** Find the first run in \b runs not smaller than \b count pages at \b pgno */
+static unsigned mdb_runs_search(const pgno_t *runs, pgno_t count, pgno_t pgno)
+{
+	const MDB_run *ru = RUNS(runs);
+	unsigned lo = 0, hi = NUMRUNS(runs), mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (ru[mid].ru_count < count ||
+			(ru[mid].ru_count == count && ru[mid].ru_pgno < pgno))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/** Add a run to the free-space index. Drops the index if out of memory,
+ *	it gets rebuilt when it is needed next.
+ */
+static void mdb_runs_insert(MDB_pgstate *ps, pgno_t count, pgno_t pgno)
+{
+	MDB_run *ru;
+	unsigned k, n;
+
+	if (mdb_midl_expand(&ps->mf_runs, 2)) {
+		ps->mf_runs_ok = 0;
+		return;
+	}
+	k = mdb_runs_search(ps->mf_runs, count, pgno);
+	n = NUMRUNS(ps->mf_runs);
+	ru = RUNS(ps->mf_runs);
+	memmove(ru + k + 1, ru + k, (n - k) * sizeof(MDB_run));
+	ru[k].ru_count = count;
+	ru[k].ru_pgno = pgno;
+	ps->mf_runs[0] += 2;
+}
+
+/** Remove a run from the free-space index */
+static void mdb_runs_remove(MDB_pgstate *ps, pgno_t count, pgno_t pgno)
+{
+	unsigned k = mdb_runs_search(ps->mf_runs, count, pgno);
+	unsigned n = NUMRUNS(ps->mf_runs);
+	MDB_run *ru = RUNS(ps->mf_runs);
+
+	if (k < n && ru[k].ru_count == count && ru[k].ru_pgno == pgno) {
+		memmove(ru + k, ru + k + 1, (n - k - 1) * sizeof(MDB_run));
+		ps->mf_runs[0] -= 2;
+	} else {
+		ps->mf_runs_ok = 0;
+	}
+}
+
+/** Order runs by size, then page number */
+static int mdb_run_cmp(const void *a, const void *b)
+{
+	const MDB_run *x = a, *y = b;
+
+	if (x->ru_count != y->ru_count)
+		return x->ru_count < y->ru_count ? -1 : 1;
+	return (x->ru_pgno > y->ru_pgno) - (x->ru_pgno < y->ru_pgno);
+}
+
+/** Rebuild the free-space index from scratch: one pass over mf_pghead. */
+static int mdb_runs_build(MDB_pgstate *ps)
+{
+	const pgno_t *mop = ps->mf_pghead;
+	unsigned i, j, n = mop ? mop[0] : 0;
+	MDB_run *ru;
+
+	if (!ps->mf_runs && !(ps->mf_runs = mdb_midl_alloc(256)))
+		return ENOMEM;
+	ps->mf_runs[0] = 0;
+	for (i = 1; i <= n; i = j + 1) {
+		j = mdb_run_bottom(mop, i, 0);
+		if (j > i) {
+			if (mdb_midl_expand(&ps->mf_runs, 2))
+				return ENOMEM;
+			ru = RUNS(ps->mf_runs) + NUMRUNS(ps->mf_runs);
+			ru->ru_count = j - i + 1;
+			ru->ru_pgno = mop[j];
+			ps->mf_runs[0] += 2;
+		}
+	}
+	qsort(RUNS(ps->mf_runs), NUMRUNS(ps->mf_runs), sizeof(MDB_run), mdb_run_cmp);
+	ps->mf_runs_ok = 1;
+	return MDB_SUCCESS;
+}
+
+/** Update the free-space index for \b count pages from \b pgno which
+ *	were just added to mf_pghead. They may join the runs directly
+ *	above and below them. Pages at or below \b floor were also added
+ *	but are not in the index yet, so they must not be joined here.
+ */
+static void mdb_runs_add_range(MDB_pgstate *ps, pgno_t pgno, pgno_t count, pgno_t floor)
+{
+	const pgno_t *mop = ps->mf_pghead;
+	unsigned x = mdb_midl_search(ps->mf_pghead, pgno + count - 1);
+	unsigned y = x + count - 1;
+	unsigned u = mdb_run_top(mop, x), d = mdb_run_bottom(mop, y, floor);
+
+	if (x - u >= 2)
+		mdb_runs_remove(ps, x - u, pgno + count);
+	if (d - y >= 2)
+		mdb_runs_remove(ps, d - y, mop[d]);
+	if (d > u)
+		mdb_runs_insert(ps, d - u + 1, mop[d]);
+}
+
+/** Update the free-space index for the descending IDL or RIDL
+ *	\b idl, which was just merged into mf_pghead.
+ */
+static void mdb_runs_merge(MDB_pgstate *ps, const pgno_t *idl)
+{
+	unsigned i, j, n = idl[0];
+
+	if (MDB_IDL_IS_RANGES(idl)) {
+		n = MDB_RIDL_LEN(idl);
+		for (i = 1; i <= n && ps->mf_runs_ok; i++)
+			mdb_runs_add_range(ps, idl[i*2-1] - idl[i*2] + 1, idl[i*2],
+				i < n ? idl[i*2+1] : 0);
+		return;
+	}
+	for (i = 1; i <= n && ps->mf_runs_ok; i = j + 1) {
+		for (j = i; j < n && idl[j+1] == idl[j] - 1; j++) ;
+		mdb_runs_add_range(ps, idl[j], j - i + 1, j < n ? idl[j+1] : 0);
+	}
+}
+
+/** Take \b num consecutive pages out of mf_pghead.
+ *	Single pages come off the tail, which just truncates the list.
+ *	Longer requests take the low end of the smallest run that fits;
+ *	the caller has checked with #mdb_runs_search() that there is one.
+ * @return the first page number.
+ */
+static pgno_t mdb_runs_take(MDB_pgstate *ps, unsigned num)
+{
+	pgno_t *mop = ps->mf_pghead;
+	MDB_run *ru;
+	pgno_t count, pgno;
+	unsigned k, x;
+
+	if (num == 1) {
+		pgno = mop[mop[0]];
+		if (ps->mf_runs_ok && mop[0] > 1 && mop[mop[0]-1] == pgno + 1) {
+			/* It was the bottom of a run */
+			x = mdb_run_top(mop, mop[0]);
+			mdb_runs_remove(ps, mop[0] - x + 1, pgno);
+			if (mop[0] - x >= 2)
+				mdb_runs_insert(ps, mop[0] - x, pgno + 1);
+		}
+		mop[0]--;
+		return pgno;
+	}
+	k = mdb_runs_search(ps->mf_runs, num, 0);
+	ru = RUNS(ps->mf_runs);
+	count = ru[k].ru_count;
+	pgno = ru[k].ru_pgno;
+	mdb_runs_remove(ps, count, pgno);
+	if (count - num >= 2)
+		mdb_runs_insert(ps, count - num, pgno + num);
+
+	/* The run is pgno+num-1 down to pgno, starting at index x */
+	x = mdb_midl_search(mop, pgno + num - 1);
+	memmove(mop + x, mop + x + num, (mop[0] - x - num + 1) * sizeof(pgno_t));
+	mop[0] -= num;
+	return pgno;
+}
+
+/** Give a nested txn its own copy of the reclaimed freeDB pages before
+ *	it first changes them, so that an abort can put back the parent's.
+ */
+static int mdb_pgstate_own(MDB_txn *txn)
+{
+	MDB_ntxn *ntxn = (MDB_ntxn *)txn;
+	MDB_pgstate *ps = &txn->mt_env->old_pg_state;
+	pgno_t *mop = ps->mf_pghead, *copy;
+
+	if (ntxn->mnt_pgcopy)
+		return MDB_SUCCESS;
+	if (mop) {
+		if (!(copy = mdb_midl_alloc(mop[0])))
+			return ENOMEM;
+		memcpy(copy, mop, (mop[0] + 1) * sizeof(pgno_t));
+		ps->mf_pghead = copy;
+	}
+	/* The runs are rebuilt from the copy when needed */
+	ps->mf_runs = NULL;
+	ps->mf_runs_ok = 0;
+	ntxn->mnt_pgcopy = 1;
+	return MDB_SUCCESS;
+}
+
+int __try_alloc_from_free_page_db(MDB_txn *txn, const int num, 	MDB_PageHeader **np){
+	int  retry = num * 60;
+	MDB_env *const env = txn->mt_env;
 	int rc=0;
+	if (txn->mt_parent && (rc = mdb_pgstate_own(txn)))
+		return rc;
 	MDB_cursor m2;
 	int found_old = 0;
-	txnid_t last_snapshot_id = env->old_pg_state.last_snapshot_id;
+	txnid_t last_snapshot_id = env->old_pg_state.last_snapshot_id, last_seq, next_id, fkey[2];
 
 	for (MDB_cursor_op op = MDB_FIRST;; op = MDB_NEXT) {
 		MDB_val key, data;
 		unsigned const  free_page_count = env->old_pg_state.mf_pghead ? env->old_pg_state.mf_pghead[0] : 0;
 
-		/* Seek a big enough contiguous page range. Prefer
-		 * pages at the tail, just truncating the list.
-		 */
+		/* Seek a big enough contiguous page range */
 		if (free_page_count >= num) {
-			unsigned i = free_page_count;
-			do {
-				const pgno_t pgno = env->old_pg_state.mf_pghead[i];
-				if (env->old_pg_state.mf_pghead[i-num+1] == pgno+num-1) /*descending*/{
-							
-							MDB_PageHeader * mp =  mdb_page_malloc(txn, num);
-								if (!mp) {
-										rc = ENOMEM;
-										return rc;
-								}
-
-									// [ i-num+1,  i]  (i-num, i]
-								/* Move any stragglers down */
-							//	for (unsigned int j = i-num; j < free_page_count; )
-							//		env->old_pg_state.mf_pghead[++j] = env->old_pg_state.mf_pghead[++i];
-								for(unsigned int j=i-num;j<free_page_count-num;){
-									env->old_pg_state.mf_pghead[++j] = env->old_pg_state.mf_pghead[++i];
-								}
-								env->old_pg_state.mf_pghead[0] = free_page_count -num;
-								assert(free_page_count>=num);
-
-								mp->mp_pgno=pgno;
-//								DPRINTF(("from free db:snapshot_id:%zu,pgno %zu,num:%u, rest:%u",last_snapshot_id,pgno,num,free_page_count-num));
-								*np=mp;
-							return MDB_SUCCESS;
-					}
-			} while (--i >=num);
+			MDB_pgstate *const ps = &env->old_pg_state;
+			if (num > 1 && !ps->mf_runs_ok && (rc = mdb_runs_build(ps)))
+				return rc;
+			if (num == 1 || mdb_runs_search(ps->mf_runs, num, 0) < NUMRUNS(ps->mf_runs)) {
+				MDB_PageHeader * mp =  mdb_page_malloc(txn, num);
+				if (!mp)
+					return ENOMEM;
+				mp->mp_pgno = mdb_runs_take(ps, num);
+//				DPRINTF(("from free db:snapshot_id:%zu,pgno %zu,num:%u, rest:%u",last_snapshot_id,pgno,num,free_page_count-num));
+				*np=mp;
+				return MDB_SUCCESS;
+			}
 			if (--retry < 0)
 				return MDB_NOTFOUND;
 		}
@@ -2218,24 +3262,27 @@ int __try_alloc_from_free_page_db(MDB_txn *txn, const int num, 	MDB_PageHeader *
 		if (op == MDB_FIRST) {	/* 1st iteration */
 			/* Prepare to fetch more and coalesce */
 			mdb_cursor_init(&m2, txn, FREE_DBI, NULL);
+			m2.mc_readahead = MDB_FREE_READAHEAD;
 
 			if (last_snapshot_id) {
+				/* Look up the next chunk, or the next txn's first one */
 				op = MDB_SET_RANGE;
-				key.mv_data = &last_snapshot_id; /* will look up last+1 */
-				key.mv_size = sizeof(last_snapshot_id);
+				fkey[0] = last_snapshot_id;
+				fkey[1] = env->old_pg_state.last_snapshot_seq + 1;
+				key.mv_data = fkey;
+				key.mv_size = sizeof(fkey);
 			}
 
 		}
 
-
-		last_snapshot_id++;
 		/* Do not fetch more if the record will be too recent */
-		if (env->alive_snapshot_id <= last_snapshot_id) {
+		next_id = last_snapshot_id + !env->old_pg_state.last_snapshot_more;
+		if (env->alive_snapshot_id <= next_id) {
 			if (!found_old) {
 				env->alive_snapshot_id = mdb_find_alive_snapshot_id(txn);
 				found_old = 1;
 			}
-			if (env->alive_snapshot_id <= last_snapshot_id)
+			if (env->alive_snapshot_id <= next_id)
 				break;
 		}
 		rc = mdb_cursor_get(&m2, &key, NULL, op);
@@ -2243,6 +3290,7 @@ int __try_alloc_from_free_page_db(MDB_txn *txn, const int num, 	MDB_PageHeader *
 			 return rc;
 		}
 		last_snapshot_id = *(txnid_t*)key.mv_data;
+		last_seq = FREE_KEY_SEQ(&key);
 //		DPRINTF(("alive_snapshot_id=%lu,find last_snapshot_id=%lu",env->alive_snapshot_id,last_snapshot_id));
 		if (env->alive_snapshot_id <= last_snapshot_id) {
 			if (!found_old) {
@@ -2256,10 +3304,11 @@ int __try_alloc_from_free_page_db(MDB_txn *txn, const int num, 	MDB_PageHeader *
 		MDB_node * const leaf_node = get_node_n(np, m2.mc_ki[m2.mc_top]);
 		if ((rc = mdb_node_read(&m2, leaf_node, &data)) != MDB_SUCCESS)
 			return rc;
+		MDB_METRIC(env, me_freedb_reads, 1);
 
 		pgno_t *const idl = (MDB_ID *) data.mv_data;
-		assert(data.mv_size==(idl[0]+1)*sizeof(MDB_ID));
-		const unsigned int n = idl[0];
+		assert(data.mv_size == (MDB_IDL_IS_RANGES(idl) ? MDB_RIDL_SIZEOF(idl) : MDB_IDL_SIZEOF(idl)));
+		const unsigned int n = FREE_REC_PAGES(idl);
 		if (!env->old_pg_state.mf_pghead) {
 			if (!(env->old_pg_state.mf_pghead =mdb_midl_alloc(n))) {
 				rc = ENOMEM;
@@ -2270,6 +3319,8 @@ int __try_alloc_from_free_page_db(MDB_txn *txn, const int num, 	MDB_PageHeader *
 				return rc;
 		}
 		env->old_pg_state.last_snapshot_id = last_snapshot_id;
+		env->old_pg_state.last_snapshot_seq = last_seq;
+		env->old_pg_state.last_snapshot_more = MDB_FREE_CHUNK && n >= MDB_FREE_CHUNK;
 #if (MDB_DEBUG) > 1
 		DPRINTF(("read next free page list: snapshot_id: %zu root %zu num %u", last_snapshot_id, txn->mt_dbs[FREE_DBI].md_root, n));
 		print_data(true,&data);
@@ -2277,10 +3328,15 @@ int __try_alloc_from_free_page_db(MDB_txn *txn, const int num, 	MDB_PageHeader *
 		//	DPRINTF(("IDL %"Yu, idl[j]));
 #endif
 		/* Merge in descending sorted order */
-		mdb_midl_xmerge(env->old_pg_state.mf_pghead, idl);
+		if (MDB_IDL_IS_RANGES(idl))
+			mdb_ridl_xmerge(env->old_pg_state.mf_pghead, idl);
+		else
+			mdb_midl_xmerge(env->old_pg_state.mf_pghead, idl);
+		if (env->old_pg_state.mf_runs_ok)
+			mdb_runs_merge(&env->old_pg_state, idl);
 	}//for
 
-
+	return MDB_NOTFOUND;
 }
 /** Allocate page numbers and memory for writing.  Maintain old_pg_state.last_snapshot_id,
  * old_pg_state.mf_pghead and mt_next_pgno.  Set #MDB_TXN_ERROR on failure.
@@ -2319,6 +3375,10 @@ static int mdb_page_alloc(MDB_txn *txn,MDB_dbi table,const int num, MDB_PageHead
 		txn->txn_flags |= MDB_TXN_ERROR;
 		return rc;
 	}
+	if ((rc = mdb_dlist_grow(txn))) {
+		txn->txn_flags |= MDB_TXN_ERROR;
+		return rc;
+	}
 
 	rc =__try_alloc_from_free_page_db(txn,num,mp);
 	if(rc== MDB_SUCCESS){
@@ -2373,6 +3433,33 @@ static void mdb_page_copy(MDB_PageHeader *dst, MDB_PageHeader *src, unsigned int
 	}
 }
 
+/** Prepare a dirty page for a change in place. In a nested txn, first
+ *	save the contents of a page its parent dirtied, so that an abort
+ *	can put them back. Set #MDB_TXN_ERROR on failure.
+ */
+static int mdb_page_undo(MDB_txn *txn, MDB_PageHeader *mp)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_PageHeader *np;
+	unsigned num;
+	int rc;
+
+	if (!txn->mt_parent || IS_SUBP(mp) || mdb_dhash_find(&txn->mt_undo, mp->mp_pgno))
+		return MDB_SUCCESS;
+	num = IS_OVERFLOW(mp) ? mp->m_ovf_page_count : 1;
+	if ((rc = mdb_dhash_reserve(&txn->mt_undo, 1)) ||
+		!(np = mdb_page_malloc(txn, num))) {
+		txn->txn_flags |= MDB_TXN_ERROR;
+		return rc ? rc : ENOMEM;
+	}
+	if (num > 1)
+		memcpy(np, mp, num * env->me_psize);
+	else
+		mdb_page_copy(np, mp, env->me_psize);
+	mdb_dhash_add(&txn->mt_undo, mp->mp_pgno, np);
+	return MDB_SUCCESS;
+}
+
 /** Pull a page off the txn's spill list, if present.
  * If a page being referenced was spilled to disk in this txn, bring
  * it back and make it dirty/writable again.
@@ -2396,6 +3483,9 @@ static int mdb_page_unspill(MDB_txn *txn, MDB_PageHeader *mp, MDB_PageHeader **r
 				int num;
 				if (txn->mt_dirty_room == 0)
 					return MDB_TXN_FULL;
+				int rc = mdb_dlist_grow(txn);
+				if (rc)
+					return rc;
 				if (IS_OVERFLOW(mp))
 					num = mp->m_ovf_page_count;
 				else
@@ -2413,14 +3503,19 @@ static int mdb_page_unspill(MDB_txn *txn, MDB_PageHeader *mp, MDB_PageHeader **r
 				/* If in current txn, this page is no longer spilled.
 				 * If it happens to be the last page, truncate the spill list.
 				 * Otherwise mark it as deleted by setting the LSB.
+				 * The list belongs to the parent of a nested txn, which
+				 * only drops the page when the nested txn commits.
 				 */
-				if (x == txn->mt_spill_pgs[0])
+				if (txn->mt_parent)
+					;
+				else if (x == txn->mt_spill_pgs[0])
 					txn->mt_spill_pgs[0]--;
 				else
 					txn->mt_spill_pgs[x] |= 1;
 
 				mdb_page_dirty(txn, np);
 				np->mp_flags |= P_DIRTY;
+				MDB_METRIC(env, me_unspills, 1);
 				*ret = np;
 				return MDB_SUCCESS;
 		}
@@ -2438,7 +3533,7 @@ static int mdb_copy_on_write(MDB_cursor *mc)
 	MDB_PageHeader *const mp = mc->mc_pg[mc->mc_top], *np;
 
 	if (F_ISSET(MP_FLAGS(mp), P_DIRTY))
-		return MDB_SUCCESS;
+		return mdb_page_undo(mc->mc_txn, mp);
 
 	MDB_txn *const txn = mc->mc_txn;
 
@@ -2505,6 +3600,27 @@ fail:
 	return rc;
 }
 
+	/** Monotonic time in microseconds, for #mdb_env_metrics() */
+static mdb_size_t mdb_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (mdb_size_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+	/** Count an event that took \b usec in latency histogram \b hist */
+static void mdb_metric_hist(mdb_size_t *hist, mdb_size_t usec)
+{
+	int i = 0;
+
+	while (usec && i < MDB_METRICS_HIST-1) {
+		usec >>= 1;
+		i++;
+	}
+	(void) MDB_XADD(&hist[i], 1);
+}
+
 int mdb_env_sync0(MDB_env *env, int force, pgno_t numpgs)
 {
 	DKBUF;
@@ -2516,9 +3632,17 @@ int mdb_env_sync0(MDB_env *env, int force, pgno_t numpgs)
 		|| !(env->me_flags & MDB_NOSYNC)
 #endif
 		) {
+		mdb_size_t t0 = mdb_now_usec(), usec;
 		DPRINTF(("fdatasync fd:%d\n",env->me_fd));
 			if (MDB_FDATASYNC(env->me_fd))
 				rc = ErrCode();
+		/* The log must cover whatever meta gets written next */
+		if (!rc && env->me_chgfd != INVALID_HANDLE_VALUE && MDB_FDATASYNC(env->me_chgfd))
+			rc = ErrCode();
+		usec = mdb_now_usec() - t0;
+		MDB_METRIC(env, me_syncs, 1);
+		MDB_METRIC(env, me_sync_usec, usec);
+		mdb_metric_hist(env->me_metrics->me_sync_hist, usec);
 	}
 	return rc;
 }
@@ -2580,7 +3704,8 @@ static void mdb_cursors_close(MDB_txn *txn, unsigned merge)
 	int i;
 
 	for (i = txn->mt_numdbs; --i >= 0; ) {
-		for (mc = cursors[i]; mc; mc = mc->mc_next) {
+		for (mc = cursors[i]; mc; mc = next) {
+			next = mc->mc_next;
 			if ((bk = mc->mc_backup) != NULL) {
 				if (merge) {
 					/* Commit changes to parent txn */
@@ -2659,10 +3784,27 @@ static int mdb_check_pid_exclusive_lock(MDB_env *env, MDB_PID_T pid)
 	}
 }
 
-static int __allocate_reader_slot(MDB_env *env,MDB_reader_entry **_r){
+	/** Monotonic time in milliseconds, comparable across processes */
+static mdb_size_t mdb_now_msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (mdb_size_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Claim a free reader lock table slot for this process.
+ * @param[in] env the environment.
+ * @param[out] _r the slot, with no snapshot in it yet.
+ * @param[in] bind also tie the slot to this thread, unless #MDB_NOTLS is in use.
+ * @return 0 on success, non-zero on failure.
+ */
+static int __allocate_reader_slot(MDB_env *env,MDB_reader_entry **_r,int bind){
 		int rc=0;
 		MDB_THR_T const tid = pthread_self();
-		mdb_mutexref_t const rmutex = env->me_rmutex;
+		MDB_reader_LockTableHeader * const ti = env->m_reader_table;
+		MDB_reader_entry *r;
+		unsigned int i, nr;
 
 		if (!env->me_live_reader) {
 			rc = mdb_pid_exclusive_lock(env, env->me_pid);
@@ -2670,36 +3812,36 @@ static int __allocate_reader_slot(MDB_env *env,MDB_reader_entry **_r){
 				return rc;
 			env->me_live_reader = 1;
 		}
-		rc =lock_mutex(env,rmutex);
-		if (rc!=MDB_SUCCESS)
-			return rc;
-		const unsigned int nr = env->m_reader_table->mti_numreaders;
-		int i=0;
-		for (i=0; i<nr; i++)
-			if (env->m_reader_table->mti_readers[i].mr_pid == 0)
-				break;
-		if (i == env->me_maxreaders) {
-			pthread_mutex_unlock(rmutex);
-			return MDB_READERS_FULL;
-		}
-		MDB_reader_entry * const r = &env->m_reader_table->mti_readers[i];
-		/* Claim the reader slot, carefully since other code
-		 * uses the reader table un-mutexed: First reset the
-		 * slot, next publish it in mti_numreaders.  After
-		 * that, it is safe for mdb_env_close() to touch it.
-		 * When it will be closed, we can finally claim it.
+		/* Claim a free slot by swapping our pid into it. Slots only
+		 * become free again by their owners clearing mr_pid, or by
+		 * #MDB_reader_entry_check0() clearing a dead process' slots
+		 * under the reader mutex, so no mutex is needed here.
 		 */
-		r->mr_pid = 0;
+		for (;;) {
+			nr = ti->mti_numreaders;
+			for (i=0; i<nr; i++)
+				if (ti->mti_readers[i].mr_pid == 0 &&
+					MDB_CAS(&ti->mti_readers[i].mr_pid, 0, env->me_pid))
+					break;
+			if (i < nr)
+				break;
+			if (nr >= env->me_maxreaders)
+				return MDB_READERS_FULL;
+			/* Publish one more slot, zeroed by mdb_env_setup_locks(),
+			 * and compete for it with the other threads.
+			 */
+			MDB_CAS(&ti->mti_numreaders, nr, nr+1);
+		}
+		r = &ti->mti_readers[i];
 		r->mr_txnid = (txnid_t)-1;
 		r->mr_tid = tid;
-		if (i == nr)
-			env->m_reader_table->mti_numreaders = nr+1;
-		env->me_close_readers = env->m_reader_table->mti_numreaders ;
-		r->mr_pid = env->me_pid;
-		pthread_mutex_unlock(rmutex);
+		/* Our slots must be below me_close_readers for mdb_env_close() */
+		while ((nr = env->me_close_readers) <= i &&
+			!MDB_CAS(&env->me_close_readers, nr, i+1))
+			;
 
 		const bool new_notls = (env->me_flags & MDB_NOTLS);
-		if (!new_notls && (rc=pthread_setspecific(env->me_txkey, r))) {
+		if (bind && !new_notls && (rc=pthread_setspecific(env->me_txkey, r))) {
 			r->mr_pid = 0;
 			return rc;
 		}
@@ -2712,7 +3854,11 @@ static int __allocate_reader_slot(MDB_env *env,MDB_reader_entry **_r){
  * @param[in] txn the transaction handle to initialize
  * @return 0 on success, non-zero on failure.
  */
-static int __mdb_txn_init(MDB_txn *txn)
+/** Set up a txn handle to begin. A read-only txn reads the latest
+ *	snapshot, unless \b snap is given: then it reads the same snapshot and
+ *	sees the same DB handles as \b snap, see #mdb_txn_clone().
+ */
+static int __mdb_txn_init(MDB_txn *txn, const MDB_txn *snap)
 {
 	MDB_env *env = txn->mt_env;
 	MDB_reader_LockTableHeader * const reader_table = env->m_reader_table;
@@ -2727,13 +3873,26 @@ static int __mdb_txn_init(MDB_txn *txn)
 				if (r->mr_pid != env->me_pid || r->mr_txnid != (txnid_t)-1)
 					return MDB_BAD_RSLOT;
 			} else {
-				rc = __allocate_reader_slot(env,&r);
+				rc = __allocate_reader_slot(env,&r,1);
 				if(rc!=MDB_SUCCESS) return rc;
 			}
 
-			do /* LY: Retry on a race, ITS#7970. */
+			/* Set before the txnid is published, so that
+			 * #mdb_reader_info() never pairs it with a stale time
+			 */
+			r->mr_since = mdb_now_msec();
+			if (snap) {
+				/* snap's own slot already holds this snapshot. Its meta
+				 * may have been reused since, so copy snap's DB info.
+				 */
+				r->mr_txnid = snap->m_snapshot_id;
+				mdb_reader_new(env, r->mr_txnid);
+				meta = NULL;
+			} else {
+			do { /* LY: Retry on a race, ITS#7970. */
 				r->mr_txnid = reader_table->mti_txnid;
-			while(r->mr_txnid != reader_table->mti_txnid);
+				mdb_reader_new(env, r->mr_txnid);
+			} while(r->mr_txnid != reader_table->mti_txnid);
 
 			if (!r->mr_txnid && (env->me_flags & MDB_RDONLY)) {
 				meta = mdb_env_pick_meta(env);
@@ -2741,8 +3900,10 @@ static int __mdb_txn_init(MDB_txn *txn)
 			} else {
 				meta = env->me_metas[r->mr_txnid & 1];
 			}
+			}
 			txn->m_snapshot_id = r->mr_txnid;
 			txn->mt_u.reader = r;
+			txn->mt_bcache = mdb_bcache_replica(env);
 
 	} else {
 		/* Not yet touching txn == env->me_txn0, it may be active */
@@ -2750,8 +3911,11 @@ static int __mdb_txn_init(MDB_txn *txn)
 			if (rc!=MDB_SUCCESS)
 				return rc;
 		//	txn->m_snapshot_id = reader_table->mti_txnid;
-			meta = mdb_env_pick_meta(env);
-			assert(meta->mm_txnid==reader_table->mti_txnid);
+			meta = mdb_env_pending_meta(env);
+			if (!meta) {
+				meta = mdb_env_pick_meta(env);
+				assert(meta->mm_txnid==reader_table->mti_txnid);
+			}
 			txn->m_snapshot_id = meta->mm_txnid+1;
 #if MDB_DEBUG
 		if (txn->m_snapshot_id == mdb_debug_start)
@@ -2760,25 +3924,33 @@ static int __mdb_txn_init(MDB_txn *txn)
 		txn->mt_child = NULL;
 		txn->mt_loose_pgs = NULL;
 		txn->mt_loose_count = 0;
-		txn->mt_dirty_room = MDB_IDL_UM_MAX;
+		txn->mt_dirty_room = env->me_dirty_limit ? env->me_dirty_limit : UINT_MAX;
 		txn->mt_u.dirty_list = env->me_dirty_list;
 		txn->mt_u.dirty_list[0].mid = 0;
+		txn->mt_dirty_nsorted = 0;
 		txn->m_free_pgs = env->m_free_pgs;
 		txn->m_free_pgs[0] = 0;
 		txn->mt_spill_pgs = NULL;
 		env->me_txn = txn;
 		memcpy(txn->m_dbiseqs, env->m_dbiseqs, env->m_maxdbs * sizeof(unsigned int));
+		memset(txn->mt_ins_hints, 0, env->m_maxdbs * sizeof(MDB_ins_hint));
 
 	}
 
+	txn->txn_flags = flags;
+
+	if (snap) {
+		txn->mt_next_pgno = snap->mt_next_pgno;
+		txn->mt_numdbs = snap->mt_numdbs;
+		memcpy(txn->mt_dbs, snap->mt_dbs, txn->mt_numdbs * sizeof(MDB_db));
+		memcpy(txn->mt_dbflags, snap->mt_dbflags, txn->mt_numdbs);
+	} else {
 	/* Copy the in-built DB info and flags */
 	memcpy(txn->mt_dbs, meta->mm_dbs, CORE_DBS * sizeof(MDB_db));
 
 	/* Moved to here to avoid a data race in read TXNs */
 	txn->mt_next_pgno = meta->mm_last_pg+1;
 
-	txn->txn_flags = flags;
-
 	/* Setup db info */
 	txn->mt_numdbs = env->me_numdbs;
 	for (i=CORE_DBS; i<txn->mt_numdbs; i++) {
@@ -2788,6 +3960,7 @@ static int __mdb_txn_init(MDB_txn *txn)
 	}
 	txn->mt_dbflags[MAIN_DBI] = DB_VALID|DB_USRVALID;
 	txn->mt_dbflags[FREE_DBI] = DB_VALID;
+	}
 
 	if (env->me_flags & MDB_FATAL_ERROR) {
 		DPUTS("environment had fatal error, must shutdown!");
@@ -2808,7 +3981,7 @@ int mdb_txn_renew(MDB_txn *txn)
 	if (!txn || !F_ISSET(txn->txn_flags, MDB_TXN_RDONLY|MDB_TXN_FINISHED))
 		return EINVAL;
 
-	rc = __mdb_txn_init(txn);
+	rc = __mdb_txn_init(txn, NULL);
 	if (rc == MDB_SUCCESS) {
 		DPRINTF(("renew txn %zu %c %p on mdbenv %p, root page %zu",
 			txn->m_snapshot_id, (txn->txn_flags & MDB_TXN_RDONLY) ? 'r' : 'w',
@@ -2817,20 +3990,122 @@ int mdb_txn_renew(MDB_txn *txn)
 	return rc;
 }
 
-int mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
+/** Begin a nested write txn under \b parent. The nested txn works on
+ *	its parent's dirty pages in place and keeps what an abort needs in
+ *	#MDB_txn.%mt_undo, so its commit and abort cost only as much as
+ *	the nested txn itself did, however big the parent is.
+ */
+static int mdb_txn_nest(MDB_txn *parent, unsigned int flags, MDB_txn **ret)
 {
-	assert(!parent);
-
+	MDB_env *env = parent->mt_env;
 	MDB_txn *txn;
 	MDB_ntxn *ntxn;
-	int rc, size, tsize;
+	const int tsize = sizeof(MDB_ntxn);
+	const int size = tsize
+	  + env->m_maxdbs *(
+		sizeof(MDB_db)+
+		sizeof(MDB_cursor *)+
+		sizeof(MDB_ins_hint)+
+		1);
+	unsigned int i;
+	int rc;
+
+	if ((ntxn = calloc(1, size)) == NULL)
+		return ENOMEM;
+	txn = &ntxn->mnt_txn;
+	txn->mt_dbs = (MDB_db *)((char *)txn + tsize);
+	txn->mt_cursors = (MDB_cursor **)(txn->mt_dbs + env->m_maxdbs);
+	txn->mt_ins_hints = (MDB_ins_hint *)(txn->mt_cursors + env->m_maxdbs);
+	txn->mt_dbflags = (unsigned char *)(txn->mt_ins_hints + env->m_maxdbs);
+	txn->mt_dbxs = env->me_dbxs;
+	txn->m_dbiseqs = parent->m_dbiseqs;
+	txn->mt_env = env;
+	/* Savepoints usually dirty few pages */
+	if (!(txn->m_free_pgs = mdb_midl_alloc(256)) ||
+		mdb_dhash_resize(&txn->mt_undo, MDB_DHASH_MIN / 16)) {
+		mdb_midl_free(txn->m_free_pgs);
+		free(txn);
+		return ENOMEM;
+	}
+	txn->txn_flags = flags;
+	txn->m_snapshot_id = parent->m_snapshot_id;
+	txn->mt_next_pgno = parent->mt_next_pgno;
+	txn->mt_u.dirty_list = parent->mt_u.dirty_list;
+	txn->mt_dirty_base = txn->mt_u.dirty_list[0].mid;
+	txn->mt_dirty_nsorted = parent->mt_dirty_nsorted;
+	txn->mt_dirty_room = UINT_MAX;
+	txn->mt_spill_pgs = parent->mt_spill_pgs;
+	txn->mt_bcache = parent->mt_bcache;
+	txn->mt_numdbs = parent->mt_numdbs;
+	memcpy(txn->mt_dbs, parent->mt_dbs, txn->mt_numdbs * sizeof(MDB_db));
+	memcpy(txn->mt_ins_hints, parent->mt_ins_hints, txn->mt_numdbs * sizeof(MDB_ins_hint));
+	/* Copy parent's mt_dbflags, but clear DB_NEW */
+	for (i=0; i<txn->mt_numdbs; i++)
+		txn->mt_dbflags[i] = parent->mt_dbflags[i] & ~DB_NEW;
+	ntxn->mnt_pgstate = env->old_pg_state;	/* see mdb_pgstate_own() */
+	parent->txn_flags |= MDB_TXN_HAS_CHILD;
+	parent->mt_child = txn;
+	txn->mt_parent = parent;
+	rc = mdb_cursor_shadow(parent, txn);
+	if (rc)
+		mdb_txn_end(txn, MDB_END_FAIL_BEGINCHILD|MDB_END_FREE);
+	else
+		*ret = txn;
+	return rc;
+}
+
+int mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **ret)
+{
+	int rc;
 
 	flags &= MDB_TXN_BEGIN_FLAGS;
 
 	if (env->me_flags & MDB_RDONLY & ~flags) /* write txn in RDONLY env */
 		return EACCES;
 
- if (flags & MDB_RDONLY) {
+	if (parent) {
+		/* Nested transactions: Max 1 child, write txns only */
+		flags |= parent->txn_flags;
+		if (flags & (MDB_RDONLY|MDB_TXN_BLOCKED))
+			return (parent->txn_flags & MDB_TXN_RDONLY) ? EINVAL : MDB_BAD_TXN;
+		rc = mdb_txn_nest(parent, flags, ret);
+		MDB_TRACE(("%p, %p, %u = %p", env, parent, flags, rc ? NULL : *ret));
+		return rc;
+	}
+
+	rc = mdb_txn_begin0(env, NULL, flags, ret);
+	MDB_TRACE(("%p, %p, %u = %p", env, parent, flags, rc ? NULL : *ret));
+	return rc;
+}
+
+int mdb_txn_clone(MDB_txn *txn, MDB_txn **ret)
+{
+	int rc;
+
+	if (!txn || !ret || !(txn->txn_flags & MDB_TXN_RDONLY))
+		return EINVAL;
+	if (txn->txn_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	rc = mdb_txn_begin0(txn->mt_env, txn, MDB_RDONLY, ret);
+	MDB_TRACE(("%p = %p", txn, rc ? NULL : *ret));
+	return rc;
+}
+
+/** Allocate or reuse a top-level txn handle and begin it, on the
+ *	snapshot of \b snap if given. See #__mdb_txn_init().
+ */
+static int mdb_txn_begin0(MDB_env *env, const MDB_txn *snap, unsigned int flags, MDB_txn **ret)
+{
+	MDB_txn *txn;
+	int rc;
+
+ if ((flags & MDB_RDONLY) && (env->me_flags & MDB_ENV_TXPOOL) &&
+		(txn = pthread_getspecific(env->me_txpool)) != NULL) {
+		/* This thread's spare read txn, sized and set up already */
+		pthread_setspecific(env->me_txpool, NULL);
+		txn->txn_flags = flags;
+	} else if (flags & MDB_RDONLY) {
 			const int size = sizeof(MDB_txn) + env->m_maxdbs * (sizeof(MDB_db)+1);
 			const int tsize = sizeof(MDB_txn);
 			if ((txn = calloc(1, size)) == NULL) {
@@ -2854,9 +4129,11 @@ int mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **r
 		
 	}
 
-		rc = __mdb_txn_init(txn);
+		rc = __mdb_txn_init(txn, snap);
 	if (rc) {
-		if (txn != env->me_txn0) {
+		if (txn->mt_pooled) {
+			pthread_setspecific(env->me_txpool, txn);
+		} else if (txn != env->me_txn0) {
 			free(txn);
 		}
 	} else {
@@ -2866,7 +4143,6 @@ int mdb_txn_begin(MDB_env *env, MDB_txn *parent, unsigned int flags, MDB_txn **r
 			txn->m_snapshot_id, (flags & MDB_RDONLY) ? 'r' : 'w',
 			 txn->mt_dbs[MAIN_DBI].md_root));
 	}
-	MDB_TRACE(("%p, %p, %u = %p", env, parent, flags, txn));
 
 	return rc;
 }
@@ -2893,6 +4169,8 @@ static void mdb_dbis_update(MDB_txn *txn, int keep)
 	MDB_env *env = txn->mt_env;
 	unsigned char *tdbflags = txn->mt_dbflags;
 
+	if (!(txn->txn_flags & MDB_TXN_DBI_NEW))
+		return;
 	for (i = n; --i >= CORE_DBS;) {
 		if (tdbflags[i] & DB_NEW) {
 			if (keep) {
@@ -2913,6 +4191,96 @@ static void mdb_dbis_update(MDB_txn *txn, int keep)
 		env->me_numdbs = n;
 }
 
+/** Take a pooled read txn off #MDB_env.%me_pooled before freeing it. */
+static void mdb_txn_unpool(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_txn **prev;
+
+	pthread_mutex_lock(&env->me_pool_mutex);
+	for (prev = &env->me_pooled; *prev; prev = &(*prev)->mt_pool_next) {
+		if (*prev == txn) {
+			*prev = txn->mt_pool_next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&env->me_pool_mutex);
+	txn->mt_pooled = 0;
+}
+
+/** Keep an ended read txn as this thread's spare, instead of freeing it.
+ *	The next #mdb_txn_begin(MDB_RDONLY) on this thread then needs no
+ *	allocation. Pooled txns are listed in the env, so that
+ *	#mdb_env_close() can free those of threads that are still alive.
+ * @return 1 if the txn was pooled, 0 if it should be freed.
+ */
+static int mdb_txn_pool_put(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+
+	if (!(txn->txn_flags & MDB_TXN_RDONLY) || !(env->me_flags & MDB_ENV_TXPOOL) ||
+		pthread_getspecific(env->me_txpool) ||
+		pthread_setspecific(env->me_txpool, txn))
+		return 0;
+	if (!txn->mt_pooled) {
+		pthread_mutex_lock(&env->me_pool_mutex);
+		txn->mt_pool_next = env->me_pooled;
+		env->me_pooled = txn;
+		pthread_mutex_unlock(&env->me_pool_mutex);
+		txn->mt_pooled = 1;
+	}
+	return 1;
+}
+
+/** Put back the parent's pages and freestate as they were when the
+ *	nested txn \b txn began.
+ */
+static void mdb_txn_undo(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_ntxn *ntxn = (MDB_ntxn *)txn;
+	MDB_ID2 *dl = txn->mt_u.dirty_list, *h = txn->mt_undo.dh_slots, *dp;
+	MDB_PageHeader *np;
+	unsigned i, n = txn->mt_undo.dh_mask + 1;
+
+	for (i = 0; i < n; i++) {
+		if (!h[i].mid || !(np = h[i].mptr))
+			continue;
+		dp = mdb_dhash_find(&env->me_dirty_hash, h[i].mid);
+		mdb_tassert(txn, dp != NULL);
+		if (IS_OVERFLOW(np))
+			memcpy(dp->mptr, np, np->m_ovf_page_count * env->me_psize);
+		else
+			mdb_page_copy(dp->mptr, np, env->me_psize);
+		mdb_dpage_free(env, np);
+	}
+	/* The pages the txn dirtied first are all after the parent's */
+	for (i = txn->mt_dirty_base; ++i <= dl[0].mid; ) {
+		mdb_dhash_del(&env->me_dirty_hash, dl[i].mid);
+		mdb_dpage_free(env, dl[i].mptr);
+	}
+	dl[0].mid = txn->mt_dirty_base;
+	if (ntxn->mnt_pgcopy) {
+		mdb_midl_free(env->old_pg_state.mf_pghead);
+		mdb_midl_free(env->old_pg_state.mf_runs);
+	}
+	env->old_pg_state = ntxn->mnt_pgstate;
+}
+
+/** Hand the parent of nested txn \b txn back its dirty list */
+static void mdb_txn_unnest(MDB_txn *txn)
+{
+	MDB_txn *parent = txn->mt_parent;
+
+	/* It may have moved while the nested txn grew it */
+	parent->mt_u.dirty_list = txn->mt_u.dirty_list;
+	parent->mt_child = NULL;
+	parent->txn_flags &= ~MDB_TXN_HAS_CHILD;
+	mdb_midl_free(txn->m_free_pgs);
+	free(txn->mt_undo.dh_slots);
+	txn->mt_undo.dh_slots = NULL;
+}
+
 /** End a transaction, except successful commit of a nested transaction.
  * May be called twice for readonly txns: First reset it, then abort.
  * @param[in] txn the transaction handle to end
@@ -2927,6 +4295,13 @@ static void mdb_txn_end(MDB_txn *txn, unsigned mode)
 
 	/* Export or close DBI handles opened in this txn */
 	mdb_dbis_update(txn, mode & MDB_END_UPDATE);
+	if (txn->mt_page_gets) {
+		/* Once per txn, not per lookup: readers don't share a cacheline */
+		MDB_METRIC(env, me_page_gets, txn->mt_page_gets);
+		MDB_METRIC(env, me_page_dirty, txn->mt_page_dirty);
+		MDB_METRIC(env, me_page_spilled, txn->mt_page_spilled);
+		txn->mt_page_gets = txn->mt_page_dirty = txn->mt_page_spilled = 0;
+	}
 
 	DPRINTF(("%s txn %"Yu" %c %p on mdbenv %p, root page %"Yu,
 		names[mode & MDB_END_OPMASK],
@@ -2934,8 +4309,21 @@ static void mdb_txn_end(MDB_txn *txn, unsigned mode)
 		(void *) txn, (void *)env, txn->mt_dbs[MAIN_DBI].md_root));
 
 	if (F_ISSET(txn->txn_flags, MDB_TXN_RDONLY)) {
+		if (txn->mt_stage) {
+			/* Unless committed, the staged ops are discarded */
+			mdb_stage_free(env, txn->mt_stage);
+			txn->mt_stage = NULL;
+		}
+		if (txn->mt_lease) {
+			/* The lease keeps the values we returned */
+			txn->mt_lease->ml_scratch = txn->mt_scratch;
+			txn->mt_scratch = NULL;
+			mdb_lease_release(txn->mt_lease);
+			txn->mt_lease = NULL;
+		}
 		if (txn->mt_u.reader) {
 			txn->mt_u.reader->mr_txnid = (txnid_t)-1;
+			mdb_reader_gone(env, txn->m_snapshot_id);
 			if (!(env->me_flags & MDB_NOTLS)) {
 				txn->mt_u.reader = NULL; /* txn does not own reader */
 			} else if (mode & MDB_END_SLOT) {
@@ -2946,6 +4334,14 @@ static void mdb_txn_end(MDB_txn *txn, unsigned mode)
 		txn->mt_numdbs = 0;		/* prevent further DBI activity */
 		txn->txn_flags |= MDB_TXN_FINISHED;
 
+	} else if (txn->mt_parent) {
+		/* Only aborts end a nested txn here, see mdb_txn_merge() */
+		mdb_cursors_close(txn, 0);
+		mdb_txn_undo(txn);
+		mdb_txn_unnest(txn);
+		txn->mt_numdbs = 0;
+		txn->txn_flags = MDB_TXN_FINISHED;
+
 	} else if (!F_ISSET(txn->txn_flags, MDB_TXN_FINISHED)) {
 		pgno_t *pghead = env->old_pg_state.mf_pghead;
 
@@ -2953,6 +4349,7 @@ static void mdb_txn_end(MDB_txn *txn, unsigned mode)
 			mdb_cursors_close(txn, 0);
 		if (!(env->me_flags & MDB_WRITEMAP)) {
 			mdb_dlist_free(txn);
+			mdb_arena_reset(env);
 		}
 
 		txn->mt_numdbs = 0;
@@ -2964,6 +4361,9 @@ static void mdb_txn_end(MDB_txn *txn, unsigned mode)
 		/* old_pg_state: */
 		env->old_pg_state.mf_pghead = NULL;
 		env->old_pg_state.last_snapshot_id = 0;
+		env->old_pg_state.last_snapshot_seq = 0;
+		env->old_pg_state.last_snapshot_more = 0;
+		env->old_pg_state.mf_runs_ok = 0;
 
 		env->me_txn = NULL;
 		mode = 0;	/* txn == env->me_txn0, do not free() it */
@@ -2976,26 +4376,95 @@ static void mdb_txn_end(MDB_txn *txn, unsigned mode)
 		mdb_midl_free(pghead);
 	}
 
-	if (mode & MDB_END_FREE)
+	if ((mode & MDB_END_FREE) && mdb_txn_pool_put(txn))
+		mode &= ~MDB_END_FREE;
+	mdb_txn_scratch_free(txn, mode & MDB_END_FREE);
+	if (mode & MDB_END_FREE) {
+		if (txn->mt_pooled)
+			mdb_txn_unpool(txn);
 		free(txn);
+	}
 }
 
-void mdb_txn_reset(MDB_txn *txn)
+int mdb_lease_acquire(MDB_txn *txn, MDB_lease **lease)
 {
-	if (txn == NULL)
-		return;
+	MDB_env *env;
+	MDB_lease *ml;
+	int rc;
 
-	/* This call is only valid for read-only txns */
-	if (!(txn->txn_flags & MDB_TXN_RDONLY))
-		return;
+	if (!txn || !lease || !(txn->txn_flags & MDB_TXN_RDONLY))
+		return EINVAL;
+	if (txn->txn_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
 
-	mdb_txn_end(txn, MDB_END_RESET);
+	if ((ml = txn->mt_lease) != NULL) {
+		MDB_XADD(&ml->ml_refs, 1);
+		*lease = ml;
+		return MDB_SUCCESS;
+	}
+	env = txn->mt_env;
+	if ((ml = calloc(1, sizeof(MDB_lease))) == NULL)
+		return ENOMEM;
+	ml->ml_env = env;
+	ml->ml_txnid = txn->m_snapshot_id;
+	if (env->m_reader_table) {
+		/* The txn's own slot pins the snapshot until ours is set */
+		if ((rc = __allocate_reader_slot(env, &ml->ml_reader, 0)) != MDB_SUCCESS) {
+			free(ml);
+			return rc;
+		}
+		ml->ml_reader->mr_since = mdb_now_msec();
+		ml->ml_reader->mr_txnid = ml->ml_txnid;
+		mdb_reader_new(env, ml->ml_txnid);
+	}
+	ml->ml_refs = 2;
+	txn->mt_lease = ml;
+	*lease = ml;
+	MDB_TRACE(("%p, %p", txn, ml));
+	return MDB_SUCCESS;
 }
 
-static void
-_mdb_txn_abort(MDB_txn *txn)
+void mdb_lease_retain(MDB_lease *lease)
 {
-	if (txn == NULL)
+	if (lease)
+		MDB_XADD(&lease->ml_refs, 1);
+}
+
+void mdb_lease_release(MDB_lease *lease)
+{
+	MDB_scratch *ms;
+
+	if (!lease || MDB_XADD(&lease->ml_refs, -1))
+		return;
+	MDB_TRACE(("%p", lease));
+	if (lease->ml_reader) {
+		lease->ml_reader->mr_txnid = (txnid_t)-1;
+		mdb_reader_gone(lease->ml_env, lease->ml_txnid);
+		lease->ml_reader->mr_pid = 0;
+	}
+	while ((ms = lease->ml_scratch) != NULL) {
+		lease->ml_scratch = ms->ms_next;
+		free(ms);
+	}
+	free(lease);
+}
+
+void mdb_txn_reset(MDB_txn *txn)
+{
+	if (txn == NULL)
+		return;
+
+	/* This call is only valid for read-only txns */
+	if (!(txn->txn_flags & MDB_TXN_RDONLY))
+		return;
+
+	mdb_txn_end(txn, MDB_END_RESET);
+}
+
+static void
+_mdb_txn_abort(MDB_txn *txn)
+{
+	if (txn == NULL)
 		return;
 
 	if (txn->mt_child)
@@ -3010,6 +4479,35 @@ void mdb_txn_abort(MDB_txn *txn)
 	_mdb_txn_abort(txn);
 }
 
+/** Build the freeDB record for the \b len page numbers following
+ *	\b pgs[0], range-encoded if that is smaller.
+ * @param[out] rec where to write the record, or NULL to only size it.
+ * @param[in] pgs the word before a descending run of page numbers.
+ *	It is overwritten while encoding and restored.
+ * @param[in] len the number of page numbers.
+ * @return the size of the record in bytes.
+ */
+static size_t mdb_free_record(pgno_t *rec, pgno_t *pgs, pgno_t len)
+{
+	pgno_t save = pgs[0];
+	unsigned nr;
+	size_t size;
+
+	pgs[0] = len;
+	nr = mdb_midl_nranges(pgs);
+	if (nr * 2 < len) {
+		size = (nr * 2 + 1) * sizeof(pgno_t);
+		if (rec)
+			mdb_ridl_encode(rec, pgs);
+	} else {
+		size = MDB_IDL_SIZEOF(pgs);
+		if (rec)
+			memcpy(rec, pgs, size);
+	}
+	pgs[0] = save;
+	return size;
+}
+
 /** Save the freelist as of this transaction to the freeDB.
  * This changes the freelist. Keep trying until it stabilizes.
  *
@@ -3049,6 +4547,8 @@ static int mdb_freelist_save(MDB_txn *txn)
 		unsigned x;
 		if ((rc = mdb_midl_expand(&txn->m_free_pgs, txn->mt_loose_count)) != 0)
 			return rc;
+		if ((rc = mdb_dlist_sort(txn)) != 0)
+			return rc;
 		for (; mp; mp = NEXT_LOOSE_PAGE(mp)) {
 			mdb_midl_xappend(txn->m_free_pgs, mp->mp_pgno);
 			/* must also remove from dirty list */
@@ -3060,6 +4560,7 @@ static int mdb_freelist_save(MDB_txn *txn)
 			} else {
 				x = mdb_mid2l_search(dl, mp->mp_pgno);
 				mdb_tassert(txn, dl[x].mid == mp->mp_pgno);
+				mdb_dhash_del(&env->me_dirty_hash, mp->mp_pgno);
 				mdb_dpage_free(env, mp);
 			}
 			dl[x].mptr = NULL;
@@ -3079,12 +4580,13 @@ static int mdb_freelist_save(MDB_txn *txn)
 				/* all slots freed */
 				dl[0].mid = 0;
 			}
+			txn->mt_dirty_nsorted = dl[0].mid;
 		}
 		txn->mt_loose_pgs = NULL;
 		txn->mt_loose_count = 0;
 	}
 
-	txnid_t	pglast = 0, head_id = 0;
+	txnid_t	pglast = 0, pgseq = 0, head_id = 0, fkey[2];
 	pgno_t	  *mop;
 	/* MDB_RESERVE cancels meminit in ovpage malloc (when no WRITEMAP) */
 	clean_limit = (env->me_flags & (MDB_NOMEMINIT)) ? SSIZE_MAX : maxfree_1pg;
@@ -3098,11 +4600,14 @@ static int mdb_freelist_save(MDB_txn *txn)
 		/* If using records from freeDB which we have not yet
 		 * deleted, delete them and any we reserved for old_pg_state.mf_pghead.
 		 */
-		while (pglast < env->old_pg_state.last_snapshot_id) {
+		while (pglast < env->old_pg_state.last_snapshot_id ||
+			(pglast == env->old_pg_state.last_snapshot_id &&
+			 pgseq < env->old_pg_state.last_snapshot_seq)) {
 			rc = mdb_cursor_first(&mc, &key, NULL);
 			if (rc)
 				return rc;
 			pglast = head_id = *(txnid_t *)key.mv_data;
+			pgseq = FREE_KEY_SEQ(&key);
 			total_room = head_room = 0;
 			mdb_tassert(txn, pglast <= env->old_pg_state.last_snapshot_id);
 			rc = _mdb_cursor_del(&mc, 0/*flags*/);
@@ -3110,7 +4615,9 @@ static int mdb_freelist_save(MDB_txn *txn)
 				return rc;
 		}
 		
-		/* Save the IDL of pages freed by this txn, to a single record */
+		/* Save the IDL of pages freed by this txn, in records of
+		 * at most MDB_FREE_CHUNK pages keyed by {txnid, chunk}
+		 */
 		if (freecnt < txn->m_free_pgs[0]) {
 			if (!freecnt) {
 				/* Make sure last page of freeDB is touched and on freelist */
@@ -3119,28 +4626,43 @@ static int mdb_freelist_save(MDB_txn *txn)
 					return rc;
 			}
 			pgno_t* free_pgs = txn->m_free_pgs;
+			ssize_t chunk, len;
 			/* Write to last page of freeDB */
-			key.mv_size = sizeof(txn->m_snapshot_id); key.mv_data = &txn->m_snapshot_id;
+			fkey[0] = txn->m_snapshot_id;
+			key.mv_data = fkey;
 			do {
 				freecnt = free_pgs[0];
-				data.mv_size = MDB_IDL_SIZEOF(free_pgs);
-				rc = _mdb_cursor_put(&mc, &key, &data, MDB_RESERVE);
-				if (rc)
-					return rc;
-				/* Retry if m_free_pgs[] grew during the Put() */
+				/* Sort first, the record sizes depend on the ranges */
+				mdb_midl_sort(free_pgs);
+				chunk = MDB_FREE_CHUNK ? MDB_FREE_CHUNK : freecnt;
+				for (j = 0; j < freecnt; j += chunk) {
+					fkey[1] = j / chunk;
+					key.mv_size = fkey[1] ? sizeof(fkey) : sizeof(txnid_t);
+					len = freecnt - j < chunk ? freecnt - j : chunk;
+					data.mv_size = mdb_free_record(NULL, free_pgs + j, len);
+					rc = _mdb_cursor_put(&mc, &key, &data, MDB_RESERVE);
+					if (rc)
+						return rc;
+				}
+				/* Retry if m_free_pgs[] grew during the Put()s */
 				free_pgs = txn->m_free_pgs;
 			} while (freecnt < free_pgs[0]);
-			mdb_midl_sort(free_pgs);
-			memcpy(data.mv_data, free_pgs, data.mv_size);
+			/* Later Put()s may have moved earlier reservations */
+			for (j = 0; j < freecnt; j += chunk) {
+				fkey[1] = j / chunk;
+				key.mv_size = fkey[1] ? sizeof(fkey) : sizeof(txnid_t);
+				len = freecnt - j < chunk ? freecnt - j : chunk;
+				rc = mdb_cursor_get(&mc, &key, &data, MDB_SET);
+				if (rc)
+					return rc;
+				mdb_free_record(data.mv_data, free_pgs + j, len);
 				#if (MDB_DEBUG) > 1
 							{
-								unsigned int i = free_pgs[0];
-								DPRINTF(("saved freed page list, snapshot_id:%zu, new root %"Yu" num %u",txn->m_snapshot_id, txn->mt_dbs[FREE_DBI].md_root, i));
-								//for (; i; i--)
-								//	DPRINTF(("IDL %"Yu, free_pgs[i]));
+								DPRINTF(("saved freed page list, snapshot_id:%zu, chunk %zu, new root %"Yu" num %zd",txn->m_snapshot_id, fkey[1], txn->mt_dbs[FREE_DBI].md_root, len));
 								print_data(true,&data);
 							}
 				#endif
+			}
 			continue;
 		}//save freed page list
 
@@ -3202,6 +4724,7 @@ static int mdb_freelist_save(MDB_txn *txn)
 		loose[0] = count;
 		mdb_midl_sort(loose);
 		mdb_midl_xmerge(mop, loose);
+		env->old_pg_state.mf_runs_ok = 0;
 		txn->mt_loose_pgs = NULL;
 		txn->mt_loose_count = 0;
 		free_page_count = mop[0];
@@ -3245,12 +4768,69 @@ static int mdb_freelist_save(MDB_txn *txn)
 	return rc;
 }
 
+/** Free the dirty pages written by a flush, and compact the ones
+ *	it skipped back into the dirty list.
+ * @param[in] txn the transaction that's being committed
+ * @param[in] keep number of initial pages in dirty_list that were kept dirty.
+ */
+static void mdb_page_flush_done(MDB_txn *txn, int keep)
+{
+	MDB_env		*env = txn->mt_env;
+	MDB_ID2*	const dl = txn->mt_u.dirty_list;
+	const int pagecount = dl[0].mid;
+	unsigned int 	j=keep;
+	int i;
+
+		for (i = keep; ++i <= pagecount; ) {
+			MDB_PageHeader	* const dp  = dl[i].mptr;
+			/* This is a page we skipped above */
+			if (!dl[i].mid) {
+				++j;
+				dl[j] = dl[i];
+				dl[j].mid = dp->mp_pgno;
+				continue;
+			}
+			mdb_dhash_del(&env->me_dirty_hash, dl[i].mid);
+			mdb_dpage_free(env, dp);
+		}
+
+	txn->mt_dirty_room += pagecount - j;
+	dl[0].mid = j;
+	txn->mt_dirty_nsorted = j;
+}
+
+/** Reserve data file space ahead of \b txn's last page.
+ *	See #MDB_FALLOC_CHUNK. Errors are not fatal, the writes allocate
+ *	the space themselves then. A filesystem without support for it
+ *	is not asked again.
+ */
+static void mdb_env_prealloc(MDB_txn *txn)
+{
+#if MDB_FALLOC_CHUNK && defined(FALLOC_FL_KEEP_SIZE)
+	MDB_env *env = txn->mt_env;
+	size_t end = (size_t)txn->mt_next_pgno * env->me_psize, start;
+
+	if (end <= env->me_falloc_end)
+		return;
+	start = env->me_falloc_end ? env->me_falloc_end : end;
+	end += 2 * (size_t)MDB_FALLOC_CHUNK - end % MDB_FALLOC_CHUNK;
+	if (end > env->m_map_size)
+		end = env->m_map_size;
+	if (end <= start)
+		return;
+	if (!fallocate(env->me_fd, FALLOC_FL_KEEP_SIZE, start, end - start))
+		env->me_falloc_end = end;
+	else if (ErrCode() == EOPNOTSUPP || ErrCode() == ENOSYS)
+		env->me_falloc_end = (size_t)-1;
+#endif
+}
+
 /** Flush (some) dirty pages to the map, after clearing their dirty flag.
  * @param[in] txn the transaction that's being committed
  * @param[in] keep number of initial pages in dirty_list to keep dirty.
  * @return 0 on success, non-zero on failure.
  */
-static int mdb_page_flush(MDB_txn *txn, int keep)
+static int mdb_page_flush0(MDB_txn *txn, int keep)
 {
 	MDB_env		*env = txn->mt_env;
 	MDB_ID2*	const dl = txn->mt_u.dirty_list;
@@ -3268,6 +4848,7 @@ static int mdb_page_flush(MDB_txn *txn, int keep)
 	int			n = 0;
 	pgno_t		pgno=0;
 	MDB_PageHeader	* dp;
+	mdb_size_t	npages = 0, nbytes = 0;
 
 	 i = keep;
 	/* Write the pages */
@@ -3325,6 +4906,8 @@ static int mdb_page_flush(MDB_txn *txn, int keep)
 												return rc;
 											}
 
+											npages += n;
+											nbytes += wsize;
 											n = 0;
 				}
 				if (i > pagecount)
@@ -3344,49 +4927,482 @@ static int mdb_page_flush(MDB_txn *txn, int keep)
 	}//loop
 
 
-	unsigned int 	j=keep;
+	assert(i > pagecount);
+	MDB_METRIC(env, me_flush_pages, npages);
+	MDB_METRIC(env, me_flush_bytes, nbytes);
+	mdb_page_flush_done(txn, keep);
+	return MDB_SUCCESS;
+}
 
-		for (i = keep; ++i <= pagecount; ) {
-			MDB_PageHeader	* const dp  = dl[i].mptr;
-			/* This is a page we skipped above */
-			if (!dl[i].mid) {
-				++j;
-				dl[j] = dl[i];
-				dl[j].mid = dp->mp_pgno;
-				continue;
+/** Flush dirty pages under the #MDB_MAP_INTERLEAVE memory policy.
+ *	See #mdb_page_flush0().
+ */
+static int mdb_page_flush(MDB_txn *txn, int keep)
+{
+	MDB_numapol np;
+	mdb_size_t t0 = mdb_now_usec();
+	int rc;
+
+	if ((rc = mdb_dlist_sort(txn)))
+		return rc;
+	mdb_env_prealloc(txn);
+	mdb_numa_enter(txn->mt_env, &np);
+	rc = mdb_page_flush0(txn, keep);
+	mdb_numa_leave(&np);
+	MDB_METRIC(txn->mt_env, me_flush_usec, mdb_now_usec() - t0);
+	return rc;
+}
+
+	/** Stamp identifying an #MDB_CHANGELOG file */
+#define MDB_CHG_MAGIC	 0xBEEFC4A6
+	/** The version number of the #MDB_CHANGELOG file format */
+#define MDB_CHG_VERSION	 1
+
+/** Header of an #MDB_CHANGELOG file.
+ *	A record for each txn committed after #mh_base follows it, in
+ *	txnid order. A record is an array of #MDB_ID: the txnid, the
+ *	number of runs of pages the txn wrote, then each run's first
+ *	pgno and its number of pages.
+ */
+typedef struct MDB_chghdr {
+	uint32_t	mh_magic;		/**< #MDB_CHG_MAGIC */
+	uint32_t	mh_version;		/**< #MDB_CHG_VERSION */
+	txnid_t		mh_base;		/**< the txn the log starts after */
+} MDB_chghdr;
+
+	/** Read buffer size of #MDB_chgrd */
+#define MDB_CHGRD_BUF	(1024*1024)
+
+/** Buffered reader for going through a change log once */
+typedef struct MDB_chgrd {
+	HANDLE		cr_fd;		/**< the change log */
+	char		*cr_buf;	/**< #MDB_CHGRD_BUF bytes */
+	size_t		cr_pos;		/**< next unread byte in #cr_buf */
+	size_t		cr_len;		/**< bytes in #cr_buf */
+	mdb_size_t	cr_off;		/**< file offset of the end of #cr_buf */
+	mdb_size_t	cr_size;	/**< file size, nothing is read past it */
+} MDB_chgrd;
+
+	/** File offset of the next unread byte of an #MDB_chgrd */
+#define CHGRD_TELL(cr)	((cr)->cr_off - ((cr)->cr_len - (cr)->cr_pos))
+
+static int ESECT mdb_fsize(HANDLE fd, mdb_size_t *size);
+
+/** Read from a change log.
+ * @param[in] cr the reader
+ * @param[out] dst where to store the bytes
+ * @param[in] len how many bytes to read
+ * @return 0 on success, #MDB_NOTFOUND if the log ends first.
+ */
+static int mdb_chgrd_read(MDB_chgrd *cr, void *dst, size_t len)
+{
+	char *ptr = dst;
+	size_t n;
+	ssize_t rd;
+
+	while (len) {
+		if (cr->cr_pos == cr->cr_len) {
+			n = MDB_CHGRD_BUF;
+			if (n > cr->cr_size - cr->cr_off)
+				n = cr->cr_size - cr->cr_off;
+			if (!n)
+				return MDB_NOTFOUND;
+			rd = pread(cr->cr_fd, cr->cr_buf, n, cr->cr_off);
+			if (rd <= 0) {
+				if (!rd)
+					return MDB_NOTFOUND;
+				if (ErrCode() == EINTR)
+					continue;
+				return ErrCode();
 			}
-			mdb_dpage_free(env, dp);
+			cr->cr_off += rd;
+			cr->cr_pos = 0;
+			cr->cr_len = rd;
+		}
+		n = cr->cr_len - cr->cr_pos;
+		if (n > len)
+			n = len;
+		memcpy(ptr, cr->cr_buf + cr->cr_pos, n);
+		cr->cr_pos += n;
+		ptr += n;
+		len -= n;
+	}
+	return MDB_SUCCESS;
+}
+
+/** Read the next record of a change log.
+ * @param[in] cr the reader
+ * @param[out] rec the txnid and number of runs of the record
+ * @param[in,out] runsp the runs, as pgno and count pairs
+ * @return 0 on success, #MDB_NOTFOUND if the log ends, possibly
+ * in the middle of a record.
+ */
+static int mdb_chgrd_next(MDB_chgrd *cr, MDB_ID *rec, MDB_IDL *runsp)
+{
+	int rc;
+
+	if ((rc = mdb_chgrd_read(cr, rec, 2 * sizeof(MDB_ID))))
+		return rc;
+	/* A torn record may claim anything */
+	if (rec[1] > (cr->cr_size - CHGRD_TELL(cr)) / (2 * sizeof(MDB_ID)))
+		return MDB_NOTFOUND;
+	(*runsp)[0] = 0;
+	if ((rc = mdb_midl_expand(runsp, rec[1] * 2)))
+		return rc;
+	if ((rc = mdb_chgrd_read(cr, *runsp + 1, rec[1] * 2 * sizeof(MDB_ID))))
+		return rc;
+	(*runsp)[0] = rec[1] * 2;
+	return MDB_SUCCESS;
+}
+
+/** Find the end of the change log when a process first commits.
+ *	Records that failed or crashed commits left behind the committed
+ *	ones are cut off. A missing or unusable log is started afresh.
+ * @param[in] txn the write txn about to be logged
+ * @return 0 on success, non-zero on failure.
+ */
+static int ESECT mdb_chglog_open(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	txnid_t last = txn->m_snapshot_id - 1, prev;
+	MDB_chghdr hdr;
+	MDB_chgrd cr = {0};
+	MDB_IDL runs = NULL;
+	MDB_ID rec[2];
+	mdb_size_t end = 0;
+	int rc;
+
+	cr.cr_fd = env->me_chgfd;
+	if ((rc = mdb_fsize(cr.cr_fd, &cr.cr_size)))
+		return rc;
+	if (cr.cr_size >= sizeof(hdr)) {
+		if (!(cr.cr_buf = malloc(MDB_CHGRD_BUF)) ||
+			!(runs = mdb_midl_alloc(MDB_IDL_UM_MAX))) {
+			rc = ENOMEM;
+			goto leave;
 		}
-	
+		if ((rc = mdb_chgrd_read(&cr, &hdr, sizeof(hdr))))
+			goto leave;
+		if (hdr.mh_magic == MDB_CHG_MAGIC && hdr.mh_version == MDB_CHG_VERSION &&
+			hdr.mh_base <= last) {
+			prev = hdr.mh_base;
+			end = sizeof(hdr);
+			while (!(rc = mdb_chgrd_next(&cr, rec, &runs)) &&
+				rec[0] > prev && rec[0] <= last) {
+				prev = rec[0];
+				end = CHGRD_TELL(&cr);
+			}
+			if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND)
+				goto leave;
+			rc = MDB_SUCCESS;
+		}
+	}
+	if (!end) {
+		DPRINTF(("starting change log after txn %"Yu, last));
+		hdr.mh_magic = MDB_CHG_MAGIC;
+		hdr.mh_version = MDB_CHG_VERSION;
+		hdr.mh_base = last;
+		if (pwrite(cr.cr_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			rc = ErrCode();
+			if (!rc)
+				rc = EIO;
+			goto leave;
+		}
+		end = sizeof(hdr);
+	}
+	if (cr.cr_size > end && ftruncate(cr.cr_fd, end))
+		rc = ErrCode();
+	else
+		*env->me_chglen = end;
 
-done:
-	i--;
-	assert(i==pagecount);
-	txn->mt_dirty_room += i - j;
-	dl[0].mid = j;
+leave:
+	free(cr.cr_buf);
+	mdb_midl_free(runs);
+	return rc;
+}
+
+/** Add a run of pages to a change log record.
+ * @param[in,out] recp the record, see #MDB_chghdr
+ * @param[in] pgno the first page of the run
+ * @param[in] n the number of pages
+ * @return 0 on success, ENOMEM on failure.
+ */
+static int mdb_chglog_run(MDB_IDL *recp, pgno_t pgno, pgno_t n)
+{
+	MDB_IDL rec = *recp;
+	int rc;
+
+	/* Extend the previous run if this one continues it */
+	if (rec[0] > 2 && rec[rec[0]-1] + rec[rec[0]] == pgno) {
+		rec[rec[0]] += n;
+		return MDB_SUCCESS;
+	}
+	if (!(rc = mdb_midl_append(recp, pgno)))
+		rc = mdb_midl_append(recp, n);
+	return rc;
+}
+
+/** Log the pages written by a txn being committed, for #MDB_CHANGELOG.
+ *	These are the dirty pages, which must be sorted, and the pages
+ *	spilled earlier. The record only counts once the commit has
+ *	succeeded, until then it stays in #MDB_env.%me_chgpend.
+ * @param[in] txn the txn that's being committed
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_chglog_write(MDB_txn *txn)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_ID2L dl = txn->mt_u.dirty_list;
+	MDB_IDL sl = txn->mt_spill_pgs;
+	MDB_PageHeader *dp;
+	MDB_OFF_T off;
+	char *ptr;
+	size_t len;
+	ssize_t wres;
+	pgno_t pgno;
+	unsigned i;
+	int rc;
+
+	if (!*env->me_chglen && (rc = mdb_chglog_open(txn)))
+		return rc;
+	if (!env->me_chgrec && !(env->me_chgrec = mdb_midl_alloc(MDB_IDL_UM_MAX)))
+		return ENOMEM;
+	env->me_chgrec[0] = 2;
+	env->me_chgrec[1] = txn->m_snapshot_id;
+	for (i=1; i<=dl[0].mid; i++) {
+		dp = dl[i].mptr;
+		if (dp->mp_flags & (P_LOOSE|P_KEEP))
+			continue;
+		if ((rc = mdb_chglog_run(&env->me_chgrec, dl[i].mid,
+			IS_OVERFLOW(dp) ? dp->m_ovf_page_count : 1)))
+			return rc;
+	}
+	if (sl) {
+		for (i=1; i<=sl[0]; i++) {
+			if (sl[i] & 1)	/* deleted slot */
+				continue;
+			pgno = sl[i] >> 1;
+			dp = (MDB_PageHeader *)(env->m_shmem_data_file + pgno * env->me_psize);
+			if ((rc = mdb_chglog_run(&env->me_chgrec, pgno,
+				IS_OVERFLOW(dp) ? dp->m_ovf_page_count : 1)))
+				return rc;
+		}
+	}
+	env->me_chgrec[2] = (env->me_chgrec[0] - 2) / 2;
+
+	ptr = (char *)(env->me_chgrec + 1);
+	len = env->me_chgrec[0] * sizeof(MDB_ID);
+	off = *env->me_chglen;
+	env->me_chgpend = len;
+	while (len) {
+		wres = pwrite(env->me_chgfd, ptr, len, off);
+		if (wres <= 0) {
+			rc = wres ? ErrCode() : EIO;
+			if (rc == EINTR)
+				continue;
+			return rc;
+		}
+		ptr += wres;
+		off += wres;
+		len -= wres;
+	}
+	mdb_midl_shrink(&env->me_chgrec);
 	return MDB_SUCCESS;
 }
 
 static int ESECT mdb_env_share_locks(MDB_env *env, int *excl);
 
-static int _mdb_txn_commit(MDB_txn *txn)
+/** Count the free pages that readers keep from being reused.
+ *
+ * Only the free DB records of txns at or after the oldest reader and
+ * before the last committed txn count; txns at the tail are held back
+ * by the last snapshot no matter what readers do. Counting stops
+ * at #MDB_env.%me_pinlimit.
+ * @param[in] txn a write txn whose free DB is up to date.
+ * @param[out] pinned the number of pinned pages.
+ * @param[out] oldest the txnid of the oldest reader.
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_txn_pinned(MDB_txn *txn, mdb_size_t *pinned, txnid_t *oldest)
+{
+	MDB_cursor mc;
+	MDB_val key, data;
+	txnid_t last = txn->m_snapshot_id - 1, id;
+	mdb_size_t n = 0;
+	int rc;
+
+	*oldest = mdb_find_alive_snapshot_id(txn);
+	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
+	for (rc = mdb_cursor_get(&mc, &key, &data, MDB_LAST);
+		rc == MDB_SUCCESS && n < txn->mt_env->me_pinlimit;
+		rc = mdb_cursor_get(&mc, &key, &data, MDB_PREV)) {
+		id = *(txnid_t *)key.mv_data;
+		if (id < *oldest)
+			break;
+		if (id < last)
+			n += FREE_REC_PAGES((MDB_ID *)data.mv_data);
+	}
+	*pinned = n;
+	return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+}
+
+/** Fold nested txn \b txn into its parent. Only the nested txn's own
+ *	pages are visited: the parent's that it changed are already up to
+ *	date in place, its saved copies are dropped, and the pages it
+ *	dirtied first are already on the parent's dirty list.
+ * @param[out] over how many of those pages the parent had no
+ *	dirty room for. See #mdb_txn_spill().
+ */
+static int mdb_txn_merge(MDB_txn *txn, unsigned int *over)
+{
+	MDB_txn *parent = txn->mt_parent;
+	MDB_env *env = txn->mt_env;
+	MDB_ntxn *ntxn = (MDB_ntxn *)txn;
+	MDB_ID2 *h = txn->mt_undo.dh_slots;
+	MDB_IDL sl = parent->mt_spill_pgs;
+	MDB_PageHeader **lp;
+	unsigned i, x, n = txn->mt_undo.dh_mask + 1, added;
+	unsigned char f;
+	int rc;
+
+	/* Do what may fail first, so that the parent is left as it was */
+	if (parent->mt_parent &&
+		(rc = mdb_dhash_reserve(&parent->mt_undo, txn->mt_undo.dh_count)))
+		return rc;
+	if ((rc = mdb_midl_append_list(&parent->m_free_pgs, txn->m_free_pgs)))
+		return rc;
+
+	for (i = 0; i < n; i++) {
+		if (!h[i].mid)
+			continue;
+		if (parent->mt_parent) {
+			/* Unless the parent saved an older copy, this one is its */
+			if (!mdb_dhash_find(&parent->mt_undo, h[i].mid)) {
+				mdb_dhash_add(&parent->mt_undo, h[i].mid, h[i].mptr);
+				continue;
+			}
+		} else if (!h[i].mptr && sl) {
+			/* A page the parent spilled is dirty again */
+			MDB_ID pn = h[i].mid << 1;
+			x = mdb_midl_search(sl, pn);
+			if (x <= sl[0] && sl[x] == pn) {
+				if (x == sl[0])
+					sl[0]--;
+				else
+					sl[x] |= 1;
+			}
+		}
+		if (h[i].mptr)
+			mdb_dpage_free(env, h[i].mptr);
+	}
+
+	mdb_cursors_close(txn, 1);
+	added = txn->mt_u.dirty_list[0].mid - txn->mt_dirty_base;
+	if (parent->mt_dirty_room > added) {
+		parent->mt_dirty_room -= added;
+		*over = 0;
+	} else {
+		*over = added - parent->mt_dirty_room;
+		parent->mt_dirty_room = 0;
+	}
+	parent->mt_dirty_nsorted = txn->mt_dirty_nsorted;
+	parent->mt_next_pgno = txn->mt_next_pgno;
+	parent->txn_flags = txn->txn_flags;
+	if (txn->mt_loose_pgs) {
+		for (lp = &txn->mt_loose_pgs; *lp; lp = &NEXT_LOOSE_PAGE(*lp)) ;
+		*lp = parent->mt_loose_pgs;
+		parent->mt_loose_pgs = txn->mt_loose_pgs;
+		parent->mt_loose_count += txn->mt_loose_count;
+	}
+	if (ntxn->mnt_pgcopy) {
+		if (parent->mt_parent && !((MDB_ntxn *)parent)->mnt_pgcopy) {
+			/* The state it saved is the one the parent saved too,
+			 * for its own abort. The copy is the parent's now.
+			 */
+			((MDB_ntxn *)parent)->mnt_pgcopy = 1;
+		} else {
+			mdb_midl_free(ntxn->mnt_pgstate.mf_pghead);
+			mdb_midl_free(ntxn->mnt_pgstate.mf_runs);
+		}
+	}
+
+	/* Update parent's DB table */
+	memcpy(parent->mt_dbs, txn->mt_dbs, txn->mt_numdbs * sizeof(MDB_db));
+	memcpy(parent->mt_ins_hints, txn->mt_ins_hints, txn->mt_numdbs * sizeof(MDB_ins_hint));
+	parent->mt_numdbs = txn->mt_numdbs;
+	parent->mt_dbflags[FREE_DBI] = txn->mt_dbflags[FREE_DBI];
+	parent->mt_dbflags[MAIN_DBI] = txn->mt_dbflags[MAIN_DBI];
+	for (i=CORE_DBS; i<txn->mt_numdbs; i++) {
+		/* preserve parent's DB_NEW status */
+		f = parent->mt_dbflags[i] & DB_NEW;
+		parent->mt_dbflags[i] = txn->mt_dbflags[i] | f;
+	}
+
+	parent->mt_page_gets += txn->mt_page_gets;
+	parent->mt_page_dirty += txn->mt_page_dirty;
+	parent->mt_page_spilled += txn->mt_page_spilled;
+	mdb_txn_unnest(txn);
+	mdb_txn_scratch_free(txn, 1);
+	free(txn);
+	return MDB_SUCCESS;
+}
+
+/** Bring \b txn back under its dirty limit after a nested txn merged
+ *	\b over pages more than it had room for. Not every page write
+ *	spills first, those that don't would fail with #MDB_TXN_FULL.
+ */
+static int mdb_txn_spill(MDB_txn *txn, unsigned int over)
+{
+	MDB_cursor mc;
+	int rc;
+
+	/* No op is under way: only tracked cursors' pages must stay */
+	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
+	rc = mdb_page_spill0(&mc, over + txn->mt_env->me_dirty_limit / 8);
+	txn->mt_dirty_room = txn->mt_dirty_room > over ? txn->mt_dirty_room - over : 0;
+	return rc;
+}
+
+/** Commit a transaction.
+ * @param[in] txn the transaction to commit
+ * @param[out] ticket if non-NULL, do a group commit: the data pages are
+ * written but the sync and the meta page are left to #mdb_env_sync_group(),
+ * and the txnid to pass to it is stored here.
+ * @return 0 on success, non-zero on failure.
+ */
+static int _mdb_txn_commit(MDB_txn *txn, mdb_size_t *ticket)
 {
-	int		rc;
+	int		rc, pin_state = 0, pin_fire = 0;
 	unsigned int i, end_mode;
 	MDB_env	*env;
+	mdb_size_t pinned, t0 = 0;
+	txnid_t oldest;
 
 	if (txn == NULL)
 		return EINVAL;
 
+	/* An empty commit is durable once the snapshot it started from is */
+	if (ticket)
+		*ticket = F_ISSET(txn->txn_flags, MDB_TXN_RDONLY) ? txn->m_snapshot_id : txn->m_snapshot_id - 1;
+
 	/* mdb_txn_end() mode for a commit which writes nothing */
 	end_mode = MDB_END_EMPTY_COMMIT|MDB_END_UPDATE|MDB_END_SLOT|MDB_END_FREE;
 
 	env = txn->mt_env;
 
+	if (txn->mt_stage)
+		return mdb_stage_commit(txn, ticket);
+
 	if (F_ISSET(txn->txn_flags, MDB_TXN_RDONLY)) {
 		goto done;
 	}
 
+	if (txn->mt_child) {
+		rc = _mdb_txn_commit(txn->mt_child, NULL);
+		if (rc)
+			goto fail;
+	}
+
 	if (txn->txn_flags & (MDB_TXN_FINISHED|MDB_TXN_ERROR)) {
 		DPUTS("txn has failed/finished, can't commit");
 
@@ -3394,6 +5410,15 @@ static int _mdb_txn_commit(MDB_txn *txn)
 		goto fail;
 	}
 
+	if (txn->mt_parent) {
+		MDB_txn *parent = txn->mt_parent;
+		unsigned int over;
+		if ((rc = mdb_txn_merge(txn, &over)))
+			goto fail;
+		/* txn is gone, a failed spill is left on the parent */
+		return over ? mdb_txn_spill(parent, over) : MDB_SUCCESS;
+	}
+
 	if (txn != env->me_txn) {
 		DPUTS("attempt to commit unknown transaction");
 		rc = EINVAL;
@@ -3405,6 +5430,7 @@ static int _mdb_txn_commit(MDB_txn *txn)
 	if (!txn->mt_u.dirty_list[0].mid &&
 		!(txn->txn_flags & (MDB_TXN_DIRTY|MDB_TXN_SPILLS)))
 		goto done;
+	t0 = mdb_now_usec();
 
 	DPRINTF(("begin committing txn %"Yu" %p on mdbenv %p, main root page %"Yu,txn->m_snapshot_id, (void*)txn, (void*)env, txn->mt_dbs[MAIN_DBI].md_root));
 
@@ -3434,21 +5460,66 @@ static int _mdb_txn_commit(MDB_txn *txn)
 	if (rc)
 		goto fail;
 
+	if (env->me_pinfunc) {
+		if ((rc = mdb_txn_pinned(txn, &pinned, &oldest)))
+			goto fail;
+		pin_state = 1 + (pinned >= env->me_pinlimit);
+	}
+
 	mdb_midl_free(env->old_pg_state.mf_pghead);
 	env->old_pg_state.mf_pghead = NULL;
+	env->old_pg_state.mf_runs_ok = 0;
 	mdb_midl_shrink(&txn->m_free_pgs);
 
-#if (MDB_DEBUG) > 2
-	mdb_audit(txn);
+	if (env->me_chgfd != INVALID_HANDLE_VALUE) {
+		if ((rc = mdb_dlist_sort(txn)) || (rc = mdb_chglog_write(txn)))
+			goto fail;
+#ifdef MDB_USE_IOURING
+		/* The ring only syncs the data file before the meta */
+		if (env->me_ring_ok && !ticket && !F_ISSET(txn->txn_flags, MDB_TXN_NOSYNC) &&
+			MDB_FDATASYNC(env->me_chgfd)) {
+			rc = ErrCode();
+			goto fail;
+		}
+#endif
+	}
+
+#if (MDB_DEBUG) > 2
+	mdb_audit(txn);
 #endif
 
+#ifdef MDB_USE_IOURING
+	if (env->me_ring_ok && !ticket) {
+		mdb_env_prealloc(txn);
+		if ((rc = mdb_txn_flush_uring(txn)))
+			goto fail;
+		goto written;
+	}
+#endif
 	if ((rc = mdb_page_flush(txn, 0)))
 		goto fail;
+	if (ticket) {
+		/* Publish to the next writer only, readers see it after the sync */
+		MDB_meta *pm = &env->m_reader_table->mti_pending[txn->m_snapshot_id & 1];
+		pm->mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
+		pm->mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
+		pm->mm_last_pg = txn->mt_next_pgno - 1;
+		pm->mm_txnid = txn->m_snapshot_id;
+		*ticket = txn->m_snapshot_id;
+		end_mode = MDB_END_COMMITTED|MDB_END_UPDATE;
+		goto done;
+	}
 	if (!F_ISSET(txn->txn_flags, MDB_TXN_NOSYNC) &&
 		(rc = mdb_env_sync0(env, 0, txn->mt_next_pgno)))
 		goto fail;
-	if ((rc = mdb_env_write_meta(txn)))
+	if ((rc = mdb_env_write_prev(env, txn->m_snapshot_id, txn->txn_flags | env->me_flags)) ||
+		(rc = mdb_env_write_meta(txn)))
 		goto fail;
+#ifdef MDB_USE_IOURING
+written:
+#endif
+	/* This meta covers any group commits it was built on */
+	memset(env->m_reader_table->mti_pending, 0, sizeof(env->m_reader_table->mti_pending));
 	end_mode = MDB_END_COMMITTED|MDB_END_UPDATE;
 	if (env->me_flags & MDB_PREVSNAPSHOT) {
 		if (!(env->me_flags & MDB_NOLOCK)) {
@@ -3461,10 +5532,32 @@ static int _mdb_txn_commit(MDB_txn *txn)
 	}
 
 done:
+	*env->me_chglen += env->me_chgpend;
+	env->me_chgpend = 0;
+	if (t0) {
+		mdb_size_t usec = mdb_now_usec() - t0;
+		MDB_METRIC(env, me_commits, 1);
+		MDB_METRIC(env, me_commit_usec, usec);
+		mdb_metric_hist(env->me_metrics->me_commit_hist, usec);
+	}
+	if (pin_state) {
+		/* Fire once per crossing, not on every commit above the limit */
+		pin_fire = pin_state == 2 && !env->me_pinned;
+		env->me_pinned = pin_state == 2;
+	}
 	mdb_txn_end(txn, end_mode);
+	/* Outside the write lock, the callback may well look at readers */
+	if (pin_fire)
+		env->me_pinfunc(env, pinned, oldest, env->me_pinctx);
 	return MDB_SUCCESS;
 
 fail:
+	if (env->me_chgpend) {
+		/* Drop the record of the txn that didn't happen */
+		int r2 = ftruncate(env->me_chgfd, *env->me_chglen);
+		(void)r2;
+		env->me_chgpend = 0;
+	}
 	_mdb_txn_abort(txn);
 	return rc;
 }
@@ -3472,7 +5565,39 @@ fail:
 int mdb_txn_commit(MDB_txn *txn)
 {
 	MDB_TRACE(("%p", txn));
-	return _mdb_txn_commit(txn);
+	return _mdb_txn_commit(txn, NULL);
+}
+
+int mdb_txn_commit_group(MDB_txn *txn, mdb_size_t *ticket)
+{
+	if (!ticket)
+		return EINVAL;
+	MDB_TRACE(("%p", txn));
+	return _mdb_txn_commit(txn, ticket);
+}
+
+int mdb_env_sync_group(MDB_env *env, mdb_size_t ticket)
+{
+	int rc;
+
+	if (!env || !env->m_reader_table || !env->m_shmem_data_file)
+		return EINVAL;
+	if (env->me_flags & MDB_RDONLY)
+		return EACCES;
+	/* Already visible means already durable. Pending metas are set
+	 * before their tickets are handed out, so none means none to sync.
+	 */
+	if (ticket <= env->m_reader_table->mti_txnid ||
+		!mdb_env_pending_meta(env))
+		return MDB_SUCCESS;
+
+	/* Whoever gets the lock first syncs for everyone queued behind it */
+	if ((rc = lock_mutex(env, env->me_wmutex)))
+		return rc;
+	if (ticket > env->m_reader_table->mti_txnid)
+		rc = mdb_env_write_pending(env);
+	pthread_mutex_unlock(env->me_wmutex);
+	return rc;
 }
 
 /** Read the environment parameters of a DB environment before
@@ -3604,36 +5729,64 @@ static int ESECT mdb_env_init_meta(MDB_env *env, MDB_meta *meta)
 	return rc;
 }
 
-/** Update the environment info to commit a transaction.
- * @param[in] txn the transaction that's being committed
- * @return 0 on success, non-zero on failure.
+/** Build the meta page tail that #mdb_env_write_meta0() writes.
+ * @param[in] env the environment handle
+ * @param[in] src the DB roots, last page and txnid to write
+ * @param[out] meta the meta to write, starting at mm_mapsize
+ * @param[out] bak the txnid and last page currently in the target slot
+ * @return the file offset of the mm_mapsize field of the target slot.
  */
-static int mdb_env_write_meta(MDB_txn *txn)
+static MDB_OFF_T mdb_env_meta_prep(MDB_env *env, const MDB_meta *src, MDB_meta *meta, MDB_meta *bak)
 {
-	assert( (txn->txn_flags & MDB_TXN_RDONLY) ==0 );
-
-	int r2;
-	const int toggle = txn->m_snapshot_id & 1;
-
+	const int toggle = src->mm_txnid & 1;
 
-	MDB_env * const env = txn->mt_env;
-	const unsigned flags = txn->txn_flags | env->me_flags;
 	MDB_meta* const mp = env->me_metas[toggle];
 	const MDB_meta * prev_meta = env->me_metas[toggle ^ 1];
-	const mdb_size_t mapsize = prev_meta->mm_mapsize < env->m_map_size ? env->m_map_size : prev_meta->mm_mapsize;
 	/* Persist any increases of mapsize config */
+	const mdb_size_t mapsize = prev_meta->mm_mapsize < env->m_map_size ? env->m_map_size : prev_meta->mm_mapsize;
 
-	MDB_meta	meta, meta_b;
-	meta_b.mm_txnid = mp->mm_txnid;
-	meta_b.mm_last_pg = mp->mm_last_pg;
+	bak->mm_txnid = mp->mm_txnid;
+	bak->mm_last_pg = mp->mm_last_pg;
 
-	meta.mm_mapsize = mapsize;
-	meta.mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
-	meta.mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
-	meta.mm_last_pg = txn->mt_next_pgno - 1;
-	meta.mm_txnid = txn->m_snapshot_id;
+	meta->mm_mapsize = mapsize;
+	meta->mm_dbs[FREE_DBI] = src->mm_dbs[FREE_DBI];
+	meta->mm_dbs[MAIN_DBI] = src->mm_dbs[MAIN_DBI];
+	meta->mm_last_pg = src->mm_last_pg;
+	meta->mm_txnid = src->mm_txnid;
 
-	MDB_OFF_T const off =  (char *)mp - env->m_shmem_data_file + offsetof(MDB_meta, mm_mapsize);
+	return (char *)mp - env->m_shmem_data_file + offsetof(MDB_meta, mm_mapsize);
+}
+
+/** Undo a failed meta page write.
+ *	On a failure, the pagecache still contains the new data.
+ *	Write some old data back, to prevent it from being used.
+ *	Use the non-SYNC fd; we know it will fail anyway.
+ */
+static void mdb_env_meta_fail(MDB_env *env, MDB_meta *meta, const MDB_meta *bak, MDB_OFF_T off)
+{
+	int r2;
+
+	DPUTS("write failed, disk error?");
+	meta->mm_last_pg = bak->mm_last_pg;
+	meta->mm_txnid = bak->mm_txnid;
+
+	r2 = pwrite(env->me_fd, (char *)meta + offsetof(MDB_meta, mm_mapsize),
+		sizeof(MDB_meta) - offsetof(MDB_meta, mm_mapsize), off);
+	(void)r2;	/* Silence warnings. We don't care about pwrite's return value */
+
+	env->me_flags |= MDB_FATAL_ERROR;
+}
+
+/** Write a meta page to the data file, making its snapshot visible.
+ * @param[in] env the environment handle
+ * @param[in] src the DB roots, last page and txnid to write
+ * @param[in] flags txn and env flags deciding whether to sync
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_env_write_meta0(MDB_env *env, const MDB_meta *src, unsigned flags)
+{
+	MDB_meta	meta, meta_b;
+	MDB_OFF_T const off = mdb_env_meta_prep(env, src, &meta, &meta_b);
 	char * const ptr = (char *)&meta +  offsetof(MDB_meta, mm_mapsize);
 	const int len = sizeof(MDB_meta) - offsetof(MDB_meta, mm_mapsize);
 
@@ -3652,22 +5805,10 @@ static int mdb_env_write_meta(MDB_txn *txn)
 			rc=MDB_SUCCESS;
 	}
 	if(rc!=MDB_SUCCESS){
-		DPUTS("write failed, disk error?");
-		/* On a failure, the pagecache still contains the new data.
-		 * Write some old data back, to prevent it from being used.
-		 * Use the non-SYNC fd; we know it will fail anyway.
-		 */
-		meta.mm_last_pg = meta_b.mm_last_pg;
-		meta.mm_txnid = meta_b.mm_txnid;
-
-		r2 = pwrite(env->me_fd, ptr, len, off);
-		(void)r2;	/* Silence warnings. We don't care about pwrite's return value */
-
-		env->me_flags |= MDB_FATAL_ERROR;
+		mdb_env_meta_fail(env, &meta, &meta_b, off);
 		return rc;
 	}
 
-done:
 	/* Memory ordering issues are irrelevant; since the entire writer
 	 * is wrapped by wmutex, all of these changes will become visible
 	 * after the wmutex is unlocked. Since the DB is multi-version,
@@ -3676,15 +5817,273 @@ done:
 	 */
  	//full_memory_barrier();
 //	sleep(5);
-	DPRINTF(("writing meta page %d,root page %zu, meta_tx_id:%zu,%zu",toggle, txn->mt_dbs[MAIN_DBI].md_root, meta.mm_txnid,mp->mm_txnid));
+	DPRINTF(("writing meta page %d,root page %zu, meta_tx_id:%zu",(int)(src->mm_txnid & 1), src->mm_dbs[MAIN_DBI].md_root, meta.mm_txnid));
 
-		assert(meta.mm_txnid == txn->m_snapshot_id);
-		assert(mp->mm_txnid == txn->m_snapshot_id);
+		assert(env->me_metas[src->mm_txnid & 1]->mm_txnid == src->mm_txnid);
 		env->m_reader_table->mti_txnid = meta.mm_txnid;
 
 	return MDB_SUCCESS;
 }
 
+/** Update the environment info to commit a transaction.
+ * @param[in] txn the transaction that's being committed
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_env_write_meta(MDB_txn *txn)
+{
+	assert( (txn->txn_flags & MDB_TXN_RDONLY) ==0 );
+	MDB_meta	meta;
+
+	meta.mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
+	meta.mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
+	meta.mm_last_pg = txn->mt_next_pgno - 1;
+	meta.mm_txnid = txn->m_snapshot_id;
+	return mdb_env_write_meta0(txn->mt_env, &meta, txn->txn_flags | txn->mt_env->me_flags);
+}
+
+#ifdef MDB_USE_IOURING
+/** Wait for all requests in flight on the commit ring.
+ *	Each request carries the number of bytes it must transfer in
+ *	its user_data.
+ * @param[in] env the environment handle
+ * @param[in,out] inflight the number of requests to wait for
+ * @return 0 if they all completed in full, otherwise the first error.
+ */
+static int mdb_uring_reap(MDB_env *env, unsigned *inflight)
+{
+	struct io_uring_cqe *cqe;
+	int rc = MDB_SUCCESS, err;
+
+	while (*inflight) {
+		err = io_uring_wait_cqe(&env->me_ring, &cqe);
+		if (err < 0) {
+			if (err == -EINTR)
+				continue;
+			/* Can't tell what is still in flight, don't use the ring again */
+			env->me_ring_ok = 0;
+			env->me_flags |= MDB_FATAL_ERROR;
+			return -err;
+		}
+		if (!rc) {
+			if (cqe->res < 0) {
+				rc = -cqe->res;
+				DPRINTF(("ring write error: %s", strerror(rc)));
+			} else if ((__u64)cqe->res != cqe->user_data) {
+				rc = EIO;
+				DPUTS("short write, filesystem full?");
+			}
+		}
+		io_uring_cqe_seen(&env->me_ring, cqe);
+		--*inflight;
+	}
+	return rc;
+}
+
+/** Submit whatever is queued on the commit ring and wait for all of it.
+ * @param[in] env the environment handle
+ * @param[in,out] inflight the number of queued requests
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_uring_drain(MDB_env *env, unsigned *inflight)
+{
+	int rc, err;
+
+	do
+		err = io_uring_submit_and_wait(&env->me_ring, *inflight);
+	while (err == -EINTR);
+	rc = mdb_uring_reap(env, inflight);
+	if (err < 0 && !rc)
+		rc = -err;
+	return rc;
+}
+
+/** Queue one run of adjacent pages on the commit ring.
+ *	Two entries are always left free for the sync and the meta page.
+ * @param[in] env the environment handle
+ * @param[in] iov the pages to write
+ * @param[in] n the number of entries in \b iov
+ * @param[in] pos the file offset of the first page
+ * @param[in] size the total size of the pages
+ * @param[in,out] inflight the number of queued requests
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_uring_writev(MDB_env *env, const struct iovec *iov, int n,
+	MDB_OFF_T pos, size_t size, unsigned *inflight)
+{
+	struct io_uring_sqe *sqe;
+	int rc;
+
+	if (*inflight + 2 >= MDB_URING_DEPTH && (rc = mdb_uring_drain(env, inflight)))
+		return rc;
+	sqe = io_uring_get_sqe(&env->me_ring);
+	io_uring_prep_writev(sqe, env->me_fd, iov, n, pos);
+	sqe->user_data = size;
+	++*inflight;
+	return MDB_SUCCESS;
+}
+
+/** Commit the dirty pages and the meta page of a txn through the ring.
+ *	All runs of adjacent dirty pages are queued without waiting, and
+ *	the datasync is drained behind them. Data writes are not linked to
+ *	each other, so that the device can service them in parallel. The
+ *	meta page is only queued once every one of those has completed in
+ *	full, so a failed data write never gets a meta page pointing at it.
+ *	If the meta write itself fails, the old meta is written back like
+ *	in #mdb_env_write_meta0().
+ * @param[in] txn the transaction that's being committed
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_txn_flush_uring(MDB_txn *txn)
+{
+	MDB_env		*env = txn->mt_env;
+	MDB_ID2*	const dl = txn->mt_u.dirty_list;
+	const unsigned	psize = env->me_psize;
+	const unsigned	flags = txn->txn_flags | env->me_flags;
+	const int pagecount = dl[0].mid;
+	const HANDLE mfd = (flags & (MDB_NOSYNC|MDB_NOMETASYNC)) ? env->me_fd : env->me_mfd;
+	const int len = sizeof(MDB_meta) - offsetof(MDB_meta, mm_mapsize);
+	struct io_uring_sqe *sqe;
+	struct iovec *iov;
+	MDB_PageHeader	*dp;
+	MDB_meta	src, meta, meta_b;
+	MDB_OFF_T	pos, wpos = 0, next_pos = 1, off;
+	size_t		size, wsize = 0;
+	mdb_size_t	nbytes = 0;
+	unsigned	inflight = 0;
+	int			i, n = 0, base = 0, rc = MDB_SUCCESS;
+
+	if (!pagecount)
+		iov = NULL;
+	else if ((rc = mdb_dlist_sort(txn)))
+		return rc;
+	else if (!(iov = malloc(pagecount * sizeof(struct iovec))))
+		return ENOMEM;
+
+	for (i = 1; i <= pagecount; i++) {
+		dp = dl[i].mptr;
+		/* Don't flush this page yet */
+		if (dp->mp_flags & (P_LOOSE|P_KEEP)) {
+			dp->mp_flags &= ~P_KEEP;
+			dl[i].mid = 0;
+			continue;
+		}
+		/* clear dirty flag */
+		dp->mp_flags &= ~P_DIRTY;
+		pos = dl[i].mid * psize;
+		size = psize;
+		if (IS_OVERFLOW(dp)) size *= dp->m_ovf_page_count;
+		if (pos != next_pos || n - base == MDB_URING_IOV || wsize + size > MAX_WRITE) {
+			if (n > base && (rc = mdb_uring_writev(env, iov + base, n - base, wpos, wsize, &inflight)))
+				goto fail;
+			base = n;
+			wpos = pos;
+			wsize = 0;
+		}
+		iov[n].iov_len = size;
+		iov[n].iov_base = (char *)dp;
+		n++;
+		next_pos = pos + size;
+		wsize += size;
+		nbytes += size;
+	}
+	if (n > base && (rc = mdb_uring_writev(env, iov + base, n - base, wpos, wsize, &inflight)))
+		goto fail;
+
+	if (!(flags & MDB_NOSYNC)) {
+		sqe = io_uring_get_sqe(&env->me_ring);
+		io_uring_prep_fsync(sqe, env->me_fd, IORING_FSYNC_DATASYNC);
+		sqe->flags |= IOSQE_IO_DRAIN;
+		sqe->user_data = 0;
+		inflight++;
+	}
+	/* Every data write and the sync must have landed before the meta */
+	if ((rc = mdb_uring_drain(env, &inflight)))
+		goto fail;
+	if ((rc = mdb_env_write_prev(env, txn->m_snapshot_id, flags)))
+		goto fail;
+
+	src.mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
+	src.mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
+	src.mm_last_pg = txn->mt_next_pgno - 1;
+	src.mm_txnid = txn->m_snapshot_id;
+	off = mdb_env_meta_prep(env, &src, &meta, &meta_b);
+	sqe = io_uring_get_sqe(&env->me_ring);
+	io_uring_prep_write(sqe, mfd, (char *)&meta + offsetof(MDB_meta, mm_mapsize), len, off);
+	sqe->user_data = len;
+	inflight++;
+
+	if ((rc = mdb_uring_drain(env, &inflight))) {
+		mdb_env_meta_fail(env, &meta, &meta_b, off);
+		free(iov);
+		return rc;
+	}
+
+	DPRINTF(("writing meta page %d,root page %zu, meta_tx_id:%zu",(int)(src.mm_txnid & 1), src.mm_dbs[MAIN_DBI].md_root, meta.mm_txnid));
+	env->m_reader_table->mti_txnid = meta.mm_txnid;
+	/* The sync went down the same ring, its time is in the commit's */
+	MDB_METRIC(env, me_flush_pages, n);
+	MDB_METRIC(env, me_flush_bytes, nbytes);
+	mdb_page_flush_done(txn, 0);
+	free(iov);
+	return MDB_SUCCESS;
+
+fail:
+	/* Nothing refers to these pages yet, just let the writes finish */
+	if (inflight)
+		mdb_uring_drain(env, &inflight);
+	free(iov);
+	return rc;
+}
+#endif
+
+/** Return the newest group commit meta not yet written, or NULL.
+ *	The caller must hold the wmutex, unless it only tests for NULL.
+ */
+static MDB_meta * mdb_env_pending_meta(const MDB_env *env)
+{
+	MDB_meta *pending = env->m_reader_table->mti_pending;
+	MDB_meta *mp = &pending[pending[0].mm_txnid < pending[1].mm_txnid];
+	return mp->mm_txnid ? mp : NULL;
+}
+
+/** Write the pending group commit meta of txn \b txnid-1, if any.
+ *	The caller must hold the wmutex, have synced the data pages, and be
+ *	about to write the meta of \b txnid. That meta goes into the other
+ *	slot, which then only gets overwritten once this one holds a snapshot
+ *	whose pages were never reused, so a crash during the second write
+ *	can still fall back.
+ */
+static int mdb_env_write_prev(MDB_env *env, txnid_t txnid, unsigned flags)
+{
+	MDB_meta *prev = &env->m_reader_table->mti_pending[(txnid & 1) ^ 1];
+
+	if (!prev->mm_txnid || prev->mm_txnid + 1 != txnid)
+		return MDB_SUCCESS;
+	return mdb_env_write_meta0(env, prev, flags);
+}
+
+/** Sync and publish all pending group commits. The caller must hold the wmutex.
+ *	When the two newest pending txns have different parity, the older one
+ *	goes into its meta slot first, see #mdb_env_write_prev().
+ */
+static int mdb_env_write_pending(MDB_env *env)
+{
+	MDB_meta *pending = env->m_reader_table->mti_pending;
+	MDB_meta *mp = mdb_env_pending_meta(env);
+	int rc;
+
+	if (!mp)
+		return MDB_SUCCESS;
+	if ((rc = mdb_env_sync0(env, 1, mp->mm_last_pg+1)))
+		return rc;
+	if ((rc = mdb_env_write_prev(env, mp->mm_txnid, env->me_flags)))
+		return rc;
+	if ((rc = mdb_env_write_meta0(env, mp, env->me_flags)))
+		return rc;
+	memset(pending, 0, NUM_METAS * sizeof(MDB_meta));
+	return MDB_SUCCESS;
+}
+
 /** Check both meta pages to see which one is newer.
  * @param[in] env the environment handle
  * @return newest #MDB_meta.
@@ -3708,8 +6107,12 @@ int ESECT mdb_env_create(MDB_env **env)
 	e->me_fd = INVALID_HANDLE_VALUE;
 	e->me_lfd = INVALID_HANDLE_VALUE;//lock file
 	e->me_mfd = INVALID_HANDLE_VALUE;//data file
+	e->me_chgfd = INVALID_HANDLE_VALUE;
 
 	e->me_pid = getpid();
+	e->me_metrics = &e->me_metrics0;
+	e->me_chglen = &e->me_chglen0;
+	e->me_dirty_limit = MDB_IDL_UM_MAX;
 	GET_PAGESIZE(e->me_os_psize);
 	VGMEMP_CREATE(e,0,0);
 	*env = e;
@@ -3754,6 +6157,10 @@ static int ESECT mdb_env_map(MDB_env *env, void *addr)
 #endif /* MADV_RANDOM */
 
 	}
+#ifdef MADV_HUGEPAGE
+	if (env->me_mapopts & MDB_MAP_HUGEPAGE)
+		(void) madvise(env->m_shmem_data_file, env->m_map_size, MADV_HUGEPAGE);
+#endif
 
 	MDB_PageHeader * const p = (MDB_PageHeader *)env->m_shmem_data_file;
 	env->me_metas[0] = PAGE_DATA(p);
@@ -3822,6 +6229,140 @@ mdb_env_set_maxreaders(MDB_env *env, unsigned int readers)
 	return MDB_SUCCESS;
 }
 
+int ESECT
+mdb_env_set_branch_cache(MDB_env *env, unsigned int slots)
+{
+	unsigned int n;
+
+	if (env->m_shmem_data_file || slots > (1U << 20))
+		return EINVAL;
+	for (n = slots ? 1 : 0; n < slots; n <<= 1) ;
+	env->me_bcache_slots = n;
+	MDB_TRACE(("%p, %u", env, slots));
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_set_dirty_limit(MDB_env *env, unsigned int pages)
+{
+	if (!env || (pages && pages < MDB_DIRTY_LIMIT_MIN))
+		return EINVAL;
+	env->me_dirty_limit = pages;
+	MDB_TRACE(("%p, %u", env, pages));
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_set_mapopts(MDB_env *env, unsigned int opts)
+{
+	if (env->m_shmem_data_file ||
+		(opts & ~(MDB_MAP_HUGEPAGE|MDB_MAP_INTERLEAVE|MDB_MAP_NODECACHE)))
+		return EINVAL;
+	env->me_mapopts = opts;
+	MDB_TRACE(("%p, %u", env, opts));
+	return MDB_SUCCESS;
+}
+
+/** Return the number of NUMA nodes of the host, at least 1 */
+static unsigned int ESECT mdb_numa_nodes(void)
+{
+	unsigned int n = 1;
+#ifdef MDB_NUMA
+	char buf[256], *ptr;
+	FILE *fp;
+
+	/* A list of ranges like "0-3"; the last number is the highest node */
+	if ((fp = fopen("/sys/devices/system/node/possible", "r")) != NULL) {
+		if (fgets(buf, sizeof(buf), fp)) {
+			for (ptr = buf + strlen(buf); ptr > buf && !isdigit((unsigned char)ptr[-1]); ptr--) ;
+			while (ptr > buf && isdigit((unsigned char)ptr[-1]))
+				ptr--;
+			n = atoi(ptr) + 1;
+		}
+		fclose(fp);
+	}
+	if (n > MDB_NUMA_BITS)
+		n = MDB_NUMA_BITS;
+#endif
+	return n;
+}
+
+/** Allocate the branch cache, one replica per node for #MDB_MAP_NODECACHE.
+ *	Each replica starts on a page boundary and prefers its own node.
+ */
+static int ESECT mdb_bcache_alloc(MDB_env *env)
+{
+	const size_t psize = env->me_os_psize;
+	size_t size = env->me_bcache_slots * sizeof(MDB_bcslot);
+	unsigned int n = 1;
+	void *ptr;
+
+	if (env->me_mapopts & MDB_MAP_NODECACHE)
+		n = env->me_numa_nodes;
+	size = (size + psize - 1) & ~(psize - 1);
+	ptr = mmap(NULL, n * size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return ErrCode();
+#ifdef MDB_NUMA
+	if (n > 1) {
+		unsigned int i;
+		unsigned long mask;
+		for (i = 0; i < n; i++) {
+			mask = 1UL << i;
+			(void) syscall(SYS_mbind, (char *)ptr + i * size, size,
+				MDB_MPOL_PREFERRED, &mask, MDB_NUMA_BITS + 1, 0);
+		}
+	}
+#endif
+	env->me_bcache = ptr;
+	env->me_bcache_nodes = n;
+	env->me_bcache_stride = size;
+	return MDB_SUCCESS;
+}
+
+/** Return the branch cache replica for the calling thread, or NULL */
+static MDB_bcslot *mdb_bcache_replica(MDB_env *env)
+{
+#ifdef MDB_NUMA
+	unsigned int cpu, node;
+
+	if (env->me_bcache_nodes > 1 && !syscall(SYS_getcpu, &cpu, &node, NULL))
+		return (MDB_bcslot *)((char *)env->me_bcache +
+			(node % env->me_bcache_nodes) * env->me_bcache_stride);
+#endif
+	return env->me_bcache;
+}
+
+/** Have this thread interleave the pages it allocates over all nodes,
+ *	until #mdb_numa_leave(). This is how #MDB_MAP_INTERLEAVE places the
+ *	page cache pages a commit writes, since shared file maps take no
+ *	mbind() policy.
+ */
+static void mdb_numa_enter(MDB_env *env, MDB_numapol *np)
+{
+	np->np_mode = -1;
+#ifdef MDB_NUMA
+	if ((env->me_mapopts & MDB_MAP_INTERLEAVE) && env->me_numa_nodes > 1) {
+		unsigned long all = env->me_numa_nodes < MDB_NUMA_BITS ?
+			(1UL << env->me_numa_nodes) - 1 : ~0UL;
+		if (syscall(SYS_get_mempolicy, &np->np_mode, &np->np_mask,
+				MDB_NUMA_BITS, NULL, 0UL) ||
+			syscall(SYS_set_mempolicy, MDB_MPOL_INTERLEAVE, &all, MDB_NUMA_BITS + 1))
+			np->np_mode = -1;
+	}
+#endif
+}
+
+/** Restore the memory policy saved by #mdb_numa_enter() */
+static void mdb_numa_leave(MDB_numapol *np)
+{
+#ifdef MDB_NUMA
+	if (np->np_mode >= 0)
+		(void) syscall(SYS_set_mempolicy, np->np_mode,
+			np->np_mode == MDB_MPOL_DEFAULT ? NULL : &np->np_mask, MDB_NUMA_BITS + 1);
+#endif
+}
+
 int ESECT
 mdb_env_get_maxreaders(MDB_env *env, unsigned int *readers)
 {
@@ -3871,13 +6412,14 @@ typedef struct MDB_name {
 	mdb_nchar_t	*mn_val;		/**< Contents */
 } MDB_name;
 
-/** Filename suffixes [datafile,lockfile][without,with MDB_NOSUBDIR] */
-static const mdb_nchar_t *const mdb_suffixes[2][2] = {
+/** Filename suffixes [datafile,lockfile,change log][without,with MDB_NOSUBDIR] */
+static const mdb_nchar_t *const mdb_suffixes[3][2] = {
 	{ MDB_NAME("/data.mdb"), MDB_NAME("")      },
-	{ MDB_NAME("/lock.mdb"), MDB_NAME("-lock") }
+	{ MDB_NAME("/lock.mdb"), MDB_NAME("-lock") },
+	{ MDB_NAME("/changes.mdb"), MDB_NAME("-changes") }
 };
 
-#define MDB_SUFFLEN 9	/**< Max string length in #mdb_suffixes[] */
+#define MDB_SUFFLEN 12	/**< Max string length in #mdb_suffixes[] */
 
 /** Set up filename + scratch area for filename suffix, for opening files.
  * It should be freed with #mdb_fname_destroy().
@@ -3890,7 +6432,8 @@ static const mdb_nchar_t *const mdb_suffixes[2][2] = {
 static int ESECT
 mdb_fname_init(const char *path, unsigned envflags, MDB_name *fname)
 {
-	int no_suffix = F_ISSET(envflags, MDB_NOSUBDIR|MDB_NOLOCK);
+	int no_suffix = F_ISSET(envflags, MDB_NOSUBDIR|MDB_NOLOCK) &&
+		!(envflags & MDB_CHANGELOG);
 	fname->mn_alloced = 0;
 #ifdef _WIN32
 	return utf8_to_utf16(path, fname, no_suffix ? 0 : MDB_SUFFLEN);
@@ -3930,7 +6473,11 @@ enum mdb_fopen_type {
 	 * distinguish otherwise-equal MDB_O_* constants from each other.
 	 */
 	MDB_O_MASK  = O_RDWR|O_CREAT| O_CLOEXEC | O_RDONLY|O_WRONLY | O_DSYNC |O_EXCL,
-	MDB_O_LOCKS = O_RDWR  |O_CREAT|O_CLOEXEC | ((MDB_O_MASK+1) & ~MDB_O_MASK) /**< for me_lfd */
+	MDB_O_LOCKS = O_RDWR  |O_CREAT|O_CLOEXEC | ((MDB_O_MASK+1) & ~MDB_O_MASK), /**< for me_lfd */
+	/** Bit telling the change log types below from the others */
+	MDB_O_CHGBIT = ((MDB_O_MASK|MDB_O_LOCKS)+1) & ~(MDB_O_MASK|MDB_O_LOCKS),
+	MDB_O_CHANGES = O_RDWR|O_CREAT|O_CLOEXEC | MDB_O_CHGBIT, /**< for me_chgfd */
+	MDB_O_CHGREAD = O_RDONLY      |O_CLOEXEC | MDB_O_CHGBIT  /**< for #mdb_env_copyfd_delta() */
 
 };
 
@@ -3953,7 +6500,7 @@ static int ESECT mdb_fopen(const MDB_env *env, MDB_name *fname,	enum mdb_fopen_t
 
 	if (fname->mn_alloced)		/* modifiable copy */
 		mdb_name_cpy(fname->mn_val + fname->mn_len,
-			mdb_suffixes[which==MDB_O_LOCKS][F_ISSET(env->me_flags, MDB_NOSUBDIR)]);
+			mdb_suffixes[(which & MDB_O_CHGBIT) ? 2 : which==MDB_O_LOCKS][F_ISSET(env->me_flags, MDB_NOSUBDIR)]);
 
 	/* The directory must already exist.  Usually the file need not.
 	 * MDB_O_META requires the file because we already created it using
@@ -4119,6 +6666,16 @@ static void mdb_env_reader_dest(void *ptr)
 		reader->mr_pid = 0;
 }
 
+/** Free the spare read txn of an exiting thread, see #mdb_txn_pool_put(). */
+static void mdb_env_txpool_dest(void *ptr)
+{
+	MDB_txn *txn = ptr;
+
+	mdb_txn_unpool(txn);
+	mdb_txn_scratch_free(txn, 1);
+	free(txn);
+}
+
 /** Downgrade the exclusive lock on the region back to shared */
 static int ESECT mdb_env_share_locks(MDB_env *env, int *excl)
 {
@@ -4233,7 +6790,8 @@ static int ESECT mdb_env_setup_locks(MDB_env *env, MDB_name *fname, int mode, in
 		void *m = mmap(NULL, rsize, PROT_READ|PROT_WRITE, MAP_SHARED,env->me_lfd, 0);
 		if (m == MAP_FAILED) goto fail_errno;
 		env->m_reader_table = m;
-
+		env->me_metrics = &env->m_reader_table->mti_metrics;
+		env->me_chglen = &env->m_reader_table->mti_chglen;
 	}
 	if (*excl > 0) {
 	/* MDB_USE_POSIX_MUTEX: */
@@ -4263,6 +6821,18 @@ static int ESECT mdb_env_setup_locks(MDB_env *env, MDB_name *fname, int mode, in
 		env->m_reader_table->mti_format = MDB_LOCK_FORMAT;
 		env->m_reader_table->mti_txnid = 0;
 		env->m_reader_table->mti_numreaders = 0;
+		/* Slots are claimed as soon as they are counted, so they
+		 * can't be reset at that point: clear them all now.
+		 */
+		memset(env->m_reader_table->mti_readers, 0,
+			env->me_maxreaders * sizeof(MDB_reader_entry));
+		env->m_reader_table->mti_oldest = (txnid_t)-1;
+		env->m_reader_table->mti_oldest_gen = 0;
+		env->m_reader_table->mti_readers_gen = 1;
+		/* Group commits that never got synced did not happen */
+		memset(env->m_reader_table->mti_pending, 0, sizeof(env->m_reader_table->mti_pending));
+		memset(&env->m_reader_table->mti_metrics, 0, sizeof(MDB_metrics));
+		env->m_reader_table->mti_chglen = 0;
 
 	} else {
 
@@ -4297,7 +6867,8 @@ fail:
 	 */
 #define	CHANGEABLE	(MDB_NOSYNC|MDB_NOMETASYNC|MDB_MAPASYNC|MDB_NOMEMINIT)
 #define	CHANGELESS	(MDB_FIXEDMAP|MDB_NOSUBDIR|MDB_RDONLY| \
-	MDB_WRITEMAP|MDB_NOTLS|MDB_NOLOCK|MDB_NORDAHEAD|MDB_PREVSNAPSHOT)
+	MDB_WRITEMAP|MDB_NOTLS|MDB_NOLOCK|MDB_NORDAHEAD|MDB_PREVSNAPSHOT| \
+	MDB_CHANGELOG)
 
 #if VALID_FLAGS & PERSISTENT_FLAGS & (CHANGEABLE|CHANGELESS)
 # error "Persistent DB flags & env flags overlap, but both go in mm_flags"
@@ -4327,8 +6898,10 @@ int ESECT mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_m
 		flags &= ~MDB_WRITEMAP;
 	} else {
 		if (!((env->m_free_pgs = mdb_midl_alloc(MDB_IDL_UM_MAX)) &&
-			  (env->me_dirty_list = calloc(MDB_IDL_UM_SIZE, sizeof(MDB_ID2)))))
+			  (env->me_dirty_list = calloc(MDB_IDL_UM_SIZE, sizeof(MDB_ID2)))) ||
+			mdb_dhash_resize(&env->me_dirty_hash, MDB_DHASH_MIN))
 			rc = ENOMEM;
+		env->me_dirty_cap = MDB_IDL_UM_MAX;
 	}
 
 	env->me_flags = flags;
@@ -4339,11 +6912,13 @@ int ESECT mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_m
 	env->me_dbxs = calloc(env->m_maxdbs, sizeof(MDB_dbx));
 	env->me_dbflags = calloc(env->m_maxdbs, sizeof(uint16_t));
 	env->m_dbiseqs = calloc(env->m_maxdbs, sizeof(unsigned int));
-	if (!(env->me_dbxs && env->me_path && env->me_dbflags && env->m_dbiseqs)) {
+	env->me_dbi_busy = calloc(env->m_maxdbs, 1);
+	if (!(env->me_dbxs && env->me_path && env->me_dbflags && env->m_dbiseqs &&
+		env->me_dbi_busy)) {
 		rc = ENOMEM;
 		goto leave;
 	}
-	env->me_dbxs[FREE_DBI].md_cmp = mdb_cmp_long; /* aligned MDB_INTEGERKEY */
+	env->me_dbxs[FREE_DBI].md_cmp = mdb_cmp_free; /* aligned MDB_INTEGERKEY */
 
 	/* For RDONLY, get lockfile after we know datafile exists */
 	if (!(flags & (MDB_RDONLY|MDB_NOLOCK))) {
@@ -4374,6 +6949,13 @@ int ESECT mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_m
 			rc = mdb_fopen(env, &fname, MDB_O_META, mode, &env->me_mfd);
 			if (rc)
 				goto leave;
+			if ((flags & MDB_CHANGELOG) && (rc = mdb_fopen(env, &fname,
+				MDB_O_CHANGES, mode, &env->me_chgfd)))
+				goto leave;
+#ifdef MDB_USE_IOURING
+			/* No ring just means commits take the pwritev() path */
+			env->me_ring_ok = !io_uring_queue_init(MDB_URING_DEPTH, &env->me_ring, 0);
+#endif
 		}
 		DPRINTF(("opened dbenv %p", (void *) env));
 		if (excl > 0 && !(flags & MDB_PREVSNAPSHOT)) {
@@ -4381,6 +6963,22 @@ int ESECT mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_m
 			if (rc)
 				goto leave;
 		}
+		env->me_numa_nodes = (env->me_mapopts & (MDB_MAP_INTERLEAVE|MDB_MAP_NODECACHE)) ?
+			mdb_numa_nodes() : 1;
+		if (env->me_bcache_slots && (rc = mdb_bcache_alloc(env)) != MDB_SUCCESS)
+			goto leave;
+		if (!pthread_mutex_init(&env->me_pool_mutex, NULL)) {
+			if (!pthread_key_create(&env->me_txpool, mdb_env_txpool_dest))
+				env->me_flags |= MDB_ENV_TXPOOL;
+			else
+				pthread_mutex_destroy(&env->me_pool_mutex);
+		}
+		if (!(flags & MDB_RDONLY) && !pthread_mutex_init(&env->me_stage_mutex, NULL)) {
+			if (!pthread_cond_init(&env->me_stage_cond, NULL))
+				env->me_flags |= MDB_ENV_STAGE;
+			else
+				pthread_mutex_destroy(&env->me_stage_mutex);
+		}
 		if (!(flags & MDB_RDONLY)) {
 			MDB_txn *txn;
 			const int tsize = sizeof(MDB_txn);
@@ -4388,6 +6986,7 @@ int ESECT mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_m
 			  + env->m_maxdbs *(
 			  	sizeof(MDB_db)+
 			  	sizeof(MDB_cursor *)+
+			  	sizeof(MDB_ins_hint)+
 			  	sizeof(unsigned int)+
 			  	1);
 			if ((env->one_page_buf = calloc(1, env->me_psize)) &&
@@ -4395,7 +6994,8 @@ int ESECT mdb_env_open(MDB_env *env, const char *path, unsigned int flags, mdb_m
 			{
 				txn->mt_dbs = (MDB_db *)((char *)txn + tsize);
 				txn->mt_cursors = (MDB_cursor **)(txn->mt_dbs + env->m_maxdbs);
-				txn->m_dbiseqs = (unsigned int *)(txn->mt_cursors + env->m_maxdbs);
+				txn->mt_ins_hints = (MDB_ins_hint *)(txn->mt_cursors + env->m_maxdbs);
+				txn->m_dbiseqs = (unsigned int *)(txn->mt_ins_hints + env->m_maxdbs);
 				txn->mt_dbflags = (unsigned char *)(txn->m_dbiseqs + env->m_maxdbs);
 				txn->mt_env = env;
 
@@ -4434,22 +7034,55 @@ static void ESECT mdb_env_close0(MDB_env *env, int excl)
 
 	free(env->one_page_buf);
 	free(env->m_dbiseqs);
+	free(env->me_dbi_busy);
 	free(env->me_dbflags);
 	free(env->me_path);
 	free(env->me_dirty_list);
+	free(env->me_dirty_hash.dh_slots);
+	if (env->me_bcache)
+		munmap(env->me_bcache, env->me_bcache_nodes * env->me_bcache_stride);
+	env->me_bcache = NULL;
 
+	if (env->me_txn0)
+		mdb_txn_scratch_free(env->me_txn0, 1);
 	free(env->me_txn0);
+	free(env->me_pbuf);
 	mdb_midl_free(env->m_free_pgs);
+	mdb_midl_free(env->old_pg_state.mf_runs);
 
 	if (env->me_flags & MDB_EVN_TLS_TX_KEY) {
 		pthread_key_delete(env->me_txkey);
 	}
+	if (env->me_flags & MDB_ENV_TXPOOL) {
+		MDB_txn *txn;
+		/* Spare txns of live threads; no destructor runs after this */
+		pthread_key_delete(env->me_txpool);
+		while ((txn = env->me_pooled) != NULL) {
+			env->me_pooled = txn->mt_pool_next;
+			mdb_txn_scratch_free(txn, 1);
+			free(txn);
+		}
+		pthread_mutex_destroy(&env->me_pool_mutex);
+	}
+	if (env->me_flags & MDB_ENV_STAGE) {
+		pthread_cond_destroy(&env->me_stage_cond);
+		pthread_mutex_destroy(&env->me_stage_mutex);
+	}
 
 	if (env->m_shmem_data_file) {
 		munmap(env->m_shmem_data_file, env->m_map_size);
 	}
+#ifdef MDB_USE_IOURING
+	if (env->me_ring_ok) {
+		io_uring_queue_exit(&env->me_ring);
+		env->me_ring_ok = 0;
+	}
+#endif
 	if (env->me_mfd != INVALID_HANDLE_VALUE)
 		(void) close(env->me_mfd);
+	if (env->me_chgfd != INVALID_HANDLE_VALUE)
+		(void) close(env->me_chgfd);
+	mdb_midl_free(env->me_chgrec);
 
 	if (env->me_fd != INVALID_HANDLE_VALUE)
 		(void) close(env->me_fd);
@@ -4472,23 +7105,20 @@ static void ESECT mdb_env_close0(MDB_env *env, int excl)
 		(void) close(env->me_lfd);
 	}
 
-	env->me_flags &= ~(MDB_ENV_ACTIVE|MDB_EVN_TLS_TX_KEY);
+	env->me_flags &= ~(MDB_ENV_ACTIVE|MDB_EVN_TLS_TX_KEY|MDB_ENV_TXPOOL|MDB_ENV_STAGE);
 }
 
 void ESECT mdb_env_close(MDB_env *env)
 {
-	MDB_PageHeader *dp;
-
 	if (env == NULL)
 		return;
 
 	MDB_TRACE(("%p", env));
+	/* Don't leave group commits unsynced */
+	if (env->m_reader_table && env->m_shmem_data_file && !(env->me_flags & MDB_RDONLY))
+		mdb_env_sync_group(env, (mdb_size_t)-1);
 	VGMEMP_DESTROY(env);
-	while ((dp = env->m_free_mem_pages) != NULL) {
-		VGMEMP_DEFINED(&dp->mp_next, sizeof(dp->mp_next));
-		env->m_free_mem_pages = dp->mp_next;
-		free(dp);
-	}
+	mdb_arena_free(env);
 
 	mdb_env_close0(env, 0);
 	free(env);
@@ -4501,6 +7131,20 @@ static int mdb_cmp_long(const MDB_val *a, const MDB_val *b)
 		*(mdb_size_t *)a->mv_data > *(mdb_size_t *)b->mv_data;
 }
 
+/** Compare two freeDB keys: an aligned txnid, then the chunk number
+ *	if it is not chunk 0. See #MDB_FREE_CHUNK.
+ */
+static int mdb_cmp_free(const MDB_val *a, const MDB_val *b)
+{
+	txnid_t x = *(txnid_t *)a->mv_data, y = *(txnid_t *)b->mv_data;
+
+	if (x == y) {
+		x = FREE_KEY_SEQ(a);
+		y = FREE_KEY_SEQ(b);
+	}
+	return (x < y) ? -1 : x > y;
+}
+
 /** Compare two items pointing at aligned unsigned int's.
  *
  *	This is also set as #MDB_INTEGERDUP|#MDB_DUPFIXED's #MDB_dbx.%md_dcmp,
@@ -4571,6 +7215,35 @@ static int mdb_cmp_memnr(const MDB_val *a, const MDB_val *b)
 	return len_diff<0 ? -1 : len_diff;
 }
 
+/** Load the first 8 bytes of a key as a big-endian integer, zero padded.
+ *	Unsigned comparison of two prefixes orders them the same way
+ *	#mdb_cmp_memn() orders the keys, except that equal prefixes
+ *	say nothing about the remaining bytes.
+ */
+static inline uint64_t mdb_key_prefix(const void *data, size_t len)
+{
+	uint64_t v = 0;
+
+	memcpy(&v, data, len < sizeof(v) ? len : sizeof(v));
+#if BYTE_ORDER == LITTLE_ENDIAN
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+/** Lexical compare with a precomputed prefix of the search key.
+ *	Most probes in a binary search are settled by the first 8 bytes,
+ *	so this avoids the indirect call and the memcmp() for them.
+ */
+static inline int mdb_cmp_memn_prefix(uint64_t apfx, const MDB_val *a, const MDB_val *b)
+{
+	uint64_t bpfx = mdb_key_prefix(b->mv_data, b->mv_size);
+
+	if (apfx != bpfx)
+		return apfx < bpfx ? -1 : 1;
+	return mdb_cmp_memn(a, b);
+}
+
 const char * page_type_tag(uint16_t flags){
 	if(flags& P_LEAF2){
 		return "leaf2";
@@ -4602,6 +7275,8 @@ static MDB_node * mdb_node_search_in_page(MDB_cursor *mc, const MDB_val *key, in
 	MDB_node	*node = NULL;
 	MDB_val	 nodekey;
 	MDB_cmp_func *cmp;
+	uint64_t	 kpfx = 0;
+	int		 use_pfx;
 	DKBUF;
 
 	const unsigned int n = NUMKEYS(mp);
@@ -4622,13 +7297,18 @@ static MDB_node * mdb_node_search_in_page(MDB_cursor *mc, const MDB_val *key, in
 			cmp = mdb_cmp_int;
 	}
 
+	/* Default lexical order: probe on a big-endian key prefix first */
+	use_pfx = (cmp == mdb_cmp_memn);
+	if (use_pfx)
+		kpfx = mdb_key_prefix(key->mv_data, key->mv_size);
+
 	if (IS_LEAF2(mp)) {
 		nodekey.mv_size = mc->mc_db->m_leaf2_element_size;
 		node = get_node_n(mp, 0);	/* fake */
 		while (low <= high) {
 			i = (low + high) >> 1;
 			nodekey.mv_data = get_leaf2_element(mp, i, nodekey.mv_size);
-			rc = cmp(key, &nodekey);
+			rc = use_pfx ? mdb_cmp_memn_prefix(kpfx, key, &nodekey) : cmp(key, &nodekey);
 			DPRINTF(("found leaf_node index %u [%s], rc = %i", i, DKEY(&nodekey), rc));
 			if (rc == 0)
 				break;
@@ -4645,7 +7325,7 @@ static MDB_node * mdb_node_search_in_page(MDB_cursor *mc, const MDB_val *key, in
 			nodekey.mv_size = NODEKSZ(node);
 			nodekey.mv_data = NODEKEY(node);
 
-			rc = cmp(key, &nodekey);
+			rc = use_pfx ? mdb_cmp_memn_prefix(kpfx, key, &nodekey) : cmp(key, &nodekey);
 #if MDB_DEBUG>100
 			if (IS_LEAF(mp))
 				DPRINTF(("leaf_node page checking %u [%s]",i, DKEY(&nodekey)));
@@ -4683,7 +7363,7 @@ static MDB_node * mdb_node_search_in_page(MDB_cursor *mc, const MDB_val *key, in
 }
 
 void print_cursor(MDB_cursor*mc,const char * func_name,int line){
-	#if defined(MDB_DEBUG)
+	#if MDB_DEBUG
 	printf("cursor stack db:%d,%s:%d:\n",mc->mc_dbi,func_name,line);
 	for( int k=mc->mc_top;k>=0;--k){
 		printf(" page %lu:%u:%d",mc->mc_pg[k]->mp_pgno,mc->mc_ki[k], (mc->mc_pg[k]->mp_flags&P_DIRTY)!=0);
@@ -4743,29 +7423,33 @@ static int mdb_page_get(MDB_txn *txn, pgno_t pgno, MDB_PageHeader **ret, int *lv
 	MDB_env * const env = txn->mt_env;
 	int level;
 
+	txn->mt_page_gets++;
 	if (! (txn->txn_flags & (MDB_TXN_RDONLY))) {
 		  level = 1;
 			unsigned x;
+			if (txn->mt_u.dirty_list[0].mid) {
+				MDB_ID2 *dp = mdb_dhash_find(&env->me_dirty_hash, pgno);
+				if (dp) {
+						*ret = dp->mptr;
+						txn->mt_page_dirty++;
+						if (lvl)
+							*lvl = level;
+						return MDB_SUCCESS;
+				}
+			}
 			/* Spilled pages were dirtied in this txn and flushed
 			 * because the dirty list got full. Bring this page
 			 * back in from the map (but don't unspill it here,
 			 * leave that unless page_touch happens again).
+			 * A nested txn may have a dirty copy of a page its
+			 * parent spilled, so look there first.
 			 */
 			if (txn->mt_spill_pgs) {
 				MDB_ID pn = pgno << 1;
 				x = mdb_midl_search(txn->mt_spill_pgs, pn);
 				if (x <= txn->mt_spill_pgs[0] && txn->mt_spill_pgs[x] == pn) {
 						*ret = (MDB_PageHeader *)(env->m_shmem_data_file + env->me_psize * pgno);
-						if (lvl)
-							*lvl = level;
-						return MDB_SUCCESS;
-				}
-			}
-			if (txn->mt_u.dirty_list[0].mid) {
-					MDB_ID2* const dl = txn->mt_u.dirty_list;
-				unsigned x = mdb_mid2l_search(dl, pgno);
-				if (x <= dl[0].mid && dl[x].mid == pgno) {
-						*ret = dl[x].mptr;
+						txn->mt_page_spilled++;
 						if (lvl)
 							*lvl = level;
 						return MDB_SUCCESS;
@@ -4786,6 +7470,87 @@ static int mdb_page_get(MDB_txn *txn, pgno_t pgno, MDB_PageHeader **ret, int *lv
 	return MDB_SUCCESS;
 }
 
+/** Find the child to descend to from branch page \b mp in the branch cache.
+ *	Only valid for #mdb_cmp_memn() order. Most steps of the binary search
+ *	are settled by the cached key prefixes, without touching the page.
+ * @param[in] mc the read-only cursor doing the search.
+ * @param[in] mp the branch page on top of the cursor stack.
+ * @param[in] key the key to search for.
+ * @param[out] child the page number of the child.
+ * @return the index of the child in \b mp, or -1 if the cache does not
+ *	hold \b mp for this snapshot.
+ */
+static int mdb_bcache_search(MDB_cursor *mc, MDB_PageHeader *mp, const MDB_val *key, pgno_t *child)
+{
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_bcslot *bs = &mc->mc_txn->mt_bcache[mp->mp_pgno & (env->me_bcache_slots - 1)];
+	unsigned int seq = bs->bs_seq, n = NUMKEYS(mp);
+	uint64_t kpfx;
+	MDB_val nodekey;
+	MDB_node *node;
+	int low, high, mid, i = 0, rc;
+
+	MDB_MB();
+	if ((seq & 1) || bs->bs_pgno != mp->mp_pgno ||
+		bs->bs_txnid != mc->mc_txn->m_snapshot_id || bs->bs_nkeys != n)
+		return -1;
+	kpfx = mdb_key_prefix(key->mv_data, key->mv_size);
+	/* The last key not above the search key, key 0 being implicit */
+	low = 1;
+	high = n - 1;
+	while (low <= high) {
+		mid = (low + high) >> 1;
+		if (kpfx != bs->bs_pfx[mid]) {
+			rc = kpfx < bs->bs_pfx[mid] ? -1 : 1;
+		} else {
+			node = get_node_n(mp, mid);
+			nodekey.mv_size = NODEKSZ(node);
+			nodekey.mv_data = NODEKEY(node);
+			rc = mdb_cmp_memn(key, &nodekey);
+		}
+		if (rc >= 0) {
+			i = mid;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+	*child = bs->bs_child[i];
+	MDB_MB();
+	if (bs->bs_seq != seq)
+		return -1;
+	return i;
+}
+
+/** Decode branch page \b mp into its branch cache slot.
+ *	Skipped if another reader is filling the slot, or if the slot
+ *	already holds a page for this snapshot or a newer one.
+ */
+static void mdb_bcache_fill(MDB_txn *txn, MDB_PageHeader *mp)
+{
+	MDB_env *env = txn->mt_env;
+	MDB_bcslot *bs = &txn->mt_bcache[mp->mp_pgno & (env->me_bcache_slots - 1)];
+	unsigned int seq = bs->bs_seq, i, n = NUMKEYS(mp);
+	MDB_node *node;
+
+	if ((seq & 1) || n > MDB_BCACHE_KEYS || bs->bs_txnid >= txn->m_snapshot_id)
+		return;
+	if (!MDB_CAS(&bs->bs_seq, seq, seq + 1))
+		return;
+	bs->bs_pfx[0] = 0;
+	bs->bs_child[0] = get_page_no(get_node_n(mp, 0));
+	for (i = 1; i < n; i++) {
+		node = get_node_n(mp, i);
+		bs->bs_pfx[i] = mdb_key_prefix(NODEKEY(node), NODEKSZ(node));
+		bs->bs_child[i] = get_page_no(node);
+	}
+	bs->bs_pgno = mp->mp_pgno;
+	bs->bs_txnid = txn->m_snapshot_id;
+	bs->bs_nkeys = n;
+	MDB_MB();
+	bs->bs_seq = seq + 2;
+}
+
 /** Finish #mdb_relocate_cursor() / #mdb_page_search_lowest().
  *	The cursor is at the root page, set up the rest of it.
  */
@@ -4794,10 +7559,18 @@ static int __mdb_locate_cursor(MDB_cursor *mc, const MDB_val *key, int flags)
 	DKBUF;
 	MDB_PageHeader	*mp = mc->mc_pg[mc->mc_top];
 	int rc;
+	/* Read txns in default key order may use the branch cache. It only
+	 * holds the levels above the leaf parents, which every search visits.
+	 */
+	const int bcache = mc->mc_txn->mt_bcache && key &&
+		(mc->mc_txn->txn_flags & MDB_TXN_RDONLY) &&
+		!(flags & (MDB_PS_FIRST|MDB_PS_LAST)) && mc->mc_dbx->md_cmp == mdb_cmp_memn;
 //	DPRINTF(("key:%s,flags:0x%x",DKEY(key),flags));
 	while (IS_BRANCH(mp)) {
 		MDB_node	*node;
 		indx_t		i;
+		pgno_t		child = P_INVALID;
+		int			upper = bcache && mc->mc_top + 2U < mc->mc_db->md_depth, c;
 
 //		DPRINTF(("branch page %"Yu" has %u keys", mp->mp_pgno, NUMKEYS(mp)));
 		/* Don't assert on branch pages in the FreeDB. We can get here
@@ -4820,9 +7593,13 @@ static int __mdb_locate_cursor(MDB_cursor *mc, const MDB_val *key, int flags)
 					}
 				}
 			}
+		} else if (upper && (c = mdb_bcache_search(mc, mp, key, &child)) >= 0) {
+			i = c;
 		} else {
 			assert(key);
 			int	 exact;
+			if (upper)
+				mdb_bcache_fill(mc->mc_txn, mp);
 			node = mdb_node_search_in_page(mc, key, &exact);
 			if (node == NULL)
 				i = NUMKEYS(mp) - 1;
@@ -4835,8 +7612,9 @@ static int __mdb_locate_cursor(MDB_cursor *mc, const MDB_val *key, int flags)
 			}
 		}
 
-		node = get_node_n(mp,i);//get_node_n(mp, i);
-		if ((rc = mdb_page_get(mc->mc_txn, get_page_no(node), &mp, NULL)) != 0)
+		if (child == P_INVALID)
+			child = get_page_no(get_node_n(mp, i));
+		if ((rc = mdb_page_get(mc->mc_txn, child, &mp, NULL)) != 0)
 			return rc;
 
 		mc->mc_ki[mc->mc_top] = i;
@@ -4990,10 +7768,10 @@ static int mdb_ovpage_free(MDB_cursor *mc, MDB_PageHeader *omp)
 	 * Otherwise put it onto the list of pages we freed in this txn.
 	 *
 	 * Won't create old_pg_state.mf_pghead: old_pg_state.last_snapshot_id must be inited along with it.
-	 * Unsupported in nested txns: They would need to hide the page
-	 * range in ancestor txns' dirty and spilled lists.
+	 * Unsupported in nested txns: They leave their parent's dirty
+	 * and spilled lists alone until they commit.
 	 */
-	if (env->old_pg_state.mf_pghead &&
+	if (!txn->mt_parent && env->old_pg_state.mf_pghead &&
 		((omp->mp_flags & P_DIRTY) ||
 		 (sl && (x = mdb_midl_search(sl, pn)) <= sl[0] && sl[x] == pn)))
 	{
@@ -5027,6 +7805,9 @@ static int mdb_ovpage_free(MDB_cursor *mc, MDB_PageHeader *omp)
 				return MDB_PROBLEM;
 			}
 		}
+		if (x <= txn->mt_dirty_nsorted)
+			txn->mt_dirty_nsorted--;
+		mdb_dhash_del(&env->me_dirty_hash, omp->mp_pgno);
 		txn->mt_dirty_room++;
 	
 		mdb_dpage_free(env, omp);
@@ -5039,6 +7820,8 @@ release:
 		while (j>i)
 			mop[j--] = pg++;
 		mop[0] += ovf_page_count;
+		if (env->old_pg_state.mf_runs_ok)
+			mdb_runs_add_range(&env->old_pg_state, pg - ovf_page_count, ovf_page_count, 0);
 	} else {
 		rc = mdb_midl_append_range(&txn->m_free_pgs, pg, ovf_page_count);
 		if (rc)
@@ -5049,6 +7832,106 @@ release:
 	return 0;
 }
 
+/** Allocate \b size bytes that stay valid until the txn ends or is reset.
+ *	Small requests are carved from #MDB_SCRATCH_SIZE blocks, so repeated
+ *	reads in a reused txn handle need no allocation.
+ */
+static void * mdb_txn_scratch(MDB_txn *txn, size_t size)
+{
+	MDB_scratch *ms = txn->mt_scratch;
+
+	size = (size + sizeof(mdb_size_t) - 1) & -sizeof(mdb_size_t);
+	if (!ms || ms->ms_used + size > ms->ms_size) {
+		size_t bsize = size > MDB_SCRATCH_SIZE ? size : MDB_SCRATCH_SIZE;
+		if (!(ms = malloc(sizeof(MDB_scratch) + bsize)))
+			return NULL;
+		ms->ms_next = txn->mt_scratch;
+		ms->ms_size = bsize;
+		ms->ms_used = 0;
+		txn->mt_scratch = ms;
+	}
+	ms->ms_used += size;
+	return (char *)(ms + 1) + ms->ms_used - size;
+}
+
+/** Release the scratch memory of a txn.
+ * @param[in] txn the transaction handle
+ * @param[in] all also free the one standard-size block normally kept for re-use.
+ */
+static void mdb_txn_scratch_free(MDB_txn *txn, int all)
+{
+	MDB_scratch *ms, *keep = NULL;
+
+	while ((ms = txn->mt_scratch) != NULL) {
+		txn->mt_scratch = ms->ms_next;
+		if (!all && !keep && ms->ms_size == MDB_SCRATCH_SIZE)
+			keep = ms;
+		else
+			free(ms);
+	}
+	if (keep) {
+		keep->ms_next = NULL;
+		keep->ms_used = 0;
+		txn->mt_scratch = keep;
+	}
+}
+
+/** Try to compress a value that is going to overflow pages.
+ *	The result goes to the env's pack buffer, after its compressed size.
+ *	It is only kept if it needs fewer overflow pages than \b data.
+ * @param[in] mc The cursor for this operation.
+ * @param[in] data The value to compress.
+ * @return the number of bytes of me_pbuf to store, or 0 to store \b data as is.
+ */
+static size_t mdb_node_pack(MDB_cursor *mc, const MDB_val *data)
+{
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_dbx *dbx = mc->mc_dbx;
+	const size_t room = (OVPAGES(data->mv_size, env->me_psize) - 1) * env->me_psize - PAGEHDRSZ;
+	mdb_size_t clen;
+
+	if (room <= sizeof(clen))
+		return 0;
+	if (env->me_pbuf_size < room) {
+		void *p = realloc(env->me_pbuf, room);
+		if (!p)
+			return 0;	/* just store it uncompressed */
+		env->me_pbuf = p;
+		env->me_pbuf_size = room;
+	}
+	clen = dbx->md_pack(data, (char *)env->me_pbuf + sizeof(clen), room - sizeof(clen), dbx->md_packctx);
+	if (!clen || clen > room - sizeof(clen))
+		return 0;
+	memcpy(env->me_pbuf, &clen, sizeof(clen));
+	return clen + sizeof(clen);
+}
+
+/** Decompress the overflow data of an #F_COMPRESSED node.
+ * @param[in] mc The cursor for this operation.
+ * @param[in,out] data The original size and the overflow data on input,
+ * the decompressed value in txn scratch memory on output.
+ * @return 0 on success, non-zero on failure.
+ */
+static int mdb_node_unpack(MDB_cursor *mc, MDB_val *data)
+{
+	MDB_dbx *dbx = mc->mc_dbx;
+	MDB_val src;
+	mdb_size_t clen;
+
+	if (!dbx->md_unpack)
+		return MDB_INCOMPATIBLE;
+	memcpy(&clen, data->mv_data, sizeof(clen));
+	src.mv_size = clen;
+	src.mv_data = (char *)data->mv_data + sizeof(clen);
+	if (!(data->mv_data = mdb_txn_scratch(mc->mc_txn, data->mv_size)))
+		return ENOMEM;
+	if (dbx->md_unpack(&src, data, dbx->md_packctx)) {
+		DPUTS("failed to decompress overflow data");
+		return MDB_CORRUPTED;
+	}
+	return MDB_SUCCESS;
+}
+
 /** Return the data associated with a given node.
  * @param[in] mc The cursor for this operation.
  * @param[in] leaf_node The node being read.
@@ -5077,6 +7960,8 @@ static int mdb_node_read(MDB_cursor *mc, MDB_node *leaf_node, MDB_val *data)
 		return rc;
 	}
 	data->mv_data = PAGE_DATA(omp);
+	if (F_ISSET(leaf_node->mn_flags, F_COMPRESSED))
+		return mdb_node_unpack(mc, data);
 
 	return MDB_SUCCESS;
 }
@@ -5085,6 +7970,7 @@ int mdb_get(MDB_txn *txn, MDB_dbi dbi,MDB_val *key, MDB_val *data)
 {
 	MDB_cursor	mc;
 	MDB_xcursor	mx;
+	MDB_sop		*so;
 	int exact = 0, rc;
 	DKBUF;
 
@@ -5096,12 +7982,266 @@ int mdb_get(MDB_txn *txn, MDB_dbi dbi,MDB_val *key, MDB_val *data)
 	if (txn->txn_flags & MDB_TXN_BLOCKED)
 		return MDB_BAD_TXN;
 
+	/* A staged op hides the snapshot */
+	if (txn->mt_stage && (so = mdb_stage_find(txn, dbi, key)) != NULL) {
+		if (so->so_del)
+			return MDB_NOTFOUND;
+		*data = so->so_data;
+		return MDB_SUCCESS;
+	}
+
 	mdb_cursor_init(&mc, txn, dbi, &mx);
 	rc = mdb_locate_cursor_by_op(&mc, key, data, MDB_SET, &exact);
 
 	return rc;
 }
 
+/** Sort the probe order of a #mdb_get_batch() call by key.
+ * Bottom-up merge sort of indices into \b keys, so that the
+ * caller's arrays are left untouched and equal keys keep their order.
+ * @param[in,out] idx n indices into \b keys.
+ * @param[in] tmp scratch space for n indices.
+ */
+static void mdb_batch_sort(size_t *idx, size_t *tmp, size_t n, const MDB_val *keys, MDB_cmp_func *cmp)
+{
+	size_t width, lo, mid, hi, a, b, k;
+	size_t *src = idx, *dst = tmp, *t;
+
+	for (width = 1; width < n; width <<= 1) {
+		for (lo = 0; lo < n; lo += 2*width) {
+			mid = lo + width < n ? lo + width : n;
+			hi = mid + width < n ? mid + width : n;
+			a = lo; b = mid; k = lo;
+			while (a < mid && b < hi)
+				dst[k++] = cmp(&keys[src[b]], &keys[src[a]]) < 0 ? src[b++] : src[a++];
+			while (a < mid)
+				dst[k++] = src[a++];
+			while (b < hi)
+				dst[k++] = src[b++];
+		}
+		t = src; src = dst; dst = t;
+	}
+	if (src != idx)
+		memcpy(idx, src, n * sizeof(*idx));
+}
+
+/** Pop the cursor stack back to the deepest page that may hold \b key.
+ * The cursor must be initialized, and \b key must not sort before
+ * the key it was last positioned on, so only the upper bound of each
+ * subtree has to be checked. That bound is the next separator in the
+ * nearest parent where the cursor is not on the last child.
+ */
+static void mdb_cursor_climb(MDB_cursor *mc, const MDB_val *key)
+{
+	MDB_val sep;
+	int j = mc->mc_top, k;
+
+	while (j > 0) {
+		for (k = j-1; k >= 0; k--)
+			if (mc->mc_ki[k] + 1U < NUMKEYS(mc->mc_pg[k]))
+				break;
+		if (k < 0)
+			break;		/* rightmost path, no upper bound */
+		mdb_node_read_key(get_node_n(mc->mc_pg[k], mc->mc_ki[k] + 1), &sep);
+		if (mc->mc_dbx->md_cmp(key, &sep) < 0)
+			break;
+		j = k;
+	}
+	mc->mc_top = j;
+	mc->mc_snum = j + 1;
+}
+
+int mdb_get_batch(MDB_txn *txn, MDB_dbi dbi, MDB_val *keys, size_t n, MDB_val *vals, int *rcs)
+{
+	MDB_cursor	mc;
+	MDB_xcursor	mx;
+	MDB_PageHeader	*mp;
+	MDB_node	*leaf_node;
+	MDB_cmp_func	*cmp;
+	size_t		*idx, i, m;
+	int exact, sorted = 1, rc = MDB_SUCCESS;
+
+	if (!keys || !vals || !rcs || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	if (txn->txn_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	if (!n)
+		return MDB_SUCCESS;
+
+	if (txn->mt_stage && mdb_stage_dbi(txn, dbi)) {
+		for (i=0; i<n; i++)
+			rcs[i] = mdb_get(txn, dbi, &keys[i], &vals[i]);
+		return MDB_SUCCESS;
+	}
+
+	if ((idx = malloc(2 * n * sizeof(*idx))) == NULL)
+		return ENOMEM;
+
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	cmp = mc.mc_dbx->md_cmp;
+	/* Only valid keys are probed, so only they need to be in order */
+	for (i=0, m=0; i<n; i++) {
+		if (keys[i].mv_size == 0 || keys[i].mv_size > MDB_MAXKEYSIZE) {
+			rcs[i] = MDB_BAD_VALSIZE;
+			continue;
+		}
+		if (m && sorted && cmp(&keys[i], &keys[idx[m-1]]) < 0)
+			sorted = 0;
+		idx[m++] = i;
+	}
+	if (!sorted)
+		mdb_batch_sort(idx, idx + m, m, keys, cmp);
+
+	for (i=0; i<m; i++) {
+		const size_t x = idx[i];
+		MDB_val *key = &keys[x];
+
+		/* Reuse as much of the previous path as still covers this key */
+		if (mc.mc_flags & C_INITIALIZED) {
+			mdb_cursor_climb(&mc, key);
+			rc = __mdb_locate_cursor(&mc, key, 0);
+		} else {
+			rc = mdb_relocate_cursor(&mc, key, 0);
+		}
+		if (rc == MDB_NOTFOUND) {	/* empty tree */
+			rcs[x] = rc;
+			continue;
+		}
+		if (rc)
+			goto fail;
+
+		mp = mc.mc_pg[mc.mc_top];
+		leaf_node = mdb_node_search_in_page(&mc, key, &exact);
+		if (!exact) {
+			rcs[x] = MDB_NOTFOUND;
+		} else if (IS_LEAF2(mp)) {
+			rcs[x] = MDB_SUCCESS;
+		} else if (F_ISSET(leaf_node->mn_flags, F_DUPDATA)) {
+			mdb_xcursor_init1(&mc, leaf_node);
+			rcs[x] = mdb_cursor_first(&mx.mx_cursor, &vals[x], NULL);
+		} else {
+			rcs[x] = mdb_node_read(&mc, leaf_node, &vals[x]);
+		}
+
+		/* Keys are ascending: start loading the right sibling leaf,
+		 * it is the most likely page for the next probe to land on.
+		 */
+		if (i+1 < m && mc.mc_top) {
+			const unsigned int k = mc.mc_top - 1;
+			if (mc.mc_ki[k] + 1U < NUMKEYS(mc.mc_pg[k])) {
+				pgno_t pgno = get_page_no(get_node_n(mc.mc_pg[k], mc.mc_ki[k] + 1));
+				if (pgno < txn->mt_next_pgno)
+					MDB_PREFETCH(txn->mt_env->m_shmem_data_file + txn->mt_env->me_psize * pgno);
+			}
+		}
+	}
+	free(idx);
+	return MDB_SUCCESS;
+
+fail:
+	for (; i<m; i++)
+		rcs[idx[i]] = rc;
+	free(idx);
+	return rc;
+}
+
+/** Tell the OS we will soon read \b count pages from \b pgno. */
+static void mdb_env_willneed(MDB_env *env, pgno_t pgno, pgno_t count)
+{
+	size_t off = pgno * env->me_psize, len = count * env->me_psize, pad;
+
+	if (off >= env->m_map_size)
+		return;
+	if (len > env->m_map_size - off)
+		len = env->m_map_size - off;
+	pad = off & (env->me_os_psize - 1);
+#ifdef MADV_WILLNEED
+	(void) madvise(env->m_shmem_data_file + off - pad, len + pad, MADV_WILLNEED);
+#elif defined(POSIX_MADV_WILLNEED)
+	(void) posix_madvise(env->m_shmem_data_file + off - pad, len + pad, POSIX_MADV_WILLNEED);
+#endif
+}
+
+/** Add \b count pages at \b pgno to the pending range \b ra.
+ *	Adjacent pages are advised together; call with \b count 0 to
+ *	flush the last range.
+ */
+static void mdb_willneed_add(MDB_env *env, MDB_run *ra, pgno_t pgno, pgno_t count)
+{
+	if (ra->ru_count && pgno == ra->ru_pgno + ra->ru_count) {
+		ra->ru_count += count;
+		return;
+	}
+	if (ra->ru_count)
+		mdb_env_willneed(env, ra->ru_pgno, ra->ru_count);
+	ra->ru_pgno = pgno;
+	ra->ru_count = count;
+}
+
+/** Prefetch what a scan will read after moving onto a new leaf.
+ *	That is the overflow pages of the leaf's values, and the next
+ *	#MDB_cursor.%mc_readahead leaves under the parent branch page.
+ *	The window of leaves is only topped up once half of it was read,
+ *	so a scan makes about one madvise() call per half window.
+ * @param[in] mc A cursor with the new leaf on top.
+ * @param[in] move_right Non-zero if the scan goes right.
+ */
+static void mdb_cursor_readahead(MDB_cursor *mc, int move_right)
+{
+	MDB_env		*env = mc->mc_txn->mt_env;
+	MDB_PageHeader	*mp = mc->mc_pg[mc->mc_top];
+	MDB_PageHeader	*parent = mc->mc_pg[mc->mc_top-1];
+	const unsigned	ki = mc->mc_ki[mc->mc_top-1], K = mc->mc_readahead;
+	const int		fresh = parent != mc->mc_ra_pg;
+	int			ahead;
+	MDB_run		ra = {0, 0};
+	MDB_node	*node;
+	unsigned	i, n, from, to;
+	pgno_t		pgno;
+
+	if (!IS_LEAF2(mp)) {
+		n = NUMKEYS(mp);
+		for (i = 0; i < n; i++) {
+			node = get_node_n(mp, i);
+			if (F_ISSET(node->mn_flags, F_BIGDATA)) {
+				/* The node has the unpacked size. The packed one is only
+				 * on the overflow page, so take just the page known to
+				 * be part of the record.
+				 */
+				memcpy(&pgno, get_node_data(node), sizeof(pgno));
+				mdb_willneed_add(env, &ra, pgno, F_ISSET(node->mn_flags, F_COMPRESSED) ? 1 :
+					OVPAGES(get_node_data_size(node), env->me_psize));
+			}
+		}
+	}
+
+	n = NUMKEYS(parent);
+	if (move_right) {
+		ahead = !fresh && mc->mc_ra_ki > ki;
+		if (ahead && (mc->mc_ra_ki - ki) * 2u >= K)
+			goto done;
+		from = ahead ? mc->mc_ra_ki + 1u : ki + 1;
+		to = ki + K < n ? ki + K : n - 1;
+		for (i = from; i <= to; i++)
+			mdb_willneed_add(env, &ra, get_page_no(get_node_n(parent, i)), 1);
+		mc->mc_ra_ki = to;
+	} else {
+		ahead = !fresh && mc->mc_ra_ki < ki;
+		if (ahead && (ki - mc->mc_ra_ki) * 2u >= K)
+			goto done;
+		from = ahead ? mc->mc_ra_ki : ki;
+		to = ki > K ? ki - K : 0;
+		for (i = from; i-- > to; )
+			mdb_willneed_add(env, &ra, get_page_no(get_node_n(parent, i)), 1);
+		mc->mc_ra_ki = to;
+	}
+	mc->mc_ra_pg = parent;
+done:
+	mdb_willneed_add(env, &ra, 0, 0);
+}
+
 /** Find a sibling for a page.
  * Replaces the page at the top of the cursor's stack with the
  * specified sibling, if one exists.
@@ -5149,6 +8289,8 @@ static int mdb_cursor_sibling(MDB_cursor *mc, int move_right)
 	mdb_cursor_push(mc, mp);
 	if (!move_right)
 		mc->mc_ki[mc->mc_top] = NUMKEYS(mp)-1;
+	if (mc->mc_readahead && IS_LEAF(mp))
+		mdb_cursor_readahead(mc, move_right);
 
 	return MDB_SUCCESS;
 }
@@ -5927,8 +9069,9 @@ static int _mdb_cursor_put_simple(MDB_cursor *mc, MDB_val *key, MDB_val *data, u
 			memcpy(&overflow_pg_no, olddata.mv_data, sizeof(pgno_t));
 			if ((rc = mdb_page_get(mc->mc_txn, overflow_pg_no, &omp, &level)) != MDB_SUCCESS)
 				return rc;
-			/* Is the ov page large enough? */
-			if (omp->m_ovf_page_count >= dpages) {
+			/* Is the ov page large enough? Packed values are always rewritten */
+			if (omp->m_ovf_page_count >= dpages &&
+				!(leaf_node->mn_flags & F_COMPRESSED) && !mc->mc_dbx->md_pack) {
 			  if (!(omp->mp_flags & P_DIRTY) && level )
 			  {
 					rc = mdb_page_unspill(mc->mc_txn, omp, &omp);
@@ -5942,6 +9085,8 @@ static int _mdb_cursor_put_simple(MDB_cursor *mc, MDB_val *key, MDB_val *data, u
 						 * bother to try shrinking the page if the new data
 						 * is smaller than the overflow threshold.
 						 */
+						if ((rc = mdb_page_undo(mc->mc_txn, omp)))
+							return rc;
 						set_node_data_size(leaf_node, data->mv_size);
 						if (F_ISSET(flags, MDB_RESERVE))
 							data->mv_data = PAGE_DATA(omp);
@@ -5977,10 +9122,25 @@ static int _mdb_cursor_put_simple(MDB_cursor *mc, MDB_val *key, MDB_val *data, u
 ///insert new 
 	unsigned int nflags = flags & NODE_ADD_FLAGS;
 	const size_t nsize = IS_LEAF2(mp) ? key->mv_size : mdb_leaf_size(env, key, data);
+	MDB_ins_hint *hint = NULL;
+	if (insert_key && !(mc->mc_flags & C_SUB)) {
+		/* Extend or restart the insert run the split heuristic looks at */
+		hint = &mc->mc_txn->mt_ins_hints[mc->mc_dbi];
+		if (hint->mh_pgno != mp->mp_pgno)
+			hint->mh_run = 0;
+		else if (K == hint->mh_ki + 1U)
+			hint->mh_run = hint->mh_run > 0 ? hint->mh_run + (hint->mh_run < SHRT_MAX) : 1;
+		else if (K == hint->mh_ki)
+			hint->mh_run = hint->mh_run < 0 ? hint->mh_run - (hint->mh_run > -SHRT_MAX) : -1;
+		else
+			hint->mh_run = 0;
+	}
 	if (get_page_left_size(mp) < nsize) {
 		if (!insert_key)
 			nflags |= MDB_SPLIT_REPLACE;   /**< newkey is not new */
-			rc = mdb_page_split_insert(mc, key, data, P_INVALID, nflags);
+		rc = mdb_page_split_insert(mc, key, data, P_INVALID, nflags);
+		if (rc == MDB_SUCCESS && insert_key)
+			mc->mc_db->md_entries++;
 	} else {
 		/* There is room already in this leaf_node page. */
 		rc = mdb_insert_node(mc, K, key, data, 0/*gpno*/, nflags);
@@ -6001,6 +9161,10 @@ static int _mdb_cursor_put_simple(MDB_cursor *mc, MDB_val *key, MDB_val *data, u
 			mc->mc_txn->txn_flags |= MDB_TXN_ERROR;
 		}
 	}
+	if (hint && rc == MDB_SUCCESS) {
+		hint->mh_pgno = mc->mc_pg[mc->mc_top]->mp_pgno;
+		hint->mh_ki = mc->mc_ki[mc->mc_top];
+	}
 return rc;
 	
 }
@@ -6024,151 +9188,6 @@ static inline int __new_dup_sub_db(MDB_cursor* mc, MDB_val*key,MDB_val*data, uns
 		}
 	}
 	return rc;
-}
-static inline void __copy_subpage_to_temporary_page(MDB_cursor * mc, MDB_PageHeader *sub_page,MDB_PageHeader*mp){
-		MDB_env * env = mc->mc_txn->mt_env;
-		unsigned int page_flags = sub_page->mp_flags;
- //1 converted sub_page, 2 existing sub page
-		mp->mp_flags = page_flags | P_DIRTY;
-		mp->m_leaf2_element_size   = sub_page->m_leaf2_element_size;
-		mp->mp_lower = sub_page->mp_lower;
-		unsigned int sub_page_size=get_node_data_size(leaf_node);
-		unsigned int old_node_heap_size = sub_page_size - sub_page->mp_upper;
-		mp->mp_upper =env->me_psize - old_node_heap_size;
-		//lower upper offsets  data
-		//lower upper offsets  data
-		if (page_flags & P_LEAF2) {
-			memcpy(PAGE_DATA(mp), PAGE_DATA(sub_page), NUMKEYS(sub_page) * sub_page->m_leaf2_element_size);
-		} else {
-			// lower  upper nnnn
-			memcpy((char *)mp + mp->mp_upper , (char *)sub_page + sub_page->mp_upper, old_node_heap_size);
-			memcpy((char *)mp->offsets, (char *)sub_page->offsets, NUMKEYS(sub_page) * sizeof(mp->offsets[0]));
-			const unsigned offset = env->me_psize-sub_page_size;
-			for (i=0; i<NUMKEYS(sub_page); i++)
-				mp->offsets[i] += offset;
-		}
-}
-static int subpage_to_subdb(MDB_cursor * mc, MDB_PageHeader *sub_page, unsigned int sub_page_size, MDB_db*dummy_db ){
-	int rc=MDB_SUCCESS;
-	MDB_env * env = mc->mc_txn->mt_env;
-	unsigned int page_flags = sub_page->mp_flags;
-	/* Too big for a sub-page, convert to sub-DB */
-	page_flags &= ~P_SUBP;
-
-	if (mc->mc_db->md_flags & MDB_DUPFIXED) {
-		page_flags |= P_LEAF2;
-	}
-
-	MDB_PageHeader * root_page;
-	if ((rc = mdb_page_alloc(mc->mc_txn, DDBI(mc), 1, &root_page)))
-		return rc;
-	//lower upper offsets  data
-	//lower upper offsets  data
-	root_page->mp_flags = page_flags | P_DIRTY;
-	root_page->m_leaf2_element_size   = sub_page->m_leaf2_element_size;
-	root_page->mp_lower = sub_page->mp_lower;
-	unsigned int old_node_heap_size = sub_page_size - sub_page->mp_upper;
-	root_page->mp_upper =env->me_psize - old_node_heap_size;
-	const unsigned int n = get_page_keys_count(sub_page);
-	if (page_flags & P_LEAF2) {
-		memcpy(PAGE_DATA(root_page), PAGE_DATA(sub_page), n * sub_page->m_leaf2_element_size);
-	} else {
-		// lower  upper nnnn
-		memcpy((char *)root_page + root_page->mp_upper , (char *)sub_page + sub_page->mp_upper,old_node_heap_size);
-		memcpy((char *)root_page->offsets, (char *)sub_page->offsets,n * sizeof(mp->offsets[0]));
-		const unsigned offset = env->me_psize-sub_page_size;
-		for (i=0; i<n; i++)
-			root_page->offsets[i] += offset;
-	}
-		
-		if (mc->mc_db->md_flags & MDB_DUPFIXED) {
-			dummy_db.m_leaf2_element_size = sub_page->m_leaf2_element_size;
-			dummy_db.md_flags = MDB_DUPFIXED;
-			if (mc->mc_db->md_flags & MDB_INTEGERDUP)
-				dummy_db.md_flags |= MDB_INTEGERKEY;
-		} else {
-			dummy_db->m_leaf2_element_size = 0;
-			dummy_db->md_flags = 0;
-		}
-		dummy_db->md_depth = 1;
-		dummy_db->md_branch_pages = 0;
-		dummy_db->md_leaf_pages = 1;
-		dummy_db->md_overflow_pages = 0;
-		dummy_db.md_entries = n;
-		dummy_db.md_root = root_page->mp_pgno;
-
-		flags |= F_DUPDATA|F_SUB_DATABASE;
-	
-		sub_root = root_page;
-		return rc;
-}
-
-
-static int node_to_subpage(MDB_cursor*mc, MDB_node* leaf_node, MDB_PageHeader* sub_page){
-	int rc=MDB_SUCCESS;
-	assert((leaf_node->mn_flags&F_BIGDATA)==0);
-
-	/* Back up original data item */
-	dkey.mv_size = 	olddata.mv_size;
-	dkey.mv_data = memcpy(sub_page+1, olddata.mv_data,	olddata.mv_size );
-
-	/* Make sub-page header for the dup items, with dummy_db body */
-	sub_page->mp_flags = P_LEAF|P_DIRTY|P_SUBP;
-	sub_page->mp_lower = PAGEHDRSZ;
-	unsigned int sub_page_size = 0 ;
-	if (mc->mc_db->md_flags & MDB_DUPFIXED) {
-		sub_page->mp_flags |= P_LEAF2;
-		sub_page->m_leaf2_element_size = data->mv_size;
-		sub_page_size = PAGEHDRSZ + get_node_data_size(leaf_node) + data->mv_size + 2 * data->mv_size;	/* leave space for 2 more */
-	} else {
-		sub_page_size = PAGEHDRSZ+ 2*(sizeof(indx_t) + __node_header_size) +get_node_data_size(leaf_node) + data->mv_size+ (get_node_data_size(leaf_node) & 1) + (data->mv_size & 1);
-	}
-	sub_page->mp_upper 	  = sub_page_size;
-	return rc;
-}
-
-static int write_sub_db(MDB_cursor*mc,unsigned int flags,MDB_val * data,bool insert_key){
-	int rc=MDB_SUCCESS;
-	MDB_val zero_data; zero_data.mv_size=0; zero_data.mv_data="";
-	//refresh the node pointer..
-	MDB_node * const leaf_node = get_node_n(mc->mc_pg[mc->mc_top], mc->mc_ki[mc->mc_top]);
-	unsigned xflags;
-	if ((flags & MDB_CURRENT) == MDB_CURRENT) {
-		xflags = MDB_CURRENT|MDB_NOSPILL;
-	} else {
-		mdb_xcursor_init1(mc, leaf_node);
-		xflags = (flags & MDB_NODUPDATA) ? MDB_NOOVERWRITE|MDB_NOSPILL : MDB_NOSPILL;
-	}
-	assert(leaf_node->mn_flags&F_SUB_DATABASE);
-
-	ecount = mc->mc_xcursor->mx_db.md_entries;
-	rc = _mdb_cursor_put(&mc->mc_xcursor->mx_cursor, data, &zero_data, xflags);
-
-	void *db = get_node_data(leaf_node);
-	memcpy(db, &mc->mc_xcursor->mx_db, sizeof(MDB_db));
-
-	const bool insert_data = mc->mc_xcursor->mx_db.md_entries - ecount;
-			/* Increment count unless we just replaced an existing item. */
-	if (insert_data)
-		mc->mc_db->md_entries++;
-	if (insert_key) {
-		/* Invalidate txn if we created an empty sub-DB */
-		if (rc!=MDB_SUCCESS){
-				if (rc == MDB_KEYEXIST)	/* should not happen, we deleted that item */
-							rc = MDB_PROBLEM;
-				mc->mc_txn->txn_flags |= MDB_TXN_ERROR;
-				return rc;
-		}else{
-				/* If we succeeded and the key didn't exist before,
-				 * make sure the cursor is marked valid.
-				 */
-			mc->mc_flags |= C_INITIALIZED;
-			print_cursor(mc,__FUNCTION__,__LINE__);
-		}
-	}
-	
-return rc;
-
 }
 /*
 new key: subpage or sub_db
@@ -6201,9 +9220,11 @@ static int _mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data, unsigned
 		return MDB_BAD_VALSIZE;
 
 	DPRINTF(("==> put db %d key [%s], size %zu, data size %zu, flags:0x%x",DDBI(mc), DKEY(key), key ? key->mv_size : 0, data->mv_size, flags));
+#if MDB_DEBUG
 	if(mc->mc_dbi==FREE_DBI && (flags&MDB_RESERVE)==0 ){
 		print_data(true,data);
 	}
+#endif
 
 	bool insert_key;
 	if (flags & MDB_CURRENT) {
@@ -6344,118 +9365,129 @@ static int _mdb_cursor_put(MDB_cursor *mc, MDB_val *key, MDB_val *data, unsigned
 		olddata.mv_size = get_node_data_size(leaf_node);
 		olddata.mv_data = get_node_data(leaf_node);
 
-		/* DB has dups? */
+		/* DB has dups */
 		{
 			/* Prepare (sub-)page/sub-DB to accept the new item,
 			 * if needed.  sub_page: old sub-page or a header faking
 			 * it.  mp: new (sub-)page.  offset: growth in page
 			 * size.  xdata: node data with new page or DB.
 			 */
+			unsigned int i, offset = 0;
 			mp = sub_page = xdata.mv_data = env->one_page_buf;
 			mp->mp_pgno = mc->mc_pg[mc->mc_top]->mp_pgno;
 
-		
-			 if (leaf_node->mn_flags & F_SUB_DATABASE) {
-				/* Data is on sub-DB, just store it */
-				flags |= F_DUPDATA|F_SUB_DATABASE;
-				return write_sub_db(mc,flags,data,insert_key);
-			} else if (!F_ISSET(leaf_node->mn_flags, F_DUPDATA)) {	/* Was a single item before, must convert now */
+			if (!F_ISSET(leaf_node->mn_flags, F_DUPDATA)) {
+				/* Was a single item before, must convert now */
+				MDB_cmp_func *dcmp = mc->mc_dbx->md_dcmp;
 				/* Just overwrite the current item */
 				if (flags == MDB_CURRENT)
 					goto current;
-
-				assert((leaf_node->mn_flags&F_BIGDATA)==0);
-				MDB_cmp_func * const dcmp = mc->mc_dbx->md_dcmp; assert(dcmp==mdb_cmp_long);
+				if (NEED_CMP_CLONG(dcmp, olddata.mv_size))
+					dcmp = mdb_cmp_clong;
 				/* does data match? */
 				if (!dcmp(data, &olddata)) {
-					if (flags & (MDB_NODUPDATA))
+					if (flags & MDB_NODUPDATA)
 						return MDB_KEYEXIST;
 					/* overwrite it */
 					goto current;
 				}
-				sub_page =  env->one_page_buf;
-				sub_page->mp_pgno = mc->mc_pg[mc->mc_top]->mp_pgno;
-				/* Back up original data item */
-				dkey.mv_size = 	olddata.mv_size;
-				dkey.mv_data = memcpy(sub_page+1, olddata.mv_data,	olddata.mv_size );
-				rc =node_to_subpage(mc,leaf_node,sub_page);
-				const unsigned int sub_page_size = sub_page->mp_upper;
-				if(rc!=MDB_SUCCESS) return rc;
-				if (__node_header_size + NODEKSZ(leaf_node) + sub_page_size > env->me_nodemax) {
-						/* Too big for a sub-page, convert to sub-DB */
-						rc = subpage_to_subdb(mc,sub_page,sub_page_size,&dummy_db);
-						if(rc!=MDB_SUCCESS) return rc;
-						sub_root = sub_page;
-					}
 
-				rdata = &xdata;
-				flags |= F_DUPDATA;
-				do_sub = 1;
-				__mdb_node_del(mc, 0);
-				MDB_val sub_page_data; sub_page_data.mv_size=sub_page_size;sub_page_data.mv_data=sub_page;
-				rc = __new_dup_sub_db(mc,key,&sub_page_data,flags,false);
-				if(rc!=MDB_SUCCESS){
-						mc->mc_txn->txn_flags |= MDB_TXN_ERROR;
-						return rc;
+				/* Back up original data item */
+				dkey.mv_size = olddata.mv_size;
+				dkey.mv_data = memcpy(sub_page+1, olddata.mv_data, olddata.mv_size);
+
+				/* Make sub-page header for the dup items, with dummy body */
+				sub_page->mp_flags = P_LEAF|P_DIRTY|P_SUBP;
+				sub_page->mp_lower = PAGEHDRSZ-PAGEBASE;
+				xdata.mv_size = PAGEHDRSZ + dkey.mv_size + data->mv_size;
+				if (mc->mc_db->md_flags & MDB_DUPFIXED) {
+					sub_page->mp_flags |= P_LEAF2;
+					sub_page->m_leaf2_element_size = data->mv_size;
+					xdata.mv_size += 2 * data->mv_size;	/* leave space for 2 more */
+				} else {
+					xdata.mv_size += 2 * (sizeof(indx_t) + __node_header_size) +
+						(dkey.mv_size & 1) + (data->mv_size & 1);
 				}
+				sub_page->mp_upper = xdata.mv_size - PAGEBASE;
+				olddata.mv_size = xdata.mv_size; /* pretend olddata is sub_page */
+			} else if (leaf_node->mn_flags & F_SUB_DATABASE) {
+				/* Data is on sub-DB, just store it */
+				flags |= F_DUPDATA|F_SUB_DATABASE;
 				goto put_sub;
-
-			} else{
+			} else {
 				/* Data is on sub-page */
-				sub_page = get_node_data(leaf_node);
+				sub_page = olddata.mv_data;
 				switch (flags) {
-
+				default:
+					if (!(mc->mc_db->md_flags & MDB_DUPFIXED)) {
+						offset = EVEN(__node_header_size + sizeof(indx_t) + data->mv_size);
+						break;
+					}
+					offset = sub_page->m_leaf2_element_size;
+					if (SIZELEFT(sub_page) < offset) {
+						offset *= 4; /* space for 4 more */
+						break;
+					}
 					/* FALLTHRU */ /* Big enough MDB_DUPFIXED sub-page */
 				case MDB_CURRENT:
-						sub_page->mp_flags |= P_DIRTY;
-						sub_page->mp_pgno =  mc->mc_pg[mc->mc_top]->mp_pgno; //MP_PGNO(mp);
-						mc->mc_xcursor->mx_cursor.mc_pg[0] = sub_page;
-						flags |= F_DUPDATA;
-						goto put_sub;
-						break;
-				default:
-						if (!(mc->mc_db->md_flags & MDB_DUPFIXED)) {
-							xdata.mv_size = get_node_data_size(leaf_node) + EVEN(__node_header_size + sizeof(indx_t) + data->mv_size);
-						}else {
-						
-							if (get_page_left_size(sub_page) < sub_page->m_leaf2_element_size) {
-								 /* space for 4 more */
-								xdata.mv_size = get_node_data_size(leaf_node) +  4*sub_page->m_leaf2_element_size;
-							}else{
-								sub_page->mp_flags |= P_DIRTY;
-								sub_page->mp_pgno =  mp->mp_pgno; //MP_PGNO(mp);
-								mc->mc_xcursor->mx_cursor.mc_pg[0] = sub_page;
-								flags |= F_DUPDATA;
-								goto put_sub;
-							}
-						}
-					break;
-				}//switch
-
-				fp_flags = sub_page->mp_flags;
-				if (__node_header_size + NODEKSZ(leaf_node) + xdata.mv_size > env->me_nodemax) {
-						/* Too big for a sub-page, convert to sub-DB */
-						rc = subpage_to_subdb(mc,sub_page,xdata.mv_size,&dummy_db);
-						if(rc!=MDB_SUCCESS) return rc;
-						sub_root = mp;
-					}else {
-					  //1 converted sub_page, 2 existing sub page
-						__copy_subpage_to_temporary_page(mc,sub_page,env->one_page_buf);
+					sub_page->mp_flags |= P_DIRTY;
+					sub_page->mp_pgno = mp->mp_pgno;
+					mc->mc_xcursor->mx_cursor.mc_pg[0] = sub_page;
+					flags |= F_DUPDATA;
+					goto put_sub;
 				}
+				xdata.mv_size = olddata.mv_size + offset;
+			}
 
-				rdata = &xdata;
-				flags |= F_DUPDATA;
-				do_sub = 1;
-					__mdb_node_del(mc, 0);
-				MDB_val sub_page_data; sub_page_data.mv_size=sub_page_size;sub_page_data.mv_data=sub_page;
-				rc = __new_dup_sub_db(mc,key,&sub_page_data,flags,false);
-				if(rc!=MDB_SUCCESS){
-						mc->mc_txn->txn_flags |= MDB_TXN_ERROR;
-						return rc;
+			fp_flags = sub_page->mp_flags;
+			if (__node_header_size + NODEKSZ(leaf_node) + xdata.mv_size > env->me_nodemax) {
+				/* Too big for a sub-page, convert to sub-DB */
+				fp_flags &= ~P_SUBP;
+				if (mc->mc_db->md_flags & MDB_DUPFIXED) {
+					fp_flags |= P_LEAF2;
+					dummy_db.m_leaf2_element_size = sub_page->m_leaf2_element_size;
+					dummy_db.md_flags = MDB_DUPFIXED;
+					if (mc->mc_db->md_flags & MDB_INTEGERDUP)
+						dummy_db.md_flags |= MDB_INTEGERKEY;
+				} else {
+					dummy_db.m_leaf2_element_size = 0;
+					dummy_db.md_flags = 0;
 				}
-				goto put_sub;
+				dummy_db.md_depth = 1;
+				dummy_db.md_branch_pages = 0;
+				dummy_db.md_leaf_pages = 1;
+				dummy_db.md_overflow_pages = 0;
+				dummy_db.md_entries = NUMKEYS(sub_page);
+				xdata.mv_size = sizeof(MDB_db);
+				xdata.mv_data = &dummy_db;
+				if ((rc = mdb_page_alloc(mc->mc_txn, DDBI(mc), 1, &mp)))
+					return rc;
+				offset = env->me_psize - olddata.mv_size;
+				flags |= F_DUPDATA|F_SUB_DATABASE;
+				dummy_db.md_root = mp->mp_pgno;
+				sub_root = mp;
 			}
-			
+			if (mp != sub_page) {
+				mp->mp_flags = fp_flags | P_DIRTY;
+				mp->m_leaf2_element_size = sub_page->m_leaf2_element_size;
+				mp->mp_lower = sub_page->mp_lower;
+				mp->mp_upper = sub_page->mp_upper + offset;
+				if (fp_flags & P_LEAF2) {
+					memcpy(PAGE_DATA(mp), PAGE_DATA(sub_page), NUMKEYS(sub_page) * sub_page->m_leaf2_element_size);
+				} else {
+					memcpy((char *)mp + mp->mp_upper + PAGEBASE, (char *)sub_page + sub_page->mp_upper + PAGEBASE,
+						olddata.mv_size - sub_page->mp_upper - PAGEBASE);
+					memcpy((char *)mp->offsets, (char *)sub_page->offsets, NUMKEYS(sub_page) * sizeof(mp->offsets[0]));
+					for (i=0; i<NUMKEYS(sub_page); i++)
+						mp->offsets[i] += offset;
+				}
+			}
+
+			rdata = &xdata;
+			flags |= F_DUPDATA;
+			do_sub = 1;
+			__mdb_node_del(mc, 0);
+			goto new_sub;
 		}
 current:
 		/* LMDB passes F_SUB_DATABASE in 'flags' to write a DB record */
@@ -6473,8 +9505,9 @@ current:
 				return rc2;
 			const int ovf_page_count = omp->m_ovf_page_count;
 
-			/* Is the ov page large enough? */
-			if (ovf_page_count >= dpages) {
+			/* Is the ov page large enough? Packed values are always rewritten */
+			if (ovf_page_count >= dpages &&
+				!(leaf_node->mn_flags & F_COMPRESSED) && !mc->mc_dbx->md_pack) {
 			  if (!(omp->mp_flags & P_DIRTY) && (level || (env->me_flags & MDB_WRITEMAP)))
 			  {
 				rc = mdb_page_unspill(mc->mc_txn, omp, &omp);
@@ -6488,7 +9521,8 @@ current:
 				 * bother to try shrinking the page if the new data
 				 * is smaller than the overflow threshold.
 				 */
-			
+				if ((rc2 = mdb_page_undo(mc->mc_txn, omp)))
+					return rc2;
 				SETDSZ(leaf_node, data->mv_size);
 				if (F_ISSET(flags, MDB_RESERVE))
 					data->mv_data = PAGE_DATA(omp);
@@ -6597,6 +9631,7 @@ put_sub:
 
 		return rc;
 		}
+		return MDB_SUCCESS;
 
 bad_sub:
 		if (rc == MDB_KEYEXIST)	/* should not happen, we deleted that item */
@@ -6831,6 +9866,7 @@ static int mdb_insert_node(MDB_cursor *mc, indx_t indx,MDB_val *key, MDB_val *da
 	size_t		 node_size = __node_header_size;
 	MDB_PageHeader	*mp = mc->mc_pg[mc->mc_top];
 	MDB_PageHeader	*ofp = NULL;		/* overflow page */
+	size_t		 packed = 0;		/* size of the packed overflow data */
 
 	DKBUF;
 
@@ -6842,9 +9878,11 @@ static int mdb_insert_node(MDB_cursor *mc, indx_t indx,MDB_val *key, MDB_val *da
 		mdb_dbg_pgno(mp), indx, data ? data->mv_size : 0,
 		key ? key->mv_size : 0, key ? DKEY(key) : "null", node_flags));
 
+#if MDB_DEBUG
 	if(mc->mc_dbi==FREE_DBI && (node_flags & MDB_RESERVE)==0 && data) {
 		print_data(true,data);
 	}
+#endif
 	const unsigned int n = get_page_keys_count(mp);
 	if (IS_LEAF2(mp)) {
 		/* Move higher keys up one slot. */
@@ -6871,17 +9909,22 @@ static int mdb_insert_node(MDB_cursor *mc, indx_t indx,MDB_val *key, MDB_val *da
 			/* Data already on overflow page. */
 			node_size += sizeof(pgno_t);
 		} else if (node_size + data->mv_size > mc->mc_txn->mt_env->me_nodemax) {
-			int ovf_page_count = OVPAGES(data->mv_size, mc->mc_txn->mt_env->me_psize);
+			int ovf_page_count;
 			int rc;
 			/* Put data on overflow page. */
 			DPRINTF(("data size is %"Z"u, node would be %"Z"u, put data on overflow page",data->mv_size, node_size+data->mv_size));
 			node_size = EVEN(node_size + sizeof(pgno_t));
 			if ((ssize_t)node_size > room)
 				goto full;
+			if (mc->mc_dbx->md_pack && !F_ISSET(node_flags, MDB_RESERVE))
+				packed = mdb_node_pack(mc, data);
+			ovf_page_count = OVPAGES(packed ? packed : data->mv_size, mc->mc_txn->mt_env->me_psize);
 			if ((rc = mdb_page_new(mc, P_OVERFLOW, ovf_page_count, &ofp)))
 				return rc;
 			DPRINTF(("allocated overflow page %"Yu, ofp->mp_pgno));
 			node_flags |= F_BIGDATA;
+			if (packed)
+				node_flags |= F_COMPRESSED;
 		//	goto update;
 		} else {
 			node_size += data->mv_size;
@@ -6929,6 +9972,8 @@ update:
 			void * const ofp_data = PAGE_DATA(ofp);
 			if (F_ISSET(node_flags, MDB_RESERVE))
 				data->mv_data = ofp_data;
+			else if (packed)
+				memcpy(ofp_data, mc->mc_txn->mt_env->me_pbuf, packed);
 			else
 				memcpy(ofp_data, data->mv_data, data->mv_size);
 		}
@@ -6959,7 +10004,7 @@ static void __mdb_node_del(MDB_cursor *mc, int ksize)
 	char		*base;
 
 	DPRINTF(("delete node %u on %s page %zu", K, IS_LEAF(mp) ? "leaf_node" : "branch", mdb_dbg_pgno(mp)));
-	#if defined(MDB_DEBUG)
+	#if MDB_DEBUG
 	if(IS_LEAF(mp)){
 		char buf[1024];
 		 MDB_node	*const node  = get_node_n(mp,K);
@@ -7072,6 +10117,7 @@ static void mdb_xcursor_init0(MDB_cursor *mc)
 	mx->mx_cursor.mc_dbflag = &mx->mx_dbflag;
 	mx->mx_cursor.mc_snum = 0;
 	mx->mx_cursor.mc_top = 0;
+	mx->mx_cursor.mc_readahead = 0;
 
 	mx->mx_cursor.mc_flags = C_SUB | (mc->mc_flags & (MDB_TXN_RDONLY));
 	mx->mx_dbx.md_name.mv_size = 0;
@@ -7079,6 +10125,8 @@ static void mdb_xcursor_init0(MDB_cursor *mc)
 	mx->mx_dbx.md_cmp = mc->mc_dbx->md_dcmp;
 	mx->mx_dbx.md_dcmp = NULL;
 	mx->mx_dbx.md_rel = mc->mc_dbx->md_rel;
+	mx->mx_dbx.md_pack = NULL;
+	mx->mx_dbx.md_unpack = NULL;
 }
 
 /** Final setup of a sorted-dups cursor.
@@ -7179,6 +10227,8 @@ static void mdb_cursor_init(MDB_cursor *mc, MDB_txn *txn, MDB_dbi dbi, MDB_xcurs
 	mc->mc_top = 0;
 	mc->mc_pg[0] = 0;
 	mc->mc_ki[0] = 0;
+	mc->mc_readahead = 0;
+	mc->mc_ra_pg = NULL;
 
 	mc->mc_flags = txn->txn_flags & (MDB_TXN_RDONLY);
 	if (txn->mt_dbs[dbi].md_flags & MDB_DUPSORT) {
@@ -7195,10 +10245,61 @@ static void mdb_cursor_init(MDB_cursor *mc, MDB_txn *txn, MDB_dbi dbi, MDB_xcurs
 //	DPRINTF(("new cursor %p on db %u, root:%lu",mc,dbi,mc->mc_db->md_root));
 }
 
-int mdb_cursor_open(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **ret)
-{
+	/** Most closed cursors each thread keeps for #mdb_cursor_open() */
+#ifndef MDB_CURSOR_POOL
+#define MDB_CURSOR_POOL	4
+#endif
+
+	/** Closed cursors of one thread, all with room for an #MDB_xcursor.
+	 *	Cursors may outlive their txn and env, so the pool is per process.
+	 */
+typedef struct MDB_curpool {
+	unsigned int	cf_count;	/**< number of cursors in cf_free */
+	MDB_cursor	*cf_free[MDB_CURSOR_POOL];
+} MDB_curpool;
+
+static pthread_once_t mdb_curpool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t mdb_curpool_key;
+static int mdb_curpool_ok;
+
+static void mdb_curpool_dest(void *ptr)
+{
+	MDB_curpool *cp = ptr;
+
+	while (cp->cf_count)
+		free(cp->cf_free[--cp->cf_count]);
+	free(cp);
+}
+
+static void mdb_curpool_init(void)
+{
+	mdb_curpool_ok = !pthread_key_create(&mdb_curpool_key, mdb_curpool_dest);
+}
+
+/** Return this thread's cursor pool, or NULL.
+ * @param[in] create allocate the pool if the thread has none yet.
+ */
+static MDB_curpool *mdb_curpool(int create)
+{
+	MDB_curpool *cp;
+
+	if (pthread_once(&mdb_curpool_once, mdb_curpool_init) || !mdb_curpool_ok)
+		return NULL;
+	cp = pthread_getspecific(mdb_curpool_key);
+	if (!cp && create && (cp = calloc(1, sizeof(MDB_curpool))) != NULL &&
+		pthread_setspecific(mdb_curpool_key, cp)) {
+		free(cp);
+		cp = NULL;
+	}
+	return cp;
+}
+
+int mdb_cursor_open(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **ret)
+{
 	MDB_cursor	*mc;
-	size_t size = sizeof(MDB_cursor);
+	MDB_curpool	*cp;
+	/* Always room for an xcursor, so that any closed cursor can be reused */
+	size_t size = sizeof(MDB_cursor) + sizeof(MDB_xcursor);
 
 	if (!ret || !TXN_DBI_EXIST(txn, dbi, DB_VALID))
 		return EINVAL;
@@ -7209,10 +10310,15 @@ int mdb_cursor_open(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **ret)
 	if (dbi == FREE_DBI && !F_ISSET(txn->txn_flags, MDB_TXN_RDONLY))
 		return EINVAL;
 
-	if (txn->mt_dbs[dbi].md_flags & MDB_DUPSORT)
-		size += sizeof(MDB_xcursor);
+	/* Cursors would not see staged ops */
+	if (txn->mt_stage && mdb_stage_dbi(txn, dbi))
+		return EINVAL;
 
-	if ((mc = malloc(size)) != NULL) {
+	if ((cp = mdb_curpool(0)) != NULL && cp->cf_count)
+		mc = cp->cf_free[--cp->cf_count];
+	else
+		mc = malloc(size);
+	if (mc != NULL) {
 		mdb_cursor_init(mc, txn, dbi, (MDB_xcursor *)(mc + 1));
 		if (txn->mt_cursors) {
 			mc->mc_next = txn->mt_cursors[dbi];
@@ -7231,6 +10337,8 @@ int mdb_cursor_open(MDB_txn *txn, MDB_dbi dbi, MDB_cursor **ret)
 
 int mdb_cursor_renew(MDB_txn *txn, MDB_cursor *mc)
 {
+	unsigned int readahead;
+
 	if (!mc || !TXN_DBI_EXIST(txn, mc->mc_dbi, DB_VALID))
 		return EINVAL;
 
@@ -7240,7 +10348,18 @@ int mdb_cursor_renew(MDB_txn *txn, MDB_cursor *mc)
 	if (txn->txn_flags & MDB_TXN_BLOCKED)
 		return MDB_BAD_TXN;
 
+	readahead = mc->mc_readahead;
 	mdb_cursor_init(mc, txn, mc->mc_dbi, mc->mc_xcursor);
+	mc->mc_readahead = readahead;
+	return MDB_SUCCESS;
+}
+
+int mdb_cursor_set_readahead(MDB_cursor *mc, unsigned int leaves)
+{
+	if (!mc || (mc->mc_flags & C_SUB))
+		return EINVAL;
+	mc->mc_readahead = leaves;
+	mc->mc_ra_pg = NULL;
 	return MDB_SUCCESS;
 }
 
@@ -7284,6 +10403,8 @@ int mdb_cursor_count(MDB_cursor *mc, mdb_size_t *countp)
 
 void mdb_cursor_close(MDB_cursor *mc)
 {
+	MDB_curpool *cp;
+
 	MDB_TRACE(("%p", mc));
 
 	if (mc && !mc->mc_backup) {
@@ -7297,7 +10418,10 @@ void mdb_cursor_close(MDB_cursor *mc)
 			if (*prev == mc)
 				*prev = mc->mc_next;
 		}
-		free(mc);
+		if ((cp = mdb_curpool(1)) != NULL && cp->cf_count < MDB_CURSOR_POOL)
+			cp->cf_free[cp->cf_count++] = mc;
+		else
+			free(mc);
 	}
 }
 
@@ -7648,6 +10772,7 @@ static int mdb_page_merge(MDB_cursor *csrc, MDB_cursor *cdst)
 	pdst = cdst->mc_pg[cdst->mc_top];
 
 	DPRINTF(("merging page %"Yu" into %"Yu, psrc->mp_pgno, pdst->mp_pgno));
+	MDB_METRIC(csrc->mc_txn->mt_env, me_merges, 1);
 
 	mdb_cassert(csrc, csrc->mc_snum > 1);	/* can't merge root page */
 	mdb_cassert(csrc, cdst->mc_snum > 1);
@@ -7788,6 +10913,7 @@ mdb_cursor_copy(const MDB_cursor *csrc, MDB_cursor *cdst)
 	cdst->mc_snum = csrc->mc_snum;
 	cdst->mc_top = csrc->mc_top;
 	cdst->mc_flags = csrc->mc_flags;
+	cdst->mc_readahead = 0;
 	MC_SET_OVPG(cdst, MC_OVPG(csrc));
 
 	for (i=0; i<csrc->mc_snum; i++) {
@@ -7827,6 +10953,7 @@ static int mdb_rebalance(MDB_cursor *mc)
 		    mdb_dbg_pgno(mc->mc_pg[mc->mc_top])));
 		return MDB_SUCCESS;
 	}
+	MDB_METRIC(mc->mc_txn->mt_env, me_rebalances, 1);
 
 	if (mc->mc_snum < 2) {
 		MDB_PageHeader *mp = mc->mc_pg[0];
@@ -8095,6 +11222,9 @@ int mdb_del(MDB_txn *txn, MDB_dbi dbi,MDB_val *key, MDB_val *data)
 	if (!key || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
 		return EINVAL;
 
+	if (txn->mt_stage && mdb_stage_dbi(txn, dbi))
+		return mdb_stage_del(txn, dbi, key);
+
 	if (txn->txn_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
 		return (txn->txn_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
 
@@ -8189,6 +11319,7 @@ static int mdb_page_split_insert(MDB_cursor *mc, MDB_val *newkey, MDB_val *newda
 		return rc;
 	rp->m_leaf2_element_size = mp->m_leaf2_element_size;
 	DPRINTF(("new right sibling: page %"Yu, rp->mp_pgno));
+	MDB_METRIC(env, me_splits, 1);
 
 	/* Usually when splitting the root page, the cursor
 	 * height is 1. But when called from mdb_update_key,
@@ -8312,6 +11443,42 @@ static int mdb_page_split_insert(MDB_cursor *mc, MDB_val *newkey, MDB_val *newda
 				copy->offsets[j++] = mp->offsets[i];
 			}
 
+			/* In a run of ascending inserts that land inside the page,
+			 * end the left page with the new key and move only the keys
+			 * after it to the right page. The rest of the run then goes
+			 * to the end of the left page, where the split below keeps
+			 * pages full. In a descending run start the right page with
+			 * the new key instead. Only do so if both halves fit.
+			 */
+			if (IS_LEAF(mp) && !(mc->mc_flags & C_SUB) && !(nflags & MDB_SPLIT_REPLACE) &&
+				newindx < nkeys) {
+				int run = mc->mc_txn->mt_ins_hints[mc->mc_dbi].mh_run;
+				if (run >= MDB_SPLIT_SEQ || run <= -MDB_SPLIT_SEQ) {
+					int lsize = 0;
+					split_indx = run > 0 ? newindx + 1 : newindx ? newindx : 1;
+					for (i=0, psize=0; i<=nkeys; i++) {
+						if (i == split_indx) {
+							lsize = psize;
+							psize = 0;
+						}
+						if (i == newindx) {
+							psize += nsize;
+							continue;
+						}
+						node = (MDB_node *)((char *)mp + copy->offsets[i] + PAGEBASE);
+						psize += __node_header_size + NODEKSZ(node) + sizeof(indx_t);
+						if (F_ISSET(node->mn_flags, F_BIGDATA))
+							psize += sizeof(pgno_t);
+						else
+							psize += get_node_data_size(node);
+						psize = EVEN(psize);
+					}
+					if (lsize <= pmax && psize <= pmax)
+						goto found;
+					split_indx = (nkeys+1) / 2;
+				}
+			}
+
 			/* When items are relatively large the split point needs
 			 * to be checked, because being off-by-one will make the
 			 * difference between success or failure in mdb_insert_node.
@@ -8358,6 +11525,7 @@ static int mdb_page_split_insert(MDB_cursor *mc, MDB_val *newkey, MDB_val *newda
 					}
 				}
 			}
+found:
 			if (split_indx == newindx) {
 				sepkey.mv_size = newkey->mv_size;
 				sepkey.mv_data = newkey->mv_data;
@@ -8591,6 +11759,9 @@ int mdb_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, unsigned int
 	if (flags & ~(MDB_NOOVERWRITE|MDB_NODUPDATA|MDB_RESERVE|MDB_APPEND|MDB_APPENDDUP))
 		return EINVAL;
 
+	if (txn->mt_stage && mdb_stage_dbi(txn, dbi))
+		return mdb_stage_put(txn, dbi, key, data, flags);
+
 	if (txn->txn_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
 		return (txn->txn_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
 
@@ -8606,221 +11777,1398 @@ int mdb_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, unsigned int
 	return rc;
 }
 
-#ifndef MDB_WBUF
-#define MDB_WBUF	(1024*1024)
+/** Most keys #mdb_put_batch() merges into one leaf page per pass */
+#ifndef MDB_BATCH_LEAF
+#define MDB_BATCH_LEAF	512
 #endif
-#define MDB_EOF		0x10	/**< #mdb_env_copyfd1() is done reading */
 
-	/** State needed for a double-buffering compacting copy. */
-typedef struct mdb_copy {
-	MDB_env *mc_env;
-	MDB_txn *mc_txn;
-	pthread_mutex_t mc_mutex;
-	pthread_cond_t mc_cond;	/**< Condition variable for #mc_new */
-	char *mc_wbuf[2];
-	char *mc_over[2];
-	int mc_wlen[2];
-	int mc_olen[2];
-	pgno_t mc_next_pgno;
-	HANDLE mc_fd;
-	int mc_toggle;			/**< Buffer number in provider */
-	int mc_new;				/**< (0-2 buffers to write) | (#MDB_EOF at end) */
-	/** Error code.  Never cleared if set.  Both threads can set nonzero
-	 *	to fail the copy.  Not mutex-protected, LMDB expects atomic int.
+/** Insert sorted batch keys into the cursor's leaf page in one pass.
+ *	Takes keys from the front of \b ix while they are new, belong on
+ *	this leaf, fit in it and need no overflow page. The cursor must be
+ *	on a key below all of them, as it is after a put. In a nested txn
+ *	the leaf is saved by #mdb_page_undo() before it is changed.
+ * @return the number of keys inserted. 0 means the first key needs
+ *	the regular put path, which also reports a failed undo.
+ */
+static size_t mdb_batch_leaf(MDB_cursor *mc, MDB_val *keys, MDB_val *data,
+	size_t *ix, size_t n)
+{
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_PageHeader *mp = mc->mc_pg[mc->mc_top];
+	MDB_cmp_func *cmp = mc->mc_dbx->md_cmp;
+	MDB_val bound, nkey, *key, *d;
+	MDB_node *node;
+	MDB_cursor *m2;
+	indx_t pos[MDB_BATCH_LEAF], ofs;
+	size_t m;
+	unsigned int i, j, k, nkeys, top = mc->mc_top;
+	int c = 1, bounded = 0;
+	size_t room, sz;
+
+	if (!IS_LEAF(mp) || IS_LEAF2(mp) || !(mp->mp_flags & P_DIRTY))
+		return 0;
+	/* Keys at or past the next leaf's separator belong elsewhere */
+	for (i = top; i-- > 0; ) {
+		if (mc->mc_ki[i] + 1U < NUMKEYS(mc->mc_pg[i])) {
+			mdb_node_read_key(get_node_n(mc->mc_pg[i], mc->mc_ki[i] + 1), &bound);
+			bounded = 1;
+			break;
+		}
+	}
+	nkeys = NUMKEYS(mp);
+	room = get_page_left_size(mp);
+	j = mc->mc_ki[top];
+	for (m = 0; m < n && m < MDB_BATCH_LEAF; m++) {
+		key = &keys[ix[m]];
+		d = &data[ix[m]];
+		if (key->mv_size - 1 >= MDB_MAXKEYSIZE || LEAFSIZE(key, d) > env->me_nodemax)
+			break;
+		sz = EVEN(LEAFSIZE(key, d)) + sizeof(indx_t);
+		if (sz > room || (bounded && cmp(key, &bound) >= 0))
+			break;
+		if (m && !cmp(key, &keys[ix[m-1]]))
+			break;
+		/* Merge scan: the page keys and the batch are both sorted */
+		for (; j < nkeys; j++) {
+			mdb_node_read_key(get_node_n(mp, j), &nkey);
+			if ((c = cmp(key, &nkey)) <= 0)
+				break;
+		}
+		if (j < nkeys && !c)
+			break;
+		pos[m] = j;
+		room -= sz;
+	}
+	if (!m || mdb_page_undo(mc->mc_txn, mp))
+		return 0;
+
+	/* Shift the pointer array once, from the top down, writing
+	 * each new node as its slot comes up
 	 */
-	volatile int mc_error;
-} mdb_copy;
+	k = nkeys + m;
+	j = nkeys;
+	for (i = m; i-- > 0; ) {
+		while (j > pos[i])
+			mp->offsets[--k] = mp->offsets[--j];
+		key = &keys[ix[i]];
+		d = &data[ix[i]];
+		ofs = mp->mp_upper - EVEN(LEAFSIZE(key, d));
+		mp->mp_upper = ofs;
+		mp->offsets[--k] = ofs;
+		node = (MDB_node *)((char *)mp + ofs);
+		node->mn_ksize = key->mv_size;
+		node->mn_flags = 0;
+		set_node_data_size(node, d->mv_size);
+		memcpy(NODEKEY(node), key->mv_data, key->mv_size);
+		memcpy(get_node_data(node), d->mv_data, d->mv_size);
+	}
+	mp->mp_lower += m * sizeof(indx_t);
 
-	/** Dedicated writer thread for compacting copy. */
-static THREAD_RET ESECT CALL_CONV
-mdb_env_copythr(void *arg)
-{
-	mdb_copy *my = arg;
-	char *ptr;
-	int toggle = 0, wsize, rc;
-#ifdef _WIN32
-	DWORD len;
-#define DO_WRITE(rc, fd, ptr, w2, len)	rc = WriteFile(fd, ptr, w2, &len, NULL)
-#else
-	int len;
-#define DO_WRITE(rc, fd, ptr, w2, len)	len = write(fd, ptr, w2); rc = (len >= 0)
-#ifdef SIGPIPE
-	sigset_t set;
-	sigemptyset(&set);
-	sigaddset(&set, SIGPIPE);
-	if ((rc = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0)
-		my->mc_error = rc;
-#endif
+	/* Adjust other cursors pointing to mp */
+	for (m2 = mc->mc_txn->mt_cursors[mc->mc_dbi]; m2; m2 = m2->mc_next) {
+		if (m2 == mc || m2->mc_snum < mc->mc_snum || m2->mc_pg[top] != mp)
+			continue;
+		for (i = 0; i < m && pos[i] <= m2->mc_ki[top]; i++) ;
+		m2->mc_ki[top] += i;
+	}
+	mc->mc_ki[top] = pos[m-1] + m - 1;
+	mc->mc_db->md_entries += m;
+	return m;
+}
+
+/** How many keys ahead #mdb_put_batch() prefetches leaf pages for.
+ *	Leaves of upcoming keys under the cursor's parent branch page are
+ *	advised with madvise(MADV_WILLNEED), so a cold-cache batch reads
+ *	them while earlier keys are merged. 0 disables it.
+ */
+#ifndef MDB_BATCH_PREFETCH
+#define MDB_BATCH_PREFETCH	64
 #endif
 
-	pthread_mutex_lock(&my->mc_mutex);
-	for(;;) {
-		while (!my->mc_new)
-			pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
-		if (my->mc_new == 0 + MDB_EOF) /* 0 buffers, just EOF */
+/** Prefetch the leaves that sorted batch keys will land on.
+ *	Looks up the keys from \b from on in the parent of the cursor's
+ *	leaf, and advises each clean leaf they fall in other than the
+ *	current one.
+ * @return the index of the first key not looked up. \b count when
+ *	there is nothing more to prefetch.
+ */
+static size_t mdb_batch_prefetch(MDB_cursor *mc, MDB_val *keys, size_t *ix,
+	size_t from, size_t count)
+{
+	MDB_txn *txn = mc->mc_txn;
+	MDB_env *env = txn->mt_env;
+	MDB_cmp_func *cmp = mc->mc_dbx->md_cmp;
+	MDB_PageHeader *parent;
+	MDB_run ra = {0, 0};
+	MDB_val bound, sep;
+	size_t m, end = from + MDB_BATCH_PREFETCH;
+	unsigned int i, j, prev, nkeys, top = mc->mc_top;
+	pgno_t pgno;
+	int bounded = 0;
+
+	if (!MDB_BATCH_PREFETCH || top == 0)
+		return count;
+	parent = mc->mc_pg[top-1];
+	nkeys = NUMKEYS(parent);
+	j = prev = mc->mc_ki[top-1];
+	/* Keys at or past the parent's separator are under another branch */
+	for (i = top - 1; i-- > 0; ) {
+		if (mc->mc_ki[i] + 1U < NUMKEYS(mc->mc_pg[i])) {
+			mdb_node_read_key(get_node_n(mc->mc_pg[i], mc->mc_ki[i] + 1), &bound);
+			bounded = 1;
 			break;
-		wsize = my->mc_wlen[toggle];
-		ptr = my->mc_wbuf[toggle];
-again:
-		rc = MDB_SUCCESS;
-		while (wsize > 0 && !my->mc_error) {
-			DO_WRITE(rc, my->mc_fd, ptr, wsize, len);
-			if (!rc) {
-				rc = ErrCode();
-#if defined(SIGPIPE) && !defined(_WIN32)
-				if (rc == EPIPE) {
-					/* Collect the pending SIGPIPE, otherwise at least OS X
-					 * gives it to the process on thread-exit (ITS#8504).
-					 */
-					int tmp;
-					sigwait(&set, &tmp);
-				}
-#endif
-				break;
-			} else if (len > 0) {
-				rc = MDB_SUCCESS;
-				ptr += len;
-				wsize -= len;
-				continue;
-			} else {
-				rc = EIO;
-				break;
-			}
 		}
-		if (rc) {
-			my->mc_error = rc;
-		}
-		/* If there's an overflow page tail, write it too */
-		if (my->mc_olen[toggle]) {
-			wsize = my->mc_olen[toggle];
-			ptr = my->mc_over[toggle];
-			my->mc_olen[toggle] = 0;
-			goto again;
+	}
+	if (end > count)
+		end = count;
+	for (m = from; m < end; m++) {
+		if (bounded && cmp(&keys[ix[m]], &bound) >= 0)
+			break;
+		for (; j + 1 < nkeys; j++) {
+			mdb_node_read_key(get_node_n(parent, j + 1), &sep);
+			if (cmp(&keys[ix[m]], &sep) < 0)
+				break;
 		}
-		my->mc_wlen[toggle] = 0;
-		toggle ^= 1;
-		/* Return the empty buffer to provider */
-		my->mc_new--;
-		pthread_cond_signal(&my->mc_cond);
+		if (j == prev)
+			continue;
+		prev = j;
+		pgno = get_page_no(get_node_n(parent, j));
+		/* Dirty leaves are in memory, their pgno may not hold them yet */
+		if (txn->mt_u.dirty_list[0].mid && mdb_dhash_find(&env->me_dirty_hash, pgno))
+			continue;
+		mdb_willneed_add(env, &ra, pgno, 1);
 	}
-	pthread_mutex_unlock(&my->mc_mutex);
-	return (THREAD_RET)0;
-#undef DO_WRITE
+	mdb_willneed_add(env, &ra, 0, 0);
+	return m;
 }
 
-	/** Give buffer and/or #MDB_EOF to writer thread, await unused buffer.
-	 *
-	 * @param[in] my control structure.
-	 * @param[in] adjust (1 to hand off 1 buffer) | (MDB_EOF when ending).
-	 */
-static int ESECT
-mdb_env_cthr_toggle(mdb_copy *my, int adjust)
+int mdb_put_batch(MDB_txn *txn, MDB_dbi dbi, MDB_val *keys, MDB_val *data,
+	size_t count, unsigned int flags)
 {
-	pthread_mutex_lock(&my->mc_mutex);
-	my->mc_new += adjust;
-	pthread_cond_signal(&my->mc_cond);
-	while (my->mc_new & 2)		/* both buffers in use */
-		pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
-	pthread_mutex_unlock(&my->mc_mutex);
+	MDB_cursor mc;
+	MDB_xcursor mx;
+	size_t *ix, i, n, ra = 0;
+	int rc = MDB_SUCCESS;
 
-	my->mc_toggle ^= (adjust & 1);
-	/* Both threads reset mc_wlen, to be safe from threading errors */
-	my->mc_wlen[my->mc_toggle] = 0;
-	return my->mc_error;
-}
+	if (!keys || !data || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
 
-	/** Depth-first tree traversal for compacting copy.
-	 * @param[in] my control structure.
-	 * @param[in,out] pg database root.
-	 * @param[in] flags includes #F_DUPDATA if it is a sorted-duplicate sub-DB.
-	 */
-static int ESECT mdb_env_cwalk(mdb_copy *my, pgno_t *pg, int flags)
-{
-	MDB_cursor mc = {0};
-	MDB_node *ni;
-	MDB_PageHeader *mo, *mp, *leaf_node;
-	char *buf, *ptr;
-	int rc, toggle;
-	unsigned int i;
+	if (flags & ~MDB_NOOVERWRITE)
+		return EINVAL;
 
-	/* Empty DB, nothing to do */
-	if (*pg == P_INVALID)
-		return MDB_SUCCESS;
+	if (txn->mt_stage && mdb_stage_dbi(txn, dbi)) {
+		/* Staging sorts anyway, at commit */
+		for (i = 0; i < count && !rc; i++)
+			if ((rc = mdb_stage_put(txn, dbi, &keys[i], &data[i], flags)) == MDB_KEYEXIST)
+				rc = MDB_SUCCESS;
+		return rc;
+	}
 
-	mc.mc_snum = 1;
-	mc.mc_txn = my->mc_txn;
-	mc.mc_flags = my->mc_txn->txn_flags & (MDB_TXN_RDONLY|C_WRITEMAP);
+	if (txn->txn_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
+		return (txn->txn_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
 
-	rc = mdb_page_get(mc.mc_txn, *pg, &mc.mc_pg[0], NULL);
-	if (rc)
-		return rc;
-	rc = __mdb_locate_cursor(&mc, NULL, MDB_PS_FIRST);
-	if (rc)
-		return rc;
+	if (txn->mt_dbs[dbi].md_flags & MDB_DUPSORT)
+		return MDB_INCOMPATIBLE;
 
-	/* Make cursor pages writable */
-	buf = ptr = malloc(my->mc_env->me_psize * mc.mc_snum);
-	if (buf == NULL)
+	MDB_TRACE(("%p, %u, %"Z"u, %u", txn, dbi, count, flags));
+	if (!count)
+		return MDB_SUCCESS;
+	if ((ix = malloc(2 * count * sizeof(*ix))) == NULL)
 		return ENOMEM;
+	for (i = 0; i < count; i++)
+		ix[i] = i;
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	mdb_batch_sort(ix, ix + count, count, keys, mc.mc_dbx->md_cmp);
 
-	for (i=0; i<mc.mc_top; i++) {
-		mdb_page_copy((MDB_PageHeader *)ptr, mc.mc_pg[i], my->mc_env->me_psize);
-		mc.mc_pg[i] = (MDB_PageHeader *)ptr;
-		ptr += my->mc_env->me_psize;
+	mc.mc_next = txn->mt_cursors[dbi];
+	txn->mt_cursors[dbi] = &mc;
+	for (i = 0; i < count; i += n) {
+		if ((mc.mc_flags & C_INITIALIZED) &&
+			(n = mdb_batch_leaf(&mc, keys, data, ix + i, count - i)))
+			continue;
+		/* New leaf, split, overflow data or an existing key */
+		rc = _mdb_cursor_put(&mc, &keys[ix[i]], &data[ix[i]], flags);
+		if (rc == MDB_KEYEXIST)
+			rc = MDB_SUCCESS;
+		if (rc)
+			break;
+		n = 1;
+		/* Keep the prefetch window at least half full */
+		if (ra < i + 1 + MDB_BATCH_PREFETCH / 2)
+			ra = mdb_batch_prefetch(&mc, keys, ix, ra > i + 1 ? ra : i + 1, count);
 	}
+	txn->mt_cursors[dbi] = mc.mc_next;
+	free(ix);
+	return rc;
+}
 
-	/* This is writable space for a leaf_node page. Usually not needed. */
-	leaf_node = (MDB_PageHeader *)ptr;
-
-	toggle = my->mc_toggle;
-	while (mc.mc_snum > 0) {
-		unsigned n;
-		mp = mc.mc_pg[mc.mc_top];
-		n = NUMKEYS(mp);
-
-		if (IS_LEAF(mp)) {
-			if (!IS_LEAF2(mp) && !(flags & F_DUPDATA)) {
-				for (i=0; i<n; i++) {
-					ni = get_node_n(mp, i);
-					if (ni->mn_flags & F_BIGDATA) {
-						MDB_PageHeader *omp;
-						pgno_t pg;
+/** Insert sorted batch values into the cursor's sub-database leaf in
+ *	one pass. The cursor must be on a key whose duplicates live in a
+ *	#MDB_DUPFIXED sub-database, with its sub-cursor on a value below
+ *	all of them, as it is after a put. Takes values from the front of
+ *	\b ix while they are new, belong on this leaf and fit in it.
+ * @return the number of values inserted. 0 means the first value needs
+ *	the regular put path, which also reports a failed undo.
+ */
+static size_t mdb_batch_dupleaf(MDB_cursor *mc, MDB_val *data, size_t *ix, size_t n)
+{
+	MDB_xcursor *mx = mc->mc_xcursor;
+	MDB_cursor *xc = &mx->mx_cursor, *m2;
+	MDB_PageHeader *mp;
+	MDB_node *leaf;
+	MDB_cmp_func *cmp = xc->mc_dbx->md_cmp;
+	MDB_val bound, val, *d;
+	indx_t pos[MDB_BATCH_LEAF];
+	size_t m, room, cnt;
+	unsigned int i, j, k, nkeys, ksize, top = mc->mc_top, xtop;
+	char *base;
+	int c = 1, bounded = 0;
+
+	if (!(mc->mc_pg[top]->mp_flags & P_DIRTY))
+		return 0;
+	leaf = get_node_n(mc->mc_pg[top], mc->mc_ki[top]);
+	if (!(leaf->mn_flags & F_SUB_DATABASE) || !(xc->mc_flags & C_INITIALIZED))
+		return 0;
+	xtop = xc->mc_top;
+	mp = xc->mc_pg[xtop];
+	if (!IS_LEAF2(mp) || !(mp->mp_flags & P_DIRTY))
+		return 0;
+	/* Values at or past the next leaf's separator belong elsewhere */
+	for (i = xtop; i-- > 0; ) {
+		if (xc->mc_ki[i] + 1U < NUMKEYS(xc->mc_pg[i])) {
+			mdb_node_read_key(get_node_n(xc->mc_pg[i], xc->mc_ki[i] + 1), &bound);
+			bounded = 1;
+			break;
+		}
+	}
+	ksize = mx->mx_db.m_leaf2_element_size;
+	nkeys = NUMKEYS(mp);
+	room = get_page_left_size(mp);
+	val.mv_size = ksize;
+	j = xc->mc_ki[xtop];
+	for (m = 0; m < n && m < MDB_BATCH_LEAF; m++) {
+		d = &data[ix[m]];
+		if (d->mv_size != ksize || ksize > room || (bounded && cmp(d, &bound) >= 0))
+			break;
+		if (m && !cmp(d, &data[ix[m-1]]))
+			break;
+		for (; j < nkeys; j++) {
+			val.mv_data = get_leaf2_element(mp, j, ksize);
+			if ((c = cmp(d, &val)) <= 0)
+				break;
+		}
+		if (j < nkeys && !c)
+			break;
+		pos[m] = j;
+		room -= ksize;
+	}
+	/* Both the sub-database leaf and the main leaf holding its record
+	 * are changed in place
+	 */
+	if (!m || mdb_page_undo(mc->mc_txn, mp) ||
+		mdb_page_undo(mc->mc_txn, mc->mc_pg[top]))
+		return 0;
+
+	/* Move each run of old values up once, from the top down */
+	base = get_leaf2_element(mp, 0, ksize);
+	k = nkeys + m;
+	j = nkeys;
+	for (i = m; i-- > 0; ) {
+		cnt = j - pos[i];
+		k -= cnt;
+		memmove(base + k * ksize, base + pos[i] * ksize, cnt * ksize);
+		j = pos[i];
+		memcpy(base + --k * ksize, data[ix[i]].mv_data, ksize);
+	}
+	/* Just using these for counting, as mdb_node_add() does */
+	mp->mp_lower += m * sizeof(indx_t);
+	mp->mp_upper -= m * (ksize - sizeof(indx_t));
+
+	/* Adjust other cursors on this key */
+	for (m2 = mc->mc_txn->mt_cursors[mc->mc_dbi]; m2; m2 = m2->mc_next) {
+		MDB_cursor *x2;
+		if (m2 == mc || m2->mc_snum < mc->mc_snum || m2->mc_pg[top] != mc->mc_pg[top] ||
+			m2->mc_ki[top] != mc->mc_ki[top])
+			continue;
+		x2 = &m2->mc_xcursor->mx_cursor;
+		if (!(x2->mc_flags & C_INITIALIZED))
+			continue;
+		m2->mc_xcursor->mx_db.md_entries += m;
+		if (x2->mc_snum < xc->mc_snum || x2->mc_pg[xtop] != mp)
+			continue;
+		for (i = 0; i < m && pos[i] <= x2->mc_ki[xtop]; i++) ;
+		x2->mc_ki[xtop] += i;
+	}
+	xc->mc_ki[xtop] = pos[m-1] + m - 1;
+	mx->mx_db.md_entries += m;
+	mc->mc_db->md_entries += m;
+	memcpy(get_node_data(leaf), &mx->mx_db, sizeof(MDB_db));
+	return m;
+}
+
+int mdb_put_dups(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data, size_t count)
+{
+	MDB_cursor mc;
+	MDB_xcursor mx;
+	size_t *ix, i, n;
+	int rc = MDB_SUCCESS;
+
+	if (!key || !data || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	if (txn->txn_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
+		return (txn->txn_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
+
+	if (!(txn->mt_dbs[dbi].md_flags & MDB_DUPSORT))
+		return MDB_INCOMPATIBLE;
+
+	MDB_TRACE(("%p, %u, %"Z"u", txn, dbi, count));
+	if (!count)
+		return MDB_SUCCESS;
+	if ((ix = malloc(2 * count * sizeof(*ix))) == NULL)
+		return ENOMEM;
+	for (i = 0; i < count; i++)
+		ix[i] = i;
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	mdb_batch_sort(ix, ix + count, count, data, mc.mc_dbx->md_dcmp);
+
+	mc.mc_next = txn->mt_cursors[dbi];
+	txn->mt_cursors[dbi] = &mc;
+	for (i = 0; i < count; i += n) {
+		if (i && (n = mdb_batch_dupleaf(&mc, data, ix + i, count - i)))
+			continue;
+		/* New key, sub-page, sub-database split or an existing value */
+		rc = _mdb_cursor_put(&mc, key, &data[ix[i]], MDB_NODUPDATA);
+		if (rc == MDB_KEYEXIST)
+			rc = MDB_SUCCESS;
+		if (rc)
+			break;
+		n = 1;
+	}
+	txn->mt_cursors[dbi] = mc.mc_next;
+	free(ix);
+	return rc;
+}
+
+int mdb_del_dups(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data,
+	size_t count, size_t *deleted)
+{
+	MDB_cursor mc;
+	MDB_xcursor mx;
+	MDB_val ck, cd, v;
+	size_t *ix, i, ndel = 0;
+	int rc = MDB_SUCCESS, exact, here = 0;
+
+	if (!key || !data || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+
+	if (txn->txn_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
+		return (txn->txn_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
+
+	if (!(txn->mt_dbs[dbi].md_flags & MDB_DUPSORT))
+		return MDB_INCOMPATIBLE;
+
+	MDB_TRACE(("%p, %u, %"Z"u", txn, dbi, count));
+	if (deleted)
+		*deleted = 0;
+	if (!count)
+		return MDB_SUCCESS;
+	if ((ix = malloc(2 * count * sizeof(*ix))) == NULL)
+		return ENOMEM;
+	for (i = 0; i < count; i++)
+		ix[i] = i;
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	mdb_batch_sort(ix, ix + count, count, data, mc.mc_dbx->md_dcmp);
+
+	mc.mc_next = txn->mt_cursors[dbi];
+	txn->mt_cursors[dbi] = &mc;
+	for (i = 0; i < count; i++) {
+		/* A delete leaves the cursor on the next value, so a run of
+		 * adjacent values is removed without searching again.
+		 */
+		if (here && mdb_cursor_get(&mc, &ck, &cd, MDB_GET_CURRENT) == MDB_SUCCESS &&
+			!mc.mc_dbx->md_cmp(key, &ck) && !mc.mc_dbx->md_dcmp(&data[ix[i]], &cd)) {
+			rc = MDB_SUCCESS;
+		} else {
+			v = data[ix[i]];
+			exact = 0;
+			rc = mdb_locate_cursor_by_op(&mc, key, &v, MDB_GET_BOTH, &exact);
+		}
+		if (rc == MDB_NOTFOUND) {
+			here = 0;
+			rc = MDB_SUCCESS;
+			continue;
+		}
+		if (rc || (rc = _mdb_cursor_del(&mc, 0)))
+			break;
+		ndel++;
+		here = 1;
+	}
+	txn->mt_cursors[dbi] = mc.mc_next;
+	free(ix);
+	if (deleted)
+		*deleted = ndel;
+	return rc;
+}
+
+int mdb_cursor_get_dups(MDB_cursor *mc, MDB_val *key, MDB_val *data,
+	mdb_size_t *countp, MDB_cursor_op op)
+{
+	int rc;
+
+	if (mc == NULL || data == NULL || countp == NULL)
+		return EINVAL;
+
+	if (!mc->mc_xcursor || !(mc->mc_db->md_flags & MDB_DUPFIXED))
+		return MDB_INCOMPATIBLE;
+
+	rc = mdb_cursor_get(mc, key, data, op);
+	/* After positioning on a key, widen its value to the page of
+	 * duplicates holding it. A single value is its own view.
+	 */
+	if (rc == MDB_SUCCESS && op != MDB_GET_MULTIPLE && op != MDB_NEXT_MULTIPLE &&
+		op != MDB_PREV_MULTIPLE && XCURSOR_INITED(mc))
+		rc = mdb_cursor_get(mc, NULL, data, MDB_GET_MULTIPLE);
+	if (rc == MDB_SUCCESS)
+		rc = mdb_cursor_count(mc, countp);
+	return rc;
+}
+
+/** Return the staged state of \b dbi, or NULL if the txn did not declare it */
+static MDB_sdbi *mdb_stage_dbi(MDB_txn *txn, MDB_dbi dbi)
+{
+	MDB_stage *st = txn->mt_stage;
+	unsigned int i;
+
+	for (i = 0; i < st->st_ndbs; i++)
+		if (st->st_dbs[i].sd_dbi == dbi)
+			return &st->st_dbs[i];
+	return NULL;
+}
+
+/** Search sorted ops for a key.
+ * @param[out] pos where the key is, or where it would be inserted.
+ * @return 1 if the key was found.
+ */
+static int mdb_srun_search(const MDB_sop *ops, size_t n, const MDB_val *key,
+	MDB_cmp_func *cmp, size_t *pos)
+{
+	size_t lo = 0, hi = n, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		c = cmp(key, &ops[mid].so_key);
+		if (!c) {
+			*pos = mid;
+			return 1;
+		}
+		if (c < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*pos = lo;
+	return 0;
+}
+
+/** Return the newest staged op on \b key in \b dbi, or NULL */
+static MDB_sop *mdb_stage_find(MDB_txn *txn, MDB_dbi dbi, const MDB_val *key)
+{
+	MDB_sdbi *sd = mdb_stage_dbi(txn, dbi);
+	MDB_cmp_func *cmp;
+	size_t pos;
+	unsigned int i;
+
+	if (!sd)
+		return NULL;
+	cmp = txn->mt_dbxs[dbi].md_cmp;
+	if (mdb_srun_search(sd->sd_buf, sd->sd_nbuf, key, cmp, &pos))
+		return &sd->sd_buf[pos];
+	for (i = sd->sd_nruns; i-- > 0; )
+		if (mdb_srun_search(sd->sd_runs[i].sr_ops, sd->sd_runs[i].sr_n, key, cmp, &pos))
+			return &sd->sd_runs[i].sr_ops[pos];
+	return NULL;
+}
+
+/** Merge the newest run of a staged DBI into the one before it.
+ *	Where both have a key, the newer op wins.
+ */
+static int mdb_srun_merge(MDB_sdbi *sd, MDB_cmp_func *cmp)
+{
+	MDB_srun *a = &sd->sd_runs[sd->sd_nruns-2], *b = a + 1;
+	MDB_sop *ops;
+	size_t i = 0, j = 0, k = 0;
+	int c;
+
+	if ((ops = malloc((a->sr_n + b->sr_n) * sizeof(MDB_sop))) == NULL)
+		return ENOMEM;
+	while (i < a->sr_n && j < b->sr_n) {
+		c = cmp(&a->sr_ops[i].so_key, &b->sr_ops[j].so_key);
+		if (c < 0) {
+			ops[k++] = a->sr_ops[i++];
+		} else {
+			if (!c)
+				i++;	/* hidden by the newer op */
+			ops[k++] = b->sr_ops[j++];
+		}
+	}
+	while (i < a->sr_n)
+		ops[k++] = a->sr_ops[i++];
+	while (j < b->sr_n)
+		ops[k++] = b->sr_ops[j++];
+	free(a->sr_ops);
+	free(b->sr_ops);
+	a->sr_ops = ops;
+	a->sr_n = k;
+	sd->sd_nruns--;
+	return MDB_SUCCESS;
+}
+
+/** Turn the buffer of a staged DBI into its newest run.
+ * @param[in] all merge all runs into one, for commit.
+ */
+static int mdb_stage_flush(MDB_sdbi *sd, MDB_cmp_func *cmp, int all)
+{
+	MDB_srun *r;
+	int rc;
+
+	if (sd->sd_nbuf) {
+		r = &sd->sd_runs[sd->sd_nruns];
+		if ((r->sr_ops = malloc(sd->sd_nbuf * sizeof(MDB_sop))) == NULL)
+			return ENOMEM;
+		memcpy(r->sr_ops, sd->sd_buf, sd->sd_nbuf * sizeof(MDB_sop));
+		r->sr_n = sd->sd_nbuf;
+		sd->sd_nruns++;
+		sd->sd_nbuf = 0;
+	}
+	while (sd->sd_nruns > 1 && (all ||
+		sd->sd_runs[sd->sd_nruns-2].sr_n <= 2 * sd->sd_runs[sd->sd_nruns-1].sr_n))
+		if ((rc = mdb_srun_merge(sd, cmp)) != MDB_SUCCESS)
+			return rc;
+	return MDB_SUCCESS;
+}
+
+/** Copy \b len bytes into the staged txn's memory, or just reserve them */
+static void *mdb_stage_copy(MDB_stage *st, const void *src, size_t len)
+{
+	MDB_sblk *sb = st->st_blk;
+	char *ptr;
+
+	len = (len + sizeof(size_t)-1) & ~(sizeof(size_t)-1);
+	if (!sb || sb->sb_size - sb->sb_used < len) {
+		size_t size = len > 65536 ? len : 65536;
+		if ((sb = malloc(sizeof(MDB_sblk) + size)) == NULL)
+			return NULL;
+		sb->sb_next = st->st_blk;
+		sb->sb_used = 0;
+		sb->sb_size = size;
+		st->st_blk = sb;
+	}
+	ptr = (char *)(sb + 1) + sb->sb_used;
+	sb->sb_used += len;
+	if (src)
+		memcpy(ptr, src, len);
+	return ptr;
+}
+
+/** Add an op to a staged DBI. Its key and data must be staged copies. */
+static int mdb_stage_add(MDB_txn *txn, MDB_dbi dbi, MDB_sop *op)
+{
+	MDB_sdbi *sd = mdb_stage_dbi(txn, dbi);
+	MDB_cmp_func *cmp = txn->mt_dbxs[dbi].md_cmp;
+	size_t pos;
+	int rc;
+
+	if (mdb_srun_search(sd->sd_buf, sd->sd_nbuf, &op->so_key, cmp, &pos)) {
+		sd->sd_buf[pos] = *op;
+		return MDB_SUCCESS;
+	}
+	if (sd->sd_nbuf == MDB_STAGE_BUF) {
+		if ((rc = mdb_stage_flush(sd, cmp, 0)) != MDB_SUCCESS)
+			return rc;
+		pos = 0;
+	}
+	memmove(&sd->sd_buf[pos+1], &sd->sd_buf[pos], (sd->sd_nbuf - pos) * sizeof(MDB_sop));
+	sd->sd_buf[pos] = *op;
+	sd->sd_nbuf++;
+	return MDB_SUCCESS;
+}
+
+static int mdb_stage_put(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, MDB_val *data,
+	unsigned int flags)
+{
+	MDB_sop op;
+	MDB_val old;
+	int rc;
+
+	if (flags & ~(MDB_NOOVERWRITE|MDB_RESERVE))
+		return EINVAL;
+	if (txn->txn_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+	if (key->mv_size-1 >= ENV_MAXKEY(txn->mt_env) || data->mv_size > MAXDATASIZE)
+		return MDB_BAD_VALSIZE;
+
+	if (flags & MDB_NOOVERWRITE) {
+		rc = mdb_get(txn, dbi, key, &old);
+		if (rc == MDB_SUCCESS) {
+			*data = old;
+			return MDB_KEYEXIST;
+		}
+		if (rc != MDB_NOTFOUND)
+			return rc;
+	}
+	op.so_key.mv_size = key->mv_size;
+	op.so_data.mv_size = data->mv_size;
+	op.so_del = 0;
+	if ((op.so_key.mv_data = mdb_stage_copy(txn->mt_stage, key->mv_data, key->mv_size)) == NULL ||
+		(op.so_data.mv_data = mdb_stage_copy(txn->mt_stage,
+			(flags & MDB_RESERVE) ? NULL : data->mv_data, data->mv_size)) == NULL ||
+		(rc = mdb_stage_add(txn, dbi, &op)) != MDB_SUCCESS) {
+		txn->txn_flags |= MDB_TXN_ERROR;
+		return ENOMEM;
+	}
+	if (flags & MDB_RESERVE)
+		data->mv_data = op.so_data.mv_data;
+	return MDB_SUCCESS;
+}
+
+static int mdb_stage_del(MDB_txn *txn, MDB_dbi dbi, MDB_val *key)
+{
+	MDB_sop op;
+	int rc;
+
+	/* Deleting a missing key fails now, as it would in a write txn */
+	if ((rc = mdb_get(txn, dbi, key, &op.so_data)) != MDB_SUCCESS)
+		return rc;
+	op.so_key.mv_size = key->mv_size;
+	op.so_del = 1;
+	if ((op.so_key.mv_data = mdb_stage_copy(txn->mt_stage, key->mv_data, key->mv_size)) == NULL ||
+		(rc = mdb_stage_add(txn, dbi, &op)) != MDB_SUCCESS) {
+		txn->txn_flags |= MDB_TXN_ERROR;
+		return ENOMEM;
+	}
+	return MDB_SUCCESS;
+}
+
+/** Return 1 if any of the DBIs of \b st is claimed by another staged txn */
+static int mdb_stage_busy(MDB_env *env, MDB_stage *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->st_ndbs; i++)
+		if (env->me_dbi_busy[st->st_dbs[i].sd_dbi])
+			return 1;
+	return 0;
+}
+
+/** Release the DBIs of a staged txn and free its ops */
+static void mdb_stage_free(MDB_env *env, MDB_stage *st)
+{
+	MDB_sblk *sb;
+	unsigned int i, j;
+
+	pthread_mutex_lock(&env->me_stage_mutex);
+	for (i = 0; i < st->st_ndbs; i++)
+		env->me_dbi_busy[st->st_dbs[i].sd_dbi] = 0;
+	pthread_cond_broadcast(&env->me_stage_cond);
+	pthread_mutex_unlock(&env->me_stage_mutex);
+
+	for (i = 0; i < st->st_ndbs; i++)
+		for (j = 0; j < st->st_dbs[i].sd_nruns; j++)
+			free(st->st_dbs[i].sd_runs[j].sr_ops);
+	while ((sb = st->st_blk) != NULL) {
+		st->st_blk = sb->sb_next;
+		free(sb);
+	}
+	free(st);
+}
+
+/** Refresh a stale named DB record, as a cursor on it would */
+static void mdb_stage_load(MDB_txn *txn, MDB_dbi dbi)
+{
+	MDB_cursor mc;
+	MDB_xcursor mx;
+
+	if (txn->mt_dbflags[dbi] & DB_STALE)
+		mdb_cursor_init(&mc, txn, dbi, &mx);
+}
+
+int mdb_txn_begin_dbis(MDB_env *env, const MDB_dbi *dbis, unsigned int ndbis,
+	unsigned int flags, MDB_txn **ret)
+{
+	MDB_stage *st;
+	MDB_txn *txn;
+	MDB_dbi dbi;
+	unsigned int i, j;
+	int rc;
+
+	if (!env || !dbis || !ndbis || !ret || (flags & ~(MDB_NOSYNC|MDB_NOMETASYNC)))
+		return EINVAL;
+	if (env->me_flags & MDB_RDONLY)
+		return EACCES;
+	if (!(env->me_flags & MDB_ENV_STAGE))
+		return EINVAL;
+
+	if ((st = calloc(1, offsetof(MDB_stage, st_dbs) + ndbis * sizeof(MDB_sdbi))) == NULL)
+		return ENOMEM;
+	st->st_flags = flags;
+	for (i = 0; i < ndbis; i++) {
+		dbi = dbis[i];
+		if (dbi < CORE_DBS || dbi >= env->me_numdbs || !(env->me_dbflags[dbi] & MDB_VALID)) {
+			free(st);
+			return EINVAL;
+		}
+		if (env->me_dbflags[dbi] & MDB_DUPSORT) {
+			free(st);
+			return MDB_INCOMPATIBLE;
+		}
+		for (j = 0; j < st->st_ndbs && st->st_dbs[j].sd_dbi != dbi; j++) ;
+		if (j == st->st_ndbs)
+			st->st_dbs[st->st_ndbs++].sd_dbi = dbi;
+	}
+
+	/* Claim all DBIs at once, so two staged txns cannot deadlock */
+	pthread_mutex_lock(&env->me_stage_mutex);
+	while (mdb_stage_busy(env, st))
+		pthread_cond_wait(&env->me_stage_cond, &env->me_stage_mutex);
+	for (i = 0; i < st->st_ndbs; i++)
+		env->me_dbi_busy[st->st_dbs[i].sd_dbi] = 1;
+	pthread_mutex_unlock(&env->me_stage_mutex);
+
+	/* Only now take the snapshot, so that it has the commits of the
+	 * previous claimants of these DBIs.
+	 */
+	if ((rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn)) != MDB_SUCCESS) {
+		mdb_stage_free(env, st);
+		return rc;
+	}
+	for (i = 0; i < st->st_ndbs; i++) {
+		dbi = st->st_dbs[i].sd_dbi;
+		mdb_stage_load(txn, dbi);
+		st->st_dbs[i].sd_db = txn->mt_dbs[dbi];
+	}
+	txn->mt_stage = st;
+	*ret = txn;
+	return MDB_SUCCESS;
+}
+
+/** Commit a staged txn: replay its ops in a regular write txn.
+ *	Only the replay holds the writer lock. It fails with #MDB_CONFLICT
+ *	if a declared DBI changed since the snapshot, which is only possible
+ *	through a regular write txn or another process.
+ *	The staged txn is ended in any case.
+ */
+static int mdb_stage_commit(MDB_txn *txn, mdb_size_t *ticket)
+{
+	MDB_stage *st = txn->mt_stage;
+	MDB_env *env = txn->mt_env;
+	MDB_txn *wtxn = NULL;
+	MDB_sdbi *sd;
+	MDB_sop *ops;
+	MDB_val *keys = NULL, *vals;
+	MDB_dbi dbi;
+	size_t i, j, n, max = 0;
+	unsigned int k;
+	int rc;
+
+	if (txn->txn_flags & (MDB_TXN_FINISHED|MDB_TXN_ERROR)) {
+		rc = MDB_BAD_TXN;
+		goto fail;
+	}
+	/* Sort everything before taking the writer lock */
+	for (k = 0; k < st->st_ndbs; k++) {
+		sd = &st->st_dbs[k];
+		if ((rc = mdb_stage_flush(sd, txn->mt_dbxs[sd->sd_dbi].md_cmp, 1)) != MDB_SUCCESS)
+			goto fail;
+		if (sd->sd_nruns && sd->sd_runs[0].sr_n > max)
+			max = sd->sd_runs[0].sr_n;
+	}
+	if (!max) {
+		rc = MDB_SUCCESS;
+		if (ticket)
+			*ticket = txn->m_snapshot_id;
+		goto done;
+	}
+	if ((keys = malloc(2 * max * sizeof(MDB_val))) == NULL) {
+		rc = ENOMEM;
+		goto fail;
+	}
+	vals = keys + max;
+
+	if ((rc = mdb_txn_begin(env, NULL, st->st_flags, &wtxn)) != MDB_SUCCESS)
+		goto fail;
+	for (k = 0; k < st->st_ndbs; k++) {
+		sd = &st->st_dbs[k];
+		dbi = sd->sd_dbi;
+		if (!TXN_DBI_EXIST(wtxn, dbi, DB_USRVALID)) {
+			rc = MDB_BAD_DBI;
+			goto fail;
+		}
+		mdb_stage_load(wtxn, dbi);
+		if (wtxn->mt_dbs[dbi].md_root != sd->sd_db.md_root ||
+			wtxn->mt_dbs[dbi].md_entries != sd->sd_db.md_entries) {
+			rc = MDB_CONFLICT;
+			goto fail;
+		}
+		if (!sd->sd_nruns)
+			continue;
+		ops = sd->sd_runs[0].sr_ops;
+		n = sd->sd_runs[0].sr_n;
+		for (i = 0; i < n; i = j) {
+			if (ops[i].so_del) {
+				rc = mdb_del(wtxn, dbi, &ops[i].so_key, NULL);
+				if (rc == MDB_NOTFOUND)
+					rc = MDB_SUCCESS;	/* key was put and deleted again */
+				j = i + 1;
+			} else {
+				for (j = i; j < n && !ops[j].so_del; j++) {
+					keys[j-i] = ops[j].so_key;
+					vals[j-i] = ops[j].so_data;
+				}
+				rc = mdb_put_batch(wtxn, dbi, keys, vals, j - i, 0);
+			}
+			if (rc)
+				goto fail;
+		}
+	}
+	rc = _mdb_txn_commit(wtxn, ticket);
+	wtxn = NULL;
+	if (rc)
+		goto fail;
+done:
+	free(keys);
+	mdb_txn_end(txn, MDB_END_COMMITTED|MDB_END_UPDATE|MDB_END_SLOT|MDB_END_FREE);
+	return rc;
+fail:
+	free(keys);
+	if (wtxn)
+		_mdb_txn_abort(wtxn);
+	_mdb_txn_abort(txn);
+	return rc;
+}
+
+/** State of a bottom-up build started by #mdb_bulk_begin().
+ *	The cursor stack holds the open (rightmost) page of every level,
+ *	root first, leaf last. Every other page is complete and is never
+ *	touched again, so the tree is valid after each #mdb_bulk_put().
+ */
+struct MDB_bulk {
+	MDB_cursor	mb_cursor;	/**< tracked, and first: see #mdb_cursors_close() */
+	unsigned int	mb_fill;	/**< max bytes to use in a page */
+};
+
+/** Append a node to the open page \b lvl levels above the leaves,
+ *	starting a new page there if it would grow past the fill limit.
+ *	A new page is linked into its parent level, which may in turn
+ *	start a new page or a new root.
+ */
+static int mdb_bulk_add(MDB_bulk *mb, unsigned int lvl, MDB_val *key, MDB_val *data, pgno_t pgno)
+{
+	MDB_cursor *mc = &mb->mb_cursor;
+	MDB_env *env = mc->mc_txn->mt_env;
+	MDB_PageHeader *mp, *np, *pp;
+	MDB_val nullkey;
+	size_t nsize;
+	unsigned int top, used;
+	int i, rc;
+
+	mp = mc->mc_pg[mc->mc_top - lvl];
+	nsize = IS_LEAF(mp) ? mdb_leaf_size(env, key, data) : mdb_branch_size(env, key);
+	used = env->me_psize - PAGEHDRSZ - SIZELEFT(mp);
+	if (NUMKEYS(mp) && (nsize > SIZELEFT(mp) || used + nsize > mb->mb_fill)) {
+		if ((rc = mdb_page_new(mc, mp->mp_flags & (P_BRANCH|P_LEAF), 1, &np)))
+			return rc;
+		if (lvl == mc->mc_top) {
+			/* mp is the root, grow the tree by one level */
+			if (mc->mc_snum >= CURSOR_STACK)
+				return MDB_CURSOR_FULL;
+			if ((rc = mdb_page_new(mc, P_BRANCH, 1, &pp)))
+				return rc;
+			for (i=mc->mc_snum; i>0; i--) {
+				mc->mc_pg[i] = mc->mc_pg[i-1];
+				mc->mc_ki[i] = mc->mc_ki[i-1];
+			}
+			mc->mc_pg[0] = pp;
+			mc->mc_ki[0] = 0;
+			mc->mc_snum++;
+			mc->mc_top++;
+			mc->mc_db->md_root = pp->mp_pgno;
+			mc->mc_db->md_depth++;
+			top = mc->mc_top;
+			mc->mc_top = 0;
+			rc = mdb_insert_node(mc, 0, NULL, NULL, mp->mp_pgno, 0);
+			mc->mc_top = top;
+			if (rc)
+				return rc;
+		}
+		if ((rc = mdb_bulk_add(mb, lvl + 1, key, NULL, np->mp_pgno)))
+			return rc;
+		mc->mc_pg[mc->mc_top - lvl] = np;
+		if (IS_BRANCH(np)) {
+			/* First branch index doesn't need key data. */
+			nullkey.mv_size = 0;
+			nullkey.mv_data = NULL;
+			key = &nullkey;
+		}
+	}
+
+	top = mc->mc_top;
+	mc->mc_top -= lvl;
+	mp = mc->mc_pg[mc->mc_top];
+	rc = mdb_insert_node(mc, NUMKEYS(mp), key, data, pgno, 0);
+	mc->mc_ki[mc->mc_top] = NUMKEYS(mp) - 1;
+	mc->mc_top = top;
+	return rc;
+}
+
+int mdb_bulk_begin(MDB_txn *txn, MDB_dbi dbi, unsigned int fill, MDB_bulk **ret)
+{
+	MDB_bulk *mb;
+	MDB_cursor *mc;
+	int rc;
+
+	if (!ret || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID) || fill > 100)
+		return EINVAL;
+
+	if (txn->txn_flags & (MDB_TXN_RDONLY|MDB_TXN_BLOCKED))
+		return (txn->txn_flags & MDB_TXN_RDONLY) ? EACCES : MDB_BAD_TXN;
+
+	if (txn->mt_dbs[dbi].md_flags & (MDB_DUPSORT|MDB_DUPFIXED))
+		return MDB_INCOMPATIBLE;
+
+	if ((mb = calloc(1, sizeof(MDB_bulk))) == NULL)
+		return ENOMEM;
+	mc = &mb->mb_cursor;
+	mdb_cursor_init(mc, txn, dbi, NULL);
+
+	/* Make sure we're looking at an up-to-date, empty root */
+	rc = mdb_relocate_cursor(mc, NULL, MDB_PS_ROOTONLY);
+	if (rc != MDB_NOTFOUND) {
+		free(mb);
+		return rc ? rc : EINVAL;
+	}
+	mc->mc_snum = 0;
+	mc->mc_top = 0;
+	/* Tracked, so that spills for other DBs leave its open pages alone */
+	mc->mc_flags = C_UNTRACK;
+	mc->mc_next = txn->mt_cursors[dbi];
+	txn->mt_cursors[dbi] = mc;
+
+	if (!fill)
+		fill = 100;
+	mb->mb_fill = (txn->mt_env->me_psize - PAGEHDRSZ) * fill / 100;
+	*ret = mb;
+	return MDB_SUCCESS;
+}
+
+int mdb_bulk_put(MDB_bulk *mb, MDB_val *key, MDB_val *data)
+{
+	MDB_cursor *mc;
+	MDB_PageHeader *mp;
+	MDB_val lastkey;
+	int rc;
+
+	if (!mb || !key || !data)
+		return EINVAL;
+
+	mc = &mb->mb_cursor;
+	if (mc->mc_txn->txn_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	if (key->mv_size-1 >= MDB_MAXKEYSIZE || data->mv_size > MAXDATASIZE)
+		return MDB_BAD_VALSIZE;
+
+	if (mc->mc_snum) {
+		mp = mc->mc_pg[mc->mc_top];
+		mdb_node_read_key(get_node_n(mp, NUMKEYS(mp) - 1), &lastkey);
+		if (mc->mc_dbx->md_cmp(key, &lastkey) <= 0)
+			return MDB_KEYEXIST;
+	}
+
+	if ((rc = mdb_page_spill(mc, key, data)))
+		goto fail;
+
+	if (!mc->mc_snum) {
+		if ((rc = mdb_page_new(mc, P_LEAF, 1, &mp)))
+			goto fail;
+		mdb_cursor_push(mc, mp);
+		mc->mc_db->md_root = mp->mp_pgno;
+		mc->mc_db->md_depth = 1;
+		mc->mc_flags |= C_INITIALIZED;
+		*mc->mc_dbflag |= DB_DIRTY;
+	}
+
+	if ((rc = mdb_bulk_add(mb, 0, key, data, 0)))
+		goto fail;
+	mc->mc_db->md_entries++;
+	return MDB_SUCCESS;
+
+fail:
+	mc->mc_txn->txn_flags |= MDB_TXN_ERROR;
+	return rc;
+}
 
-						/* Need writable leaf_node */
-						if (mp != leaf_node) {
-							mc.mc_pg[mc.mc_top] = leaf_node;
-							mdb_page_copy(leaf_node, mp, my->mc_env->me_psize);
-							mp = leaf_node;
-							ni = get_node_n(mp, i);
-						}
+void mdb_bulk_close(MDB_bulk *mb)
+{
+	MDB_cursor *mc, **prev;
 
-						memcpy(&pg, get_node_data(ni), sizeof(pg));
-						memcpy(get_node_data(ni), &my->mc_next_pgno, sizeof(pgno_t));
-						rc = mdb_page_get(mc.mc_txn, pg, &omp, NULL);
-						if (rc)
-							goto done;
-						if (my->mc_wlen[toggle] >= MDB_WBUF) {
-							rc = mdb_env_cthr_toggle(my, 1);
-							if (rc)
-								goto done;
-							toggle = my->mc_toggle;
-						}
-						mo = (MDB_PageHeader *)(my->mc_wbuf[toggle] + my->mc_wlen[toggle]);
-						memcpy(mo, omp, my->mc_env->me_psize);
-						mo->mp_pgno = my->mc_next_pgno;
-						my->mc_next_pgno += omp->m_ovf_page_count;
-						my->mc_wlen[toggle] += my->mc_env->me_psize;
-						if (omp->m_ovf_page_count > 1) {
-							my->mc_olen[toggle] = my->mc_env->me_psize * (omp->m_ovf_page_count - 1);
-							my->mc_over[toggle] = (char *)omp + my->mc_env->me_psize;
-							rc = mdb_env_cthr_toggle(my, 1);
-							if (rc)
-								goto done;
-							toggle = my->mc_toggle;
-						}
-					} else if (ni->mn_flags & F_SUB_DATABASE) {
-						MDB_db db;
+	if (!mb)
+		return;
+	mc = &mb->mb_cursor;
+	for (prev = &mc->mc_txn->mt_cursors[mc->mc_dbi]; *prev; prev = &(*prev)->mc_next) {
+		if (*prev == mc) {
+			*prev = mc->mc_next;
+			break;
+		}
+	}
+	free(mb);
+}
+
+#ifndef MDB_WBUF
+#define MDB_WBUF	(1024*1024)
+#endif
+#define MDB_EOF		0x10	/**< #mdb_env_copyfd1() is done reading */
+
+#ifndef MDB_CP_THREADS
+	/** Most worker threads used by a compacting copy to a regular file.
+	 *	The actual number is limited by the online CPUs. Copies to a
+	 *	pipe always use a single walker and a stream writer.
+	 */
+#define MDB_CP_THREADS	32
+#endif
+
+#ifndef MDB_CP_MINPAGES
+	/** Smallest environment, in pages, that a compacting copy spreads
+	 *	over worker threads. Named DBs smaller than this are copied by
+	 *	a single worker as a whole.
+	 */
+#define MDB_CP_MINPAGES	16384
+#endif
+
+	/** Sub-trees wanted per worker when splitting a DB for the workers */
+#define MDB_CP_SPREAD	8
+
+struct mdb_cpool;
+
+	/** State needed for a double-buffering compacting copy. */
+typedef struct mdb_copy {
+	MDB_env *mc_env;
+	MDB_txn *mc_txn;
+	pthread_mutex_t mc_mutex;
+	pthread_cond_t mc_cond;	/**< Condition variable for #mc_new */
+	char *mc_wbuf[2];
+	char *mc_over[2];
+	int mc_wlen[2];
+	int mc_olen[2];
+	pgno_t mc_next_pgno;
+	HANDLE mc_fd;
+	int mc_toggle;			/**< Buffer number in provider */
+	int mc_new;				/**< (0-2 buffers to write) | (#MDB_EOF at end) */
+	/** Error code.  Never cleared if set.  Both threads can set nonzero
+	 *	to fail the copy.  Not mutex-protected, LMDB expects atomic int.
+	 */
+	volatile int mc_error;
+	/** Set while this walker writes a pre-assigned page range with
+	 *	pwrite() for a parallel copy, instead of feeding #mdb_env_copythr().
+	 */
+	struct mdb_cpool *mc_pool;
+} mdb_copy;
+
+	/** A sub-tree copied by one worker of a parallel compacting copy. */
+typedef struct mdb_cunit {
+	pgno_t cu_pgno;		/**< root of the sub-tree in the source */
+	pgno_t cu_root;		/**< root of the sub-tree in the copy */
+	pgno_t cu_base;		/**< first page number of its output range */
+	pgno_t cu_count;	/**< pages it takes in the copy, 0 if not yet known */
+	int cu_height;		/**< levels from #cu_pgno down to the leaves */
+	int cu_scan;		/**< leaves must be read to count overflow and sub-DB pages */
+} mdb_cunit;
+
+	/** Shared state of a parallel compacting copy.
+	 *
+	 * The upper levels of the main DB and of large named DBs are walked
+	 * by the calling thread, which cuts the trees into sub-trees. Workers
+	 * first count the pages of each sub-tree, which fixes its range of
+	 * output page numbers, and then copy the sub-trees into their ranges
+	 * concurrently. Finally the calling thread copies the upper pages
+	 * after all the sub-trees, ending with the main DB root. The copy
+	 * is as compact as a single walker's; only the page order differs.
+	 */
+typedef struct mdb_cpool {
+	MDB_txn *cp_txn;
+	MDB_OFF_T cp_off;		/**< file offset of page 0 of the copy */
+	pthread_mutex_t cp_mutex;	/**< Protects #cp_next */
+	mdb_cunit *cp_units;
+	unsigned cp_nunits;
+	unsigned cp_maxunits;
+	unsigned cp_next;		/**< next unit to hand out or to link in */
+	int cp_copy;			/**< 0 while counting, 1 while copying */
+	unsigned cp_spread;		/**< sub-trees wanted per split DB */
+	volatile int cp_error;	/**< first error of any worker */
+} mdb_cpool;
+
+	/** Dedicated writer thread for compacting copy. */
+static THREAD_RET ESECT CALL_CONV
+mdb_env_copythr(void *arg)
+{
+	mdb_copy *my = arg;
+	char *ptr;
+	int toggle = 0, wsize, rc;
+#ifdef _WIN32
+	DWORD len;
+#define DO_WRITE(rc, fd, ptr, w2, len)	rc = WriteFile(fd, ptr, w2, &len, NULL)
+#else
+	int len;
+#define DO_WRITE(rc, fd, ptr, w2, len)	len = write(fd, ptr, w2); rc = (len >= 0)
+#ifdef SIGPIPE
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	if ((rc = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0)
+		my->mc_error = rc;
+#endif
+#endif
+
+	pthread_mutex_lock(&my->mc_mutex);
+	for(;;) {
+		while (!my->mc_new)
+			pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
+		if (my->mc_new == 0 + MDB_EOF) /* 0 buffers, just EOF */
+			break;
+		wsize = my->mc_wlen[toggle];
+		ptr = my->mc_wbuf[toggle];
+again:
+		rc = MDB_SUCCESS;
+		while (wsize > 0 && !my->mc_error) {
+			DO_WRITE(rc, my->mc_fd, ptr, wsize, len);
+			if (!rc) {
+				rc = ErrCode();
+#if defined(SIGPIPE) && !defined(_WIN32)
+				if (rc == EPIPE) {
+					/* Collect the pending SIGPIPE, otherwise at least OS X
+					 * gives it to the process on thread-exit (ITS#8504).
+					 */
+					int tmp;
+					sigwait(&set, &tmp);
+				}
+#endif
+				break;
+			} else if (len > 0) {
+				rc = MDB_SUCCESS;
+				ptr += len;
+				wsize -= len;
+				continue;
+			} else {
+				rc = EIO;
+				break;
+			}
+		}
+		if (rc) {
+			my->mc_error = rc;
+		}
+		/* If there's an overflow page tail, write it too */
+		if (my->mc_olen[toggle]) {
+			wsize = my->mc_olen[toggle];
+			ptr = my->mc_over[toggle];
+			my->mc_olen[toggle] = 0;
+			goto again;
+		}
+		my->mc_wlen[toggle] = 0;
+		toggle ^= 1;
+		/* Return the empty buffer to provider */
+		my->mc_new--;
+		pthread_cond_signal(&my->mc_cond);
+	}
+	pthread_mutex_unlock(&my->mc_mutex);
+	return (THREAD_RET)0;
+#undef DO_WRITE
+}
+
+	/** Write all of \b len bytes at offset \b off. */
+static int ESECT
+mdb_env_cpput(HANDLE fd, const char *ptr, size_t len, MDB_OFF_T off)
+{
+	ssize_t rc;
+
+	while (len) {
+		rc = pwrite(fd, ptr, len, off);
+		if (rc < 0) {
+			rc = ErrCode();
+			if (rc == EINTR)
+				continue;
+			return rc;
+		}
+		if (rc == 0)
+			return EIO;
+		ptr += rc;
+		len -= rc;
+		off += rc;
+	}
+	return MDB_SUCCESS;
+}
+
+	/** Write out a parallel copy walker's buffer and overflow tail.
+	 *
+	 * The buffered pages are the ones numbered just below
+	 * #mdb_copy.mc_next_pgno, so they go right below its offset.
+	 * @param[in] my control structure.
+	 * @return the walker's or any other worker's error code.
+	 */
+static int ESECT
+mdb_env_cpwrite(mdb_copy *my)
+{
+	int toggle = my->mc_toggle;
+	size_t wlen = my->mc_wlen[toggle], olen = my->mc_olen[toggle];
+	MDB_OFF_T off = my->mc_pool->cp_off +
+		(MDB_OFF_T)my->mc_next_pgno * my->mc_env->me_psize - (MDB_OFF_T)(wlen + olen);
+	int rc;
+
+	rc = mdb_env_cpput(my->mc_fd, my->mc_wbuf[toggle], wlen, off);
+	if (!rc && olen)
+		rc = mdb_env_cpput(my->mc_fd, my->mc_over[toggle], olen, off + wlen);
+	my->mc_wlen[toggle] = 0;
+	my->mc_olen[toggle] = 0;
+	if (rc)
+		my->mc_error = rc;
+	return my->mc_error ? my->mc_error : my->mc_pool->cp_error;
+}
+
+	/** Give buffer and/or #MDB_EOF to writer thread, await unused buffer.
+	 *
+	 * @param[in] my control structure.
+	 * @param[in] adjust (1 to hand off 1 buffer) | (MDB_EOF when ending).
+	 */
+static int ESECT
+mdb_env_cthr_toggle(mdb_copy *my, int adjust)
+{
+	if (my->mc_pool)
+		return mdb_env_cpwrite(my);
+	pthread_mutex_lock(&my->mc_mutex);
+	my->mc_new += adjust;
+	pthread_cond_signal(&my->mc_cond);
+	while (my->mc_new & 2)		/* both buffers in use */
+		pthread_cond_wait(&my->mc_cond, &my->mc_mutex);
+	pthread_mutex_unlock(&my->mc_mutex);
+
+	my->mc_toggle ^= (adjust & 1);
+	/* Both threads reset mc_wlen, to be safe from threading errors */
+	my->mc_wlen[my->mc_toggle] = 0;
+	return my->mc_error;
+}
+
+	/** Append a copy of page \b mp to the output of a compacting copy.
+	 * @param[in] my control structure.
+	 * @param[in] mp the page to copy.
+	 * @param[out] pgno the number of the page in the copy.
+	 */
+static int ESECT
+mdb_env_cput(mdb_copy *my, MDB_PageHeader *mp, pgno_t *pgno)
+{
+	MDB_PageHeader *mo;
+	int rc;
+
+	if (my->mc_wlen[my->mc_toggle] >= MDB_WBUF) {
+		rc = mdb_env_cthr_toggle(my, 1);
+		if (rc)
+			return rc;
+	}
+	mo = (MDB_PageHeader *)(my->mc_wbuf[my->mc_toggle] + my->mc_wlen[my->mc_toggle]);
+	mdb_page_copy(mo, mp, my->mc_env->me_psize);
+	*pgno = mo->mp_pgno = my->mc_next_pgno++;
+	my->mc_wlen[my->mc_toggle] += my->mc_env->me_psize;
+	return MDB_SUCCESS;
+}
 
+	/** Copy the overflow pages of a #F_BIGDATA node for a compacting copy.
+	 * @param[in] my control structure.
+	 * @param[in,out] ni a node in a writable page; its data is pointed
+	 *	at the copy of the overflow pages.
+	 */
+static int ESECT
+mdb_env_covfl(mdb_copy *my, MDB_node *ni)
+{
+	MDB_PageHeader *omp, *mo;
+	pgno_t pg;
+	int rc;
+
+	memcpy(&pg, get_node_data(ni), sizeof(pg));
+	memcpy(get_node_data(ni), &my->mc_next_pgno, sizeof(pgno_t));
+	rc = mdb_page_get(my->mc_txn, pg, &omp, NULL);
+	if (rc)
+		return rc;
+	if (my->mc_wlen[my->mc_toggle] >= MDB_WBUF) {
+		rc = mdb_env_cthr_toggle(my, 1);
+		if (rc)
+			return rc;
+	}
+	mo = (MDB_PageHeader *)(my->mc_wbuf[my->mc_toggle] + my->mc_wlen[my->mc_toggle]);
+	memcpy(mo, omp, my->mc_env->me_psize);
+	mo->mp_pgno = my->mc_next_pgno;
+	my->mc_next_pgno += omp->m_ovf_page_count;
+	my->mc_wlen[my->mc_toggle] += my->mc_env->me_psize;
+	if (omp->m_ovf_page_count > 1) {
+		my->mc_olen[my->mc_toggle] = my->mc_env->me_psize * (omp->m_ovf_page_count - 1);
+		my->mc_over[my->mc_toggle] = (char *)omp + my->mc_env->me_psize;
+		rc = mdb_env_cthr_toggle(my, 1);
+	}
+	return rc;
+}
+
+	/** Depth-first tree traversal for compacting copy.
+	 * @param[in] my control structure.
+	 * @param[in,out] pg database root.
+	 * @param[in] flags includes #F_DUPDATA if it is a sorted-duplicate sub-DB.
+	 */
+static int ESECT mdb_env_cwalk(mdb_copy *my, pgno_t *pg, int flags)
+{
+	MDB_cursor mc = {0};
+	MDB_node *ni;
+	MDB_PageHeader *mp, *leaf_node;
+	char *buf, *ptr;
+	pgno_t pgno;
+	int rc;
+	unsigned int i;
+
+	/* Empty DB, nothing to do */
+	if (*pg == P_INVALID)
+		return MDB_SUCCESS;
+
+	mc.mc_snum = 1;
+	mc.mc_txn = my->mc_txn;
+	mc.mc_flags = my->mc_txn->txn_flags & (MDB_TXN_RDONLY|C_WRITEMAP);
+
+	rc = mdb_page_get(mc.mc_txn, *pg, &mc.mc_pg[0], NULL);
+	if (rc)
+		return rc;
+	rc = __mdb_locate_cursor(&mc, NULL, MDB_PS_FIRST);
+	if (rc)
+		return rc;
+
+	/* Make cursor pages writable */
+	buf = ptr = malloc(my->mc_env->me_psize * mc.mc_snum);
+	if (buf == NULL)
+		return ENOMEM;
+
+	for (i=0; i<mc.mc_top; i++) {
+		mdb_page_copy((MDB_PageHeader *)ptr, mc.mc_pg[i], my->mc_env->me_psize);
+		mc.mc_pg[i] = (MDB_PageHeader *)ptr;
+		ptr += my->mc_env->me_psize;
+	}
+
+	/* This is writable space for a leaf_node page. Usually not needed. */
+	leaf_node = (MDB_PageHeader *)ptr;
+
+	while (mc.mc_snum > 0) {
+		unsigned n;
+		mp = mc.mc_pg[mc.mc_top];
+		n = NUMKEYS(mp);
+
+		if (IS_LEAF(mp)) {
+			if (!IS_LEAF2(mp) && !(flags & F_DUPDATA)) {
+				for (i=0; i<n; i++) {
+					ni = get_node_n(mp, i);
+					if (ni->mn_flags & (F_BIGDATA|F_SUB_DATABASE)) {
 						/* Need writable leaf_node */
 						if (mp != leaf_node) {
 							mc.mc_pg[mc.mc_top] = leaf_node;
@@ -8828,13 +13176,18 @@ static int ESECT mdb_env_cwalk(mdb_copy *my, pgno_t *pg, int flags)
 							mp = leaf_node;
 							ni = get_node_n(mp, i);
 						}
+					}
+					if (ni->mn_flags & F_BIGDATA) {
+						rc = mdb_env_covfl(my, ni);
+						if (rc)
+							goto done;
+					} else if (ni->mn_flags & F_SUB_DATABASE) {
+						MDB_db db;
 
 						memcpy(&db, get_node_data(ni), sizeof(db));
-						my->mc_toggle = toggle;
 						rc = mdb_env_cwalk(my, &db.md_root, ni->mn_flags & F_DUPDATA);
 						if (rc)
 							goto done;
-						toggle = my->mc_toggle;
 						memcpy(get_node_data(ni), &db, sizeof(db));
 					}
 				}
@@ -8842,11 +13195,10 @@ static int ESECT mdb_env_cwalk(mdb_copy *my, pgno_t *pg, int flags)
 		} else {
 			mc.mc_ki[mc.mc_top]++;
 			if (mc.mc_ki[mc.mc_top] < n) {
-				pgno_t pg;
 again:
 				ni = get_node_n(mp, mc.mc_ki[mc.mc_top]);
-				pg = get_page_no(ni);
-				rc = mdb_page_get(mc.mc_txn, pg, &mp, NULL);
+				pgno = get_page_no(ni);
+				rc = mdb_page_get(mc.mc_txn, pgno, &mp, NULL);
 				if (rc)
 					goto done;
 				mc.mc_top++;
@@ -8863,24 +13215,17 @@ again:
 				continue;
 			}
 		}
-		if (my->mc_wlen[toggle] >= MDB_WBUF) {
-			rc = mdb_env_cthr_toggle(my, 1);
-			if (rc)
-				goto done;
-			toggle = my->mc_toggle;
-		}
-		mo = (MDB_PageHeader *)(my->mc_wbuf[toggle] + my->mc_wlen[toggle]);
-		mdb_page_copy(mo, mp, my->mc_env->me_psize);
-		mo->mp_pgno = my->mc_next_pgno++;
-		my->mc_wlen[toggle] += my->mc_env->me_psize;
+		rc = mdb_env_cput(my, mp, &pgno);
+		if (rc)
+			goto done;
 		if (mc.mc_top) {
 			/* Update parent if there is one */
 			ni = get_node_n(mc.mc_pg[mc.mc_top-1], mc.mc_ki[mc.mc_top-1]);
-			SETPGNO(ni, mo->mp_pgno);
+			SETPGNO(ni, pgno);
 			mdb_cursor_pop(&mc);
 		} else {
 			/* Otherwise we're done */
-			*pg = mo->mp_pgno;
+			*pg = pgno;
 			break;
 		}
 	}
@@ -8889,6 +13234,380 @@ done:
 	return rc;
 }
 
+	/** Count the pages a sub-tree takes in a compacting copy.
+	 * @param[in] txn the read-only txn of the copy.
+	 * @param[in] pg root of the sub-tree.
+	 * @param[in] height levels from \b pg down to the leaves.
+	 * @param[in] scan nonzero if leaves may hold #F_BIGDATA or
+	 *	#F_SUB_DATABASE nodes and must be read.
+	 * @param[in,out] count incremented by the number of pages.
+	 */
+static int ESECT
+mdb_env_ccount(MDB_txn *txn, pgno_t pg, int height, int scan, pgno_t *count)
+{
+	MDB_PageHeader *mp, *omp;
+	MDB_node *ni;
+	MDB_db db;
+	unsigned i, n;
+	int rc;
+
+	(*count)++;
+	if (height == 1 && !scan)
+		return MDB_SUCCESS;
+	rc = mdb_page_get(txn, pg, &mp, NULL);
+	if (rc)
+		return rc;
+	n = NUMKEYS(mp);
+	if (IS_BRANCH(mp)) {
+		for (i=0; i<n; i++) {
+			rc = mdb_env_ccount(txn, get_page_no(get_node_n(mp, i)),
+				height - 1, scan, count);
+			if (rc)
+				return rc;
+		}
+	} else if (!IS_LEAF2(mp)) {
+		for (i=0; i<n; i++) {
+			ni = get_node_n(mp, i);
+			if (ni->mn_flags & F_BIGDATA) {
+				/* Compressed values don't tell their page count
+				 * by their size, so ask the overflow page itself.
+				 */
+				memcpy(&pg, get_node_data(ni), sizeof(pg));
+				rc = mdb_page_get(txn, pg, &omp, NULL);
+				if (rc)
+					return rc;
+				*count += omp->m_ovf_page_count;
+			} else if (ni->mn_flags & F_SUB_DATABASE) {
+				memcpy(&db, get_node_data(ni), sizeof(db));
+				if (db.md_root == P_INVALID)
+					continue;
+				if ((ni->mn_flags & F_DUPDATA) || !(db.md_flags & MDB_DUPSORT)) {
+					/* Neither holds sub-DBs of its own, so its stats are exact */
+					*count += db.md_branch_pages + db.md_leaf_pages +
+						db.md_overflow_pages;
+				} else {
+					rc = mdb_env_ccount(txn, db.md_root, db.md_depth, 1, count);
+					if (rc)
+						return rc;
+				}
+			}
+		}
+	}
+	return MDB_SUCCESS;
+}
+
+	/** Add a sub-tree for the workers of a parallel copy. */
+static int ESECT
+mdb_env_cunit(mdb_cpool *cp, pgno_t pg, int height, int scan)
+{
+	mdb_cunit *cu;
+
+	if (cp->cp_nunits == cp->cp_maxunits) {
+		unsigned max = cp->cp_maxunits ? cp->cp_maxunits * 2 : 64;
+		cu = realloc(cp->cp_units, max * sizeof(mdb_cunit));
+		if (!cu)
+			return ENOMEM;
+		cp->cp_units = cu;
+		cp->cp_maxunits = max;
+	}
+	cu = &cp->cp_units[cp->cp_nunits++];
+	memset(cu, 0, sizeof(*cu));
+	cu->cu_pgno = pg;
+	cu->cu_height = height;
+	cu->cu_scan = scan;
+	return MDB_SUCCESS;
+}
+
+	/** Pick the level at which a DB is cut into sub-trees for the workers.
+	 *
+	 * The fan-out along the leftmost path estimates how many pages
+	 * each level holds; the first level holding enough of them wins.
+	 * @param[in] cp the pool.
+	 * @param[in] db the DB to cut.
+	 * @param[in] main nonzero for the main DB. A small one is walked
+	 *	entirely by the caller, so that its named DBs get cut in turn.
+	 * @return the level, 0 to copy the DB as a single sub-tree.
+	 */
+static int ESECT
+mdb_env_csplit(mdb_cpool *cp, MDB_db *db, int main)
+{
+	MDB_PageHeader *mp;
+	pgno_t pg = db->md_root;
+	size_t est = 1;
+	int lvl = 0;
+
+	if (db->md_branch_pages + db->md_leaf_pages +
+		db->md_overflow_pages < MDB_CP_MINPAGES)
+		return main ? (int)db->md_depth : 0;
+	while (est < cp->cp_spread && lvl + 1 < (int)db->md_depth) {
+		/* A bad page is reported by the walk proper */
+		if (mdb_page_get(cp->cp_txn, pg, &mp, NULL))
+			break;
+		est *= NUMKEYS(mp);
+		pg = get_page_no(get_node_n(mp, 0));
+		lvl++;
+	}
+	return lvl;
+}
+
+static int mdb_env_cdb(mdb_cpool *cp, mdb_copy *my, MDB_db *db, int main);
+
+	/** Walk the levels of a DB above the level it is cut at.
+	 *
+	 * Without a writer, collect the sub-trees below the cut for the
+	 * workers. With one, copy the pages above the cut, pointing them
+	 * at the sub-trees the workers have written.
+	 * @param[in] cp the pool.
+	 * @param[in] my writer of the upper pages, or NULL when collecting.
+	 * @param[in,out] pg the page to walk; set to its number in the copy.
+	 * @param[in] lvl level of \b pg in its DB, the root being 0.
+	 * @param[in] cut level at which the DB is cut.
+	 * @param[in] depth depth of the DB.
+	 * @param[in] scan see #mdb_cunit.cu_scan.
+	 */
+static int ESECT
+mdb_env_ctree(mdb_cpool *cp, mdb_copy *my, pgno_t *pg, int lvl, int cut,
+	int depth, int scan)
+{
+	MDB_PageHeader *mp, *mo;
+	MDB_node *ni;
+	MDB_db db;
+	pgno_t pgno;
+	unsigned i, n;
+	int rc;
+
+	if (lvl == cut) {
+		if (!my)
+			return mdb_env_cunit(cp, *pg, depth - lvl, scan);
+		*pg = cp->cp_units[cp->cp_next++].cu_root;
+		return MDB_SUCCESS;
+	}
+	rc = mdb_page_get(cp->cp_txn, *pg, &mp, NULL);
+	if (rc)
+		return rc;
+	mo = mp;
+	if (my) {
+		/* Make the page writable */
+		if ((mo = malloc(my->mc_env->me_psize)) == NULL)
+			return ENOMEM;
+		mdb_page_copy(mo, mp, my->mc_env->me_psize);
+	}
+	n = NUMKEYS(mo);
+	for (i=0; i<n && !rc; i++) {
+		ni = get_node_n(mo, i);
+		if (IS_BRANCH(mo)) {
+			pgno = get_page_no(ni);
+			rc = mdb_env_ctree(cp, my, &pgno, lvl + 1, cut, depth, scan);
+			if (!rc && my)
+				SETPGNO(ni, pgno);
+		} else if (ni->mn_flags & F_BIGDATA) {
+			/* Only main DB leaves are ever above the cut */
+			if (my)
+				rc = mdb_env_covfl(my, ni);
+		} else if (ni->mn_flags & F_SUB_DATABASE) {
+			memcpy(&db, get_node_data(ni), sizeof(db));
+			if (ni->mn_flags & F_DUPDATA) {
+				if (my)
+					rc = mdb_env_cwalk(my, &db.md_root, F_DUPDATA);
+			} else {
+				rc = mdb_env_cdb(cp, my, &db, 0);
+			}
+			if (!rc && my)
+				memcpy(get_node_data(ni), &db, sizeof(db));
+		}
+	}
+	if (my) {
+		if (!rc)
+			rc = mdb_env_cput(my, mo, pg);
+		free(mo);
+	}
+	return rc;
+}
+
+	/** Cut a DB into sub-trees, or link its written sub-trees together.
+	 * See #mdb_env_ctree() for the parameters.
+	 */
+static int ESECT
+mdb_env_cdb(mdb_cpool *cp, mdb_copy *my, MDB_db *db, int main)
+{
+	int cut, scan, rc;
+
+	if (db->md_root == P_INVALID)
+		return MDB_SUCCESS;
+	cut = mdb_env_csplit(cp, db, main);
+	scan = main || (db->md_flags & MDB_DUPSORT) || db->md_overflow_pages;
+	rc = mdb_env_ctree(cp, my, &db->md_root, 0, cut, db->md_depth, scan);
+	if (!rc && !my && !cut && !scan) {
+		/* A whole plain DB: its stats tell its size */
+		cp->cp_units[cp->cp_nunits-1].cu_count = db->md_branch_pages +
+			db->md_leaf_pages + db->md_overflow_pages;
+	}
+	return rc;
+}
+
+	/** Worker thread of a parallel compacting copy. */
+static THREAD_RET ESECT CALL_CONV
+mdb_env_cpthr(void *arg)
+{
+	mdb_copy *my = arg;
+	mdb_cpool *cp = my->mc_pool;
+	mdb_cunit *cu;
+	unsigned i;
+	int rc;
+
+	for (;;) {
+		pthread_mutex_lock(&cp->cp_mutex);
+		i = cp->cp_next++;
+		pthread_mutex_unlock(&cp->cp_mutex);
+		if (i >= cp->cp_nunits || cp->cp_error)
+			break;
+		cu = &cp->cp_units[i];
+		if (!cp->cp_copy) {
+			rc = cu->cu_count ? MDB_SUCCESS : mdb_env_ccount(my->mc_txn,
+				cu->cu_pgno, cu->cu_height, cu->cu_scan, &cu->cu_count);
+		} else {
+			my->mc_next_pgno = cu->cu_base;
+			cu->cu_root = cu->cu_pgno;
+			rc = mdb_env_cwalk(my, &cu->cu_root, 0);
+			if (!rc)
+				rc = mdb_env_cpwrite(my);
+			if (!rc && my->mc_next_pgno != cu->cu_base + cu->cu_count)
+				rc = MDB_INCOMPATIBLE;	/* stats disagree with the tree */
+		}
+		if (rc) {
+			cp->cp_error = rc;
+			break;
+		}
+	}
+	return (THREAD_RET)0;
+}
+
+	/** Number of workers for a compacting copy to \b fd, 1 if it is no
+	 *	regular file that pages can be written into at any offset.
+	 */
+static int ESECT
+mdb_env_cpthreads(HANDLE fd)
+{
+	struct stat st;
+	long n;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || lseek(fd, 0, SEEK_CUR) < 0)
+		return 1;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > MDB_CP_THREADS)
+		n = MDB_CP_THREADS;
+	return n > 1 ? n : 1;
+}
+
+	/** Compacting copy with several walkers writing to a regular file.
+	 * @param[in] my control structure of #mdb_env_copyfd1(), its first
+	 *	buffer holding the meta pages.
+	 * @param[out] root the main DB root in the copy.
+	 * @param[in] nthr the number of workers.
+	 */
+static int ESECT
+mdb_env_cpar(mdb_copy *my, pgno_t *root, int nthr)
+{
+	MDB_env *env = my->mc_env;
+	MDB_db db = my->mc_txn->mt_dbs[MAIN_DBI];
+	mdb_cpool cp = {0};
+	mdb_copy *wk;
+	MDB_txn *wt;
+	pthread_t *thr;
+	pgno_t next = NUM_METAS;
+	unsigned i;
+	int n, rc;
+
+	cp.cp_txn = my->mc_txn;
+	cp.cp_spread = nthr * MDB_CP_SPREAD;
+	cp.cp_off = lseek(my->mc_fd, 0, SEEK_CUR);
+	if ((rc = pthread_mutex_init(&cp.cp_mutex, NULL)) != 0)
+		return rc;
+	wk = calloc(nthr, sizeof(mdb_copy) + sizeof(MDB_txn) + sizeof(pthread_t));
+	if (!wk) {
+		rc = ENOMEM;
+		goto done;
+	}
+	wt = (MDB_txn *)(wk + nthr);
+	thr = (pthread_t *)(wt + nthr);
+	for (n=0; n<nthr; n++) {
+		void *p;
+		if ((rc = posix_memalign(&p, env->me_os_psize, MDB_WBUF)) != 0)
+			goto done;
+		/* Each worker counts its page gets in its own copy of the
+		 * read txn, they are added up when the workers are done
+		 */
+		wt[n] = *my->mc_txn;
+		wt[n].mt_page_gets = wt[n].mt_page_dirty = wt[n].mt_page_spilled = 0;
+		wk[n].mc_wbuf[0] = p;
+		wk[n].mc_env = env;
+		wk[n].mc_txn = &wt[n];
+		wk[n].mc_fd = my->mc_fd;
+		wk[n].mc_pool = &cp;
+	}
+
+	/* The stream writer gets no buffers, the meta pages go here */
+	rc = mdb_env_cpput(my->mc_fd, my->mc_wbuf[0], my->mc_wlen[0], cp.cp_off);
+	my->mc_wlen[0] = 0;
+	if (rc)
+		goto done;
+
+	rc = mdb_env_cdb(&cp, NULL, &db, 1);
+	for (; !rc && cp.cp_copy < 2; cp.cp_copy++) {
+		cp.cp_next = 0;
+		for (n=0; n<nthr; n++) {
+			if ((rc = THREAD_CREATE(thr[n], mdb_env_cpthr, &wk[n])) != 0) {
+				cp.cp_error = rc;
+				break;
+			}
+		}
+		while (n)
+			THREAD_FINISH(thr[--n]);
+		if (!rc)
+			rc = cp.cp_error;
+		if (!rc && !cp.cp_copy) {
+			/* Hand out the output ranges in walk order */
+			for (i=0; i<cp.cp_nunits; i++) {
+				cp.cp_units[i].cu_base = next;
+				next += cp.cp_units[i].cu_count;
+			}
+		}
+	}
+	if (!rc) {
+		/* Copy the upper pages after the sub-trees */
+		cp.cp_next = 0;
+		my->mc_pool = &cp;
+		my->mc_next_pgno = next;
+		rc = mdb_env_cdb(&cp, my, &db, 1);
+		if (!rc)
+			rc = mdb_env_cpwrite(my);
+		my->mc_pool = NULL;
+		*root = db.md_root;
+		/* Leave the file offset where a stream writer would */
+		if (!rc && lseek(my->mc_fd, cp.cp_off +
+			(MDB_OFF_T)my->mc_next_pgno * env->me_psize, SEEK_SET) < 0)
+			rc = ErrCode();
+	}
+
+done:
+	if (wk) {
+		for (n=0; n<nthr; n++) {
+			if (!wk[n].mc_txn)
+				break;
+			my->mc_txn->mt_page_gets += wt[n].mt_page_gets;
+			my->mc_txn->mt_page_dirty += wt[n].mt_page_dirty;
+			my->mc_txn->mt_page_spilled += wt[n].mt_page_spilled;
+			my->mc_txn->txn_flags |= wt[n].txn_flags & MDB_TXN_ERROR;
+		}
+		for (n=0; n<nthr; n++)
+			free(wk[n].mc_wbuf[0]);
+		free(wk);
+	}
+	free(cp.cp_units);
+	pthread_mutex_destroy(&cp.cp_mutex);
+	return rc;
+}
+
 	/** Copy environment with compaction. */
 static int ESECT
 mdb_env_copyfd1(MDB_env *env, HANDLE fd)
@@ -8899,7 +13618,7 @@ mdb_env_copyfd1(MDB_env *env, HANDLE fd)
 	MDB_txn *txn = NULL;
 	pthread_t thr;
 	pgno_t root, new_root;
-	int rc = MDB_SUCCESS;
+	int nthr, rc = MDB_SUCCESS;
 
 #ifdef _WIN32
 	if (!(my.mc_mutex = CreateMutex(NULL, FALSE, NULL)) ||
@@ -8971,7 +13690,7 @@ mdb_env_copyfd1(MDB_env *env, HANDLE fd)
 		MDB_val key, data;
 		mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
 		while ((rc = mdb_cursor_get(&mc, &key, &data, MDB_NEXT)) == 0)
-			freecount += *(MDB_ID *)data.mv_data;
+			freecount += FREE_REC_PAGES((MDB_ID *)data.mv_data);
 		if (rc != MDB_NOTFOUND)
 			goto finish;
 		freecount += txn->mt_dbs[FREE_DBI].md_branch_pages +
@@ -8994,7 +13713,11 @@ mdb_env_copyfd1(MDB_env *env, HANDLE fd)
 
 	my.mc_wlen[0] = env->me_psize * NUM_METAS;
 	my.mc_txn = txn;
-	rc = mdb_env_cwalk(&my, &root, 0);
+	if (root != P_INVALID && new_root >= MDB_CP_MINPAGES &&
+		(nthr = mdb_env_cpthreads(fd)) > 1)
+		rc = mdb_env_cpar(&my, &root, nthr);
+	else
+		rc = mdb_env_cwalk(&my, &root, 0);
 	if (rc == MDB_SUCCESS && root != new_root) {
 		rc = MDB_INCOMPATIBLE;	/* page leak or corrupt DB */
 	}
@@ -9052,7 +13775,7 @@ static int ESECT mdb_env_copyfd0(MDB_env *env, HANDLE fd)
 		if (LOCK_MUTEX(rc, env, wmutex))
 			goto leave;
 
-		rc = __mdb_txn_init(txn);
+		rc = __mdb_txn_init(txn, NULL);
 		if (rc) {
 			UNLOCK_MUTEX(wmutex);
 			goto leave;
@@ -9078,85 +13801,475 @@ static int ESECT mdb_env_copyfd0(MDB_env *env, HANDLE fd)
 			break;
 		}
 	}
-	if (wmutex)
-		UNLOCK_MUTEX(wmutex);
+	if (wmutex)
+		UNLOCK_MUTEX(wmutex);
+
+	if (rc)
+		goto leave;
+
+	w3 = txn->mt_next_pgno * env->me_psize;
+	{
+		mdb_size_t fsize = 0;
+		if ((rc = mdb_fsize(env->me_fd, &fsize)))
+			goto leave;
+		if (w3 > fsize)
+			w3 = fsize;
+	}
+	wsize = w3 - wsize;
+	while (wsize > 0) {
+		if (wsize > MAX_WRITE)
+			w2 = MAX_WRITE;
+		else
+			w2 = wsize;
+		DO_WRITE(rc, fd, ptr, w2, len);
+		if (!rc) {
+			rc = ErrCode();
+			break;
+		} else if (len > 0) {
+			rc = MDB_SUCCESS;
+			ptr += len;
+			wsize -= len;
+			continue;
+		} else {
+			rc = EIO;
+			break;
+		}
+	}
+
+leave:
+	_mdb_txn_abort(txn);
+	return rc;
+}
+
+int ESECT
+mdb_env_copyfd2(MDB_env *env, HANDLE fd, unsigned int flags)
+{
+	if (flags & MDB_CP_COMPACT)
+		return mdb_env_copyfd1(env, fd);
+	else
+		return mdb_env_copyfd0(env, fd);
+}
+
+int ESECT
+mdb_env_copyfd(MDB_env *env, HANDLE fd)
+{
+	return mdb_env_copyfd2(env, fd, 0);
+}
+
+int ESECT
+mdb_env_copy2(MDB_env *env, const char *path, unsigned int flags)
+{
+	int rc;
+	MDB_name fname;
+	HANDLE newfd = INVALID_HANDLE_VALUE;
+
+	rc = mdb_fname_init(path, env->me_flags | MDB_NOLOCK, &fname);
+	if (rc == MDB_SUCCESS) {
+		rc = mdb_fopen(env, &fname, MDB_O_COPY, 0666, &newfd);
+		mdb_fname_destroy(fname);
+	}
+	if (rc == MDB_SUCCESS) {
+		rc = mdb_env_copyfd2(env, newfd, flags);
+		if (close(newfd) < 0 && rc == MDB_SUCCESS)
+			rc = ErrCode();
+	}
+	return rc;
+}
+
+int ESECT
+mdb_env_copy(MDB_env *env, const char *path)
+{
+	return mdb_env_copy2(env, path, 0);
+}
+
+	/** Stamp identifying a delta from #mdb_env_copyfd_delta() */
+#define MDB_DELTA_MAGIC	 0xBEEFDE17
+	/** The version number of the delta format */
+#define MDB_DELTA_VERSION	 1
+
+/** Header of a delta from #mdb_env_copyfd_delta().
+ *	Runs of pages follow it, each one an #MDB_ID pair of its first pgno
+ *	and its number of pages, then the pages. A run of no pages ends
+ *	the delta, padding may follow it.
+ */
+typedef struct MDB_deltahdr {
+	uint32_t	dh_magic;		/**< #MDB_DELTA_MAGIC */
+	uint32_t	dh_version;		/**< #MDB_DELTA_VERSION */
+	txnid_t		dh_since;		/**< the delta holds the txns after this one */
+	MDB_meta	dh_meta;		/**< meta of the last txn it holds */
+} MDB_deltahdr;
+
+/** Output buffer of #mdb_env_copyfd_delta(). It writes whole
+ *	#MDB_WBUF buffers and pads the end to the OS page size, so that
+ *	it works with the O_DIRECT of #MDB_O_COPY.
+ */
+typedef struct MDB_dout {
+	HANDLE		do_fd;		/**< where the delta goes */
+	char		*do_buf;	/**< #MDB_WBUF bytes, OS page aligned */
+	size_t		do_len;		/**< bytes in #do_buf */
+} MDB_dout;
+
+/** Write out the buffer of a delta.
+ * @param[in] out the output buffer
+ * @param[in] len how many bytes of it to write
+ * @return 0 on success, non-zero on failure.
+ */
+static int ESECT mdb_dout_flush(MDB_dout *out, size_t len)
+{
+	char *ptr = out->do_buf;
+	ssize_t wres;
+	int rc;
+
+	while (len) {
+		wres = write(out->do_fd, ptr, len);
+		if (wres <= 0) {
+			rc = wres ? ErrCode() : EIO;
+			if (rc == EINTR)
+				continue;
+			return rc;
+		}
+		ptr += wres;
+		len -= wres;
+	}
+	out->do_len = 0;
+	return MDB_SUCCESS;
+}
+
+/** Add bytes to a delta.
+ * @param[in] out the output buffer
+ * @param[in] src the bytes to add
+ * @param[in] len the number of bytes
+ * @return 0 on success, non-zero on failure.
+ */
+static int ESECT mdb_dout_put(MDB_dout *out, const void *src, size_t len)
+{
+	const char *ptr = src;
+	size_t n;
+	int rc;
+
+	while (len) {
+		n = MDB_WBUF - out->do_len;
+		if (n > len)
+			n = len;
+		memcpy(out->do_buf + out->do_len, ptr, n);
+		out->do_len += n;
+		ptr += n;
+		len -= n;
+		if (out->do_len == MDB_WBUF && (rc = mdb_dout_flush(out, MDB_WBUF)))
+			return rc;
+	}
+	return MDB_SUCCESS;
+}
+
+int ESECT
+mdb_env_copyfd_delta(MDB_env *env, HANDLE fd, mdb_size_t since)
+{
+	MDB_txn *txn = NULL;
+	MDB_deltahdr dh;
+	MDB_chghdr hdr;
+	MDB_chgrd cr = {0};
+	MDB_dout out = {0};
+	MDB_name fname;
+	MDB_IDL runs = NULL, pgs = NULL;
+	MDB_ID rec[2], run[2];
+	txnid_t want;
+	const unsigned psize = env->me_psize;
+	unsigned i;
+	size_t pad;
+	int rc;
+
+	cr.cr_fd = INVALID_HANDLE_VALUE;
+	out.do_fd = fd;
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+		return rc;
+	if (since > txn->m_snapshot_id) {
+		rc = EINVAL;
+		goto leave;
+	}
 
+	/* Only records of txns up to ours are of interest, and the
+	 * log has them all by now.
+	 */
+	rc = mdb_fname_init(env->me_path, env->me_flags | MDB_CHANGELOG, &fname);
 	if (rc)
 		goto leave;
+	rc = mdb_fopen(env, &fname, MDB_O_CHGREAD, 0, &cr.cr_fd);
+	mdb_fname_destroy(fname);
+	if (rc || (rc = mdb_fsize(cr.cr_fd, &cr.cr_size)))
+		goto leave;
+	if (!(cr.cr_buf = malloc(MDB_CHGRD_BUF)) ||
+		!(runs = mdb_midl_alloc(MDB_IDL_UM_MAX)) ||
+		!(pgs = mdb_midl_alloc(MDB_IDL_UM_MAX))) {
+		rc = ENOMEM;
+		goto leave;
+	}
+	if ((rc = mdb_chgrd_read(&cr, &hdr, sizeof(hdr))))
+		goto leave;
+	if (hdr.mh_magic != MDB_CHG_MAGIC || hdr.mh_version != MDB_CHG_VERSION) {
+		rc = MDB_INVALID;
+		goto leave;
+	}
+	if (since < hdr.mh_base) {
+		rc = MDB_NOTFOUND;
+		goto leave;
+	}
+	for (want = since + 1; want <= txn->m_snapshot_id; want++) {
+		do {
+			if ((rc = mdb_chgrd_next(&cr, rec, &runs)))
+				goto leave;
+		} while (rec[0] < want);
+		/* Some process committed without logging */
+		if (rec[0] != want) {
+			rc = MDB_NOTFOUND;
+			goto leave;
+		}
+		for (i=1; i<runs[0]; i+=2)
+			if ((rc = mdb_midl_append_range(&pgs, runs[i], runs[i+1])))
+				goto leave;
+	}
+	mdb_midl_sort(pgs);
 
-	w3 = txn->mt_next_pgno * env->me_psize;
+#ifdef HAVE_MEMALIGN
+	out.do_buf = memalign(env->me_os_psize, MDB_WBUF);
+	if (out.do_buf == NULL) {
+		rc = errno;
+		goto leave;
+	}
+#else
 	{
-		mdb_size_t fsize = 0;
-		if ((rc = mdb_fsize(env->me_fd, &fsize)))
+		void *p;
+		if ((rc = posix_memalign(&p, env->me_os_psize, MDB_WBUF)) != 0)
 			goto leave;
-		if (w3 > fsize)
-			w3 = fsize;
+		out.do_buf = p;
 	}
-	wsize = w3 - wsize;
-	while (wsize > 0) {
-		if (wsize > MAX_WRITE)
-			w2 = MAX_WRITE;
-		else
-			w2 = wsize;
-		DO_WRITE(rc, fd, ptr, w2, len);
-		if (!rc) {
-			rc = ErrCode();
-			break;
-		} else if (len > 0) {
-			rc = MDB_SUCCESS;
-			ptr += len;
-			wsize -= len;
-			continue;
-		} else {
-			rc = EIO;
-			break;
+#endif
+	memset(&dh, 0, sizeof(dh));
+	dh.dh_magic = MDB_DELTA_MAGIC;
+	dh.dh_version = MDB_DELTA_VERSION;
+	dh.dh_since = since;
+	mdb_env_init_meta0(env, &dh.dh_meta);
+	dh.dh_meta.mm_address = env->me_metas[0]->mm_address;
+	dh.dh_meta.mm_dbs[FREE_DBI] = txn->mt_dbs[FREE_DBI];
+	dh.dh_meta.mm_dbs[MAIN_DBI] = txn->mt_dbs[MAIN_DBI];
+	dh.dh_meta.mm_last_pg = txn->mt_next_pgno - 1;
+	dh.dh_meta.mm_txnid = txn->m_snapshot_id;
+	if ((rc = mdb_dout_put(&out, &dh, sizeof(dh))))
+		goto leave;
+
+	/* The IDL is sorted in descending order. Pages a txn freed
+	 * may be rewritten by a newer writer by now, but they are free
+	 * in our snapshot too.
+	 */
+	for (i = pgs[0]; i; ) {
+		run[0] = pgs[i];
+		run[1] = 0;
+		for (; i && pgs[i] <= run[0] + run[1]; i--)
+			run[1] = pgs[i] + 1 - run[0];
+		if (run[0] < NUM_METAS || run[0] + run[1] > txn->mt_next_pgno) {
+			rc = MDB_CORRUPTED;
+			goto leave;
 		}
+		if ((rc = mdb_dout_put(&out, run, sizeof(run))) ||
+			(rc = mdb_dout_put(&out, env->m_shmem_data_file + run[0] * psize,
+				run[1] * psize)))
+			goto leave;
 	}
+	run[0] = run[1] = 0;
+	if ((rc = mdb_dout_put(&out, run, sizeof(run))))
+		goto leave;
+	pad = -out.do_len & (env->me_os_psize - 1);
+	memset(out.do_buf + out.do_len, 0, pad);
+	rc = mdb_dout_flush(&out, out.do_len + pad);
 
 leave:
+	free(out.do_buf);
+	free(cr.cr_buf);
+	mdb_midl_free(runs);
+	mdb_midl_free(pgs);
+	if (cr.cr_fd != INVALID_HANDLE_VALUE)
+		close(cr.cr_fd);
 	_mdb_txn_abort(txn);
 	return rc;
 }
 
 int ESECT
-mdb_env_copyfd2(MDB_env *env, HANDLE fd, unsigned int flags)
-{
-	if (flags & MDB_CP_COMPACT)
-		return mdb_env_copyfd1(env, fd);
-	else
-		return mdb_env_copyfd0(env, fd);
-}
-
-int ESECT
-mdb_env_copyfd(MDB_env *env, HANDLE fd)
-{
-	return mdb_env_copyfd2(env, fd, 0);
-}
-
-int ESECT
-mdb_env_copy2(MDB_env *env, const char *path, unsigned int flags)
+mdb_env_copy_delta(MDB_env *env, const char *path, mdb_size_t since)
 {
 	int rc;
 	MDB_name fname;
 	HANDLE newfd = INVALID_HANDLE_VALUE;
 
-	rc = mdb_fname_init(path, env->me_flags | MDB_NOLOCK, &fname);
+	rc = mdb_fname_init(path, MDB_NOSUBDIR|MDB_NOLOCK, &fname);
 	if (rc == MDB_SUCCESS) {
 		rc = mdb_fopen(env, &fname, MDB_O_COPY, 0666, &newfd);
 		mdb_fname_destroy(fname);
 	}
 	if (rc == MDB_SUCCESS) {
-		rc = mdb_env_copyfd2(env, newfd, flags);
+		rc = mdb_env_copyfd_delta(env, newfd, since);
 		if (close(newfd) < 0 && rc == MDB_SUCCESS)
 			rc = ErrCode();
 	}
 	return rc;
 }
 
+/** Read all of \b len bytes of a delta.
+ * @return 0 on success, #MDB_INVALID if the delta ends first.
+ */
+static int ESECT mdb_delta_read(HANDLE fd, void *dst, size_t len)
+{
+	char *ptr = dst;
+	ssize_t rd;
+
+	while (len) {
+		rd = read(fd, ptr, len);
+		if (rd <= 0) {
+			if (!rd)
+				return MDB_INVALID;
+			if (ErrCode() == EINTR)
+				continue;
+			return ErrCode();
+		}
+		ptr += rd;
+		len -= rd;
+	}
+	return MDB_SUCCESS;
+}
+
+/** Write all of \b len bytes to the data file being rolled forward */
+static int ESECT mdb_delta_write(HANDLE fd, const void *src, size_t len, MDB_OFF_T off)
+{
+	const char *ptr = src;
+	ssize_t wres;
+	int rc;
+
+	while (len) {
+		wres = pwrite(fd, ptr, len, off);
+		if (wres <= 0) {
+			rc = wres ? ErrCode() : EIO;
+			if (rc == EINTR)
+				continue;
+			return rc;
+		}
+		ptr += wres;
+		off += wres;
+		len -= wres;
+	}
+	return MDB_SUCCESS;
+}
+
 int ESECT
-mdb_env_copy(MDB_env *env, const char *path)
+mdb_env_apply_delta(const char *path, unsigned int flags, HANDLE fd)
 {
-	return mdb_env_copy2(env, path, 0);
+	MDB_env *env;
+	MDB_name fname;
+	MDB_deltahdr dh;
+	MDB_meta meta;
+	MDB_ID run[2];
+	struct flock lock_info;
+	char *buf = NULL;
+	mdb_size_t left, n, chunk;
+	MDB_OFF_T off;
+	unsigned psize;
+	int i, rc;
+
+	if (flags & ~MDB_NOSUBDIR)
+		return EINVAL;
+	if ((rc = mdb_env_create(&env)))
+		return rc;
+	env->me_flags = flags;
+	rc = mdb_fname_init(path, flags, &fname);
+	if (rc)
+		goto leave;
+	rc = mdb_fopen(env, &fname, MDB_O_LOCKS, 0666, &env->me_lfd);
+	if (rc == MDB_SUCCESS) {
+		/* The exclusive lock of the first process to open the env.
+		 * Keep it, so nothing opens the copy until it is consistent.
+		 */
+		memset((void *)&lock_info, 0, sizeof(lock_info));
+		lock_info.l_type = F_WRLCK;
+		lock_info.l_whence = SEEK_SET;
+		lock_info.l_start = 0;
+		lock_info.l_len = 1;
+		while ((rc = fcntl(env->me_lfd, F_SETLK, &lock_info)) && (rc = ErrCode()) == EINTR) ;
+		if (rc == EAGAIN || rc == EACCES)
+			rc = EBUSY;
+	}
+	if (rc == MDB_SUCCESS)
+		rc = mdb_fopen(env, &fname, MDB_O_RDWR, 0666, &env->me_fd);
+	mdb_fname_destroy(fname);
+	if (rc || (rc = mdb_env_read_header(env, 0, &meta)))
+		goto leave;
+
+	if ((rc = mdb_delta_read(fd, &dh, sizeof(dh))))
+		goto leave;
+	if (dh.dh_magic != MDB_DELTA_MAGIC || dh.dh_version != MDB_DELTA_VERSION) {
+		rc = MDB_INVALID;
+		goto leave;
+	}
+	psize = meta.mm_psize;
+	if (dh.dh_meta.mm_psize != psize) {
+		rc = MDB_INCOMPATIBLE;
+		goto leave;
+	}
+	/* The copy must hold every page the delta doesn't */
+	if (meta.mm_txnid < dh.dh_since || meta.mm_txnid > dh.dh_meta.mm_txnid) {
+		rc = MDB_NOTFOUND;
+		goto leave;
+	}
+
+	chunk = MDB_WBUF / psize;
+	if (!(buf = malloc(chunk * psize))) {
+		rc = ENOMEM;
+		goto leave;
+	}
+	for (;;) {
+		if ((rc = mdb_delta_read(fd, run, sizeof(run))))
+			goto leave;
+		if (!run[1])
+			break;
+		if (run[0] < NUM_METAS || run[0] + run[1] > dh.dh_meta.mm_last_pg + 1) {
+			rc = MDB_INVALID;
+			goto leave;
+		}
+		off = run[0] * psize;
+		for (left = run[1]; left; left -= n) {
+			n = left < chunk ? left : chunk;
+			if ((rc = mdb_delta_read(fd, buf, n * psize)) ||
+				(rc = mdb_delta_write(env->me_fd, buf, n * psize, off)))
+				goto leave;
+			off += n * psize;
+		}
+	}
+	if (MDB_FDATASYNC(env->me_fd)) {
+		rc = ErrCode();
+		goto leave;
+	}
+
+	/* Both metas get the new snapshot, the previous one may refer
+	 * to pages that were just overwritten.
+	 */
+	meta.mm_mapsize = meta.mm_mapsize < dh.dh_meta.mm_mapsize ?
+		dh.dh_meta.mm_mapsize : meta.mm_mapsize;
+	meta.mm_dbs[FREE_DBI] = dh.dh_meta.mm_dbs[FREE_DBI];
+	meta.mm_dbs[MAIN_DBI] = dh.dh_meta.mm_dbs[MAIN_DBI];
+	meta.mm_last_pg = dh.dh_meta.mm_last_pg;
+	meta.mm_txnid = dh.dh_meta.mm_txnid;
+	for (i=0; i<NUM_METAS; i++)
+		if ((rc = mdb_delta_write(env->me_fd, &meta, sizeof(meta),
+			(MDB_OFF_T)i * psize + PAGEHDRSZ)))
+			goto leave;
+	if (MDB_FDATASYNC(env->me_fd))
+		rc = ErrCode();
+
+leave:
+	free(buf);
+	if (env->me_fd != INVALID_HANDLE_VALUE)
+		close(env->me_fd);
+	if (env->me_lfd != INVALID_HANDLE_VALUE)
+		close(env->me_lfd);
+	mdb_env_close(env);
+	return rc;
 }
 
 int ESECT
@@ -9207,6 +14320,18 @@ mdb_env_set_assert(MDB_env *env, MDB_assert_func *func)
 	return MDB_SUCCESS;
 }
 
+int ESECT
+mdb_env_set_page_allocator(MDB_env *env, MDB_page_alloc_func *alloc,
+	MDB_page_free_func *dealloc, void *ctx)
+{
+	if (!env || env->m_shmem_data_file || !alloc != !dealloc)
+		return EINVAL;
+	env->me_page_alloc = alloc;
+	env->me_page_free = dealloc;
+	env->me_page_ctx = ctx;
+	return MDB_SUCCESS;
+}
+
 int ESECT
 mdb_env_get_path(MDB_env *env, const char **arg)
 {
@@ -9276,6 +14401,16 @@ int ESECT mdb_env_info(MDB_env *env, MDB_envinfo *arg)
 	return MDB_SUCCESS;
 }
 
+int ESECT mdb_env_metrics(MDB_env *env, MDB_metrics *arg)
+{
+	if (env == NULL || arg == NULL)
+		return EINVAL;
+
+	/* Counters may move while we copy, each one is still sane */
+	*arg = *env->me_metrics;
+	return MDB_SUCCESS;
+}
+
 /** Set the default comparison functions for a database.
  * Called immediately after a database is opened to set the defaults.
  * The user can then override them with #mdb_set_compare() or
@@ -9400,7 +14535,10 @@ int mdb_dbi_open(MDB_txn *txn, const char *name, unsigned int flags, MDB_dbi *db
 		txn->mt_dbxs[slot].md_name.mv_data = namedup;
 		txn->mt_dbxs[slot].md_name.mv_size = len;
 		txn->mt_dbxs[slot].md_rel = NULL;
+		txn->mt_dbxs[slot].md_pack = NULL;
+		txn->mt_dbxs[slot].md_unpack = NULL;
 		txn->mt_dbflags[slot] = dbflag;
+		txn->txn_flags |= MDB_TXN_DBI_NEW;
 		/* txn-> and env-> are the same in read txns, use
 		 * tmp variable to avoid undefined assignment
 		 */
@@ -9461,6 +14599,97 @@ int mdb_dbi_flags(MDB_txn *txn, MDB_dbi dbi, unsigned int *flags)
 	return MDB_SUCCESS;
 }
 
+int ESECT mdb_dbi_ranges(MDB_txn *txn, MDB_dbi dbi, MDB_val *keys, unsigned int *nkeys)
+{
+	MDB_cursor mc;
+	MDB_xcursor mx;
+	MDB_PageHeader *mp;
+	MDB_node *node;
+	MDB_ID2 *lvl, *next, *tmp;
+	size_t n, m, cap, j;
+	unsigned int i, nk, k, want;
+	int rc;
+
+	if (!keys || !nkeys || !TXN_DBI_EXIST(txn, dbi, DB_USRVALID))
+		return EINVAL;
+	if (txn->txn_flags & MDB_TXN_BLOCKED)
+		return MDB_BAD_TXN;
+
+	want = *nkeys;
+	*nkeys = 0;
+	if (!want)
+		return MDB_SUCCESS;
+	mdb_cursor_init(&mc, txn, dbi, &mx);
+	rc = mdb_relocate_cursor(&mc, NULL, MDB_PS_ROOTONLY);
+	if (rc)
+		return rc == MDB_NOTFOUND ? MDB_SUCCESS : rc;
+
+	/* Walk down one level at a time until it has more pages than
+	 * ranges wanted. Each entry is a page and the node whose key is
+	 * the page's lower bound, NULL for the first page of a level.
+	 */
+	cap = 16;
+	lvl = malloc(cap * sizeof(MDB_ID2));
+	next = malloc(cap * sizeof(MDB_ID2));
+	if (!lvl || !next) {
+		rc = ENOMEM;
+		goto done;
+	}
+	lvl[0].mid = mc.mc_pg[0]->mp_pgno;
+	lvl[0].mptr = NULL;
+	n = 1;
+	mp = mc.mc_pg[0];
+	while (n <= want && IS_BRANCH(mp)) {
+		m = 0;
+		for (j = 0; j < n; j++) {
+			if (j && (rc = mdb_page_get(txn, lvl[j].mid, &mp, NULL)) != 0)
+				goto done;
+			nk = NUMKEYS(mp);
+			if (m + nk > cap) {
+				while (m + nk > cap)
+					cap *= 2;
+				if ((tmp = realloc(next, cap * sizeof(MDB_ID2))) == NULL) {
+					rc = ENOMEM;
+					goto done;
+				}
+				next = tmp;
+				/* lvl becomes the next level's buffer */
+				if ((tmp = realloc(lvl, cap * sizeof(MDB_ID2))) == NULL) {
+					rc = ENOMEM;
+					goto done;
+				}
+				lvl = tmp;
+			}
+			for (i = 0; i < nk; i++) {
+				node = get_node_n(mp, i);
+				next[m].mid = get_page_no(node);
+				next[m].mptr = i ? node : lvl[j].mptr;
+				m++;
+			}
+		}
+		tmp = lvl; lvl = next; next = tmp;
+		n = m;
+		if ((rc = mdb_page_get(txn, lvl[0].mid, &mp, NULL)) != 0)
+			goto done;
+	}
+
+	/* Pick evenly spaced page boundaries */
+	if (n > 1) {
+		k = n - 1 < want ? n - 1 : want;
+		for (i = 1; i <= k; i++) {
+			node = lvl[(size_t)i * n / (k+1)].mptr;
+			keys[i-1].mv_size = NODEKSZ(node);
+			keys[i-1].mv_data = NODEKEY(node);
+		}
+		*nkeys = k;
+	}
+
+done:
+	free(lvl);
+	free(next);
+	return rc;
+}
+
 /** Add all the DB's pages to the free list.
  * @param[in] mc Cursor on the DB to free.
  * @param[in] subs non-Zero to check for sub-DBs in this DB.
@@ -9650,6 +14879,18 @@ int mdb_set_relctx(MDB_txn *txn, MDB_dbi dbi, void *ctx)
 	return MDB_SUCCESS;
 }
 
+int mdb_set_codec(MDB_txn *txn, MDB_dbi dbi, MDB_pack_func *pack,
+	MDB_unpack_func *unpack, void *ctx)
+{
+	if (!TXN_DBI_EXIST(txn, dbi, DB_USRVALID) || (pack && !unpack))
+		return EINVAL;
+
+	txn->mt_dbxs[dbi].md_pack = pack;
+	txn->mt_dbxs[dbi].md_unpack = unpack;
+	txn->mt_dbxs[dbi].md_packctx = ctx;
+	return MDB_SUCCESS;
+}
+
 int ESECT
 mdb_env_get_maxkeysize(MDB_env *env)
 {
@@ -9690,6 +14931,104 @@ int ESECT mdb_reader_list(MDB_env *env, MDB_msg_func *func, void *ctx)
 	return rc;
 }
 
+static int ESECT mdb_rdrinfo_cmp(const void *a, const void *b)
+{
+	const MDB_rdrinfo *ra = a, *rb = b;
+	/* Newest first */
+	return ra->mri_txnid < rb->mri_txnid ? 1 : ra->mri_txnid > rb->mri_txnid ? -1 : 0;
+}
+
+int ESECT mdb_reader_info(MDB_env *env, MDB_rdr_func *func, void *ctx)
+{
+	MDB_txn *txn;
+	MDB_cursor mc;
+	MDB_val key, data;
+	MDB_rdrinfo *ri;
+	MDB_reader_entry *mr, *self;
+	mdb_size_t now, sum = 0;
+	txnid_t id;
+	unsigned int i, j, n = 0, rdrs;
+	int rc;
+
+	if (!env || !func)
+		return EINVAL;
+	if (!env->m_reader_table)
+		return MDB_SUCCESS;
+
+	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+	if (rc)
+		return rc;
+	self = txn->mt_u.reader;
+	rdrs = env->m_reader_table->mti_numreaders;
+	ri = malloc((rdrs ? rdrs : 1) * sizeof(MDB_rdrinfo));
+	if (!ri) {
+		rc = ENOMEM;
+		goto leave;
+	}
+	now = mdb_now_msec();
+	mr = env->m_reader_table->mti_readers;
+	for (i=0; i<rdrs; i++) {
+		MDB_rdrinfo *r = &ri[n];
+		if (!mr[i].mr_pid || &mr[i] == self)
+			continue;
+		r->mri_txnid = mr[i].mr_txnid;
+		if (r->mri_txnid == (txnid_t)-1)
+			continue;
+		r->mri_slot = i;
+		r->mri_pid = mr[i].mr_pid;
+		r->mri_tid = (size_t)mr[i].mr_tid;
+		r->mri_lag = txn->m_snapshot_id > r->mri_txnid ? txn->m_snapshot_id - r->mri_txnid : 0;
+		r->mri_msec = now > mr[i].mr_since ? now - mr[i].mr_since : 0;
+		/* Re-read, the slot may have moved on under us */
+		if (mr[i].mr_txnid != r->mri_txnid)
+			continue;
+		n++;
+	}
+
+	/* Each reader pins the free DB records from its own txnid up to,
+	 * but not including, the last committed txn. Walk the records from
+	 * the newest down, handing out running totals to the readers.
+	 */
+	qsort(ri, n, sizeof(MDB_rdrinfo), mdb_rdrinfo_cmp);
+	mdb_cursor_init(&mc, txn, FREE_DBI, NULL);
+	j = 0;
+	for (rc = mdb_cursor_get(&mc, &key, &data, MDB_LAST); rc == MDB_SUCCESS && j < n;
+		rc = mdb_cursor_get(&mc, &key, &data, MDB_PREV)) {
+		id = *(txnid_t *)key.mv_data;
+		for (; j < n && id < ri[j].mri_txnid; j++)
+			ri[j].mri_pinned = sum;
+		if (id < txn->m_snapshot_id)
+			sum += FREE_REC_PAGES((MDB_ID *)data.mv_data);
+	}
+	if (rc != MDB_SUCCESS && rc != MDB_NOTFOUND)
+		goto leave;
+	for (; j < n; j++)
+		ri[j].mri_pinned = sum;
+
+	rc = MDB_SUCCESS;
+	for (i = n; i-- > 0; ) {
+		if (func(&ri[i], ctx) < 0)
+			break;
+	}
+
+leave:
+	free(ri);
+	mdb_txn_abort(txn);
+	return rc;
+}
+
+int ESECT mdb_env_set_pin_callback(MDB_env *env, MDB_pin_func *func,
+	mdb_size_t limit, void *ctx)
+{
+	if (!env || (func && !limit))
+		return EINVAL;
+	env->me_pinfunc = func;
+	env->me_pinctx = ctx;
+	env->me_pinlimit = limit;
+	env->me_pinned = 0;
+	return MDB_SUCCESS;
+}
+
 /** Insert pid into list if not already present.
  * return -1 if already present.
  */
@@ -9770,10 +15109,13 @@ static int ESECT MDB_reader_entry_check0(MDB_env *env, int rlocked, int *dead)
 								j = rdrs;
 						}
 					}
+					/* Slots are claimed without the mutex, so only
+					 * free those still held by the dead pid.
+					 */
 					for (; j<rdrs; j++)
-							if (mr[j].mr_pid == pid) {
+							if (mr[j].mr_pid == pid && MDB_CAS(&mr[j].mr_pid, pid, 0)) {
 								DPRINTF(("clear stale reader pid %u txn %lu",(unsigned) pid, mr[j].mr_txnid));
-								mr[j].mr_pid = 0;
+								mdb_reader_gone(env, mr[j].mr_txnid);
 								count++;
 							}
 					if (rmutex)
@@ -9839,7 +15181,6 @@ static int ESECT mdb_mutex_failed(MDB_env *env, mdb_mutexref_t mutex, int rc)
 /** @} */
 
 void print_node(int is_data, MDB_node * node){
-	char buf[64];
 	MDB_val key; key.mv_size = node->mn_ksize; key.mv_data = node->mn_data;
 	if(is_data){
 		if(node->mn_flags&F_BIGDATA){
@@ -9847,10 +15188,10 @@ void print_node(int is_data, MDB_node * node){
 		}else if(node->mn_flags & F_DUPDATA){
 			printf("flags:0x%x\n",node->mn_flags);
 		}else{
-			printf("%s:%.*s ",mdb_dkey(&key,buf),get_node_data_size(node),(char*)get_node_data(node) );
+			printf("%.*s:%.*s ",(int)key.mv_size,(char*)key.mv_data,get_node_data_size(node),(char*)get_node_data(node) );
 		}
 	}else{
-		printf("%s > %lu ",mdb_dkey(&key,buf),get_page_no(node) );
+		printf("%.*s > %lu ",(int)key.mv_size,(char*)key.mv_data,get_page_no(node) );
 	}
 }
 void print_hex_array(const char *array, size_t length) {
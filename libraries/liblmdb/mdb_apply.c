@@ -0,0 +1,72 @@
+/* mdb_apply.c - memory-mapped database incremental restore tool */
+/*
+ * Copyright 2012-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+#ifdef _WIN32
+#include <windows.h>
+#define	MDB_STDIN	GetStdHandle(STD_INPUT_HANDLE)
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define	MDB_STDIN	0
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include "lmdb.h"
+
+int main(int argc,char * argv[])
+{
+	int rc;
+	const char *progname = argv[0], *act;
+	unsigned flags = 0;
+	mdb_filehandle_t fd = MDB_STDIN;
+
+	for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
+		if (argv[1][1] == 'n' && argv[1][2] == '\0')
+			flags |= MDB_NOSUBDIR;
+		else if (argv[1][1] == 'V' && argv[1][2] == '\0') {
+			printf("%s\n", MDB_VERSION_STRING);
+			exit(0);
+		} else
+			argc = 0;
+	}
+
+	if (argc<2 || argc>3) {
+		fprintf(stderr, "usage: %s [-V] [-n] dstpath [deltafile]\n", progname);
+		exit(EXIT_FAILURE);
+	}
+
+	rc = MDB_SUCCESS;
+	if (argc == 3) {
+		act = "opening delta";
+#ifdef _WIN32
+		fd = CreateFileA(argv[2], GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (fd == INVALID_HANDLE_VALUE)
+			rc = GetLastError();
+#else
+		fd = open(argv[2], O_RDONLY);
+		if (fd < 0)
+			rc = errno;
+#endif
+	}
+	if (rc == MDB_SUCCESS) {
+		act = "applying";
+		rc = mdb_env_apply_delta(argv[1], flags, fd);
+	}
+	if (rc)
+		fprintf(stderr, "%s: %s failed, error %d (%s)\n",
+			progname, act, rc, mdb_strerror(rc));
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
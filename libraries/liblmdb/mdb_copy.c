@@ -34,6 +34,9 @@ int main(int argc,char * argv[])
 	const char *progname = argv[0], *act;
 	unsigned flags = MDB_RDONLY;
 	unsigned cpflags = 0;
+	int delta = 0;
+	mdb_size_t since = 0;
+	char *end;
 
 	for (; argc > 1 && argv[1][0] == '-'; argc--, argv++) {
 		if (argv[1][1] == 'n' && argv[1][2] == '\0')
@@ -42,6 +45,16 @@ int main(int argc,char * argv[])
 			flags |= MDB_PREVSNAPSHOT;
 		else if (argv[1][1] == 'c' && argv[1][2] == '\0')
 			cpflags |= MDB_CP_COMPACT;
+		else if (argv[1][1] == 'i' && argv[1][2] == '\0' && argc > 2) {
+			since = strtoull(argv[2], &end, 0);
+			if (*end || end == argv[2]) {
+				argc = 0;
+				break;
+			}
+			delta = 1;
+			argc--;
+			argv++;
+		}
 		else if (argv[1][1] == 'V' && argv[1][2] == '\0') {
 			printf("%s\n", MDB_VERSION_STRING);
 			exit(0);
@@ -49,8 +62,8 @@ int main(int argc,char * argv[])
 			argc = 0;
 	}
 
-	if (argc<2 || argc>3) {
-		fprintf(stderr, "usage: %s [-V] [-c] [-n] [-v] srcpath [dstpath]\n", progname);
+	if (argc<2 || argc>3 || (delta && cpflags)) {
+		fprintf(stderr, "usage: %s [-V] [-c] [-n] [-v] [-i txnid] srcpath [dstpath]\n", progname);
 		exit(EXIT_FAILURE);
 	}
 
@@ -70,7 +83,10 @@ int main(int argc,char * argv[])
 	}
 	if (rc == MDB_SUCCESS) {
 		act = "copying";
-		if (argc == 2)
+		if (delta)
+			rc = argc == 2 ? mdb_env_copyfd_delta(env, MDB_STDOUT, since) :
+				mdb_env_copy_delta(env, argv[2], since);
+		else if (argc == 2)
 			rc = mdb_env_copyfd2(env, MDB_STDOUT, cpflags);
 		else
 			rc = mdb_env_copy2(env, argv[2], cpflags);
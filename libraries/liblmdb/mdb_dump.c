@@ -12,19 +12,38 @@
  * <http://www.OpenLDAP.org/license.html>.
  */
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
+#ifdef MDB_USE_ZLIB
+#include <zlib.h>
+#endif
 #include "lmdb.h"
 
 #define Yu	MDB_PRIy(u)
 
 #define PRINT	1
+#define BINARY	2
+#define ZLIB	4
 static int mode;
 
+	/** Most worker threads for -j */
+#define MAXTHREADS	64
+
+	/** Size of the output blocks workers fill */
+#define BLOCKSIZE	(1024*1024)
+
+	/** Pages per key range a parallel dump cuts a database into, at least */
+#define RANGEPAGES	256
+
+	/** Ranges per worker, to even out the load */
+#define RANGESPER	4
+
 typedef struct flagbit {
 	int bit;
 	char *name;
@@ -49,54 +68,422 @@ static void dumpsig( int sig )
 
 static const char hexc[] = "0123456789abcdef";
 
-static void hex(unsigned char c)
+/** A block of output. In binary format a framed block starts with
+ *	its raw and stored sizes, and holds whole records only.
+ */
+typedef struct dumpbuf {
+	struct dumpbuf *next;
+	char *data;
+	size_t len, size;
+	int framed;
+} dumpbuf;
+
+/** Frame header of a binary block, two 32 bit sizes */
+#define FRAMESZ	8
+
+/** A key range of one database, dumped by one worker. The first range
+ *	of a database carries its header, the last one its trailer.
+ */
+typedef struct dumpjob {
+	MDB_dbi dbi;
+	MDB_val lo, hi;		/**< range start and end, no mv_data for open ends */
+	int last;
+	int done, rc;
+	dumpbuf *cur;		/**< block being filled */
+	dumpbuf *head, *tail;	/**< finished blocks not written yet */
+} dumpjob;
+
+static int nthreads;
+static dumpjob *jobs;
+static int njobs, maxjobs;
+static int nextjob;		/**< next job for a worker to take */
+static int headjob;		/**< job being written out */
+static int pending;		/**< finished blocks not written yet */
+static int stop, stoprc;	/**< a worker failed, with this error */
+static pthread_mutex_t dumpmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dumpcond = PTHREAD_COND_INITIALIZER;
+
+static void put32(char *p, size_t v)
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static dumpbuf *buf_new(size_t size, int framed)
+{
+	dumpbuf *b = malloc(sizeof(dumpbuf));
+	if (!b)
+		return NULL;
+	if (size < BLOCKSIZE)
+		size = BLOCKSIZE;
+	if ((b->data = malloc(size)) == NULL) {
+		free(b);
+		return NULL;
+	}
+	b->next = NULL;
+	b->size = size;
+	b->framed = framed;
+	b->len = framed ? FRAMESZ : 0;
+	return b;
+}
+
+static void buf_free(dumpbuf *b)
+{
+	free(b->data);
+	free(b);
+}
+
+/** Fill in the frame of a binary block, compressing it if asked to
+ *	and if that makes it smaller.
+ */
+static int buf_frame(dumpbuf *b)
+{
+	size_t raw = b->len - FRAMESZ, stored = raw;
+
+#ifdef MDB_USE_ZLIB
+	if (mode & ZLIB) {
+		uLongf zlen = compressBound(raw);
+		char *z = malloc(FRAMESZ + zlen);
+		if (!z)
+			return ENOMEM;
+		if (compress2((Bytef *)z + FRAMESZ, &zlen, (Bytef *)b->data + FRAMESZ,
+			raw, Z_BEST_SPEED) == Z_OK && zlen < raw) {
+			free(b->data);
+			b->data = z;
+			b->len = FRAMESZ + zlen;
+			stored = zlen;
+		} else {
+			free(z);
+		}
+	}
+#endif
+	put32(b->data, raw);
+	put32(b->data + 4, stored);
+	return MDB_SUCCESS;
+}
+
+/** Write a finished block out, or queue it for the main thread
+ *	in a parallel dump.
+ */
+static int job_put(dumpjob *job, dumpbuf *b)
+{
+	int rc = MDB_SUCCESS;
+
+	if (b->framed && (rc = buf_frame(b)) != MDB_SUCCESS) {
+		buf_free(b);
+		return rc;
+	}
+	if (!nthreads) {
+		if (fwrite(b->data, 1, b->len, stdout) != b->len)
+			rc = errno;
+		buf_free(b);
+		return rc;
+	}
+	pthread_mutex_lock(&dumpmutex);
+	/* Only the job being written out may run ahead of the writer */
+	while (pending >= nthreads * RANGESPER && job != &jobs[headjob] && !stop)
+		pthread_cond_wait(&dumpcond, &dumpmutex);
+	if (job->tail)
+		job->tail->next = b;
+	else
+		job->head = b;
+	job->tail = b;
+	pending++;
+	pthread_cond_broadcast(&dumpcond);
+	pthread_mutex_unlock(&dumpmutex);
+	return rc;
+}
+
+/** Make room for \b len more bytes in the job's current block,
+ *	starting a new block if it is full.
+ */
+static int job_room(dumpjob *job, size_t len, int framed)
+{
+	dumpbuf *b = job->cur;
+	int rc;
+
+	if (b && (b->framed != framed || b->len + len > b->size)) {
+		job->cur = NULL;
+		if ((rc = job_put(job, b)) != MDB_SUCCESS)
+			return rc;
+		b = NULL;
+	}
+	if (!b) {
+		if ((b = buf_new(len + FRAMESZ, framed)) == NULL)
+			return ENOMEM;
+		job->cur = b;
+	}
+	return MDB_SUCCESS;
+}
+
+static int job_flush(dumpjob *job)
+{
+	dumpbuf *b = job->cur;
+
+	if (!b)
+		return MDB_SUCCESS;
+	job->cur = NULL;
+	return job_put(job, b);
+}
+
+static int job_printf(dumpjob *job, const char *fmt, ...)
 {
-	putchar(hexc[c >> 4]);
-	putchar(hexc[c & 0xf]);
+	va_list ap;
+	int rc, n;
+
+	if ((rc = job_room(job, 256, 0)) != MDB_SUCCESS)
+		return rc;
+	va_start(ap, fmt);
+	n = vsnprintf(job->cur->data + job->cur->len, 256, fmt, ap);
+	va_end(ap);
+	if (n > 255)
+		n = 255;
+	job->cur->len += n;
+	return MDB_SUCCESS;
 }
 
-static void text(MDB_val *v)
+static char *text(char *p, MDB_val *v)
 {
 	unsigned char *c, *end;
 
-	putchar(' ');
+	*p++ = ' ';
 	c = v->mv_data;
 	end = c + v->mv_size;
 	while (c < end) {
 		if (isprint(*c)) {
 			if (*c == '\\')
-				putchar('\\');
-			putchar(*c);
+				*p++ = '\\';
+			*p++ = *c;
 		} else {
-			putchar('\\');
-			hex(*c);
+			*p++ = '\\';
+			*p++ = hexc[*c >> 4];
+			*p++ = hexc[*c & 0xf];
 		}
 		c++;
 	}
-	putchar('\n');
+	*p++ = '\n';
+	return p;
 }
 
-static void byte(MDB_val *v)
+static char *byte(char *p, MDB_val *v)
 {
 	unsigned char *c, *end;
 
-	putchar(' ');
+	*p++ = ' ';
 	c = v->mv_data;
 	end = c + v->mv_size;
 	while (c < end) {
-		hex(*c++);
+		*p++ = hexc[*c >> 4];
+		*p++ = hexc[*c & 0xf];
+		c++;
 	}
-	putchar('\n');
+	*p++ = '\n';
+	return p;
 }
 
-/* Dump in BDB-compatible format */
-static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
+static int putrec(dumpjob *job, MDB_val *key, MDB_val *data)
+{
+	dumpbuf *b;
+	char *p;
+	size_t len;
+	int rc;
+
+	if (mode & BINARY) {
+		len = 8 + key->mv_size + data->mv_size;
+		if (len > 0xffffffffU - FRAMESZ)
+			return MDB_BAD_VALSIZE;
+		if ((rc = job_room(job, len, 1)) != MDB_SUCCESS)
+			return rc;
+		b = job->cur;
+		p = b->data + b->len;
+		put32(p, key->mv_size);
+		put32(p + 4, data->mv_size);
+		memcpy(p + 8, key->mv_data, key->mv_size);
+		memcpy(p + 8 + key->mv_size, data->mv_data, data->mv_size);
+		b->len += len;
+		return MDB_SUCCESS;
+	}
+	len = (key->mv_size + data->mv_size) * (mode & PRINT ? 3 : 2) + 4;
+	if ((rc = job_room(job, len, 0)) != MDB_SUCCESS)
+		return rc;
+	b = job->cur;
+	p = b->data + b->len;
+	if (mode & PRINT) {
+		p = text(p, key);
+		p = text(p, data);
+	} else {
+		p = byte(p, key);
+		p = byte(p, data);
+	}
+	b->len = p - b->data;
+	return MDB_SUCCESS;
+}
+
+/** Dump the records of one job's key range, then its trailer */
+static int dumprange(MDB_txn *txn, dumpjob *job)
 {
 	MDB_cursor *mc;
-	MDB_stat ms;
 	MDB_val key, data;
+	MDB_cursor_op op = MDB_FIRST;
+	int rc;
+
+	rc = mdb_cursor_open(txn, job->dbi, &mc);
+	if (rc) return rc;
+
+	if (job->lo.mv_data) {
+		key = job->lo;
+		op = MDB_SET_RANGE;
+	}
+	while ((rc = mdb_cursor_get(mc, &key, &data, op)) == MDB_SUCCESS) {
+		if (gotsig || stop) {
+			rc = EINTR;
+			break;
+		}
+		if (job->hi.mv_data && mdb_cmp(txn, job->dbi, &key, &job->hi) >= 0)
+			break;
+		if ((rc = putrec(job, &key, &data)) != MDB_SUCCESS)
+			break;
+		op = MDB_NEXT;
+	}
+	mdb_cursor_close(mc);
+	if (rc == MDB_NOTFOUND)
+		rc = MDB_SUCCESS;
+	if (rc == MDB_SUCCESS && job->last) {
+		if (mode & BINARY) {
+			/* An empty block ends the data */
+			if ((rc = job_room(job, FRAMESZ, 0)) == MDB_SUCCESS) {
+				memset(job->cur->data + job->cur->len, 0, FRAMESZ);
+				job->cur->len += FRAMESZ;
+			}
+		} else {
+			rc = job_printf(job, "DATA=END\n");
+		}
+	}
+	if (rc == MDB_SUCCESS)
+		rc = job_flush(job);
+	return rc;
+}
+
+static void *dumpworker(void *arg)
+{
+	MDB_txn *txn = arg;
+	dumpjob *job;
+	int rc;
+
+	for (;;) {
+		pthread_mutex_lock(&dumpmutex);
+		job = (nextjob < njobs && !stop) ? &jobs[nextjob++] : NULL;
+		pthread_mutex_unlock(&dumpmutex);
+		if (!job)
+			break;
+		rc = dumprange(txn, job);
+		pthread_mutex_lock(&dumpmutex);
+		job->rc = rc;
+		job->done = 1;
+		if (rc && !stop) {
+			stop = 1;
+			stoprc = rc;
+		}
+		pthread_cond_broadcast(&dumpcond);
+		pthread_mutex_unlock(&dumpmutex);
+	}
+	return NULL;
+}
+
+/** Run the queued jobs on worker threads, each with its own clone
+ *	of \b txn, and write their output in job order.
+ */
+static int dumpjobs(MDB_txn *txn)
+{
+	pthread_t tids[MAXTHREADS];
+	MDB_txn *txns[MAXTHREADS];
+	dumpbuf *b;
+	int i, n, rc = MDB_SUCCESS, wrc;
+
+	if (nthreads > njobs)
+		nthreads = njobs;
+	for (n = 0; n < nthreads; n++) {
+		if ((rc = mdb_txn_clone(txn, &txns[n])) != MDB_SUCCESS)
+			break;
+		if ((rc = pthread_create(&tids[n], NULL, dumpworker, txns[n])) != 0) {
+			mdb_txn_abort(txns[n]);
+			break;
+		}
+	}
+	if (!n)
+		return rc;
+
+	pthread_mutex_lock(&dumpmutex);
+	for (i = 0; i < njobs && !rc; i++) {
+		headjob = i;
+		pthread_cond_broadcast(&dumpcond);
+		for (;;) {
+			while (!jobs[i].head && !jobs[i].done && !stop)
+				pthread_cond_wait(&dumpcond, &dumpmutex);
+			if ((b = jobs[i].head) == NULL) {
+				rc = jobs[i].done ? jobs[i].rc : stoprc;
+				break;
+			}
+			if ((jobs[i].head = b->next) == NULL)
+				jobs[i].tail = NULL;
+			pending--;
+			pthread_cond_broadcast(&dumpcond);
+			pthread_mutex_unlock(&dumpmutex);
+			wrc = fwrite(b->data, 1, b->len, stdout) != b->len ? errno : 0;
+			buf_free(b);
+			pthread_mutex_lock(&dumpmutex);
+			if (wrc) {
+				rc = wrc;
+				break;
+			}
+		}
+	}
+	stop = 1;
+	pthread_cond_broadcast(&dumpcond);
+	pthread_mutex_unlock(&dumpmutex);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(tids[i], NULL);
+		mdb_txn_abort(txns[i]);
+	}
+	for (i = 0; i < njobs; i++) {
+		while ((b = jobs[i].head) != NULL) {
+			jobs[i].head = b->next;
+			buf_free(b);
+		}
+		if (jobs[i].cur)
+			buf_free(jobs[i].cur);
+	}
+	return rc;
+}
+
+static dumpjob *newjob(MDB_dbi dbi)
+{
+	dumpjob *job;
+
+	if (njobs == maxjobs) {
+		int n = maxjobs ? maxjobs * 2 : 64;
+		if ((job = realloc(jobs, n * sizeof(dumpjob))) == NULL)
+			return NULL;
+		jobs = job;
+		maxjobs = n;
+	}
+	job = &jobs[njobs++];
+	memset(job, 0, sizeof(*job));
+	job->dbi = dbi;
+	return job;
+}
+
+/** Dump in BDB-compatible format, or in binary format. In a parallel
+ *	dump this only queues jobs for the DB.
+ */
+static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
+{
+	MDB_stat ms;
 	MDB_envinfo info;
-	unsigned int flags;
+	MDB_val *keys = NULL;
+	mdb_size_t pages;
+	dumpjob *job;
+	unsigned int flags, nkeys = 0, k;
 	int rc, i;
 
 	rc = mdb_dbi_flags(txn, dbi, &flags);
@@ -108,52 +495,67 @@ static int dumpit(MDB_txn *txn, MDB_dbi dbi, char *name)
 	rc = mdb_env_info(mdb_txn_env(txn), &info);
 	if (rc) return rc;
 
-	printf("VERSION=3\n");
-	printf("format=%s\n", mode & PRINT ? "print" : "bytevalue");
+	if ((job = newjob(dbi)) == NULL)
+		return ENOMEM;
+
+	job_printf(job, "VERSION=3\n");
+	job_printf(job, "format=%s\n", mode & BINARY ? "binary" :
+		mode & PRINT ? "print" : "bytevalue");
 	if (name)
-		printf("database=%s\n", name);
-	printf("type=btree\n");
-	printf("mapsize=%"Yu"\n", info.me_mapsize);
+		job_printf(job, "database=%s\n", name);
+	job_printf(job, "type=btree\n");
+	job_printf(job, "mapsize=%"Yu"\n", info.me_mapsize);
 	if (info.me_mapaddr)
-		printf("mapaddr=%p\n", info.me_mapaddr);
-	printf("maxreaders=%u\n", info.me_maxreaders);
+		job_printf(job, "mapaddr=%p\n", info.me_mapaddr);
+	job_printf(job, "maxreaders=%u\n", info.me_maxreaders);
 
 	if (flags & MDB_DUPSORT)
-		printf("duplicates=1\n");
+		job_printf(job, "duplicates=1\n");
 
 	for (i=0; dbflags[i].bit; i++)
 		if (flags & dbflags[i].bit)
-			printf("%s=1\n", dbflags[i].name);
+			job_printf(job, "%s=1\n", dbflags[i].name);
 
-	printf("db_pagesize=%d\n", ms.ms_psize);
-	printf("HEADER=END\n");
+	job_printf(job, "db_pagesize=%d\n", ms.ms_psize);
+	if ((rc = job_printf(job, "HEADER=END\n")) != MDB_SUCCESS)
+		return rc;
 
-	rc = mdb_cursor_open(txn, dbi, &mc);
-	if (rc) return rc;
+	if (!nthreads) {
+		job->last = 1;
+		rc = dumprange(txn, job);
+		njobs = 0;
+		return rc;
+	}
 
-	while ((rc = mdb_cursor_get(mc, &key, &data, MDB_NEXT) == MDB_SUCCESS)) {
-		if (gotsig) {
-			rc = EINTR;
-			break;
+	/* Cut big DBs into ranges for the workers */
+	pages = ms.ms_branch_pages + ms.ms_leaf_pages + ms.ms_overflow_pages;
+	nkeys = nthreads * RANGESPER;
+	if (pages / RANGEPAGES < nkeys)
+		nkeys = pages / RANGEPAGES;
+	if (nkeys) {
+		if ((keys = malloc(nkeys * sizeof(MDB_val))) == NULL)
+			return ENOMEM;
+		if ((rc = mdb_dbi_ranges(txn, dbi, keys, &nkeys)) != MDB_SUCCESS) {
+			free(keys);
+			return rc;
 		}
-		if (mode & PRINT) {
-			text(&key);
-			text(&data);
-		} else {
-			byte(&key);
-			byte(&data);
+	}
+	for (k = 0; k < nkeys; k++) {
+		jobs[njobs-1].hi = keys[k];
+		if ((job = newjob(dbi)) == NULL) {
+			free(keys);
+			return ENOMEM;
 		}
+		job->lo = keys[k];
 	}
-	printf("DATA=END\n");
-	if (rc == MDB_NOTFOUND)
-		rc = MDB_SUCCESS;
-
-	return rc;
+	job->last = 1;
+	free(keys);
+	return MDB_SUCCESS;
 }
 
 static void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s [-V] [-f output] [-l] [-n] [-p] [-v] [-a|-s subdb] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-b] [-f output] [-j threads] [-l] [-n] [-p] [-v] [-z] [-a|-s subdb] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -166,7 +568,7 @@ int main(int argc, char *argv[])
 	char *prog = argv[0];
 	char *envname;
 	char *subname = NULL;
-	int alldbs = 0, envflags = 0, list = 0;
+	int alldbs = 0, envflags = 0, list = 0, maxdbs = 0;
 
 	if (argc < 2) {
 		usage(prog);
@@ -174,14 +576,17 @@ int main(int argc, char *argv[])
 
 	/* -a: dump main DB and all subDBs
 	 * -s: dump only the named subDB
+	 * -b: use binary format
+	 * -j: dump with this many threads
 	 * -n: use NOSUBDIR flag on env_open
 	 * -p: use printable characters
 	 * -f: write to file instead of stdout
 	 * -v: use previous snapshot
+	 * -z: compress binary format
 	 * -V: print version and exit
 	 * (default) dump only the main DB
 	 */
-	while ((i = getopt(argc, argv, "af:lnps:vV")) != EOF) {
+	while ((i = getopt(argc, argv, "abf:j:lnps:vVz")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
@@ -195,6 +600,9 @@ int main(int argc, char *argv[])
 				usage(prog);
 			alldbs++;
 			break;
+		case 'b':
+			mode |= BINARY;
+			break;
 		case 'f':
 			if (freopen(optarg, "w", stdout) == NULL) {
 				fprintf(stderr, "%s: %s: reopen: %s\n",
@@ -202,6 +610,13 @@ int main(int argc, char *argv[])
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAXTHREADS)
+				usage(prog);
+			if (nthreads == 1)
+				nthreads = 0;
+			break;
 		case 'n':
 			envflags |= MDB_NOSUBDIR;
 			break;
@@ -216,6 +631,13 @@ int main(int argc, char *argv[])
 				usage(prog);
 			subname = optarg;
 			break;
+		case 'z':
+#ifndef MDB_USE_ZLIB
+			fprintf(stderr, "%s: built without MDB_USE_ZLIB, -z is not supported\n", prog);
+			exit(EXIT_FAILURE);
+#endif
+			mode |= ZLIB;
+			break;
 		default:
 			usage(prog);
 		}
@@ -223,6 +645,9 @@ int main(int argc, char *argv[])
 
 	if (optind != argc - 1)
 		usage(prog);
+	if ((mode & (BINARY|PRINT)) == (BINARY|PRINT) ||
+		(mode & (BINARY|ZLIB)) == ZLIB)
+		usage(prog);
 
 #ifdef SIGPIPE
 	signal(SIGPIPE, dumpsig);
@@ -233,15 +658,22 @@ int main(int argc, char *argv[])
 	signal(SIGINT, dumpsig);
 	signal(SIGTERM, dumpsig);
 
+	/* Workers get their txns from this thread */
+	if (nthreads)
+		envflags |= MDB_NOTLS;
+	if (alldbs || subname)
+		maxdbs = 2;
+
 	envname = argv[optind];
+reopen:
 	rc = mdb_env_create(&env);
 	if (rc) {
 		fprintf(stderr, "mdb_env_create failed, error %d %s\n", rc, mdb_strerror(rc));
 		return EXIT_FAILURE;
 	}
 
-	if (alldbs || subname) {
-		mdb_env_set_maxdbs(env, 2);
+	if (maxdbs) {
+		mdb_env_set_maxdbs(env, maxdbs);
 	}
 
 	rc = mdb_env_open(env, envname, envflags | MDB_RDONLY, 0664);
@@ -272,6 +704,23 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "mdb_cursor_open failed, error %d %s\n", rc, mdb_strerror(rc));
 			goto txn_abort;
 		}
+		if (nthreads && !list && maxdbs == 2) {
+			/* A parallel dump keeps all subDBs open. Count them,
+			 * with some to spare for any created meanwhile.
+			 */
+			while ((rc = mdb_cursor_get(cursor, &key, NULL, MDB_NEXT_NODUP)) == 0)
+				if (!memchr(key.mv_data, '\0', key.mv_size))
+					count++;
+			if (count > 2) {
+				mdb_cursor_close(cursor);
+				mdb_txn_abort(txn);
+				mdb_env_close(env);
+				maxdbs = count + 16;
+				goto reopen;
+			}
+			count = 0;
+			mdb_cursor_renew(txn, cursor);
+		}
 		while ((rc = mdb_cursor_get(cursor, &key, NULL, MDB_NEXT_NODUP)) == 0) {
 			char *str;
 			MDB_dbi db2;
@@ -291,7 +740,8 @@ int main(int argc, char *argv[])
 					if (rc)
 						break;
 				}
-				mdb_close(env, db2);
+				if (!nthreads)
+					mdb_close(env, db2);
 			}
 			free(str);
 			if (rc) continue;
@@ -306,6 +756,10 @@ int main(int argc, char *argv[])
 	} else {
 		rc = dumpit(txn, dbi, subname);
 	}
+	if (rc == MDB_SUCCESS && njobs)
+		rc = dumpjobs(txn);
+	if (fflush(stdout) == EOF && !rc)
+		rc = errno;
 	if (rc && rc != MDB_NOTFOUND)
 		fprintf(stderr, "%s: %s: %s\n", prog, envname, mdb_strerror(rc));
 
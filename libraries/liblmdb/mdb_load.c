@@ -17,10 +17,15 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <pthread.h>
+#ifdef MDB_USE_ZLIB
+#include <zlib.h>
+#endif
 #include "lmdb.h"
 
 #define PRINT	1
 #define NOHDR	2
+#define BINARY	4
 static int mode;
 
 static char *subname = NULL;
@@ -66,6 +71,7 @@ static void readhdr(void)
 	char *ptr;
 
 	flags = 0;
+	mode &= ~(PRINT|BINARY);
 	while (fgets(dbuf.mv_data, dbuf.mv_size, stdin) != NULL) {
 		lineno++;
 		if (!strncmp(dbuf.mv_data, "VERSION=", STRLENOF("VERSION="))) {
@@ -76,10 +82,12 @@ static void readhdr(void)
 				exit(EXIT_FAILURE);
 			}
 		} else if (!strncmp(dbuf.mv_data, "HEADER=END", STRLENOF("HEADER=END"))) {
-			break;
+			return;
 		} else if (!strncmp(dbuf.mv_data, "format=", STRLENOF("format="))) {
 			if (!strncmp((char *)dbuf.mv_data+STRLENOF("FORMAT="), "print", STRLENOF("print")))
 				mode |= PRINT;
+			else if (!strncmp((char *)dbuf.mv_data+STRLENOF("FORMAT="), "binary", STRLENOF("binary")))
+				mode |= BINARY;
 			else if (strncmp((char *)dbuf.mv_data+STRLENOF("FORMAT="), "bytevalue", STRLENOF("bytevalue"))) {
 				fprintf(stderr, "%s: line %"Yu": unsupported FORMAT %s\n",
 					prog, lineno, (char *)dbuf.mv_data+STRLENOF("FORMAT="));
@@ -150,6 +158,8 @@ static void readhdr(void)
 			}
 		}
 	}
+	/* No more DBs */
+	Eof = 1;
 }
 
 static void badend(void)
@@ -274,9 +284,208 @@ badend:
 	return 0;
 }
 
+/** Blocks of binary input, see mdb_dump.c. A reader thread reads and
+ *	decompresses blocks into a ring while the main thread loads the
+ *	records of earlier ones.
+ */
+typedef struct loadbuf {
+	char *data;
+	size_t len, size;
+} loadbuf;
+
+#define NBUFS	4
+#define FRAMESZ	8
+
+static loadbuf bufs[NBUFS];
+static int bhead, bcount;	/**< first full block in the ring, and how many */
+static int rstarted, rdone, rstop, rerr;
+static loadbuf *bcur;		/**< block being loaded */
+static size_t bpos;
+static pthread_t rthr;
+static pthread_mutex_t rmutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcond = PTHREAD_COND_INITIALIZER;
+
+static size_t get32(const char *p)
+{
+	const unsigned char *c = (const unsigned char *)p;
+	return c[0] | (c[1] << 8) | (c[2] << 16) | ((size_t)c[3] << 24);
+}
+
+static int bufsize(loadbuf *b, size_t size)
+{
+	char *p;
+
+	if (b->size >= size)
+		return 0;
+	if ((p = realloc(b->data, size)) == NULL)
+		return ENOMEM;
+	b->data = p;
+	b->size = size;
+	return 0;
+}
+
+/** Read the blocks of one DB, up to the empty block that ends them */
+static void *readblocks(void *arg)
+{
+	loadbuf *b, zb = {NULL, 0, 0};
+	char hdr[FRAMESZ];
+	size_t n, raw, stored;
+	char *err = NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&rmutex);
+		while (bcount == NBUFS && !rstop)
+			pthread_cond_wait(&rcond, &rmutex);
+		b = &bufs[(bhead + bcount) % NBUFS];
+		pthread_mutex_unlock(&rmutex);
+		if (rstop)
+			break;
+
+		n = fread(hdr, 1, FRAMESZ, stdin);
+		if (n != FRAMESZ) {
+			err = "unexpected end of input";
+			break;
+		}
+		raw = get32(hdr);
+		stored = get32(hdr + 4);
+		if (!raw)
+			break;
+		if (stored > raw) {
+			err = "bad block size";
+			break;
+		}
+		if (bufsize(b, raw)) {
+			err = "out of memory";
+			break;
+		}
+		if (stored == raw) {
+			if (fread(b->data, 1, raw, stdin) != raw) {
+				err = "unexpected end of input";
+				break;
+			}
+		} else {
+#ifdef MDB_USE_ZLIB
+			uLongf zlen = raw;
+			if (bufsize(&zb, stored)) {
+				err = "out of memory";
+				break;
+			}
+			if (fread(zb.data, 1, stored, stdin) != stored) {
+				err = "unexpected end of input";
+				break;
+			}
+			if (uncompress((Bytef *)b->data, &zlen, (Bytef *)zb.data, stored) != Z_OK ||
+				zlen != raw) {
+				err = "bad compressed block";
+				break;
+			}
+#else
+			err = "compressed input needs MDB_USE_ZLIB";
+			break;
+#endif
+		}
+		b->len = raw;
+
+		pthread_mutex_lock(&rmutex);
+		bcount++;
+		pthread_cond_signal(&rcond);
+		pthread_mutex_unlock(&rmutex);
+	}
+	free(zb.data);
+	if (err) {
+		fprintf(stderr, "%s: %s\n", prog, err);
+		rerr = EINVAL;
+	}
+	pthread_mutex_lock(&rmutex);
+	rdone = 1;
+	pthread_cond_signal(&rcond);
+	pthread_mutex_unlock(&rmutex);
+	return NULL;
+}
+
+static int readbin(MDB_val *key, MDB_val *data)
+{
+	size_t klen, dlen;
+	int rc = EOF;
+
+	if (!rstarted) {
+		rdone = rstop = rerr = 0;
+		if (pthread_create(&rthr, NULL, readblocks, NULL)) {
+			fprintf(stderr, "%s: cannot start reader thread\n", prog);
+			return EINVAL;
+		}
+		rstarted = 1;
+	}
+	for (;;) {
+		if (bcur) {
+			if (bpos < bcur->len) {
+				if (bcur->len - bpos < 8 ||
+					(klen = get32(bcur->data + bpos),
+					 dlen = get32(bcur->data + bpos + 4),
+					 bcur->len - bpos - 8 < klen + dlen)) {
+					fprintf(stderr, "%s: record %"Yu": bad record size\n",
+						prog, lineno);
+					rc = EINVAL;
+					break;
+				}
+				key->mv_size = klen;
+				key->mv_data = bcur->data + bpos + 8;
+				data->mv_size = dlen;
+				data->mv_data = bcur->data + bpos + 8 + klen;
+				bpos += 8 + klen + dlen;
+				lineno++;
+				return 0;
+			}
+			pthread_mutex_lock(&rmutex);
+			bhead = (bhead + 1) % NBUFS;
+			bcount--;
+			pthread_cond_signal(&rcond);
+			pthread_mutex_unlock(&rmutex);
+			bcur = NULL;
+		}
+		pthread_mutex_lock(&rmutex);
+		while (!bcount && !rdone)
+			pthread_cond_wait(&rcond, &rmutex);
+		if (bcount) {
+			bcur = &bufs[bhead];
+			bpos = 0;
+		}
+		pthread_mutex_unlock(&rmutex);
+		if (!bcur)
+			break;
+	}
+	/* Done with this DB, or failed: the reader may be waiting for room */
+	pthread_mutex_lock(&rmutex);
+	rstop = 1;
+	pthread_cond_signal(&rcond);
+	pthread_mutex_unlock(&rmutex);
+	pthread_join(rthr, NULL);
+	rstarted = 0;
+	bhead = bcount = 0;
+	bcur = NULL;
+	return rerr ? rerr : rc;
+}
+
+/** Read the next key and data item.
+ * @return 0 on success, EOF at the end of the DB's data, or another
+ * error after reporting it.
+ */
+static int readrec(MDB_val *key, MDB_val *data)
+{
+	if (mode & BINARY)
+		return readbin(key, data);
+	if (readline(key, &kbuf))
+		return EOF;
+	if (readline(data, &dbuf)) {
+		fprintf(stderr, "%s: line %"Yu": failed to read key value\n", prog, lineno);
+		return EINVAL;
+	}
+	return 0;
+}
+
 static void usage(void)
 {
-	fprintf(stderr, "usage: %s [-V] [-a] [-f input] [-n] [-s name] [-N] [-T] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-a] [-b fill] [-f input] [-n] [-s name] [-N] [-T] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -289,12 +498,13 @@ int main(int argc, char *argv[])
 {
 	int i, rc;
 	MDB_env *env;
-	MDB_txn *txn;
+	MDB_txn *txn = NULL;
 	MDB_cursor *mc;
+	MDB_bulk *mb;
 	MDB_dbi dbi;
 	char *envname;
 	int envflags = MDB_NOSYNC, putflags = 0;
-	int dohdr = 0, append = 0;
+	int dohdr = 0, append = 0, bulk = 0;
 	MDB_val prevk;
 
 	prog = argv[0];
@@ -304,6 +514,7 @@ int main(int argc, char *argv[])
 	}
 
 	/* -a: append records in input order
+	 * -b: build sorted input bottom-up, filling pages to given percent
 	 * -f: load file instead of stdin
 	 * -n: use NOSUBDIR flag on env_open
 	 * -s: load into named subDB
@@ -311,7 +522,7 @@ int main(int argc, char *argv[])
 	 * -T: read plaintext
 	 * -V: print version and exit
 	 */
-	while ((i = getopt(argc, argv, "af:ns:NTV")) != EOF) {
+	while ((i = getopt(argc, argv, "ab:f:ns:NTV")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
@@ -320,6 +531,11 @@ int main(int argc, char *argv[])
 		case 'a':
 			append = 1;
 			break;
+		case 'b':
+			bulk = atoi(optarg);
+			if (bulk < 1 || bulk > 100)
+				usage();
+			break;
 		case 'f':
 			if (freopen(optarg, "r", stdin) == NULL) {
 				fprintf(stderr, "%s: %s: reopen: %s\n",
@@ -390,9 +606,12 @@ int main(int argc, char *argv[])
 
 		if (!dohdr) {
 			dohdr = 1;
-		} else if (!(mode & NOHDR))
+		} else if (!(mode & NOHDR)) {
 			readhdr();
-		
+			if (Eof)
+				break;
+		}
+
 		rc = mdb_txn_begin(env, NULL, 0, &txn);
 		if (rc) {
 			fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc, mdb_strerror(rc));
@@ -411,6 +630,34 @@ int main(int argc, char *argv[])
 				mdb_set_dupsort(txn, dbi, greater);
 		}
 
+		/* Bulk build the whole DB in this txn; dups use the normal path */
+		mb = NULL;
+		if (bulk && !(flags & MDB_DUPSORT)) {
+			rc = mdb_bulk_begin(txn, dbi, bulk, &mb);
+			if (rc) {
+				fprintf(stderr, "mdb_bulk_begin failed, error %d %s\n", rc, mdb_strerror(rc));
+				goto txn_abort;
+			}
+			while(1) {
+				rc = readrec(&key, &data);
+				if (rc == EOF)
+					break;
+				if (rc) {
+					mdb_bulk_close(mb);
+					goto txn_abort;
+				}
+
+				rc = mdb_bulk_put(mb, &key, &data);
+				if (rc) {
+					fprintf(stderr, "%s: line %"Yu": mdb_bulk_put failed, error %d %s\n", prog, lineno, rc, mdb_strerror(rc));
+					mdb_bulk_close(mb);
+					goto txn_abort;
+				}
+			}
+			mdb_bulk_close(mb);
+			goto commit;
+		}
+
 		rc = mdb_cursor_open(txn, dbi, &mc);
 		if (rc) {
 			fprintf(stderr, "mdb_cursor_open failed, error %d %s\n", rc, mdb_strerror(rc));
@@ -418,15 +665,11 @@ int main(int argc, char *argv[])
 		}
 
 		while(1) {
-			rc = readline(&key, &kbuf);
-			if (rc)  /* rc == EOF */
+			rc = readrec(&key, &data);
+			if (rc == EOF)
 				break;
-
-			rc = readline(&data, &dbuf);
-			if (rc) {
-				fprintf(stderr, "%s: line %"Yu": failed to read key value\n", prog, lineno);
+			if (rc)
 				goto txn_abort;
-			}
 
 			if (append) {
 				appflag = MDB_APPEND;
@@ -475,6 +718,7 @@ int main(int argc, char *argv[])
 				batch = 0;
 			}
 		}
+commit:
 		rc = mdb_txn_commit(txn);
 		txn = NULL;
 		if (rc) {
@@ -20,6 +20,11 @@
 #define Z	MDB_FMT_Z
 #define Yu	MDB_PRIy(u)
 
+	/* Set in the length word of a range-encoded freelist entry,
+	 * which holds {highest page, count} pairs instead of page numbers
+	 */
+#define RANGES	(~(~(mdb_size_t)0 >> 1))
+
 static void prstat(MDB_stat *ms)
 {
 #if 0
@@ -32,9 +37,59 @@ static void prstat(MDB_stat *ms)
 	printf("  Entries: %"Yu"\n",        ms->ms_entries);
 }
 
+static int prrdr(const MDB_rdrinfo *ri, void *ctx)
+{
+	int *first = ctx;
+
+	if (*first) {
+		*first = 0;
+		printf("  slot        pid     thread      txnid        lag    held(s)     pinned\n");
+	}
+	printf("%6u %10d %10"Z"u %10"Yu" %10"Yu" %10"Yu".%03u %10"Yu"\n",
+		ri->mri_slot, ri->mri_pid, ri->mri_tid, ri->mri_txnid, ri->mri_lag,
+		ri->mri_msec / 1000, (unsigned)(ri->mri_msec % 1000), ri->mri_pinned);
+	return 0;
+}
+
+static void prhist(const char *name, const mdb_size_t *hist)
+{
+	int i;
+
+	printf("  %s latency:\n", name);
+	for (i=0; i<MDB_METRICS_HIST; i++) {
+		if (!hist[i])
+			continue;
+		if (i < MDB_METRICS_HIST-1)
+			printf("    < %10"Yu" usec: %"Yu"\n", (mdb_size_t)1 << i, hist[i]);
+		else
+			printf("    >= %9"Yu" usec: %"Yu"\n", (mdb_size_t)1 << (i-1), hist[i]);
+	}
+}
+
+static void prmetrics(MDB_metrics *mm)
+{
+	printf("  Page gets: %"Yu"\n", mm->me_page_gets);
+	printf("    dirty: %"Yu"\n", mm->me_page_dirty);
+	printf("    spilled: %"Yu"\n", mm->me_page_spilled);
+	printf("  Page splits: %"Yu"\n", mm->me_splits);
+	printf("  Rebalances: %"Yu"\n", mm->me_rebalances);
+	printf("  Merges: %"Yu"\n", mm->me_merges);
+	printf("  Spilled pages: %"Yu"\n", mm->me_spills);
+	printf("  Unspilled pages: %"Yu"\n", mm->me_unspills);
+	printf("  Freelist records read: %"Yu"\n", mm->me_freedb_reads);
+	printf("  Commits: %"Yu" in %"Yu" usec\n", mm->me_commits, mm->me_commit_usec);
+	printf("  Pages written: %"Yu", %"Yu" bytes in %"Yu" usec\n",
+		mm->me_flush_pages, mm->me_flush_bytes, mm->me_flush_usec);
+	printf("  Syncs: %"Yu" in %"Yu" usec\n", mm->me_syncs, mm->me_sync_usec);
+	if (mm->me_commits)
+		prhist("Commit", mm->me_commit_hist);
+	if (mm->me_syncs)
+		prhist("Sync", mm->me_sync_hist);
+}
+
 static void usage(char *prog)
 {
-	fprintf(stderr, "usage: %s [-V] [-n] [-e] [-r[r]] [-f[f[f]]] [-v] [-a|-s subdb] dbpath\n", prog);
+	fprintf(stderr, "usage: %s [-V] [-n] [-e] [-M] [-r[r]] [-R] [-f[f[f]]] [-v] [-a|-s subdb] dbpath\n", prog);
 	exit(EXIT_FAILURE);
 }
 
@@ -49,7 +104,7 @@ int main(int argc, char *argv[])
 	char *prog = argv[0];
 	char *envname;
 	char *subname = NULL;
-	int alldbs = 0, envinfo = 0, envflags = 0, freinfo = 0, rdrinfo = 0;
+	int alldbs = 0, envinfo = 0, envflags = 0, freinfo = 0, rdrinfo = 0, rdrlag = 0, metrics = 0;
 
 	if (argc < 2) {
 		usage(prog);
@@ -58,14 +113,16 @@ int main(int argc, char *argv[])
 	/* -a: print stat of main DB and all subDBs
 	 * -s: print stat of only the named subDB
 	 * -e: print env info
+	 * -M: print hot path counters
 	 * -f: print freelist info
 	 * -r: print reader info
+	 * -R: print reader lag and pinned pages
 	 * -n: use NOSUBDIR flag on env_open
 	 * -v: use previous snapshot
 	 * -V: print version and exit
 	 * (default) print stat of only the main DB
 	 */
-	while ((i = getopt(argc, argv, "Vaefnrs:v")) != EOF) {
+	while ((i = getopt(argc, argv, "VaefMnrRs:v")) != EOF) {
 		switch(i) {
 		case 'V':
 			printf("%s\n", MDB_VERSION_STRING);
@@ -82,6 +139,9 @@ int main(int argc, char *argv[])
 		case 'f':
 			freinfo++;
 			break;
+		case 'M':
+			metrics++;
+			break;
 		case 'n':
 			envflags |= MDB_NOSUBDIR;
 			break;
@@ -91,6 +151,9 @@ int main(int argc, char *argv[])
 		case 'r':
 			rdrinfo++;
 			break;
+		case 'R':
+			rdrlag++;
+			break;
 		case 's':
 			if (alldbs)
 				usage(prog);
@@ -135,6 +198,13 @@ int main(int argc, char *argv[])
 		printf("  Number of readers used: %u\n", mei.me_numreaders);
 	}
 
+	if (metrics) {
+		MDB_metrics mm;
+		(void)mdb_env_metrics(env, &mm);
+		printf("Environment Metrics\n");
+		prmetrics(&mm);
+	}
+
 	if (rdrinfo) {
 		printf("Reader Table Status\n");
 		rc = mdb_reader_list(env, (MDB_msg_func *)fputs, stdout);
@@ -148,6 +218,20 @@ int main(int argc, char *argv[])
 			goto env_close;
 	}
 
+	if (rdrlag) {
+		int first = 1;
+		printf("Reader Lag\n");
+		rc = mdb_reader_info(env, prrdr, &first);
+		if (rc) {
+			fprintf(stderr, "mdb_reader_info failed, error %d %s\n", rc, mdb_strerror(rc));
+			goto env_close;
+		}
+		if (first)
+			printf("  (no readers holding a snapshot)\n");
+		if (!(subname || alldbs || freinfo))
+			goto env_close;
+	}
+
 	rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
 	if (rc) {
 		fprintf(stderr, "mdb_txn_begin failed, error %d %s\n", rc, mdb_strerror(rc));
@@ -174,6 +258,37 @@ int main(int argc, char *argv[])
 		prstat(&mst);
 		while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
 			iptr = data.mv_data;
+			if (*iptr & RANGES) {
+				mdb_size_t pg, prev;
+				ssize_t i, j = 0, n = *iptr++ & ~RANGES, span = 0;
+				char *bad = "";
+				for (i = n, prev = 0; --i >= 0; ) {
+					pg = iptr[i*2] - iptr[i*2+1] + 1;
+					if (pg <= prev + (i < n-1) || !iptr[i*2+1])
+						bad = " [bad sequence]";
+					prev = iptr[i*2];
+					j += iptr[i*2+1];
+					if (iptr[i*2+1] > (mdb_size_t)span)
+						span = iptr[i*2+1];
+				}
+				pages += j;
+				if (freinfo > 1) {
+					if (key.mv_size > sizeof(mdb_size_t))
+						printf("    Transaction %"Yu" chunk %"Yu", %"Z"d pages in %"Z"d ranges, maxspan %"Z"d%s\n",
+							*(mdb_size_t *)key.mv_data, ((mdb_size_t *)key.mv_data)[1], j, n, span, bad);
+					else
+						printf("    Transaction %"Yu", %"Z"d pages in %"Z"d ranges, maxspan %"Z"d%s\n",
+							*(mdb_size_t *)key.mv_data, j, n, span, bad);
+				}
+				if (freinfo > 2) {
+					for (i = n; --i >= 0; ) {
+						pg = iptr[i*2] - iptr[i*2+1] + 1;
+						printf(iptr[i*2+1] > 1 ? "     %9"Yu"[%"Yu"]\n" : "     %9"Yu"\n",
+							pg, iptr[i*2+1]);
+					}
+				}
+				continue;
+			}
 			pages += *iptr;
 			if (freinfo > 1) {
 				char *bad = "";
@@ -188,8 +303,12 @@ int main(int argc, char *argv[])
 					pg += span;
 					for (; i >= span && iptr[i-span] == pg; span++, pg++) ;
 				}
-				printf("    Transaction %"Yu", %"Z"d pages, maxspan %"Z"d%s\n",
-					*(mdb_size_t *)key.mv_data, j, span, bad);
+				if (key.mv_size > sizeof(mdb_size_t))
+					printf("    Transaction %"Yu" chunk %"Yu", %"Z"d pages, maxspan %"Z"d%s\n",
+						*(mdb_size_t *)key.mv_data, ((mdb_size_t *)key.mv_data)[1], j, span, bad);
+				else
+					printf("    Transaction %"Yu", %"Z"d pages, maxspan %"Z"d%s\n",
+						*(mdb_size_t *)key.mv_data, j, span, bad);
 				if (freinfo > 2) {
 					for (--j; j >= 0; ) {
 						pg = iptr[j];
@@ -250,6 +250,65 @@ mdb_midl_sort( MDB_IDL ids )
 	}
 }
 
+MDB_ID mdb_ridl_count( MDB_RIDL rl )
+{
+	MDB_ID i, n = MDB_RIDL_LEN(rl), count = 0;
+
+	for (i = 1; i <= n; i++)
+		count += rl[i*2];
+	return count;
+}
+
+unsigned mdb_midl_nranges( MDB_IDL ids )
+{
+	MDB_ID i, n = ids[0];
+	unsigned k = n ? 1 : 0;
+
+	for (i = 2; i <= n; i++)
+		if (ids[i] != ids[i-1] - 1)
+			k++;
+	return k;
+}
+
+void mdb_ridl_encode( MDB_RIDL rl, MDB_IDL ids )
+{
+	MDB_ID i, n = ids[0], k = 0;
+
+	for (i = 1; i <= n; i++) {
+		if (k && ids[i] == rl[k*2-1] - rl[k*2]) {
+			rl[k*2]++;
+		} else {
+			k++;
+			rl[k*2-1] = ids[i];
+			rl[k*2] = 1;
+		}
+	}
+	rl[0] = k | MDB_RIDL_FLAG;
+}
+
+void mdb_ridl_xmerge( MDB_IDL dst, MDB_RIDL merge )
+{
+	MDB_ID old_id, id, hi;
+	MDB_ID i = MDB_RIDL_LEN(merge), j = dst[0], k = j + mdb_ridl_count(merge);
+	const MDB_ID total = k;
+	dst[0] = (MDB_ID)-1;		/* delimiter for dst scan below */
+	old_id = dst[j];
+	/* Like mdb_midl_xmerge(), lowest IDs first, filling dst from the end */
+	while (i) {
+		hi = merge[i*2-1];
+		id = hi - merge[i*2] + 1;
+		i--;
+		for (;; id++) {
+			for (; old_id < id; old_id = dst[--j])
+				dst[k--] = old_id;
+			dst[k--] = id;
+			if (id == hi)
+				break;
+		}
+	}
+	dst[0] = total;
+}
+
 unsigned mdb_mid2l_search( MDB_ID2L ids, MDB_ID id )
 {
 	/*
@@ -144,6 +144,47 @@ void mdb_midl_xmerge( MDB_IDL idl, MDB_IDL merge );
 	 */
 void mdb_midl_sort( MDB_IDL ids );
 
+	/** An RIDL is a range-encoded IDL. Its first element is the
+	 * number of ranges with #MDB_RIDL_FLAG set, so an RIDL can be
+	 * stored where an IDL is expected and still be told apart.
+	 * Each range is a pair: its highest ID, then how many consecutive
+	 * IDs it covers going down. Ranges are sorted in descending order
+	 * like an IDL, and adjacent ranges never touch.
+	 */
+typedef MDB_ID *MDB_RIDL;
+
+#define MDB_RIDL_FLAG	(~(~(MDB_ID)0 >> 1))
+#define MDB_IDL_IS_RANGES(ids)	(((ids)[0] & MDB_RIDL_FLAG) != 0)
+	/** Number of ranges in an RIDL */
+#define MDB_RIDL_LEN(rl)	((rl)[0] & ~MDB_RIDL_FLAG)
+#define MDB_RIDL_SIZEOF(rl)	((MDB_RIDL_LEN(rl) * 2 + 1) * sizeof(MDB_ID))
+
+	/** Count the IDs in an RIDL.
+	 * @param[in] rl	The RIDL.
+	 * @return	The number of IDs covered by all its ranges.
+	 */
+MDB_ID mdb_ridl_count( MDB_RIDL rl );
+
+	/** Count the ranges of consecutive IDs in a sorted IDL.
+	 * @param[in] ids	The IDL.
+	 * @return	The number of ranges #mdb_ridl_encode() would produce.
+	 */
+unsigned mdb_midl_nranges( MDB_IDL ids );
+
+	/** Range-encode a sorted IDL. The RIDL must have room for
+	 * #mdb_midl_nranges() ranges.
+	 * @param[out] rl	The RIDL to write.
+	 * @param[in] ids	The IDL to encode.
+	 */
+void mdb_ridl_encode( MDB_RIDL rl, MDB_IDL ids );
+
+	/** Merge an RIDL onto an IDL. The destination IDL must be big
+	 * enough for #mdb_ridl_count() more IDs.
+	 * @param[in] idl	The IDL to merge into.
+	 * @param[in] merge	The RIDL to merge.
+	 */
+void mdb_ridl_xmerge( MDB_IDL idl, MDB_RIDL merge );
+
 	/** An ID2 is an ID/pointer pair.
 	 */
 typedef struct MDB_ID2 {
@@ -0,0 +1,181 @@
+/* mtest10.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for staged write txns, see mdb_txn_begin_dbis() */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define RES(err, expr) ((rc = expr) == (err) || (CHECK(!rc, #expr), 0))
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+#define NTHREADS	4
+#define NKEYS	5000
+
+static MDB_env *env;
+static MDB_dbi dbis[NTHREADS];
+
+static void setkey(MDB_val *key, char *kval, int i)
+{
+	sprintf(kval, "%08d", i);
+	key->mv_size = 8;
+	key->mv_data = kval;
+}
+
+/* Each thread writes its own DB: keys 0 to NKEYS-1 with data "<db> <key>",
+ * less the odd keys below 100, which it puts and then deletes.
+ */
+static void *writer(void *arg)
+{
+	int n = (int)(long)arg, i, rc;
+	MDB_txn *txn;
+	MDB_val key, data;
+	char kval[16], sval[32];
+
+	E(mdb_txn_begin_dbis(env, &dbis[n], 1, 0, &txn));
+	for (i = NKEYS; i-- > 0; ) {
+		setkey(&key, kval, i);
+		sprintf(sval, "%d %d", n, i);
+		data.mv_size = strlen(sval) + 1;
+		data.mv_data = sval;
+		E(mdb_put(txn, dbis[n], &key, &data, MDB_NOOVERWRITE));
+	}
+	/* The txn sees its own writes, and its results are final */
+	setkey(&key, kval, 42);
+	E(mdb_get(txn, dbis[n], &key, &data));
+	sprintf(sval, "%d %d", n, 42);
+	CHECK(!strcmp(data.mv_data, sval), "read own write");
+	RES(MDB_KEYEXIST, mdb_put(txn, dbis[n], &key, &data, MDB_NOOVERWRITE));
+	CHECK(rc == MDB_KEYEXIST, "staged MDB_NOOVERWRITE");
+	for (i = 1; i < 100; i += 2) {
+		setkey(&key, kval, i);
+		E(mdb_del(txn, dbis[n], &key, NULL));
+		RES(MDB_NOTFOUND, mdb_get(txn, dbis[n], &key, &data));
+		CHECK(rc == MDB_NOTFOUND, "read own delete");
+	}
+	RES(MDB_NOTFOUND, mdb_del(txn, dbis[n], &key, NULL));
+	CHECK(rc == MDB_NOTFOUND, "staged delete of a missing key");
+	E(mdb_txn_commit(txn));
+	return NULL;
+}
+
+static void check(MDB_txn *txn, int n)
+{
+	MDB_cursor *cursor;
+	MDB_val key, data;
+	char kval[16], sval[32];
+	int i = 0, rc;
+
+	E(mdb_cursor_open(txn, dbis[n], &cursor));
+	while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+		if (i < 100 && (i & 1))
+			i++;
+		sprintf(kval, "%08d", i);
+		CHECK(key.mv_size == 8 && !memcmp(key.mv_data, kval, 8), "wrong key");
+		sprintf(sval, "%d %d", n, i);
+		CHECK(!strcmp(data.mv_data, sval), "wrong data");
+		i++;
+	}
+	CHECK(rc == MDB_NOTFOUND, "mdb_cursor_get");
+	CHECK(i == NKEYS, "missing keys");
+	mdb_cursor_close(cursor);
+}
+
+int main(int argc,char * argv[])
+{
+	int i, rc;
+	MDB_dbi dbi;
+	MDB_val key, data;
+	MDB_txn *txn, *txn2;
+	pthread_t tids[NTHREADS];
+	char kval[16], name[8];
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 104857600));
+	E(mdb_env_set_maxdbs(env, NTHREADS + 1));
+	E(mdb_env_open(env, "./testdb", MDB_NOSYNC, 0664));
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	for (i = 0; i < NTHREADS; i++) {
+		sprintf(name, "db%d", i);
+		E(mdb_dbi_open(txn, name, MDB_CREATE, &dbis[i]));
+	}
+	E(mdb_dbi_open(txn, "plain", MDB_CREATE, &dbi));
+	E(mdb_txn_commit(txn));
+
+	/* Staged txns on disjoint DBs, next to regular write txns */
+	printf("Staging %d keys in each of %d threads\n", NKEYS, NTHREADS);
+	for (i = 0; i < NTHREADS; i++)
+		CHECK(!(rc = pthread_create(&tids[i], NULL, writer, (void *)(long)i)),
+			"pthread_create");
+	for (i = 0; i < NKEYS; i++) {
+		E(mdb_txn_begin(env, NULL, 0, &txn));
+		setkey(&key, kval, i);
+		E(mdb_put(txn, dbi, &key, &key, 0));
+		E(mdb_txn_commit(txn));
+	}
+	for (i = 0; i < NTHREADS; i++)
+		pthread_join(tids[i], NULL);
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	for (i = 0; i < NTHREADS; i++)
+		check(txn, i);
+
+	/* The staged txn takes a read slot, like a read-only txn */
+	RES(MDB_BAD_RSLOT, mdb_txn_begin_dbis(env, &dbis[0], 1, 0, &txn2));
+	CHECK(rc == MDB_BAD_RSLOT, "staged txn in a reader thread");
+	mdb_txn_abort(txn);
+
+	/* A regular writer changing a staged DB makes the commit fail */
+	E(mdb_txn_begin_dbis(env, &dbis[0], 1, 0, &txn2));
+	setkey(&key, kval, NKEYS);
+	E(mdb_put(txn2, dbis[0], &key, &key, 0));
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	setkey(&key, kval, 0);
+	E(mdb_del(txn, dbis[0], &key, NULL));
+	E(mdb_txn_commit(txn));
+	RES(MDB_CONFLICT, mdb_txn_commit(txn2));
+	CHECK(rc == MDB_CONFLICT, "conflicting commit");
+
+	/* Reset drops the staged ops and the claim, renew gives a reader */
+	E(mdb_txn_begin_dbis(env, &dbis[1], 1, 0, &txn));
+	setkey(&key, kval, NKEYS);
+	E(mdb_put(txn, dbis[1], &key, &key, 0));
+	mdb_txn_reset(txn);
+	E(mdb_txn_renew(txn));
+	RES(MDB_NOTFOUND, mdb_get(txn, dbis[1], &key, &data));
+	CHECK(rc == MDB_NOTFOUND, "staged put after reset");
+	RES(EACCES, mdb_put(txn, dbis[1], &key, &key, 0));
+	CHECK(rc == EACCES, "put after renew");
+	mdb_txn_abort(txn);
+	E(mdb_txn_begin_dbis(env, &dbis[1], 1, 0, &txn));
+	E(mdb_put(txn, dbis[1], &key, &key, 0));
+	E(mdb_txn_commit(txn));
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	setkey(&key, kval, NKEYS);
+	RES(MDB_NOTFOUND, mdb_get(txn, dbis[0], &key, &data));
+	CHECK(rc == MDB_NOTFOUND, "conflicting txn was applied");
+	E(mdb_get(txn, dbis[1], &key, &data));
+	mdb_txn_abort(txn);
+
+	mdb_env_close(env);
+
+	return 0;
+}
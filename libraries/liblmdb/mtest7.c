@@ -0,0 +1,155 @@
+/* mtest7.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for mdb_put_dups, mdb_del_dups and mdb_cursor_get_dups */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+#define NVALS	2000
+
+/* Walk all duplicates of key a page at a time. They must be in order,
+ * number want, and the even ones below 2*NVALS must be present unless
+ * deleted by mdb_del_dups, i.e. a multiple of 8.
+ */
+static void check_dups(MDB_txn *txn, MDB_dbi dbi, MDB_val *key, size_t want, int deleted)
+{
+	MDB_cursor *cursor;
+	MDB_val k = *key, data;
+	mdb_size_t count, n = 0, prev = 0, even = 0, *v;
+	size_t i;
+	int rc, pages = 0;
+
+	E(mdb_cursor_open(txn, dbi, &cursor));
+	E(mdb_cursor_get_dups(cursor, &k, &data, &count, MDB_SET));
+	CHECK(count == want, "duplicate count");
+	do {
+		v = data.mv_data;
+		for (i = 0; i < data.mv_size / sizeof(mdb_size_t); i++, n++) {
+			CHECK(!n || v[i] > prev, "duplicate order");
+			prev = v[i];
+			if (!(prev & 1) && prev < 2*NVALS)
+				even++;
+		}
+		pages++;
+	} while ((rc = mdb_cursor_get_dups(cursor, &k, &data, &count,
+		MDB_NEXT_MULTIPLE)) == MDB_SUCCESS);
+	CHECK(rc == MDB_NOTFOUND, "mdb_cursor_get_dups");
+	CHECK(n == want, "duplicates walked");
+	CHECK(even == (deleted ? NVALS - NVALS/4 : NVALS), "original duplicates");
+	printf("%zu duplicates on %d pages\n", (size_t)n, pages);
+	mdb_cursor_close(cursor);
+}
+
+int main(int argc,char * argv[])
+{
+	int i, j, rc;
+	MDB_env *env;
+	MDB_dbi dbi;
+	MDB_val key, *data;
+	MDB_txn *txn, *child;
+	mdb_size_t values[NVALS], news[10], t;
+	size_t deleted;
+
+	srand(time(NULL));
+
+	/* Even values in random order: mdb_put_dups sorts them */
+	for (i = 0; i < NVALS; i++)
+		values[i] = 2*i;
+	for (i = NVALS; i > 1; i--) {
+		j = rand() % i;
+		t = values[i-1];
+		values[i-1] = values[j];
+		values[j] = t;
+	}
+	data = malloc(NVALS * sizeof(MDB_val));
+	for (i = 0; i < NVALS; i++) {
+		data[i].mv_size = sizeof(mdb_size_t);
+		data[i].mv_data = &values[i];
+	}
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 10485760));
+	E(mdb_env_set_maxdbs(env, 4));
+	E(mdb_env_open(env, "./testdb", MDB_FIXEDMAP|MDB_NOSYNC, 0664));
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, "dups", MDB_CREATE|MDB_DUPSORT|MDB_DUPFIXED|MDB_INTEGERDUP, &dbi));
+	key.mv_size = sizeof("dups");
+	key.mv_data = "dups";
+
+	printf("Adding %d values\n", NVALS);
+	E(mdb_put_dups(txn, dbi, &key, data, NVALS));
+	CHECK(data[0].mv_data == &values[0], "caller's array reordered");
+	/* Values already present are skipped */
+	E(mdb_put_dups(txn, dbi, &key, data, NVALS / 2));
+	check_dups(txn, dbi, &key, NVALS, 0);
+
+	/* A child adds to the pages its parent dirtied, then aborts */
+	news[0] = 0;
+	for (i = 1; i < 10; i++)
+		news[i] = 2*i - 1;
+	for (i = 0; i < 10; i++)
+		data[i].mv_data = &news[i];
+	E(mdb_txn_begin(env, txn, 0, &child));
+	E(mdb_put_dups(child, dbi, &key, data, 10));
+	check_dups(child, dbi, &key, NVALS + 9, 0);
+	mdb_txn_abort(child);
+	check_dups(txn, dbi, &key, NVALS, 0);
+
+	/* Again, but committed this time */
+	E(mdb_txn_begin(env, txn, 0, &child));
+	E(mdb_put_dups(child, dbi, &key, data, 10));
+	E(mdb_txn_commit(child));
+	check_dups(txn, dbi, &key, NVALS + 9, 0);
+	E(mdb_txn_commit(txn));
+
+	/* Delete every 4th original and the odd ones, plus some missing */
+	for (i = 0, j = 0; i < NVALS; i += 4)
+		values[j++] = 2*i;
+	for (i = 1; i < 10; i++)
+		values[j++] = news[i];
+	for (i = 0; i < 50; i++)
+		values[j++] = 4*NVALS + i;
+	for (i = 0; i < j; i++)
+		data[i].mv_data = &values[i];
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_txn_begin(env, txn, 0, &child));
+	E(mdb_del_dups(child, dbi, &key, data, j, &deleted));
+	CHECK(deleted == NVALS/4 + 9, "deleted count");
+	mdb_txn_abort(child);
+	check_dups(txn, dbi, &key, NVALS + 9, 0);
+
+	printf("Deleting %d values\n", j);
+	E(mdb_del_dups(txn, dbi, &key, data, j, &deleted));
+	CHECK(deleted == NVALS/4 + 9, "deleted count");
+	E(mdb_txn_commit(txn));
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	check_dups(txn, dbi, &key, NVALS - NVALS/4, 1);
+	mdb_txn_abort(txn);
+
+	mdb_dbi_close(env, dbi);
+	mdb_env_close(env);
+	free(data);
+
+	return 0;
+}
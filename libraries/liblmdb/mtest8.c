@@ -0,0 +1,139 @@
+/* mtest8.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for nested transactions */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define RES(err, expr) ((rc = expr) == (err) || (CHECK(!rc, #expr), 0))
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+#define NKEYS	4000
+
+/* Randomly put or delete n keys, and note which keys are present */
+static void churn(MDB_txn *txn, MDB_dbi dbi, char *present, int n)
+{
+	MDB_val key, data;
+	char kval[16], sval[100];
+	int i, k, rc;
+
+	memset(sval, 0, sizeof(sval));
+	key.mv_size = sizeof(kval);
+	key.mv_data = kval;
+	for (i = 0; i < n; i++) {
+		k = rand() % NKEYS;
+		sprintf(kval, "%015d", k);
+		if (rand() % 3) {
+			sprintf(sval, "%d foo bar", k);
+			data.mv_size = sizeof(sval);
+			data.mv_data = sval;
+			E(mdb_put(txn, dbi, &key, &data, 0));
+			present[k] = 1;
+		} else {
+			if (RES(MDB_NOTFOUND, mdb_del(txn, dbi, &key, NULL)))
+				CHECK(!present[k], "key not found");
+			present[k] = 0;
+		}
+	}
+}
+
+/* The DB must hold just the keys marked present */
+static void check(MDB_txn *txn, MDB_dbi dbi, const char *present)
+{
+	MDB_cursor *cursor;
+	MDB_val key, data;
+	int i, n = 0, want = 0, rc;
+
+	for (i = 0; i < NKEYS; i++)
+		want += present[i];
+	E(mdb_cursor_open(txn, dbi, &cursor));
+	while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+		i = atoi(key.mv_data);
+		CHECK(present[i], "unexpected key");
+		CHECK(atoi(data.mv_data) == i, "wrong data");
+		n++;
+	}
+	CHECK(rc == MDB_NOTFOUND, "mdb_cursor_get");
+	CHECK(n == want, "missing keys");
+	mdb_cursor_close(cursor);
+}
+
+int main(int argc,char * argv[])
+{
+	int i, rc;
+	MDB_env *env;
+	MDB_dbi dbi;
+	MDB_txn *txn, *child, *grandchild;
+	char present[NKEYS], saved[NKEYS], saved2[NKEYS];
+
+	srand(time(NULL));
+	memset(present, 0, sizeof(present));
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 104857600));
+	E(mdb_env_open(env, "./testdb", MDB_FIXEDMAP|MDB_NOSYNC, 0664));
+
+	/* Leave freed pages in the freeDB for the nested txns to reuse */
+	for (i = 0; i < 4; i++) {
+		E(mdb_txn_begin(env, NULL, 0, &txn));
+		E(mdb_dbi_open(txn, NULL, 0, &dbi));
+		churn(txn, dbi, present, NKEYS);
+		E(mdb_txn_commit(txn));
+	}
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	for (i = 0; i < 20; i++) {
+		memcpy(saved, present, sizeof(present));
+		E(mdb_txn_begin(env, txn, 0, &child));
+		/* Every other round the child leaves the freestate alone,
+		 * so that the grandchild takes the first copy of it
+		 */
+		if (i & 1)
+			churn(child, dbi, present, 200);
+		memcpy(saved2, present, sizeof(present));
+		E(mdb_txn_begin(env, child, 0, &grandchild));
+		churn(grandchild, dbi, present, 500);
+		if (i % 3) {
+			E(mdb_txn_commit(grandchild));
+		} else {
+			mdb_txn_abort(grandchild);
+			memcpy(present, saved2, sizeof(present));
+		}
+		check(child, dbi, present);
+		churn(child, dbi, present, 200);
+		if (i & 2) {
+			E(mdb_txn_commit(child));
+		} else {
+			mdb_txn_abort(child);
+			memcpy(present, saved, sizeof(present));
+		}
+		check(txn, dbi, present);
+		churn(txn, dbi, present, 200);
+	}
+	printf("Committing %d rounds of nested txns\n", i);
+	E(mdb_txn_commit(txn));
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	check(txn, dbi, present);
+	mdb_txn_abort(txn);
+
+	mdb_env_close(env);
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+/* mtest9.c - memory-mapped database tester/toy */
+/*
+ * Copyright 2011-2021 Howard Chu, Symas Corp.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted only as authorized by the OpenLDAP
+ * Public License.
+ *
+ * A copy of this license is available in the file LICENSE in the
+ * top-level directory of the distribution or, alternatively, at
+ * <http://www.OpenLDAP.org/license.html>.
+ */
+
+/* Tests for the bottom-up bulk builder */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lmdb.h"
+
+#define E(expr) CHECK((rc = (expr)) == MDB_SUCCESS, #expr)
+#define RES(err, expr) ((rc = expr) == (err) || (CHECK(!rc, #expr), 0))
+#define CHECK(test, msg) ((test) ? (void)0 : ((void)fprintf(stderr, \
+	"%s:%d: %s: %s\n", __FILE__, __LINE__, msg, mdb_strerror(rc)), abort()))
+
+#define NKEYS	60000
+
+/* Both DBs must hold keys 0 to NKEYS-1, in order, with matching data */
+static void check(MDB_txn *txn, MDB_dbi dbi)
+{
+	MDB_cursor *cursor;
+	MDB_val key, data;
+	MDB_stat mst;
+	int i = 0, rc;
+
+	E(mdb_cursor_open(txn, dbi, &cursor));
+	while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+		CHECK(atoi(key.mv_data) == i, "wrong key");
+		CHECK(atoi(data.mv_data) == i, "wrong data");
+		i++;
+	}
+	CHECK(rc == MDB_NOTFOUND, "mdb_cursor_get");
+	CHECK(i == NKEYS, "missing keys");
+	mdb_cursor_close(cursor);
+	E(mdb_stat(txn, dbi, &mst));
+	CHECK(mst.ms_entries == NKEYS, "entry count");
+}
+
+int main(int argc,char * argv[])
+{
+	int i, rc;
+	MDB_env *env;
+	MDB_dbi dbi, dbi2;
+	MDB_val key, data;
+	MDB_txn *txn;
+	MDB_bulk *bulk;
+	char kval[16], sval[100];
+
+	memset(sval, 0, sizeof(sval));
+
+	E(mdb_env_create(&env));
+	E(mdb_env_set_mapsize(env, 104857600));
+	E(mdb_env_set_maxdbs(env, 4));
+	/* Small enough that the puts to the other DB spill */
+	E(mdb_env_set_dirty_limit(env, 1024));
+	E(mdb_env_open(env, "./testdb", MDB_FIXEDMAP|MDB_NOSYNC, 0664));
+
+	E(mdb_txn_begin(env, NULL, 0, &txn));
+	E(mdb_dbi_open(txn, "bulk", MDB_CREATE, &dbi));
+	E(mdb_dbi_open(txn, "put", MDB_CREATE, &dbi2));
+	key.mv_size = sizeof(kval);
+	key.mv_data = kval;
+	data.mv_size = sizeof(sval);
+	data.mv_data = sval;
+
+	printf("Building %d keys\n", NKEYS);
+	E(mdb_bulk_begin(txn, dbi, 90, &bulk));
+	for (i = 0; i < NKEYS; i++) {
+		sprintf(kval, "%015d", i);
+		sprintf(sval, "%d foo bar", i);
+		E(mdb_bulk_put(bulk, &key, &data));
+		/* Another DB may be written meanwhile, in any order */
+		sprintf(kval, "%015d", (int)((i * 7919L) % NKEYS));
+		sprintf(sval, "%d foo bar", (int)((i * 7919L) % NKEYS));
+		E(mdb_put(txn, dbi2, &key, &data, 0));
+	}
+	sprintf(kval, "%015d", 0);
+	RES(MDB_KEYEXIST, mdb_bulk_put(bulk, &key, &data));
+	CHECK(rc == MDB_KEYEXIST, "out of order key");
+	mdb_bulk_close(bulk);
+	/* Only an empty DB can be built */
+	RES(EINVAL, mdb_bulk_begin(txn, dbi, 0, &bulk));
+	CHECK(rc == EINVAL, "mdb_bulk_begin");
+	check(txn, dbi);
+	check(txn, dbi2);
+	E(mdb_txn_commit(txn));
+
+	E(mdb_txn_begin(env, NULL, MDB_RDONLY, &txn));
+	check(txn, dbi);
+	check(txn, dbi2);
+	mdb_txn_abort(txn);
+
+	mdb_env_close(env);
+
+	return 0;
+}